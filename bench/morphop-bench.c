@@ -0,0 +1,530 @@
+/*
+ * morphop-bench: measures the speed of libmorphop, without GIMP.
+ *
+ * Every operator is run with every element size on synthetic images (noise, binary blobs, line art, scanned page)
+ * of the requested sizes and pixel formats. The results are written as JSON, one object per case, so that
+ * two versions can be compared. See "morphop-bench --help" for the options; "make bench" runs it with the defaults.
+ * With "--check", it compares the engine to the reference implementation instead (see morphop-check.c).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "morphop-engine.h"
+#include "morphop-bench.h"
+
+#define MAX_LIST 16
+
+// the height of the non-flat elements, in 8-bit levels (see --weights)
+#define BENCH_WEIGHTS_HEIGHT 32
+
+// the longest name of an engine of the planner (see bench_profile())
+#define BENCH_ENGINE_SIZE 128
+
+typedef enum {
+	IMAGE_NOISE = 0, // random values on every sample
+	IMAGE_BLOBS, // white disks on a black background (binary)
+	IMAGE_LINES, // thin white lines on a black background (binary)
+	IMAGE_SCAN, // a scanned page: lines of dark "text" on a white background, with wide margins
+
+	IMAGE_END
+} SyntheticImage;
+
+typedef enum {
+	FORMAT_GRAY = 0,
+	FORMAT_GRAYA,
+	FORMAT_RGB,
+	FORMAT_RGBA,
+
+	FORMAT_END
+} BenchFormat;
+
+/*
+ * What to run: each list holds the values to be combined
+ */
+typedef struct {
+	double sizes[MAX_LIST]; // megapixels
+	int n_sizes;
+	int operators[OPERATOR_END];
+	int n_operators;
+	int element_sizes[SIZE_END];
+	int n_element_sizes;
+	int formats[FORMAT_END];
+	int n_formats;
+	int samples[SAMPLE_END];
+	int n_samples;
+	int images[IMAGE_END];
+	int n_images;
+	int iterations; // of erosion, dilation, opening and closing
+	ElementWeights weights; // the heights of the element (BENCH_WEIGHTS_HEIGHT levels high), for the non-flat kernel
+	ChannelMode channel_mode;
+	int repeat; // each case is run this many times, the fastest run is reported
+	int threads; // bands processed concurrently (1 = no parallel function)
+	const char* output; // NULL for stdout
+	int calibrate; // the planner uses a calibration of the host (morphop_calibrate()) instead of the default model
+} BenchOptions;
+
+/*
+ * A band of threads_parallel_for()
+ */
+typedef struct {
+	MorphOpBandFunc func;
+	void* data;
+	int y0, y1;
+} BandJob;
+
+static const char* image_names[IMAGE_END] = { "noise", "blobs", "lines", "scan" };
+static const char* format_names[FORMAT_END] = { "gray", "graya", "rgb", "rgba" };
+static const char* sample_names[SAMPLE_END] = { "u8", "u16", "float" };
+static const char* element_size_names[SIZE_END] = { "3x3", "5x5", "7x7", "9x9", "11x11" };
+static const char* weights_names[WEIGHTS_END] = { "flat", "ball", "cone" };
+
+// the default structuring element of the plugin
+static const signed char default_element[STRELEM_DEFAULT_SIZE][STRELEM_DEFAULT_SIZE] = {
+	{0, 0, 0, 1, 0, 0, 0},
+	{0, 0, 1, 1, 1, 0, 0},
+	{0, 1, 1, 1, 1, 1, 0},
+	{1, 1, 1, 1, 1, 1, 1},
+	{0, 1, 1, 1, 1, 1, 0},
+	{0, 0, 1, 1, 1, 0, 0},
+	{0, 0, 0, 1, 0, 0, 0},
+};
+
+static int parse_options(int, char**, BenchOptions*);
+static int parse_list(const char*, const char**, int, int*);
+static void print_usage(void);
+static PixelFormat bench_format_get_pixel_format(BenchFormat, SampleType);
+static void image_fill(MorphOpImage*, SyntheticImage);
+static unsigned int next_random(unsigned int*);
+static double now(void);
+static long get_peak_rss_kb(void);
+static void* thread_band(void*);
+static void bench_profile(const MorphOpPassInfo*, void*);
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	MorphOpCalibration calibration;
+	FILE* out = stdout;
+	int si, ti, fi, ii, oi, ei, r;
+	int first = 1;
+
+	// differential check of the engine against the reference implementation, see morphop-check.c
+	if (argc > 1 && strcmp(argv[1], "--check") == 0) return run_check(argc - 1, argv + 1);
+
+	if (!parse_options(argc, argv, &options)) {
+		print_usage();
+		return 1;
+	}
+
+	if (options.output != NULL && (out = fopen(options.output, "w")) == NULL) {
+		fprintf(stderr, "morphop-bench: can't write %s\n", options.output);
+		return 1;
+	}
+
+	if (options.calibrate) {
+		fprintf(stderr, "calibrating...\n");
+		if (morphop_calibrate(&calibration) != MORPHOP_OK) {
+			fprintf(stderr, "morphop-bench: no memory for the calibration\n");
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n\t\"repeat\": %d,\n\t\"threads\": %d,\n\t\"calibrated\": %s,\n\t\"results\": [",
+		options.repeat, options.threads, (options.calibrate ? "true" : "false"));
+
+	for (si = 0; si < options.n_sizes; si++) {
+		int side = (int)ceil(sqrt(options.sizes[si] * 1e6));
+
+		for (ti = 0; ti < options.n_samples; ti++) {
+			for (fi = 0; fi < options.n_formats; fi++) {
+				PixelFormat format = bench_format_get_pixel_format(options.formats[fi], options.samples[ti]);
+				MorphOpImage src, dst;
+
+				if (
+					morphop_image_alloc(&src, side, side, format) != MORPHOP_OK ||
+					morphop_image_alloc(&dst, side, side, format) != MORPHOP_OK
+				) {
+					fprintf(stderr, "morphop-bench: no memory for a %dx%d image\n", side, side);
+					return 1;
+				}
+
+				for (ii = 0; ii < options.n_images; ii++) {
+					image_fill(&src, options.images[ii]);
+
+					for (oi = 0; oi < options.n_operators; oi++) {
+						for (ei = 0; ei < options.n_element_sizes; ei++) {
+							MorphOpSettings settings;
+							MorphOpContext ctx;
+							MorphOpStatus status = MORPHOP_OK;
+							char engine[BENCH_ENGINE_SIZE] = "";
+							double best = -1;
+
+							settings.operator = options.operators[oi];
+							settings.element.size = options.element_sizes[ei];
+							settings.element.shape = NULL;
+							settings.iterations = options.iterations;
+							memcpy(settings.element.matrix, default_element, sizeof(default_element));
+							morphop_element_set_weights(&settings.element, options.weights, BENCH_WEIGHTS_HEIGHT);
+							settings.channel_mode = options.channel_mode;
+
+							// a new context for each case, so the peak memory of the arena is the one of this case
+							morphop_context_init(&ctx);
+							ctx.profile = bench_profile;
+							ctx.profile_data = engine;
+							if (options.calibrate) ctx.calibration = &calibration;
+							if (options.threads > 1) {
+								ctx.parallel = threads_parallel_for;
+								ctx.parallel_data = &options.threads;
+							}
+
+							fprintf(stderr, "%s %s %s %s %s %dx%d...\n",
+								morphop_operator_get_name(settings.operator), element_size_names[settings.element.size],
+								format_names[options.formats[fi]], sample_names[options.samples[ti]],
+								image_names[options.images[ii]], side, side);
+
+							for (r = 0; r < options.repeat && status == MORPHOP_OK; r++) {
+								double start = now();
+								status = morphop_run(&ctx, &settings, &src, &dst);
+								double elapsed = now() - start;
+
+								if (best < 0 || elapsed < best) best = elapsed;
+							}
+
+							double pixels = (double)side * side;
+							size_t peak_bytes = 2 * src.stride * side + ctx.arena.peak;
+
+							fprintf(out, "%s\n\t\t{\"operator\": \"%s\", \"element_size\": \"%s\", \"weights\": \"%s\", \"channels\": \"%s\", \"iterations\": %d, \"format\": \"%s\", \"sample\": \"%s\", "
+								"\"image\": \"%s\", \"width\": %d, \"height\": %d, \"status\": \"%s\", \"seconds\": %.6f, "
+								"\"mpix_per_s\": %.3f, \"ns_per_pixel\": %.3f, \"peak_bytes\": %lu, \"engine\": \"%s\"}",
+								(first ? "" : ","),
+								morphop_operator_get_name(settings.operator), element_size_names[settings.element.size],
+								weights_names[options.weights], morphop_channel_mode_get_name(options.channel_mode),
+								morphop_settings_get_iterations(&settings),
+								format_names[options.formats[fi]], sample_names[options.samples[ti]],
+								image_names[options.images[ii]], side, side,
+								(status == MORPHOP_OK ? "ok" : "error"), best,
+								pixels / 1e6 / best, best * 1e9 / pixels, (unsigned long)peak_bytes, engine);
+							fflush(out);
+							first = 0;
+
+							morphop_context_free(&ctx);
+						}
+					}
+				}
+
+				morphop_image_free(&src);
+				morphop_image_free(&dst);
+			}
+		}
+	}
+
+	fprintf(out, "\n\t],\n\t\"peak_rss_kb\": %ld\n}\n", get_peak_rss_kb());
+	if (out != stdout) fclose(out);
+
+	return 0;
+}
+
+/* parse_options()
+ *
+ * Reads the command line. Returns 0 if it's not valid.
+ */
+static int parse_options(int argc, char** argv, BenchOptions* options)
+{
+	int i;
+
+	options->sizes[0] = 1;
+	options->n_sizes = 1;
+	options->n_operators = OPERATOR_END;
+	options->n_element_sizes = SIZE_END;
+	options->n_formats = FORMAT_END;
+	options->n_images = IMAGE_END;
+	options->samples[0] = SAMPLE_U8;
+	options->n_samples = 1;
+	options->iterations = 1;
+	options->weights = WEIGHTS_FLAT;
+	options->channel_mode = CHANNELS_LUMINOSITY;
+	options->repeat = 1;
+	options->threads = 1;
+	options->output = NULL;
+	options->calibrate = 0;
+
+	for (i = 0; i < OPERATOR_END; i++) options->operators[i] = i;
+	for (i = 0; i < SIZE_END; i++) options->element_sizes[i] = i;
+	for (i = 0; i < FORMAT_END; i++) options->formats[i] = i;
+	for (i = 0; i < IMAGE_END; i++) options->images[i] = i;
+
+	for (i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const char* value = (i + 1 < argc ? argv[i + 1] : NULL);
+
+		if (strcmp(arg, "--help") == 0) return 0;
+		if (strcmp(arg, "--calibrate") == 0) {
+			options->calibrate = 1;
+			continue;
+		}
+		if (value == NULL) return 0;
+		i++;
+
+		if (strcmp(arg, "--sizes") == 0) {
+			char* list = strdup(value), *token;
+			int valid = 1;
+			options->n_sizes = 0;
+			for (token = strtok(list, ","); token != NULL && options->n_sizes < MAX_LIST; token = strtok(NULL, ",")) {
+				options->sizes[options->n_sizes] = atof(token);
+				if (options->sizes[options->n_sizes++] <= 0) valid = 0;
+			}
+			free(list);
+			if (!valid || options->n_sizes == 0) return 0;
+		}
+		else if (strcmp(arg, "--operators") == 0) {
+			const char* names[OPERATOR_END];
+			int op;
+			for (op = 0; op < OPERATOR_END; op++) names[op] = morphop_operator_get_name(op);
+			if (!(options->n_operators = parse_list(value, names, OPERATOR_END, options->operators))) return 0;
+		}
+		else if (strcmp(arg, "--element-sizes") == 0) {
+			if (!(options->n_element_sizes = parse_list(value, element_size_names, SIZE_END, options->element_sizes))) return 0;
+		}
+		else if (strcmp(arg, "--formats") == 0) {
+			if (!(options->n_formats = parse_list(value, format_names, FORMAT_END, options->formats))) return 0;
+		}
+		else if (strcmp(arg, "--samples") == 0) {
+			if (!(options->n_samples = parse_list(value, sample_names, SAMPLE_END, options->samples))) return 0;
+		}
+		else if (strcmp(arg, "--images") == 0) {
+			if (!(options->n_images = parse_list(value, image_names, IMAGE_END, options->images))) return 0;
+		}
+		else if (strcmp(arg, "--iterations") == 0) {
+			options->iterations = atoi(value);
+			if (options->iterations < 1 || options->iterations > MORPHOP_MAX_ITERATIONS) return 0;
+		}
+		else if (strcmp(arg, "--weights") == 0) {
+			int weights[WEIGHTS_END];
+			if (parse_list(value, weights_names, WEIGHTS_END, weights) != 1) return 0;
+			options->weights = weights[0];
+		}
+		else if (strcmp(arg, "--channels") == 0) {
+			options->channel_mode = morphop_channel_mode_from_name(value);
+			if (options->channel_mode == CHANNELS_END) return 0;
+		}
+		else if (strcmp(arg, "--repeat") == 0) {
+			if ((options->repeat = atoi(value)) < 1) return 0;
+		}
+		else if (strcmp(arg, "--threads") == 0) {
+			options->threads = atoi(value);
+			if (options->threads < 1 || options->threads > MAX_THREADS) return 0;
+		}
+		else if (strcmp(arg, "--output") == 0) {
+			options->output = value;
+		}
+		else return 0;
+	}
+
+	return 1;
+}
+
+/* parse_list()
+ *
+ * Parses a comma separated list of names, or "all". Sets in 'values' the indexes of the names found in 'names'
+ * and returns their number, or 0 if one of them is unknown.
+ */
+static int parse_list(const char* list, const char** names, int n_names, int* values)
+{
+	char* copy = strdup(list), *token;
+	int n = 0, i;
+
+	if (strcmp(list, "all") == 0) {
+		for (i = 0; i < n_names; i++) values[i] = i;
+		free(copy);
+		return n_names;
+	}
+
+	for (token = strtok(copy, ","); token != NULL && n < n_names; token = strtok(NULL, ",")) {
+		for (i = 0; i < n_names && strcmp(token, names[i]) != 0; i++);
+		if (i == n_names) {
+			n = 0;
+			break;
+		}
+		values[n++] = i;
+	}
+
+	free(copy);
+	return n;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr,
+		"usage: morphop-bench [options]\n"
+		"  --sizes LIST          image sizes, in megapixels (default 1; e.g. 1,10,100)\n"
+		"  --operators LIST      operators (default all; e.g. erosion,skeleton)\n"
+		"  --element-sizes LIST  3x3,5x5,7x7,9x9,11x11 (default all)\n"
+		"  --formats LIST        gray,graya,rgb,rgba (default all)\n"
+		"  --samples LIST        u8,u16,float (default u8)\n"
+		"  --images LIST         noise,blobs,lines,scan (default all)\n"
+		"  --iterations N        iterations of erosion, dilation, opening and closing (default 1)\n"
+		"  --weights NAME        flat, ball or cone: the heights of the element (default flat)\n"
+		"  --channels MODE       luminosity, color or all: how the channels of the neighbors are compared\n"
+		"                        (default luminosity)\n"
+		"  --repeat N            runs of each case, the fastest is reported (default 1)\n"
+		"  --threads N           bands processed concurrently (default 1)\n"
+		"  --output FILE         where to write the JSON results (default stdout)\n"
+		"  --calibrate           times the kernels on this host first, so the planner chooses the engines\n"
+		"                        for it (default: the built-in model)\n"
+		"\n"
+		"usage: morphop-bench --check [--cases N] [--seed N] [--max-size N]\n"
+		"  compares every engine configuration to the reference implementation on random images\n"
+	);
+}
+
+static PixelFormat bench_format_get_pixel_format(BenchFormat bench_format, SampleType type)
+{
+	PixelFormat format;
+
+	format.type = type;
+	format.is_rgb = (bench_format == FORMAT_RGB || bench_format == FORMAT_RGBA);
+	format.has_alpha = (bench_format == FORMAT_GRAYA || bench_format == FORMAT_RGBA);
+	format.channels = (format.is_rgb ? 3 : 1) + (format.has_alpha ? 1 : 0);
+
+	return format;
+}
+
+/* image_fill()
+ *
+ * Draws a synthetic image. The pattern is computed in 8-bit and converted to the sample type of the image,
+ * the alpha channel is opaque. The random generator has a fixed seed, so the images are the same in every run.
+ */
+static void image_fill(MorphOpImage* image, SyntheticImage kind)
+{
+	const int channels = image->format.channels;
+	const int color_channels = channels - (image->format.has_alpha ? 1 : 0);
+	unsigned int seed = 12345;
+	int radius = 4 + image->width / 64; // blobs
+	int spacing = 8 + image->width / 128; // line art
+	int x, y, c;
+
+	for (y = 0; y < image->height; y++) {
+		unsigned char* row = image->data + (size_t)y * image->stride;
+
+		for (x = 0; x < image->width; x++) {
+			for (c = 0; c < channels; c++) {
+				int value;
+
+				if (c >= color_channels) {
+					value = 255;
+				}
+				else if (kind == IMAGE_NOISE) {
+					value = next_random(&seed) & 0xFF;
+				}
+				else if (kind == IMAGE_BLOBS) {
+					// a disk in each cell of a 2 * radius grid, whose center is moved by a hash of the cell
+					int cx = x / (2 * radius), cy = y / (2 * radius);
+					unsigned int hash = (unsigned int)(cx * 73856093) ^ (unsigned int)(cy * 19349663);
+					int dx = x - (cx * 2 * radius + radius + (int)(hash % 5) - 2);
+					int dy = y - (cy * 2 * radius + radius + (int)((hash >> 8) % 5) - 2);
+					int r = radius - 2 - (int)((hash >> 16) % (radius / 2 + 1));
+					value = (dx * dx + dy * dy <= r * r ? 255 : 0);
+				}
+				else if (kind == IMAGE_LINES) {
+					// horizontal, vertical and diagonal lines, 1 or 2 pixels thick
+					value = (y % spacing == 0 || x % (spacing + 3) == 0 || (x + y) % (2 * spacing) < 2 ? 255 : 0);
+				}
+				else {
+					// within the margins (a tenth of the page), a line of text every 3 * spacing rows, with a blank
+					// line every 8 of them: a third of the pixels of a line are dark, the rest is paper
+					int margin = image->width / 10;
+					int line = y / (3 * spacing);
+					int in_text = (x >= margin && x < image->width - margin && y >= margin && y < image->height - margin);
+					int in_line = (y % (3 * spacing) < spacing && line % 8 != 7);
+					unsigned int hash = (unsigned int)(x * 73856093) ^ (unsigned int)(y * 19349663);
+					value = (in_text && in_line && (hash >> 4) % 3 == 0 ? 40 : 235);
+				}
+
+				switch (image->format.type) {
+					case SAMPLE_U8: row[x * channels + c] = value; break;
+					case SAMPLE_U16: ((unsigned short*)row)[x * channels + c] = value * 257; break;
+					case SAMPLE_FLOAT: ((float*)row)[x * channels + c] = value / 255.0f; break;
+					default: break;
+				}
+			}
+		}
+	}
+}
+
+// xorshift32
+static unsigned int next_random(unsigned int* state)
+{
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static long get_peak_rss_kb(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/* threads_parallel_for()
+ *
+ * A parallel function for the context (see MorphOpParallelFunc): the rows are split in one band for each
+ * thread. 'threads_data' points to the number of threads.
+ */
+void threads_parallel_for(int y0, int y1, MorphOpBandFunc func, void* data, void* threads_data)
+{
+	int n_threads = *(int*)threads_data;
+	pthread_t threads[MAX_THREADS];
+	BandJob jobs[MAX_THREADS];
+	int i;
+
+	if (n_threads < 1) n_threads = 1;
+	if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+
+	for (i = 0; i < n_threads; i++) {
+		jobs[i].func = func;
+		jobs[i].data = data;
+		jobs[i].y0 = y0 + (int)((long)(y1 - y0) * i / n_threads);
+		jobs[i].y1 = y0 + (int)((long)(y1 - y0) * (i + 1) / n_threads);
+	}
+
+	// the calling thread takes the first band
+	for (i = 1; i < n_threads; i++) pthread_create(&threads[i], NULL, thread_band, &jobs[i]);
+	thread_band(&jobs[0]);
+	for (i = 1; i < n_threads; i++) pthread_join(threads[i], NULL);
+}
+
+static void* thread_band(void* data)
+{
+	BandJob* job = data;
+	if (job->y1 > job->y0) job->func(job->y0, job->y1, job->data);
+	return NULL;
+}
+
+/* bench_profile()
+ *
+ * Keeps the engine that the planner chose for the first erosion or dilation of a case, for the results.
+ * The same case gets the same engine at each repetition.
+ */
+static void bench_profile(const MorphOpPassInfo* info, void* data)
+{
+	char* engine = data;
+
+	if (info->engine != NULL && engine[0] == '\0') snprintf(engine, BENCH_ENGINE_SIZE, "%s", info->engine);
+}
@@ -0,0 +1,11 @@
+#ifndef __MORPHOP_BENCH_H__
+#define __MORPHOP_BENCH_H__
+
+#include "morphop-engine.h"
+
+#define MAX_THREADS 64
+
+void threads_parallel_for(int, int, MorphOpBandFunc, void*, void*);
+int run_check(int, char**);
+
+#endif
@@ -0,0 +1,1048 @@
+/*
+ * Differential check of libmorphop: random images and random elements are run through every
+ * configuration of the engine ("engines" below), flat or not, and compared, bit for bit, to the reference implementation
+ * (morphop-reference.c), then with a random custom element (a disk, a slanted line, a rectangle or random cells, up to
+ * SHAPE_MAX_SIDE wide or high). Each image is also run through a few random chains of operators, compared to the reference
+ * applied step by step. A case that differs is reduced to a smaller image and element that still differ,
+ * and printed. Last, each image is the mask of a few reconstructions (morphop_reconstruct()), from a random
+ * marker and from a sparse one, compared to the slow reference; the destination is a new image, the marker
+ * or the mask. Its top-left corner also gets area openings and closings with a few thresholds, all from the same
+ * tree (morphop_area_tree_filter()), and watersheds (morphop_watershed()) from the regional minima and from random
+ * markers. The exit status is 1 if any case differs.
+ *
+ * New fast paths of the engine must be added to "engines", so they are checked too. The planner chooses among them
+ * by their cost on the host, so some engines force its choices with a made-up cost model (see check_calibration()).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-engine.h"
+#include "morphop-reference.h"
+#include "morphop-stream.h"
+#include "morphop-bench.h"
+
+/*
+ * A way of running the engine
+ */
+typedef struct {
+	const char* name;
+	int threads; // if > 1, bands are run by threads_parallel_for()
+	int in_place; // the destination is the source image
+	int stream; // run by morphop_stream_next_row(): 1 if the source copies the rows, 2 if it gives the rows of the image
+	int chain; // run by morphop_run_chain(), else by a morphop_run() for each step
+	int selection; // the context has the selection of is_selected() (the last step only, for morphop_run()): the other pixels are not compared
+	int budget; // run by morphop_run_budget(), with a budget of a few rows and the temporary images of check_temp_alloc()
+	int model; // the cost model of the planner (see check_calibration()): 0 for the default one
+} CheckEngine;
+
+// the cost models of CheckEngine.model: runs by doubling, stacks and blocks wherever they can be, or none of them
+#define MODEL_DOUBLING 1
+#define MODEL_CELLS 2
+
+static const CheckEngine engines[] = {
+	{ "serial", 1, 0, 0, 0, 0, 0, 0 },
+	{ "threaded", 3, 0, 0, 0, 0, 0, 0 },
+	{ "in-place", 1, 1, 0, 0, 0, 0, 0 },
+	{ "stream", 1, 0, 1, 0, 0, 0, 0 },
+	{ "stream-mapped", 1, 0, 2, 0, 0, 0, 0 },
+	{ "chain", 1, 0, 0, 1, 0, 0, 0 },
+	{ "chain-threaded", 3, 0, 0, 1, 0, 0, 0 },
+	{ "chain-in-place", 3, 1, 0, 1, 0, 0, 0 },
+	{ "selection", 1, 1, 0, 0, 1, 0, 0 },
+	{ "chain-selection", 3, 0, 0, 1, 1, 0, 0 },
+	{ "budget", 1, 0, 0, 0, 0, 1, 0 },
+	{ "budget-selection", 3, 0, 0, 0, 1, 1, 0 },
+	{ "planned-doubling", 1, 0, 0, 0, 0, 0, MODEL_DOUBLING },
+	{ "planned-cells", 1, 0, 1, 0, 0, 0, MODEL_CELLS },
+	{ "chain-planned-doubling", 3, 0, 0, 1, 0, 0, MODEL_DOUBLING },
+};
+
+#define N_ENGINES (int)(sizeof(engines) / sizeof(engines[0]))
+
+// the largest side of the images of the area openings and closings: the reference is quadratic
+#define AREA_MAX_SIZE 24
+
+// the largest side of the images of the watersheds: the queue of the reference is quadratic too
+#define WATERSHED_MAX_SIZE 32
+
+// the area thresholds tried on each tree
+#define AREAS_PER_TREE 4
+
+// the budget of the engines that have one, in rows of the image (see morphop_run_budget())
+#define BUDGET_ROWS 24
+
+// the temporary images of check_temp_alloc() have this many more bytes in each row, to check that the stride is used
+#define TEMP_ROW_PADDING 24
+
+// the largest side of the random custom elements (see random_shape())
+#define SHAPE_MAX_SIDE 64
+
+// the random chains run on each image, and their highest number of steps
+#define CHAINS_PER_CASE 4
+#define CHAIN_MAX_STEPS 4
+
+/*
+ * The first different sample found
+ */
+typedef struct {
+	int x, y, channel;
+	double expected, actual;
+} Mismatch;
+
+static long check_chain(const MorphOpChain*, const MorphOpImage*, unsigned int, int);
+static int check_case(const MorphOpChain*, const MorphOpImage*, const CheckEngine*, Mismatch*);
+static long check_reconstruction(const MorphOpImage*, unsigned int*, unsigned int, int, long*);
+static long check_area(const MorphOpImage*, unsigned int*, unsigned int, int, long*);
+static long check_watershed(const MorphOpImage*, unsigned int*, unsigned int, int, long*);
+static int compare_images(const MorphOpImage*, const MorphOpImage*, Mismatch*);
+static void reduce_case(MorphOpChain*, MorphOpImage*, const CheckEngine*);
+static int crop_image(const MorphOpImage*, MorphOpImage*, int, int, int, int);
+static void random_image(MorphOpImage*, unsigned int*);
+static void random_element(StructuringElement*, unsigned int*);
+static void random_shape(MorphOpShape*, MorphOpArena*, unsigned int*);
+static void print_element_size(const StructuringElement*);
+static void print_case(const MorphOpChain*, const MorphOpImage*, const CheckEngine*, const Mismatch*);
+static double get_sample(const MorphOpImage*, int, int, int);
+static void set_sample(MorphOpImage*, int, int, int, double);
+static int is_selected(int, int);
+static void run_stream(const MorphOpChain*, const MorphOpImage*, MorphOpImage*, int, const MorphOpCalibration*);
+static const MorphOpCalibration* check_calibration(int, MorphOpCalibration*);
+static const unsigned char* copy_row(int, unsigned char*, void*);
+static const unsigned char* map_row(int, unsigned char*, void*);
+static int read_strip(int, int, MorphOpImage*, void*);
+static int write_strip(int, int, MorphOpImage*, void*);
+static int check_temp_alloc(MorphOpImage*, void*);
+static void check_temp_free(MorphOpImage*, void*);
+static unsigned int next_random(unsigned int*);
+
+/* run_check()
+ *
+ * Entry point of "morphop-bench --check". Options:
+ *  --cases N: number of random images (default 200). Each one is run with all the operators and all the element sizes
+ *  --seed N: seed of the random generator (default 1), to repeat a run
+ *  --max-size N: largest side of the images (default 40)
+ */
+int run_check(int argc, char** argv)
+{
+	int cases = 200, max_size = 40;
+	unsigned int seed = 1, first_seed;
+	int i, c, k, op, size;
+	long runs = 0, failures = 0;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--cases") == 0) cases = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--seed") == 0) seed = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+		else if (strcmp(argv[i], "--max-size") == 0) max_size = atoi(argv[i + 1]);
+		else break;
+	}
+	if (i < argc || cases < 1 || max_size < 1 || seed == 0) {
+		fprintf(stderr, "usage: morphop-bench --check [--cases N] [--seed N] [--max-size N]\n");
+		return 1;
+	}
+	first_seed = seed;
+
+	for (c = 0; c < cases; c++) {
+		MorphOpImage src;
+		MorphOpChain chain;
+		MorphOpShape shape;
+		MorphOpArena shape_arena;
+		PixelFormat format;
+		int width = 1 + next_random(&seed) % max_size;
+		int height = 1 + next_random(&seed) % max_size;
+
+		format.type = next_random(&seed) % SAMPLE_END;
+		format.is_rgb = next_random(&seed) % 2;
+		format.has_alpha = next_random(&seed) % 2;
+		format.channels = (format.is_rgb ? 3 : 1) + (format.has_alpha ? 1 : 0);
+
+		if (morphop_image_alloc(&src, width, height, format) != MORPHOP_OK) return 1;
+		random_image(&src, &seed);
+		random_element(&chain.steps[0].element, &seed);
+		chain.n_steps = 1;
+
+		for (op = 0; op < OPERATOR_END; op++) {
+			for (size = 0; size < SIZE_END; size++) {
+				chain.steps[0].operator = op;
+				chain.steps[0].element.size = size;
+				chain.steps[0].iterations = 1 + next_random(&seed) % 3;
+				chain.steps[0].channel_mode = next_random(&seed) % CHANNELS_END;
+
+				runs += N_ENGINES;
+				failures += check_chain(&chain, &src, first_seed, c);
+			}
+		}
+
+		// a custom element, with all the operators
+		arena_init(&shape_arena);
+		random_shape(&shape, &shape_arena, &seed);
+		chain.steps[0].element.shape = &shape;
+
+		for (op = 0; op < OPERATOR_END; op++) {
+			chain.steps[0].operator = op;
+			chain.steps[0].iterations = 1 + next_random(&seed) % 3;
+			chain.steps[0].channel_mode = next_random(&seed) % CHANNELS_END;
+
+			runs += N_ENGINES;
+			failures += check_chain(&chain, &src, first_seed, c);
+		}
+
+		// random chains, mostly of small elements (so the image is split in several strips), a few steps with the custom one
+		for (k = 0; k < CHAINS_PER_CASE; k++) {
+			chain.n_steps = 2 + next_random(&seed) % (CHAIN_MAX_STEPS - 1);
+
+			for (i = 0; i < chain.n_steps; i++) {
+				chain.steps[i].operator = next_random(&seed) % OPERATOR_END;
+				random_element(&chain.steps[i].element, &seed);
+				chain.steps[i].element.size = next_random(&seed) % (next_random(&seed) % 4 == 0 ? SIZE_END : 2);
+				if (next_random(&seed) % 5 == 0) chain.steps[i].element.shape = &shape;
+				chain.steps[i].iterations = 1 + next_random(&seed) % 3;
+				chain.steps[i].channel_mode = next_random(&seed) % CHANNELS_END;
+			}
+
+			runs += N_ENGINES;
+			failures += check_chain(&chain, &src, first_seed, c);
+		}
+
+		failures += check_reconstruction(&src, &seed, first_seed, c, &runs);
+		failures += check_area(&src, &seed, first_seed, c, &runs);
+		failures += check_watershed(&src, &seed, first_seed, c, &runs);
+
+		arena_free(&shape_arena);
+		morphop_image_free(&src);
+		fprintf(stderr, "\rcase %d/%d, %ld failures", c + 1, cases, failures);
+	}
+
+	fprintf(stderr, "\n");
+	printf("%ld runs, %ld failures\n", runs, failures);
+
+	return (failures > 0 ? 1 : 0);
+}
+
+/* check_chain()
+ *
+ * Runs a chain (or a single operator, a chain of one step) on all the engines, printing the reduced case of each one
+ * that differs from the reference implementation. Returns the number of failures.
+ */
+static long check_chain(const MorphOpChain* chain, const MorphOpImage* src, unsigned int first_seed, int c)
+{
+	long failures = 0;
+	int e, i;
+
+	for (e = 0; e < N_ENGINES; e++) {
+		Mismatch mismatch;
+
+		if (check_case(chain, src, &engines[e], &mismatch)) continue;
+
+		MorphOpChain reduced_chain = *chain;
+		MorphOpImage reduced;
+
+		failures++;
+		printf("FAIL case %d (--seed %u): ", c, first_seed);
+		for (i = 0; i < chain->n_steps; i++) {
+			printf("%s%s ", (i > 0 ? ", " : ""), morphop_operator_get_name(chain->steps[i].operator));
+			print_element_size(&chain->steps[i].element);
+			if (morphop_settings_get_iterations(&chain->steps[i]) > 1) printf(" x%d", chain->steps[i].iterations);
+			if (chain->steps[i].channel_mode != CHANNELS_LUMINOSITY) printf(" (%s)", morphop_channel_mode_get_name(chain->steps[i].channel_mode));
+		}
+		printf(", engine %s, %dx%d image\n", engines[e].name, src->width, src->height);
+
+		if (crop_image(src, &reduced, 0, 0, src->width, src->height)) {
+			reduce_case(&reduced_chain, &reduced, &engines[e]);
+			check_case(&reduced_chain, &reduced, &engines[e], &mismatch);
+			print_case(&reduced_chain, &reduced, &engines[e], &mismatch);
+			morphop_image_free(&reduced);
+		}
+	}
+
+	return failures;
+}
+
+/* check_case()
+ *
+ * Runs a case with the reference implementation (a step at a time) and with the engine. Returns 1 if the results
+ * are the same, else 0 and the first different sample in 'mismatch'.
+ */
+static int check_case(const MorphOpChain* chain, const MorphOpImage* src, const CheckEngine* engine, Mismatch* mismatch)
+{
+	MorphOpImage expected, actual, temp;
+	MorphOpContext ctx;
+	MorphOpSelection selection;
+	MorphOpArena selection_arena;
+	MorphOpCalibration calibration;
+	int x, y, i, same;
+	int n_threads = engine->threads;
+	int temp_images = 0; // allocated by check_temp_alloc() and not freed yet
+	size_t row_size = src->width * pixel_format_get_bpp(src->format);
+
+	if (morphop_image_alloc(&expected, src->width, src->height, src->format) != MORPHOP_OK) exit(1);
+	if (morphop_image_alloc(&actual, src->width, src->height, src->format) != MORPHOP_OK) exit(1);
+	if (morphop_image_alloc(&temp, src->width, src->height, src->format) != MORPHOP_OK) exit(1);
+
+	for (i = 0; i < chain->n_steps; i++) {
+		morphop_reference_run(&chain->steps[i], (i == 0 ? src : &temp), &expected);
+		if (i + 1 < chain->n_steps) memcpy(temp.data, expected.data, row_size * src->height);
+	}
+
+	morphop_context_init(&ctx);
+	ctx.calibration = check_calibration(engine->model, &calibration);
+	if (n_threads > 1) {
+		ctx.parallel = threads_parallel_for;
+		ctx.parallel_data = &n_threads;
+	}
+
+	// the mask of the selection is built in 'temp', that is not used anymore
+	arena_init(&selection_arena);
+	if (engine->selection) {
+		for (y = 0; y < src->height; y++) {
+			for (x = 0; x < src->width; x++) temp.data[y * src->width + x] = is_selected(x, y);
+		}
+		if (morphop_selection_build(&selection, temp.data, src->width, src->width, src->height, &selection_arena) != MORPHOP_OK) exit(1);
+		if (engine->chain || engine->budget) ctx.selection = &selection;
+	}
+
+	if (engine->in_place) {
+		for (y = 0; y < src->height; y++) {
+			memcpy(actual.data + y * actual.stride, src->data + y * src->stride, row_size);
+		}
+	}
+
+	if (engine->stream) {
+		run_stream(chain, src, &actual, engine->stream, ctx.calibration);
+	}
+	else if (engine->budget) {
+		const MorphOpImage* images[2] = { src, &actual };
+
+		ctx.temp_alloc = check_temp_alloc;
+		ctx.temp_free = check_temp_free;
+		ctx.temp_data = &temp_images;
+		morphop_run_budget(&ctx, chain, src->width, src->height, src->format, 2 * BUDGET_ROWS * row_size, read_strip, write_strip, (void*)images);
+		if (temp_images != 0) {
+			fprintf(stderr, "morphop-bench: %d temporary images not freed\n", temp_images);
+			exit(1);
+		}
+	}
+	else if (engine->chain) {
+		morphop_run_chain(&ctx, chain, (engine->in_place ? &actual : src), &actual);
+	}
+	else {
+		for (i = 0; i < chain->n_steps; i++) {
+			// the steps before the last one need all their pixels, the next one reads them
+			if (engine->selection && i + 1 == chain->n_steps) ctx.selection = &selection;
+			morphop_run(&ctx, &chain->steps[i], (i == 0 && !engine->in_place ? src : &actual), &actual);
+		}
+	}
+	morphop_context_free(&ctx);
+	morphop_image_free(&temp);
+
+	// the pixels that are not selected are undefined: they get the expected ones
+	if (engine->selection) {
+		size_t bpp = pixel_format_get_bpp(src->format);
+
+		for (y = 0; y < src->height; y++) {
+			for (x = 0; x < src->width; x++) {
+				if (!is_selected(x, y)) memcpy(actual.data + y * actual.stride + x * bpp, expected.data + y * expected.stride + x * bpp, bpp);
+			}
+		}
+	}
+	arena_free(&selection_arena);
+
+	same = compare_images(&expected, &actual, mismatch);
+
+	morphop_image_free(&expected);
+	morphop_image_free(&actual);
+
+	return same;
+}
+
+/* check_reconstruction()
+ *
+ * Reconstructions by dilation and by erosion under the mask 'src', from a random marker and from a sparse one
+ * (a few pixels of the mask, the others black or white). Each one is run to a new image, to the marker and to
+ * the mask. Returns the number of failures, and adds the runs to 'runs'.
+ */
+static long check_reconstruction(const MorphOpImage* src, unsigned int* seed, unsigned int first_seed, int c, long* runs)
+{
+	static const char* dst_names[3] = { "new image", "marker", "mask" };
+	double max = (src->format.type == SAMPLE_U16 ? 65535 : (src->format.type == SAMPLE_FLOAT ? 1 : 255));
+	size_t row_size = src->width * pixel_format_get_bpp(src->format);
+	MorphOpImage marker, mask, expected, actual;
+	long failures = 0;
+	int sparse, op, mode, x, y, i;
+
+	if (
+		morphop_image_alloc(&marker, src->width, src->height, src->format) != MORPHOP_OK ||
+		morphop_image_alloc(&mask, src->width, src->height, src->format) != MORPHOP_OK ||
+		morphop_image_alloc(&expected, src->width, src->height, src->format) != MORPHOP_OK ||
+		morphop_image_alloc(&actual, src->width, src->height, src->format) != MORPHOP_OK
+	) exit(1);
+
+	for (sparse = 0; sparse < 2; sparse++) {
+		for (op = OPERATOR_EROSION; op <= OPERATOR_DILATION; op++) {
+			MorphOpImage random_marker;
+			Mismatch mismatch;
+
+			if (morphop_image_alloc(&random_marker, src->width, src->height, src->format) != MORPHOP_OK) exit(1);
+
+			if (!sparse) random_image(&random_marker, seed);
+			else {
+				for (y = 0; y < src->height; y++) {
+					for (x = 0; x < src->width; x++) {
+						int keep = (next_random(seed) % 16 == 0);
+
+						for (i = 0; i < src->format.channels; i++) {
+							set_sample(&random_marker, x, y, i, (keep ? get_sample(src, x, y, i) : (op == OPERATOR_DILATION ? 0 : max)));
+						}
+					}
+				}
+			}
+
+			morphop_reference_reconstruct(op, &random_marker, src, &expected);
+
+			for (mode = 0; mode < 3; mode++) {
+				MorphOpContext ctx;
+				MorphOpImage* dst = (mode == 0 ? &actual : (mode == 1 ? &marker : &mask));
+				MorphOpStatus status;
+
+				for (y = 0; y < src->height; y++) {
+					memcpy(marker.data + y * marker.stride, random_marker.data + y * random_marker.stride, row_size);
+					memcpy(mask.data + y * mask.stride, src->data + y * src->stride, row_size);
+				}
+
+				morphop_context_init(&ctx);
+				status = morphop_reconstruct(&ctx, op, &marker, &mask, dst);
+				morphop_context_free(&ctx);
+
+				(*runs)++;
+				if (status == MORPHOP_OK && compare_images(&expected, dst, &mismatch)) continue;
+
+				failures++;
+				printf("FAIL case %d (--seed %u): reconstruction by %s from a %s marker to the %s, %dx%d image",
+					c, first_seed, morphop_operator_get_name(op), (sparse ? "sparse" : "random"), dst_names[mode],
+					src->width, src->height);
+				if (status != MORPHOP_OK) printf(", status %d\n", status);
+				else {
+					printf("\n  pixel (%d, %d) channel %d: expected %.9g, got %.9g\n",
+						mismatch.x, mismatch.y, mismatch.channel, mismatch.expected, mismatch.actual);
+				}
+			}
+
+			morphop_image_free(&random_marker);
+		}
+	}
+
+	morphop_image_free(&marker);
+	morphop_image_free(&mask);
+	morphop_image_free(&expected);
+	morphop_image_free(&actual);
+
+	return failures;
+}
+
+/* check_area()
+ *
+ * Area openings and closings of the top-left corner of 'src' (at most AREA_MAX_SIZE pixels wide and high), with
+ * AREAS_PER_TREE thresholds for each tree: the smallest ones, a random one and one bigger than the image.
+ * Returns the number of failures, and adds the runs to 'runs'.
+ */
+static long check_area(const MorphOpImage* src, unsigned int* seed, unsigned int first_seed, int c, long* runs)
+{
+	MorphOpImage image, expected, actual;
+	MorphOpContext ctx;
+	MorphOpAreaTree tree;
+	long failures = 0;
+	int op, k;
+
+	if (
+		!crop_image(src, &image, 0, 0, (src->width < AREA_MAX_SIZE ? src->width : AREA_MAX_SIZE), (src->height < AREA_MAX_SIZE ? src->height : AREA_MAX_SIZE)) ||
+		morphop_image_alloc(&expected, image.width, image.height, image.format) != MORPHOP_OK ||
+		morphop_image_alloc(&actual, image.width, image.height, image.format) != MORPHOP_OK
+	) exit(1);
+
+	morphop_context_init(&ctx);
+	morphop_area_tree_init(&tree);
+
+	for (op = OPERATOR_OPENING; op <= OPERATOR_CLOSING; op++) {
+		unsigned long pixels = (unsigned long)image.width * image.height;
+		unsigned long areas[AREAS_PER_TREE] = { 1, 2, 1 + next_random(seed) % pixels, pixels + 1 };
+		MorphOpStatus status = morphop_area_tree_build(&ctx, op, &image, &tree);
+
+		for (k = 0; k < AREAS_PER_TREE; k++) {
+			Mismatch mismatch;
+
+			morphop_reference_area(op, areas[k], &image, &expected);
+			if (status == MORPHOP_OK) status = morphop_area_tree_filter(&tree, areas[k], &actual);
+
+			(*runs)++;
+			if (status == MORPHOP_OK && compare_images(&expected, &actual, &mismatch)) continue;
+
+			failures++;
+			printf("FAIL case %d (--seed %u): area %s, %lu pixels, %dx%d image",
+				c, first_seed, morphop_operator_get_name(op), areas[k], image.width, image.height);
+			if (status != MORPHOP_OK) printf(", status %d\n", status);
+			else {
+				printf("\n  pixel (%d, %d) channel %d: expected %.9g, got %.9g\n",
+					mismatch.x, mismatch.y, mismatch.channel, mismatch.expected, mismatch.actual);
+			}
+		}
+	}
+
+	morphop_area_tree_free(&tree);
+	morphop_context_free(&ctx);
+	morphop_image_free(&image);
+	morphop_image_free(&expected);
+	morphop_image_free(&actual);
+
+	return failures;
+}
+
+/* check_watershed()
+ *
+ * Watersheds of the top-left corner of 'src' (at most WATERSHED_MAX_SIZE pixels wide and high), with a random element:
+ * from the regional minima of the gradient and from random 8-bit gray markers, to a new image and in place.
+ * Returns the number of failures, and adds the runs to 'runs'.
+ */
+static long check_watershed(const MorphOpImage* src, unsigned int* seed, unsigned int first_seed, int c, long* runs)
+{
+	PixelFormat gray = { SAMPLE_U8, 1, 0, 0 };
+	MorphOpImage image, markers, expected, actual;
+	StructuringElement element;
+	long failures = 0;
+	int marked, in_place, y;
+
+	if (
+		!crop_image(src, &image, 0, 0, (src->width < WATERSHED_MAX_SIZE ? src->width : WATERSHED_MAX_SIZE), (src->height < WATERSHED_MAX_SIZE ? src->height : WATERSHED_MAX_SIZE)) ||
+		morphop_image_alloc(&markers, image.width, image.height, gray) != MORPHOP_OK ||
+		morphop_image_alloc(&expected, image.width, image.height, image.format) != MORPHOP_OK ||
+		morphop_image_alloc(&actual, image.width, image.height, image.format) != MORPHOP_OK
+	) exit(1);
+
+	random_element(&element, seed);
+	element.size = next_random(seed) % 2;
+
+	// a few small groups of markers
+	for (y = 0; y < image.height; y++) {
+		int x;
+		for (x = 0; x < image.width; x++) markers.data[y * markers.stride + x] = (next_random(seed) % 24 == 0 ? 255 : 0);
+	}
+
+	for (marked = 0; marked < 2; marked++) {
+		morphop_reference_watershed(&element, &image, (marked ? &markers : NULL), &expected);
+
+		for (in_place = 0; in_place < 2; in_place++) {
+			MorphOpContext ctx;
+			MorphOpStatus status;
+			Mismatch mismatch;
+
+			for (y = 0; y < image.height; y++) {
+				memcpy(actual.data + y * actual.stride, image.data + y * image.stride, image.width * pixel_format_get_bpp(image.format));
+			}
+
+			morphop_context_init(&ctx);
+			status = morphop_watershed(&ctx, &element, (in_place ? &actual : &image), (marked ? &markers : NULL), &actual);
+			morphop_context_free(&ctx);
+
+			(*runs)++;
+			if (status == MORPHOP_OK && compare_images(&expected, &actual, &mismatch)) continue;
+
+			failures++;
+			printf("FAIL case %d (--seed %u): watershed %s, %dx%d element, %s, %dx%d image",
+				c, first_seed, (marked ? "from markers" : "from minima"), 3 + 2 * element.size, 3 + 2 * element.size,
+				(in_place ? "in place" : "new image"), image.width, image.height);
+			if (status != MORPHOP_OK) printf(", status %d\n", status);
+			else {
+				printf("\n  pixel (%d, %d) channel %d: expected %.9g, got %.9g\n",
+					mismatch.x, mismatch.y, mismatch.channel, mismatch.expected, mismatch.actual);
+			}
+		}
+	}
+
+	morphop_image_free(&image);
+	morphop_image_free(&markers);
+	morphop_image_free(&expected);
+	morphop_image_free(&actual);
+
+	return failures;
+}
+
+/* compare_images()
+ *
+ * Returns 1 if the images are the same, else 0 and the first different sample in 'mismatch'
+ */
+static int compare_images(const MorphOpImage* expected, const MorphOpImage* actual, Mismatch* mismatch)
+{
+	int x, y, i;
+
+	for (y = 0; y < expected->height; y++) {
+		for (x = 0; x < expected->width; x++) {
+			for (i = 0; i < expected->format.channels; i++) {
+				double e = get_sample(expected, x, y, i), a = get_sample(actual, x, y, i);
+
+				// bitwise comparison, also for float samples
+				if (memcmp(&e, &a, sizeof(double)) != 0) {
+					mismatch->x = x;
+					mismatch->y = y;
+					mismatch->channel = i;
+					mismatch->expected = e;
+					mismatch->actual = a;
+					return 0;
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* reduce_case()
+ *
+ * Makes a failing case as small as possible, keeping it failing: the image is cropped, its pixels are made
+ * black, the cells of the element are cleared and the iterations lowered, one at a time, as long as the engine still differs
+ */
+static void reduce_case(MorphOpChain* chain, MorphOpImage* image, const CheckEngine* engine)
+{
+	Mismatch mismatch;
+	int progress = 1;
+	int x, y, i, j, k, step;
+
+	while (progress) {
+		progress = 0;
+
+		// crop: remove halves, then single rows and columns, from each side
+		for (k = 0; k < 8; k++) {
+			int side = k % 4, amount;
+			int extent = (side < 2 ? image->height : image->width);
+
+			amount = (k < 4 ? extent / 2 : 1);
+			if (amount < 1 || amount >= extent) continue;
+
+			MorphOpImage cropped;
+			int ok = 0;
+
+			if (side == 0) ok = crop_image(image, &cropped, 0, amount, image->width, image->height - amount);
+			else if (side == 1) ok = crop_image(image, &cropped, 0, 0, image->width, image->height - amount);
+			else if (side == 2) ok = crop_image(image, &cropped, amount, 0, image->width - amount, image->height);
+			else ok = crop_image(image, &cropped, 0, 0, image->width - amount, image->height);
+			if (!ok) continue;
+
+			if (!check_case(chain, &cropped, engine, &mismatch)) {
+				morphop_image_free(image);
+				*image = cropped;
+				progress = 1;
+			}
+			else {
+				morphop_image_free(&cropped);
+			}
+		}
+
+		// simplify the pixels
+		for (y = 0; y < image->height; y++) {
+			for (x = 0; x < image->width; x++) {
+				double saved[4];
+				int changed = 0;
+
+				for (i = 0; i < image->format.channels; i++) {
+					saved[i] = get_sample(image, x, y, i);
+					if (saved[i] != 0) changed = 1;
+					set_sample(image, x, y, i, 0);
+				}
+
+				if (changed && !check_case(chain, image, engine, &mismatch)) {
+					progress = 1;
+				}
+				else {
+					for (i = 0; i < image->format.channels; i++) set_sample(image, x, y, i, saved[i]);
+				}
+			}
+		}
+
+		// simplify the elements
+		for (step = 0; step < chain->n_steps; step++) {
+			StructuringElement* element = &chain->steps[step].element;
+			int matrix_size = (element->shape == NULL ? STRELEM_DEFAULT_SIZE : 0); // a custom element doesn't use the matrix
+
+			for (i = 0; i < matrix_size; i++) {
+				for (j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
+					signed char saved = element->matrix[i][j];
+					if (saved == 0) continue;
+
+					element->matrix[i][j] = 0;
+					if (!check_case(chain, image, engine, &mismatch)) progress = 1;
+					else element->matrix[i][j] = saved;
+				}
+			}
+
+			for (i = 0; i < matrix_size; i++) {
+				for (j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
+					signed char saved = element->weights[i][j];
+					if (saved == 0) continue;
+
+					element->weights[i][j] = 0;
+					if (!check_case(chain, image, engine, &mismatch)) progress = 1;
+					else element->weights[i][j] = saved;
+				}
+			}
+
+			if (morphop_settings_get_iterations(&chain->steps[step]) > 1) {
+				chain->steps[step].iterations--;
+				if (!check_case(chain, image, engine, &mismatch)) progress = 1;
+				else chain->steps[step].iterations++;
+			}
+		}
+	}
+}
+
+/* crop_image()
+ *
+ * Allocates 'dst' as a copy of a rectangle of 'src'. Returns 0 if there is no memory.
+ */
+static int crop_image(const MorphOpImage* src, MorphOpImage* dst, int x, int y, int width, int height)
+{
+	int bpp = pixel_format_get_bpp(src->format);
+	int i;
+
+	if (morphop_image_alloc(dst, width, height, src->format) != MORPHOP_OK) return 0;
+
+	for (i = 0; i < height; i++) {
+		memcpy(dst->data + i * dst->stride, src->data + (y + i) * src->stride + x * bpp, width * bpp);
+	}
+
+	return 1;
+}
+
+/* random_image()
+ *
+ * Fills an image with one of several kinds of random content: noise, binary, values close to the threshold
+ * of SRC_THRESHOLD, a few levels (so that many pixels have the same luminosity) and flat regions (a background
+ * and some rectangles of a single color, the last one noisy) where the engine copies the uniform blocks
+ */
+static void random_image(MorphOpImage* image, unsigned int* seed)
+{
+	static const int levels[] = { 0, 1, 126, 127, 128, 254, 255 };
+	int kind = next_random(seed) % 5;
+	double max = (image->format.type == SAMPLE_U16 ? 65535 : (image->format.type == SAMPLE_FLOAT ? 1 : 255));
+	int region_x0[4], region_y0[4], region_x1[4], region_y1[4]; // region 0 is the background
+	double region_value[4][4];
+	int x, y, i, k;
+
+	for (k = 0; k < 4; k++) {
+		region_x0[k] = (k == 0 ? 0 : next_random(seed) % image->width);
+		region_y0[k] = (k == 0 ? 0 : next_random(seed) % image->height);
+		region_x1[k] = (k == 0 ? image->width : region_x0[k] + 1 + next_random(seed) % (image->width / 4 + 1));
+		region_y1[k] = (k == 0 ? image->height : region_y0[k] + 1 + next_random(seed) % (image->height / 4 + 1));
+		for (i = 0; i < image->format.channels; i++) {
+			region_value[k][i] = (int)(levels[next_random(seed) % 7] * max / 255);
+		}
+	}
+
+	for (y = 0; y < image->height; y++) {
+		for (x = 0; x < image->width; x++) {
+			int region = 0;
+
+			for (k = 1; k < 4; k++) {
+				if (x >= region_x0[k] && x < region_x1[k] && y >= region_y0[k] && y < region_y1[k]) region = k;
+			}
+
+			for (i = 0; i < image->format.channels; i++) {
+				unsigned int r = next_random(seed);
+				double value;
+
+				if (kind == 0 || (kind == 4 && region == 3)) value = (image->format.type == SAMPLE_FLOAT ? (r % 100001) / 100000.0 : r % ((unsigned int)max + 1));
+				else if (kind == 1) value = (r % 2 ? max : 0);
+				else if (kind == 2) value = (120 + r % 16) * max / 255;
+				else if (kind == 3) value = levels[r % 7] * max / 255;
+				else value = region_value[region][i];
+
+				if (image->format.type != SAMPLE_FLOAT) value = (int)value;
+				set_sample(image, x, y, i, value);
+			}
+		}
+	}
+}
+
+/* random_element()
+ *
+ * A random 7x7 element: white (1), black (0) and "don't care" (-1) cells. One in three is not flat,
+ * with random heights between -64 and 64 levels.
+ */
+static void random_element(StructuringElement* element, unsigned int* seed)
+{
+	int density = 1 + next_random(seed) % 4;
+	int weighted = (next_random(seed) % 3 == 0);
+	int i, j;
+
+	for (i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
+		for (j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
+			unsigned int r = next_random(seed) % 5;
+			element->matrix[i][j] = (r < (unsigned int)density ? 1 : (r == 4 ? -1 : 0));
+			element->weights[i][j] = (weighted ? (signed char)((int)(next_random(seed) % 129) - 64) : 0);
+		}
+	}
+	element->shape = NULL;
+}
+
+/* random_shape()
+ *
+ * A random custom element: a disk, a slanted line (a few pixels thick), a rectangle or random cells, possibly
+ * with an even side. The rectangle of the disk and of the random cells is at most 25 pixels wide and high, the line
+ * can be as long as SHAPE_MAX_SIDE. The runs are taken from the arena.
+ */
+static void random_shape(MorphOpShape* shape, MorphOpArena* arena, unsigned int* seed)
+{
+	int kind = next_random(seed) % 4;
+	int width = 1 + next_random(seed) % 25, height = 1 + next_random(seed) % 25;
+	int density = 1 + next_random(seed) % 4;
+	int thickness = 1 + next_random(seed) % 3;
+	unsigned char* mask;
+	int x, y;
+
+	if (kind == 0) height = width;
+	else if (kind == 1) {
+		// mostly horizontal or mostly vertical
+		width = 1 + next_random(seed) % SHAPE_MAX_SIDE;
+		height = 1 + next_random(seed) % 8;
+		if (next_random(seed) % 2) {
+			int t = width;
+			width = height;
+			height = t;
+		}
+	}
+
+	mask = malloc(width * height);
+	if (mask == NULL) exit(1);
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			double dx = x - (width - 1) / 2.0, dy = y - (height - 1) / 2.0;
+			int cell;
+
+			if (kind == 0) cell = (4 * (dx * dx + dy * dy) <= (double)width * width);
+			else if (kind == 1) {
+				// the distance from the diagonal of the rectangle, in pixels
+				double along = (width > height ? (double)x * (height - 1) / (width > 1 ? width - 1 : 1) - y : (double)y * (width - 1) / (height > 1 ? height - 1 : 1) - x);
+				cell = (along > -thickness / 2.0 - 0.5 && along <= thickness / 2.0);
+			}
+			else if (kind == 2) cell = 1;
+			else cell = (next_random(seed) % 5 < (unsigned int)density);
+
+			mask[y * width + x] = (unsigned char)cell;
+		}
+	}
+
+	if (morphop_shape_build(shape, mask, width, width, height, arena) != MORPHOP_OK) exit(1);
+	free(mask);
+}
+
+/* print_element_size()
+ *
+ * Prints the size of an element, e.g. "5x5", or "3x61 custom"
+ */
+static void print_element_size(const StructuringElement* element)
+{
+	if (element->shape != NULL) printf("%dx%d custom", element->shape->width, element->shape->height);
+	else printf("%dx%d", 3 + 2 * element->size, 3 + 2 * element->size);
+}
+
+static void print_case(const MorphOpChain* chain, const MorphOpImage* image, const CheckEngine* engine, const Mismatch* mismatch)
+{
+	static const char* sample_names[SAMPLE_END] = { "u8", "u16", "float" };
+	int x, y, i, step;
+
+	printf("  reduced: engine %s, %dx%d %s image (%d channels%s)\n",
+		engine->name, image->width, image->height, sample_names[image->format.type], image->format.channels,
+		(image->format.has_alpha ? ", alpha" : ""));
+	printf("  pixel (%d, %d) channel %d: expected %.9g, got %.9g\n",
+		mismatch->x, mismatch->y, mismatch->channel, mismatch->expected, mismatch->actual);
+
+	for (step = 0; step < chain->n_steps; step++) {
+		const MorphOpSettings* settings = &chain->steps[step];
+
+		printf("  %s, ", morphop_operator_get_name(settings->operator));
+		print_element_size(&settings->element);
+		printf(" element, %d iterations, channels %s:\n", morphop_settings_get_iterations(settings),
+			morphop_channel_mode_get_name(settings->channel_mode));
+		if (settings->element.shape != NULL) {
+			const MorphOpShape* shape = settings->element.shape;
+
+			for (i = 0; i < shape->n_runs; i++) {
+				printf("    row %d: columns %d to %d\n", shape->runs[i].dy, shape->runs[i].dx0, shape->runs[i].dx1 - 1);
+			}
+			continue;
+		}
+		for (y = 0; y < STRELEM_DEFAULT_SIZE; y++) {
+			printf("   ");
+			for (x = 0; x < STRELEM_DEFAULT_SIZE; x++) printf(" %2d", settings->element.matrix[y][x]);
+			printf("\n");
+		}
+		if (!morphop_element_is_flat(&settings->element)) {
+			printf("  heights:\n");
+			for (y = 0; y < STRELEM_DEFAULT_SIZE; y++) {
+				printf("   ");
+				for (x = 0; x < STRELEM_DEFAULT_SIZE; x++) printf(" %3d", settings->element.weights[y][x]);
+				printf("\n");
+			}
+		}
+	}
+
+	printf("  image:\n");
+	for (y = 0; y < image->height; y++) {
+		printf("   ");
+		for (x = 0; x < image->width; x++) {
+			printf(" ");
+			for (i = 0; i < image->format.channels; i++) printf("%s%.9g", (i > 0 ? "," : ""), get_sample(image, x, y, i));
+		}
+		printf("\n");
+	}
+}
+
+/* is_selected()
+ *
+ * The selection of the engines that have one: on the left, thin diagonal stripes (closer than some elements and
+ * farther than others), on the right a few columns with wide gaps, so the chains skip some strips. Some rows have
+ * nothing selected.
+ */
+static int is_selected(int x, int y)
+{
+	return (y % 7 != 3) && (x < 20 ? (x + 2 * y) % 13 < 4 : x % 23 == 7);
+}
+
+/* check_calibration()
+ *
+ * The cost model of the engines that force the planner's choices: MODEL_DOUBLING makes doubling, stacks and the
+ * blocks nearly free, so they are used wherever they can be; MODEL_CELLS makes them so slow that they never are.
+ * Returns NULL (the default model) for 0.
+ */
+static const MorphOpCalibration* check_calibration(int model, MorphOpCalibration* calibration)
+{
+	const double cost = (model == MODEL_DOUBLING ? 1e-6 : 1e6);
+	int t;
+
+	if (model == 0) return NULL;
+
+	morphop_calibration_init(calibration);
+	for (t = 0; t < SAMPLE_END; t++) {
+		calibration->doubling[t] = calibration->stack[t] = calibration->lum_doubling[t] = calibration->summary[t] = cost;
+	}
+
+	return calibration;
+}
+
+/* run_stream()
+ *
+ * Runs a case as a stream, reading the rows of 'src' and writing them to 'dst'
+ */
+static void run_stream(const MorphOpChain* chain, const MorphOpImage* src, MorphOpImage* dst, int mode, const MorphOpCalibration* calibration)
+{
+	MorphOpStream stream;
+	const unsigned char* row;
+	int y = 0;
+
+	morphop_stream_init_chain(&stream, chain, src->width, src->height, src->format, (mode == 1 ? copy_row : map_row), (void*)src);
+	morphop_stream_plan(&stream, calibration);
+
+	while ((row = morphop_stream_next_row(&stream)) != NULL) {
+		memcpy(dst->data + (y++) * dst->stride, row, stream.row_size);
+	}
+
+	morphop_stream_free(&stream);
+}
+
+static const unsigned char* copy_row(int y, unsigned char* buffer, void* data)
+{
+	const MorphOpImage* image = data;
+
+	memcpy(buffer, image->data + y * image->stride, image->width * pixel_format_get_bpp(image->format));
+	return buffer;
+}
+
+static const unsigned char* map_row(int y, unsigned char* buffer, void* data)
+{
+	const MorphOpImage* image = data;
+
+	(void)buffer; // the rows are read in place
+	return image->data + y * image->stride;
+}
+
+/* read_strip(), write_strip()
+ *
+ * The strips of morphop_run_budget(): 'data' points to the input and to the output image
+ */
+static int read_strip(int y0, int y1, MorphOpImage* strip, void* data)
+{
+	const MorphOpImage* image = ((const MorphOpImage**)data)[0];
+	int y;
+
+	for (y = y0; y < y1; y++) {
+		memcpy(strip->data + (y - y0) * strip->stride, image->data + y * image->stride, image->width * pixel_format_get_bpp(image->format));
+	}
+
+	return 1;
+}
+
+static int write_strip(int y0, int y1, MorphOpImage* strip, void* data)
+{
+	MorphOpImage* image = ((MorphOpImage**)data)[1];
+	int y;
+
+	for (y = y0; y < y1; y++) {
+		memcpy(image->data + y * image->stride, strip->data + (y - y0) * strip->stride, image->width * pixel_format_get_bpp(image->format));
+	}
+
+	return 1;
+}
+
+/* check_temp_alloc(), check_temp_free()
+ *
+ * The temporary images of the engines with a budget: their rows are padded, and 'data' counts them
+ */
+static int check_temp_alloc(MorphOpImage* image, void* data)
+{
+	image->stride = image->width * pixel_format_get_bpp(image->format) + TEMP_ROW_PADDING;
+	image->data = malloc(image->stride * image->height);
+	if (image->data == NULL) return 0;
+
+	(*(int*)data)++;
+	return 1;
+}
+
+static void check_temp_free(MorphOpImage* image, void* data)
+{
+	free(image->data);
+	(*(int*)data)--;
+}
+
+static double get_sample(const MorphOpImage* image, int x, int y, int channel)
+{
+	const unsigned char* row = image->data + (size_t)y * image->stride;
+	int i = x * image->format.channels + channel;
+
+	switch (image->format.type) {
+		case SAMPLE_U16: return ((const unsigned short*)row)[i];
+		case SAMPLE_FLOAT: return ((const float*)row)[i];
+		default: return row[i];
+	}
+}
+
+static void set_sample(MorphOpImage* image, int x, int y, int channel, double value)
+{
+	unsigned char* row = image->data + (size_t)y * image->stride;
+	int i = x * image->format.channels + channel;
+
+	switch (image->format.type) {
+		case SAMPLE_U16: ((unsigned short*)row)[i] = (unsigned short)value; break;
+		case SAMPLE_FLOAT: ((float*)row)[i] = (float)value; break;
+		default: row[i] = (unsigned char)value; break;
+	}
+}
+
+// xorshift32
+static unsigned int next_random(unsigned int* state)
+{
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
@@ -0,0 +1,345 @@
+/*
+ * morphop-cli: runs the operators of the plugin on image files, without GIMP.
+ *
+ *	morphop-cli [options] <operator> <input> <output>
+ *
+ * The image is streamed (see libmorphop/morphop-stream.h): it's read, processed and written a row at a time,
+ * so images of any height run in a few rows of memory (except skeletonization, that needs the whole image).
+ * The results are the same of the plugin, on the same pixels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-engine.h"
+#include "morphop-stream.h"
+#include "morphop-image-io.h"
+
+static const char* size_names[SIZE_END] = { "3x3", "5x5", "7x7", "9x9", "11x11" };
+static const char* weights_names[WEIGHTS_END] = { "flat", "ball", "cone" };
+
+// the default structuring element of the plugin
+static const signed char default_element[STRELEM_DEFAULT_SIZE][STRELEM_DEFAULT_SIZE] = {
+	{0, 0, 0, 1, 0, 0, 0},
+	{0, 0, 1, 1, 1, 0, 0},
+	{0, 1, 1, 1, 1, 1, 0},
+	{1, 1, 1, 1, 1, 1, 1},
+	{0, 1, 1, 1, 1, 1, 0},
+	{0, 0, 1, 1, 1, 0, 0},
+	{0, 0, 0, 1, 0, 0, 0},
+};
+
+static int parse_element(const char*, StructuringElement*);
+static int parse_weights(const char*, ElementWeights*, int*);
+static int read_element_image(const char*, MorphOpShape*, MorphOpArena*);
+static char* read_text_file(const char*);
+static int run(const MorphOpSettings*, const char*, const char*);
+static void print_usage(void);
+
+int main(int argc, char** argv)
+{
+	MorphOpSettings settings;
+	MorphOpShape shape;
+	MorphOpArena shape_arena;
+	ElementWeights weights = WEIGHTS_FLAT;
+	int height = 0, ok;
+	int i, j;
+
+	for (i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
+		for (j = 0; j < STRELEM_DEFAULT_SIZE; j++) settings.element.matrix[i][j] = default_element[i][j];
+	}
+	settings.element.size = SIZE_7x7;
+	settings.element.shape = NULL;
+	settings.iterations = 1;
+	settings.channel_mode = CHANNELS_LUMINOSITY;
+
+	arena_init(&shape_arena);
+
+	for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+		const char* value = (i + 1 < argc ? argv[i + 1] : NULL);
+
+		if (value == NULL) {
+			print_usage();
+			return 2;
+		}
+
+		if (strcmp(argv[i], "--element") == 0) {
+			if (!parse_element(value, &settings.element)) return 2;
+		}
+		else if (strcmp(argv[i], "--element-file") == 0) {
+			char* text = read_text_file(value);
+			int ok = (text != NULL && parse_element(text, &settings.element));
+
+			free(text);
+			if (!ok) return 2;
+		}
+		else if (strcmp(argv[i], "--element-image") == 0) {
+			if (!read_element_image(value, &shape, &shape_arena)) return 2;
+			settings.element.shape = &shape;
+		}
+		else if (strcmp(argv[i], "--size") == 0) {
+			for (j = 0; j < SIZE_END && strcmp(value, size_names[j]) != 0; j++);
+			if (j == SIZE_END) {
+				fprintf(stderr, "morphop-cli: unknown element size: %s\n", value);
+				return 2;
+			}
+			settings.element.size = j;
+		}
+		else if (strcmp(argv[i], "--channels") == 0) {
+			settings.channel_mode = morphop_channel_mode_from_name(value);
+			if (settings.channel_mode == CHANNELS_END) {
+				fprintf(stderr, "morphop-cli: unknown channel mode: %s\n", value);
+				return 2;
+			}
+		}
+		else if (strcmp(argv[i], "--weights") == 0) {
+			if (!parse_weights(value, &weights, &height)) return 2;
+		}
+		else if (strcmp(argv[i], "--iterations") == 0) {
+			settings.iterations = atoi(value);
+			if (settings.iterations < 1 || settings.iterations > MORPHOP_MAX_ITERATIONS) {
+				fprintf(stderr, "morphop-cli: the iterations must be between 1 and %d\n", MORPHOP_MAX_ITERATIONS);
+				return 2;
+			}
+		}
+		else {
+			print_usage();
+			return 2;
+		}
+	}
+
+	if (argc - i != 3) {
+		print_usage();
+		return 2;
+	}
+
+	morphop_element_set_weights(&settings.element, weights, height);
+
+	settings.operator = morphop_operator_from_name(argv[i]);
+	if (settings.operator == OPERATOR_END) {
+		fprintf(stderr, "morphop-cli: unknown operator: %s\n", argv[i]);
+		return 2;
+	}
+
+	ok = run(&settings, argv[i + 1], argv[i + 2]);
+	arena_free(&shape_arena);
+
+	return (ok ? 0 : 1);
+}
+
+/* run()
+ *
+ * Streams the input file through the operator to the output file. Returns 0 if something went wrong.
+ */
+static int run(const MorphOpSettings* settings, const char* input_path, const char* output_path)
+{
+	ImageReader reader;
+	ImageWriter writer;
+	MorphOpStream stream;
+	const unsigned char* row;
+	int ok, y = 0;
+
+	if (!image_reader_open(&reader, input_path)) {
+		image_reader_close(&reader);
+		return 0;
+	}
+
+	ok = image_writer_open(&writer, output_path, reader.width, reader.height, reader.format);
+
+	if (ok && morphop_stream_init(&stream, settings, reader.width, reader.height, reader.format, image_reader_row, &reader) == MORPHOP_OK) {
+		while (ok && (row = morphop_stream_next_row(&stream)) != NULL) {
+			ok = image_writer_row(&writer, row);
+			y++;
+		}
+
+		if (stream.status == MORPHOP_NO_MEMORY) fprintf(stderr, "morphop-cli: out of memory\n");
+		if (!ok) fprintf(stderr, "morphop-cli: can't write %s\n", output_path);
+
+		ok = (ok && y == reader.height);
+		morphop_stream_free(&stream);
+	}
+	else if (ok) {
+		fprintf(stderr, "morphop-cli: out of memory\n");
+		morphop_stream_free(&stream);
+		ok = 0;
+	}
+
+	int created = (writer.file != NULL);
+	ok = image_writer_close(&writer) && ok;
+	image_reader_close(&reader);
+
+	// don't leave a partial result
+	if (!ok && created) remove(output_path);
+
+	return ok;
+}
+
+/* parse_element()
+ *
+ * Reads a 7x7 structuring element: 49 cells, row by row, each one '1' (white), '0' (black) or '-' (don't care,
+ * for hit-or-miss, thickening and thinning). Spaces, new lines, '/' and ',' between the cells are ignored,
+ * and so are the lines starting with '#'.
+ */
+static int parse_element(const char* text, StructuringElement* element)
+{
+	int cells = 0;
+	const char* c;
+
+	for (c = text; *c != '\0'; c++) {
+		if (*c == '#') {
+			while (*c != '\0' && *c != '\n') c++;
+			if (*c == '\0') break;
+			continue;
+		}
+
+		if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r' || *c == '/' || *c == ',') continue;
+
+		if ((*c != '1' && *c != '0' && *c != '-') || cells >= STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE) {
+			cells = -1;
+			break;
+		}
+
+		element->matrix[cells / STRELEM_DEFAULT_SIZE][cells % STRELEM_DEFAULT_SIZE] = (*c == '1' ? 1 : (*c == '0' ? 0 : -1));
+		cells++;
+	}
+
+	if (cells != STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE) {
+		fprintf(stderr, "morphop-cli: the element must have 7 rows of 7 cells, each one '1', '0' or '-'\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* read_element_image()
+ *
+ * Reads a custom element from an image file (of any size, up to MORPHOP_SHAPE_MAX_SIZE on a side): the pixels whose
+ * first channel is at least half of white are its cells, the center is the middle pixel. Returns 0, after printing
+ * why, if the file can't be read or it's too big.
+ */
+static int read_element_image(const char* path, MorphOpShape* shape, MorphOpArena* arena)
+{
+	ImageReader reader;
+	unsigned char* mask = NULL, *buffer = NULL;
+	MorphOpStatus status = MORPHOP_INVALID;
+	int x, y, ok;
+
+	ok = image_reader_open(&reader, path);
+	if (ok && (reader.width > MORPHOP_SHAPE_MAX_SIZE || reader.height > MORPHOP_SHAPE_MAX_SIZE)) {
+		fprintf(stderr, "morphop-cli: the element can't be larger than %dx%d\n", MORPHOP_SHAPE_MAX_SIZE, MORPHOP_SHAPE_MAX_SIZE);
+		ok = 0;
+	}
+
+	if (ok) {
+		mask = malloc((size_t)reader.width * reader.height);
+		buffer = malloc((size_t)reader.width * pixel_format_get_bpp(reader.format));
+		ok = (mask != NULL && buffer != NULL);
+	}
+
+	for (y = 0; ok && y < reader.height; y++) {
+		const unsigned char* row = image_reader_row(y, buffer, &reader);
+
+		if (row == NULL) {
+			fprintf(stderr, "morphop-cli: can't read %s\n", path);
+			ok = 0;
+			break;
+		}
+
+		for (x = 0; x < reader.width; x++) {
+			int i = x * reader.format.channels;
+
+			switch (reader.format.type) {
+				case SAMPLE_U16: mask[y * reader.width + x] = (((const unsigned short*)row)[i] >= 32768); break;
+				case SAMPLE_FLOAT: mask[y * reader.width + x] = (((const float*)row)[i] >= 0.5f); break;
+				default: mask[y * reader.width + x] = (row[i] >= 128); break;
+			}
+		}
+	}
+
+	if (ok) {
+		status = morphop_shape_build(shape, mask, reader.width, reader.width, reader.height, arena);
+		if (status == MORPHOP_NO_MEMORY) fprintf(stderr, "morphop-cli: out of memory\n");
+	}
+
+	free(mask);
+	free(buffer);
+	image_reader_close(&reader);
+
+	return (status == MORPHOP_OK);
+}
+
+static char* read_text_file(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	char* text;
+	long size;
+
+	if (file == NULL || fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0) {
+		fprintf(stderr, "morphop-cli: can't read %s\n", path);
+		if (file != NULL) fclose(file);
+		return NULL;
+	}
+
+	rewind(file);
+	text = malloc(size + 1);
+	if (text != NULL) text[fread(text, 1, size, file)] = '\0';
+	fclose(file);
+
+	return text;
+}
+
+/* parse_weights()
+ *
+ * Reads the heights of the element: "flat", or "ball:H" or "cone:H", with H the height of the center over the
+ * border in 8-bit levels (0 to 127). Returns 0, after printing why, if the text is not valid.
+ */
+static int parse_weights(const char* text, ElementWeights* weights, int* height)
+{
+	const char* colon = strchr(text, ':');
+	size_t length = (colon != NULL ? (size_t)(colon - text) : strlen(text));
+	char* end;
+	int w;
+
+	for (w = 0; w < WEIGHTS_END && (strlen(weights_names[w]) != length || strncmp(text, weights_names[w], length) != 0); w++);
+
+	*weights = w;
+	*height = (colon != NULL ? (int)strtol(colon + 1, &end, 10) : 0);
+
+	if (
+		w == WEIGHTS_END || (colon == NULL) != (w == WEIGHTS_FLAT) ||
+		(colon != NULL && (end == colon + 1 || *end != '\0' || *height < 0 || *height > 127))
+	) {
+		fprintf(stderr, "morphop-cli: the weights must be \"flat\", \"ball:H\" or \"cone:H\", with H from 0 to 127\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr,
+		"usage: morphop-cli [options] <operator> <input> <output>\n"
+		"\n"
+		"operators: erosion, dilation, opening, closing, boundary, gradient, hit-or-miss, skeleton,\n"
+		"           thickening, thinning, white-top-hat, black-top-hat\n"
+		"input: a binary PGM or PPM (8 or 16 bits) or a PNG file\n"
+		"output: a .pgm, .ppm, .pnm or .png file, with the same format of the input\n"
+		"\n"
+		"options:\n"
+		"  --element CELLS      the 7x7 element, row by row: '1' (white), '0' (black), '-' (don't care),\n"
+		"                       e.g. \"0001000/0011100/0111110/1111111/0111110/0011100/0001000\" (the default)\n"
+		"  --element-file FILE  the same, read from a file\n"
+		"  --element-image FILE a flat element of any size (up to 511x511), read from an image file: the\n"
+		"                       pixels at least half white are its cells, the middle one is its center.\n"
+		"                       --size and --weights don't apply to it\n"
+		"  --size SIZE          the final size of the element: 3x3, 5x5, 7x7 (default), 9x9 or 11x11\n"
+		"  --iterations N       erosion, dilation, opening and closing: apply the element N times (default 1),\n"
+		"                       as if it was N times bigger\n"
+		"  --weights PROFILE    the heights of the element: flat (default), ball:H or cone:H, with H the\n"
+		"                       height of its center in 8-bit levels (0 to 127). The erosion subtracts them\n"
+		"                       and the dilation adds them\n"
+		"  --channels MODE      how the neighbors of a color pixel are compared: luminosity (the whole\n"
+		"                       darkest or brightest pixel, the default), color (each color channel on\n"
+		"                       its own, the alpha doesn't change) or all (the alpha too)\n");
+}
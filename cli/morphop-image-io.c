@@ -0,0 +1,399 @@
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // madvise()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "morphop-image-io.h"
+
+// the rows of a mapped file are released once the stream is this many rows past them (it only keeps
+// a few tens of rows): they would be read again from the file if needed, so this doesn't need to be exact
+#define MAP_KEEP_ROWS 256
+
+// the mapped pixels are released in chunks of at least this size
+#define MAP_RELEASE_SIZE (4 << 20)
+
+static int pnm_read_header(ImageReader*);
+static int pnm_read_number(FILE*, int*);
+static int png_reader_open(ImageReader*);
+static int png_writer_open(ImageWriter*);
+static int has_extension(const char*, const char*);
+static int host_is_little_endian(void);
+static void swap_bytes_16(const unsigned char*, unsigned char*, size_t);
+static void map_release(ImageReader*, size_t);
+
+/* image_reader_open()
+ *
+ * Opens a PGM, PPM or PNG file (recognized by its content) and reads its header. Returns 0 (and prints
+ * why) if the file can't be read.
+ */
+int image_reader_open(ImageReader* reader, const char* path)
+{
+	unsigned char signature[8];
+
+	memset(reader, 0, sizeof(ImageReader));
+	reader->path = path;
+
+	reader->file = fopen(path, "rb");
+	if (reader->file == NULL) {
+		fprintf(stderr, "morphop-cli: can't open %s\n", path);
+		return 0;
+	}
+
+	if (fread(signature, 1, sizeof(signature), reader->file) == sizeof(signature) && png_sig_cmp(signature, 0, sizeof(signature)) == 0) {
+		reader->type = FILE_PNG;
+		return png_reader_open(reader);
+	}
+
+	rewind(reader->file);
+	reader->type = FILE_PNM;
+	if (!pnm_read_header(reader)) return 0;
+
+	// the pixels of 8-bit files are used where they are, 16-bit ones must be converted to the byte order of this machine
+	struct stat info;
+	if (fstat(fileno(reader->file), &info) == 0 && (size_t)info.st_size >= reader->data_offset) {
+		reader->map_size = info.st_size;
+		reader->map = mmap(NULL, reader->map_size, PROT_READ, MAP_PRIVATE, fileno(reader->file), 0);
+		if (reader->map == MAP_FAILED) reader->map = NULL;
+	}
+
+	size_t row_size = (size_t)reader->width * pixel_format_get_bpp(reader->format);
+	if (reader->map != NULL && reader->data_offset + row_size * reader->height > reader->map_size) {
+		fprintf(stderr, "morphop-cli: %s is truncated\n", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* image_reader_row()
+ *
+ * The row source of the stream (see MorphOpRowSource). 'data' is the ImageReader.
+ */
+const unsigned char* image_reader_row(int y, unsigned char* buffer, void* data)
+{
+	ImageReader* reader = data;
+	size_t row_size = (size_t)reader->width * pixel_format_get_bpp(reader->format);
+	int swap = (reader->format.type == SAMPLE_U16 && host_is_little_endian());
+
+	if (reader->type == FILE_PNG) {
+		if (setjmp(png_jmpbuf(reader->png))) {
+			fprintf(stderr, "morphop-cli: %s: can't read row %d\n", reader->path, y);
+			return NULL;
+		}
+
+		png_read_row(reader->png, buffer, NULL);
+		return buffer;
+	}
+
+	if (reader->map != NULL) {
+		const unsigned char* row = reader->map + reader->data_offset + y * row_size;
+
+		if (y > MAP_KEEP_ROWS) map_release(reader, reader->data_offset + (y - MAP_KEEP_ROWS) * row_size);
+		if (!swap) return row;
+
+		swap_bytes_16(row, buffer, row_size);
+		return buffer;
+	}
+
+	// the file can't be mapped (e.g. it's a pipe): the rows are read in order
+	if (fread(buffer, 1, row_size, reader->file) != row_size) {
+		fprintf(stderr, "morphop-cli: %s is truncated\n", reader->path);
+		return NULL;
+	}
+
+	if (swap) swap_bytes_16(buffer, buffer, row_size);
+	return buffer;
+}
+
+void image_reader_close(ImageReader* reader)
+{
+	if (reader->png != NULL) png_destroy_read_struct(&reader->png, &reader->info, NULL);
+	if (reader->map != NULL) munmap(reader->map, reader->map_size);
+	if (reader->file != NULL) fclose(reader->file);
+
+	reader->png = NULL;
+	reader->map = NULL;
+	reader->file = NULL;
+}
+
+/* image_writer_open()
+ *
+ * Creates a PNG file, or a PGM/PPM one (the name ends with ".pgm", ".ppm" or ".pnm"), and writes its header.
+ * PNM files can't have an alpha channel. Returns 0 (and prints why) if the file can't be written.
+ */
+int image_writer_open(ImageWriter* writer, const char* path, int width, int height, PixelFormat format)
+{
+	memset(writer, 0, sizeof(ImageWriter));
+	writer->path = path;
+	writer->width = width;
+	writer->height = height;
+	writer->format = format;
+
+	if (has_extension(path, ".png")) writer->type = FILE_PNG;
+	else if (has_extension(path, ".pgm") || has_extension(path, ".ppm") || has_extension(path, ".pnm")) writer->type = FILE_PNM;
+	else {
+		fprintf(stderr, "morphop-cli: %s: the output must be a .png, .pgm, .ppm or .pnm file\n", path);
+		return 0;
+	}
+
+	if (writer->type == FILE_PNM && (format.has_alpha || format.type == SAMPLE_FLOAT)) {
+		fprintf(stderr, "morphop-cli: %s: PNM files can't have an alpha channel, write a PNG instead\n", path);
+		return 0;
+	}
+
+	writer->buffer = malloc((size_t)width * pixel_format_get_bpp(format));
+	writer->file = fopen(path, "wb");
+	if (writer->buffer == NULL || writer->file == NULL) {
+		fprintf(stderr, "morphop-cli: can't write %s\n", path);
+		return 0;
+	}
+
+	if (writer->type == FILE_PNG) return png_writer_open(writer);
+
+	fprintf(writer->file, "P%c\n%d %d\n%d\n", (format.is_rgb ? '6' : '5'), width, height, (format.type == SAMPLE_U16 ? 65535 : 255));
+	return 1;
+}
+
+/* image_writer_row()
+ *
+ * Writes the next row. Returns 0 if it can't be written.
+ */
+int image_writer_row(ImageWriter* writer, const unsigned char* row)
+{
+	size_t row_size = (size_t)writer->width * pixel_format_get_bpp(writer->format);
+
+	if (writer->type == FILE_PNG) {
+		if (setjmp(png_jmpbuf(writer->png))) return 0;
+
+		png_write_row(writer->png, (png_bytep)row);
+		return 1;
+	}
+
+	// PNM samples are big-endian
+	if (writer->format.type == SAMPLE_U16 && host_is_little_endian()) {
+		swap_bytes_16(row, writer->buffer, row_size);
+		row = writer->buffer;
+	}
+
+	return (fwrite(row, 1, row_size, writer->file) == row_size);
+}
+
+/* image_writer_close()
+ *
+ * Completes the file. Returns 0 if it can't be written.
+ */
+int image_writer_close(ImageWriter* writer)
+{
+	int ok = 1;
+
+	if (writer->png != NULL) {
+		if (setjmp(png_jmpbuf(writer->png))) ok = 0;
+		else png_write_end(writer->png, NULL);
+
+		png_destroy_write_struct(&writer->png, &writer->info);
+	}
+
+	if (writer->file != NULL && fclose(writer->file) != 0) ok = 0;
+	free(writer->buffer);
+
+	writer->file = NULL;
+	writer->buffer = NULL;
+
+	if (!ok) fprintf(stderr, "morphop-cli: can't write %s\n", writer->path);
+	return ok;
+}
+
+/* pnm_read_header()
+ *
+ * Reads the header of a binary PGM (P5) or PPM (P6) file. The maximum value must be 255 or 65535: the operators
+ * compare the samples with fixed thresholds, so other ranges would give results different from the plugin.
+ */
+static int pnm_read_header(ImageReader* reader)
+{
+	int magic, maxval;
+
+	if (getc(reader->file) != 'P' || ((magic = getc(reader->file)) != '5' && magic != '6')) {
+		fprintf(stderr, "morphop-cli: %s is not a binary PGM, PPM or PNG file\n", reader->path);
+		return 0;
+	}
+
+	if (
+		!pnm_read_number(reader->file, &reader->width) ||
+		!pnm_read_number(reader->file, &reader->height) ||
+		!pnm_read_number(reader->file, &maxval) ||
+		reader->width <= 0 || reader->height <= 0
+	) {
+		fprintf(stderr, "morphop-cli: %s: bad header\n", reader->path);
+		return 0;
+	}
+
+	if (maxval != 255 && maxval != 65535) {
+		fprintf(stderr, "morphop-cli: %s: the maximum value must be 255 or 65535\n", reader->path);
+		return 0;
+	}
+
+	// a single whitespace separates the header from the pixels
+	getc(reader->file);
+	reader->data_offset = ftell(reader->file);
+
+	reader->format.type = (maxval == 255 ? SAMPLE_U8 : SAMPLE_U16);
+	reader->format.is_rgb = (magic == '6');
+	reader->format.has_alpha = 0;
+	reader->format.channels = (reader->format.is_rgb ? 3 : 1);
+
+	return 1;
+}
+
+// reads a number of the header, skipping whitespaces and comments
+static int pnm_read_number(FILE* file, int* number)
+{
+	int c = getc(file);
+
+	while (c != EOF && (isspace(c) || c == '#')) {
+		if (c == '#') {
+			while (c != EOF && c != '\n') c = getc(file);
+		}
+		c = getc(file);
+	}
+
+	if (c == EOF || !isdigit(c)) return 0;
+
+	*number = 0;
+	while (c != EOF && isdigit(c)) {
+		*number = *number * 10 + (c - '0');
+		c = getc(file);
+	}
+	ungetc(c, file);
+
+	return 1;
+}
+
+/* png_reader_open()
+ *
+ * Reads the header of a PNG file. Palettes and samples smaller than 8 bits are expanded, transparency
+ * becomes an alpha channel. Interlaced files are refused: they can't be read a row at a time.
+ */
+static int png_reader_open(ImageReader* reader)
+{
+	int color_type, bit_depth;
+
+	reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	reader->info = (reader->png != NULL ? png_create_info_struct(reader->png) : NULL);
+	if (reader->info == NULL) return 0;
+
+	if (setjmp(png_jmpbuf(reader->png))) {
+		fprintf(stderr, "morphop-cli: %s: bad PNG file\n", reader->path);
+		return 0;
+	}
+
+	png_init_io(reader->png, reader->file);
+	png_set_sig_bytes(reader->png, 8);
+	png_read_info(reader->png, reader->info);
+
+	if (png_get_interlace_type(reader->png, reader->info) != PNG_INTERLACE_NONE) {
+		fprintf(stderr, "morphop-cli: %s: interlaced PNG files are not supported\n", reader->path);
+		return 0;
+	}
+
+	png_set_expand(reader->png);
+	if (png_get_bit_depth(reader->png, reader->info) == 16 && host_is_little_endian()) png_set_swap(reader->png);
+	png_read_update_info(reader->png, reader->info);
+
+	color_type = png_get_color_type(reader->png, reader->info);
+	bit_depth = png_get_bit_depth(reader->png, reader->info);
+
+	reader->width = png_get_image_width(reader->png, reader->info);
+	reader->height = png_get_image_height(reader->png, reader->info);
+	reader->format.type = (bit_depth == 16 ? SAMPLE_U16 : SAMPLE_U8);
+	reader->format.is_rgb = ((color_type & PNG_COLOR_MASK_COLOR) != 0);
+	reader->format.has_alpha = ((color_type & PNG_COLOR_MASK_ALPHA) != 0);
+	reader->format.channels = (reader->format.is_rgb ? 3 : 1) + (reader->format.has_alpha ? 1 : 0);
+
+	return 1;
+}
+
+static int png_writer_open(ImageWriter* writer)
+{
+	PixelFormat format = writer->format;
+	int color_type = (format.is_rgb ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY) | (format.has_alpha ? PNG_COLOR_MASK_ALPHA : 0);
+
+	if (format.type == SAMPLE_FLOAT) {
+		fprintf(stderr, "morphop-cli: %s: PNG files can't have float samples\n", writer->path);
+		return 0;
+	}
+
+	writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	writer->info = (writer->png != NULL ? png_create_info_struct(writer->png) : NULL);
+	if (writer->info == NULL) return 0;
+
+	if (setjmp(png_jmpbuf(writer->png))) {
+		fprintf(stderr, "morphop-cli: can't write %s\n", writer->path);
+		return 0;
+	}
+
+	png_init_io(writer->png, writer->file);
+	png_set_IHDR(
+		writer->png, writer->info, writer->width, writer->height, (format.type == SAMPLE_U16 ? 16 : 8), color_type,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT
+	);
+	png_write_info(writer->png, writer->info);
+
+	if (format.type == SAMPLE_U16 && host_is_little_endian()) png_set_swap(writer->png);
+
+	return 1;
+}
+
+static int has_extension(const char* path, const char* extension)
+{
+	size_t length = strlen(path), ext_length = strlen(extension);
+	size_t i;
+
+	if (length < ext_length) return 0;
+
+	for (i = 0; i < ext_length; i++) {
+		if (tolower((unsigned char)path[length - ext_length + i]) != extension[i]) return 0;
+	}
+
+	return 1;
+}
+
+static int host_is_little_endian(void)
+{
+	const unsigned short one = 1;
+	return (*(const unsigned char*)&one == 1);
+}
+
+static void swap_bytes_16(const unsigned char* src, unsigned char* dst, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < size; i += 2) {
+		unsigned char first = src[i];
+		dst[i] = src[i + 1];
+		dst[i + 1] = first;
+	}
+}
+
+/* map_release()
+ *
+ * Gives back the pages of the mapped file before 'offset', so the memory used doesn't grow with the
+ * height of the image
+ */
+static void map_release(ImageReader* reader, size_t offset)
+{
+#ifdef MADV_DONTNEED
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t end = offset / page * page;
+
+	if (end < reader->released + MAP_RELEASE_SIZE) return;
+
+	madvise(reader->map + reader->released, end - reader->released, MADV_DONTNEED);
+	reader->released = end;
+#endif
+}
@@ -0,0 +1,58 @@
+#ifndef __MORPHOP_IMAGE_IO_H__
+#define __MORPHOP_IMAGE_IO_H__
+
+#include <stdio.h>
+#include <png.h>
+#include "morphop-engine.h"
+
+/*
+ * Row by row reading and writing of binary PGM/PPM (P5/P6, 8 or 16 bits) and PNG files.
+ * Only a row at a time is in memory: the 8-bit PNM files are even memory-mapped, and their rows
+ * are given to the engine with no copy.
+ */
+
+typedef enum {
+	FILE_PNM = 0,
+	FILE_PNG
+} ImageFileType;
+
+typedef struct {
+	int width, height;
+	PixelFormat format;
+
+	ImageFileType type;
+	FILE* file;
+	const char* path;
+
+	// PNM: the mapped file (or NULL if it can't be mapped) and the offset of the pixels in it
+	unsigned char* map;
+	size_t map_size;
+	size_t data_offset;
+	size_t released; // the pages before this offset have been given back (see map_release())
+
+	png_structp png;
+	png_infop info;
+} ImageReader;
+
+typedef struct {
+	int width, height;
+	PixelFormat format;
+
+	ImageFileType type;
+	FILE* file;
+	const char* path;
+	unsigned char* buffer; // a row, converted to the byte order of the file
+
+	png_structp png;
+	png_infop info;
+} ImageWriter;
+
+int image_reader_open(ImageReader*, const char*);
+const unsigned char* image_reader_row(int, unsigned char*, void*);
+void image_reader_close(ImageReader*);
+
+int image_writer_open(ImageWriter*, const char*, int, int, PixelFormat);
+int image_writer_row(ImageWriter*, const unsigned char*);
+int image_writer_close(ImageWriter*);
+
+#endif
@@ -0,0 +1,332 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "morphop-kernels.h"
+
+/*
+ * A pixel to be sorted by value (float samples only, see sort_pixels())
+ */
+typedef struct {
+	float value;
+	int index;
+} SortedPixel;
+
+static int sort_pixels(MorphOpContext*, const float*, SampleType, int, size_t, int*);
+static int compare_pixels(const void*, const void*);
+static void build_tree(const float*, const int*, int, int, int*, int*, unsigned int*);
+static int find_root(int*, int);
+static void area_progress(MorphOpContext*, double);
+static void profile_area(MorphOpContext*, int, const MorphOpImage*, size_t);
+
+/* morphop_area_tree_init()
+ *
+ * Initializes an empty tree, that can be given to morphop_area_tree_build() and morphop_area_tree_free()
+ */
+void morphop_area_tree_init(MorphOpAreaTree* tree)
+{
+	memset(tree, 0, sizeof(MorphOpAreaTree));
+}
+
+/* morphop_area_tree_build()
+ *
+ *  - MorphOpContext* ctx: the context, for the progress and the scratch memory
+ *  - MorphOperator op: OPERATOR_OPENING for the area opening, OPERATOR_CLOSING for the area closing
+ *  - const MorphOpImage* src: the image
+ *  - MorphOpAreaTree* tree: the result, it replaces the previous tree (if any)
+ *
+ *  Builds the max-tree (min-tree, for the closing) of each color channel of the image: the nodes are the connected
+ *  components (8 neighbors) of the pixels brighter than each value, and each one knows its area. It uses the
+ *  union-find algorithm of Berger et al. ("Effective component tree computation with application to pattern
+ *  recognition in astronomical imaging", 2007): the pixels are taken from the brightest, and each one is joined to
+ *  the components of its neighbors already taken. That's near-linear in the number of pixels.
+ *  The tree doesn't depend on the area threshold: morphop_area_tree_filter() can then give the result for
+ *  any threshold, in a single pass over the image.
+ */
+MorphOpStatus morphop_area_tree_build(MorphOpContext* ctx, MorphOperator op, const MorphOpImage* src, MorphOpAreaTree* tree)
+{
+	const int color_channels = src->format.channels - (src->format.has_alpha ? 1 : 0);
+	const size_t pixels = (size_t)src->width * src->height;
+	int* zpar;
+	int c;
+	size_t p;
+
+	if (
+		(op != OPERATOR_OPENING && op != OPERATOR_CLOSING) || src->data == NULL ||
+		src->width <= 0 || src->height <= 0 || pixels > INT_MAX
+	) return MORPHOP_INVALID;
+
+	morphop_area_tree_free(tree);
+
+	arena_reset(&ctx->arena);
+
+	ctx->done = 0;
+	ctx->total = 2 * color_channels; // the sorting and the union-find, for each channel
+	ctx->status = MORPHOP_OK;
+
+	profile_area(ctx, 0, src, 0);
+
+	tree->width = src->width;
+	tree->height = src->height;
+	tree->format = src->format;
+	tree->op = op;
+	tree->value = malloc(pixels * src->format.channels * sizeof(float));
+	tree->parent = malloc(pixels * color_channels * sizeof(int));
+	tree->order = malloc(pixels * color_channels * sizeof(int));
+	tree->area = malloc(pixels * color_channels * sizeof(unsigned int));
+
+	// the representatives of the components while they are joined (see find_root())
+	zpar = arena_alloc(&ctx->arena, pixels * sizeof(int));
+
+	if (tree->value == NULL || tree->parent == NULL || tree->order == NULL || tree->area == NULL || zpar == NULL) {
+		morphop_area_tree_free(tree);
+		return MORPHOP_NO_MEMORY;
+	}
+
+	for (c = 0; c < src->format.channels; c++) {
+		plane_get(src, c, tree->value + c * pixels);
+	}
+
+	for (c = 0; c < color_channels && ctx->status == MORPHOP_OK; c++) {
+		float* value = tree->value + c * pixels;
+		int* order = tree->order + c * pixels;
+
+		// the closing is the opening of the negated image
+		if (op == OPERATOR_CLOSING) {
+			for (p = 0; p < pixels; p++) value[p] = -value[p];
+		}
+
+		if (!sort_pixels(ctx, value, src->format.type, op == OPERATOR_CLOSING, pixels, order)) break;
+		area_progress(ctx, ctx->done + 1);
+		if (ctx->status != MORPHOP_OK) break;
+
+		build_tree(value, order, src->width, src->height, tree->parent + c * pixels, zpar, tree->area + c * pixels);
+		area_progress(ctx, ctx->done + 1);
+	}
+
+	if (ctx->status != MORPHOP_OK) morphop_area_tree_free(tree);
+
+	profile_area(ctx, 1, src, arena_mark(&ctx->arena) + pixels * (src->format.channels * sizeof(float) + color_channels * 3 * sizeof(int)));
+
+	return ctx->status;
+}
+
+/* morphop_area_tree_filter()
+ *
+ *  - const MorphOpAreaTree* tree: the trees of the image, see morphop_area_tree_build()
+ *  - unsigned long min_area: the area threshold, in pixels
+ *  - MorphOpImage* dst: the result, of the same size and format of the image of the tree
+ *
+ *  Area opening: the bright components with less than 'min_area' pixels are lowered to the level of the
+ *  surrounding ones, whatever their shape. The others don't change. The area closing does the same with the dark
+ *  components. The alpha channel is the one of the image.
+ */
+MorphOpStatus morphop_area_tree_filter(const MorphOpAreaTree* tree, unsigned long min_area, MorphOpImage* dst)
+{
+	const int color_channels = tree->format.channels - (tree->format.has_alpha ? 1 : 0);
+	const size_t pixels = (size_t)tree->width * tree->height;
+	float* out;
+	int c;
+	size_t i;
+
+	if (
+		tree->value == NULL || dst->data == NULL ||
+		dst->width != tree->width || dst->height != tree->height ||
+		memcmp(&dst->format, &tree->format, sizeof(PixelFormat)) != 0
+	) return MORPHOP_INVALID;
+
+	out = malloc(pixels * sizeof(float));
+	if (out == NULL) return MORPHOP_NO_MEMORY;
+
+	for (c = 0; c < color_channels; c++) {
+		const float* value = tree->value + c * pixels;
+		const int* parent = tree->parent + c * pixels;
+		const int* order = tree->order + c * pixels;
+		const unsigned int* area = tree->area + c * pixels;
+
+		// from the root to the leaves: a node big enough keeps its level, the others take the one of their parent
+		// (already computed). The pixels that are not the first of their node take the level of the node
+		for (i = pixels; i-- > 0;) {
+			int p = order[i];
+			int q = parent[p];
+
+			if (q == p) out[p] = value[p];
+			else if (value[q] != value[p] && area[p] >= min_area) out[p] = value[p];
+			else out[p] = out[q];
+		}
+
+		if (tree->op == OPERATOR_CLOSING) {
+			for (i = 0; i < pixels; i++) out[i] = -out[i];
+		}
+
+		plane_put(out, c, dst);
+	}
+
+	if (tree->format.has_alpha) plane_put(tree->value + color_channels * pixels, color_channels, dst);
+
+	free(out);
+
+	return MORPHOP_OK;
+}
+
+/* morphop_area_tree_free()
+ *
+ * Frees the memory of the tree, that becomes empty
+ */
+void morphop_area_tree_free(MorphOpAreaTree* tree)
+{
+	free(tree->value);
+	free(tree->parent);
+	free(tree->order);
+	free(tree->area);
+
+	morphop_area_tree_init(tree);
+}
+
+/* sort_pixels()
+ *
+ * Puts the indexes of the pixels in 'order', from the brightest to the darkest. The 8 and 16-bit samples are sorted by
+ * counting them, the float ones by comparison. 'negated' tells that the values have been negated (for the closing).
+ * Returns 0 if there is no memory.
+ */
+static int sort_pixels(MorphOpContext* ctx, const float* value, SampleType type, int negated, size_t pixels, int* order)
+{
+	size_t p;
+
+	if (type == SAMPLE_FLOAT) {
+		// the pairs (value, index) are sorted, then only the indexes are kept
+		SortedPixel* pairs = arena_alloc(&ctx->arena, pixels * sizeof(SortedPixel));
+
+		if (pairs == NULL) {
+			ctx->status = MORPHOP_NO_MEMORY;
+			return 0;
+		}
+
+		for (p = 0; p < pixels; p++) {
+			pairs[p].value = value[p];
+			pairs[p].index = (int)p;
+		}
+		qsort(pairs, pixels, sizeof(SortedPixel), compare_pixels);
+		for (p = 0; p < pixels; p++) order[p] = pairs[p].index;
+	}
+	else {
+		// the values are integers: their index in the histogram goes from the brightest (0) to the darkest
+		const int levels = (type == SAMPLE_U16 ? 65536 : 256);
+		const int offset = (negated ? 0 : levels - 1);
+		size_t* start = arena_alloc(&ctx->arena, (levels + 1) * sizeof(size_t));
+		int l;
+
+		if (start == NULL) {
+			ctx->status = MORPHOP_NO_MEMORY;
+			return 0;
+		}
+
+		memset(start, 0, (levels + 1) * sizeof(size_t));
+		for (p = 0; p < pixels; p++) start[offset - (int)value[p] + 1]++;
+		for (l = 0; l < levels; l++) start[l + 1] += start[l];
+		for (p = 0; p < pixels; p++) order[start[offset - (int)value[p]]++] = (int)p;
+	}
+
+	return 1;
+}
+
+static int compare_pixels(const void* a, const void* b)
+{
+	const SortedPixel* pa = a, *pb = b;
+
+	if (pa->value != pb->value) return (pa->value > pb->value ? -1 : 1);
+	return (pa->index < pb->index ? -1 : (pa->index > pb->index));
+}
+
+/* build_tree()
+ *
+ * The union-find: the pixels are taken in 'order', each one becomes the parent of the components of its neighbors
+ * already taken (they are all brighter, or as bright), and its area is the sum of theirs. Then the tree is made
+ * canonical: the parent of each pixel is the first pixel of its node (the last one taken), whose parent is in a
+ * darker node. The root is the last pixel taken.
+ */
+static void build_tree(const float* value, const int* order, int width, int height, int* parent, int* zpar, unsigned int* area)
+{
+	static const int dx[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+	static const int dy[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+	const size_t pixels = (size_t)width * height;
+	size_t i;
+	int k;
+
+	for (i = 0; i < pixels; i++) zpar[i] = -1;
+
+	for (i = 0; i < pixels; i++) {
+		int p = order[i];
+		int x = p % width, y = p / width;
+
+		parent[p] = zpar[p] = p;
+		area[p] = 1;
+
+		for (k = 0; k < 8; k++) {
+			int nx = x + dx[k], ny = y + dy[k];
+			int r;
+
+			if (nx < 0 || nx >= width || ny < 0 || ny >= height || zpar[ny * width + nx] < 0) continue;
+
+			r = find_root(zpar, ny * width + nx);
+			if (r != p) {
+				parent[r] = zpar[r] = p;
+				area[p] += area[r];
+			}
+		}
+	}
+
+	// from the root to the leaves, so the parent is already canonical
+	for (i = pixels; i-- > 0;) {
+		int p = order[i];
+		int q = parent[p];
+
+		if (value[parent[q]] == value[q]) parent[p] = parent[q];
+	}
+}
+
+/* find_root()
+ *
+ * The representative of the component of 'p', compressing the path to it
+ */
+static int find_root(int* zpar, int p)
+{
+	int root = p;
+
+	while (zpar[root] != root) root = zpar[root];
+
+	while (zpar[p] != root) {
+		int next = zpar[p];
+		zpar[p] = root;
+		p = next;
+	}
+
+	return root;
+}
+
+static void area_progress(MorphOpContext* ctx, double done)
+{
+	ctx->done = done;
+
+	if (ctx->progress != NULL && !ctx->progress(ctx->done, ctx->total, ctx->progress_data)) {
+		ctx->status = MORPHOP_CANCELLED;
+	}
+}
+
+/* profile_area()
+ *
+ * Tells the profile function of the context, if any, that the building of the trees starts or ends
+ */
+static void profile_area(MorphOpContext* ctx, int end, const MorphOpImage* image, size_t bytes_allocated)
+{
+	MorphOpPassInfo info = {
+		"area-tree", end,
+		(end ? (unsigned long)image->width * image->height : 0),
+		(end ? (unsigned long)image->height : 0),
+		0,
+		bytes_allocated,
+		NULL
+	};
+
+	if (ctx->profile != NULL) ctx->profile(&info, ctx->profile_data);
+}
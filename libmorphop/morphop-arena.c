@@ -0,0 +1,125 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "morphop-arena.h"
+
+struct _ArenaChunk {
+	ArenaChunk* next;
+	size_t offset; // value of arena->used when the chunk was allocated
+	void* raw;
+};
+
+static size_t align_size(size_t);
+static unsigned char* align_pointer(void*);
+
+/* arena_init()
+ * 
+ * Inits an empty arena, no memory is allocated until the first arena_alloc()
+ */
+void arena_init(MorphOpArena* arena)
+{
+	arena->block = NULL;
+	arena->block_raw = NULL;
+	arena->capacity = 0;
+	arena->used = 0;
+	arena->peak = 0;
+	arena->chunks = NULL;
+}
+
+/* arena_alloc()
+ * 
+ * Returns a 64-byte aligned buffer of (at least) 'size' bytes, or NULL if there is no memory. Its content is undefined.
+ */
+void* arena_alloc(MorphOpArena* arena, size_t size)
+{
+	void* buffer;
+	size = align_size(size > 0 ? size : 1);
+	
+	if (arena->used + size <= arena->capacity) {
+		buffer = arena->block + arena->used;
+	}
+	else {
+		// doesn't fit: use a separate chunk, until the next reset makes the block bigger
+		ArenaChunk* chunk = malloc(sizeof(ArenaChunk));
+		if (chunk == NULL) return NULL;
+		chunk->raw = malloc(size + ARENA_ALIGNMENT - 1);
+		if (chunk->raw == NULL) {
+			free(chunk);
+			return NULL;
+		}
+		chunk->offset = arena->used;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		
+		buffer = align_pointer(chunk->raw);
+	}
+	
+	arena->used += size;
+	if (arena->used > arena->peak) arena->peak = arena->used;
+	
+	return buffer;
+}
+
+/* arena_mark()
+ * 
+ * Returns the current position of the arena, so that the buffers allocated 
+ * after this call can be given back with arena_release()
+ */
+size_t arena_mark(MorphOpArena* arena)
+{
+	return arena->used;
+}
+
+/* arena_release()
+ * 
+ * Gives back all the buffers allocated after the given mark
+ */
+void arena_release(MorphOpArena* arena, size_t mark)
+{
+	while (arena->chunks != NULL && arena->chunks->offset >= mark) {
+		ArenaChunk* chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		free(chunk->raw);
+		free(chunk);
+	}
+	
+	if (mark < arena->used) arena->used = mark;
+}
+
+/* arena_reset()
+ * 
+ * Gives back all the buffers. If the last use didn't fit, the block is enlarged 
+ * to the peak size, so next time the same requests will be served from it
+ */
+void arena_reset(MorphOpArena* arena)
+{
+	arena_release(arena, 0);
+	
+	if (arena->peak > arena->capacity) {
+		free(arena->block_raw);
+		arena->block_raw = malloc(arena->peak + ARENA_ALIGNMENT - 1);
+		arena->block = (arena->block_raw != NULL ? align_pointer(arena->block_raw) : NULL);
+		arena->capacity = (arena->block_raw != NULL ? arena->peak : 0);
+	}
+}
+
+/* arena_free()
+ * 
+ * Frees all the memory held by the arena, that can still be used after this call
+ */
+void arena_free(MorphOpArena* arena)
+{
+	arena_release(arena, 0);
+	free(arena->block_raw);
+	arena_init(arena);
+}
+
+static size_t align_size(size_t size)
+{
+	return (size + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1);
+}
+
+static unsigned char* align_pointer(void* p)
+{
+	return (unsigned char*)(((uintptr_t)p + ARENA_ALIGNMENT - 1) & ~((uintptr_t)ARENA_ALIGNMENT - 1));
+}
@@ -0,0 +1,32 @@
+#ifndef __MORPHOP_ARENA_H__
+#define __MORPHOP_ARENA_H__
+
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 64
+
+typedef struct _ArenaChunk ArenaChunk;
+
+/*
+ * A scratch memory arena: buffers are taken from one 64-byte aligned block and given back 
+ * all together, with arena_release() or arena_reset(). Requests that don't fit the block are 
+ * served by separate allocations, and the block grows to the largest size seen at the next reset:
+ * after the first use, an operation that is repeated (e.g. a preview update) doesn't allocate anymore.
+ */
+typedef struct {
+	unsigned char* block; // the aligned storage
+	void* block_raw; // as returned by malloc, to be freed
+	size_t capacity; // size of the block
+	size_t used; // bytes handed out so far, including the ones in chunks
+	size_t peak; // the highest 'used' value ever reached
+	ArenaChunk* chunks; // allocations that didn't fit the block, newest first
+} MorphOpArena;
+
+void arena_init(MorphOpArena*);
+void* arena_alloc(MorphOpArena*, size_t);
+size_t arena_mark(MorphOpArena*);
+void arena_release(MorphOpArena*, size_t);
+void arena_reset(MorphOpArena*);
+void arena_free(MorphOpArena*);
+
+#endif
@@ -0,0 +1,183 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-kernels.h"
+#include "morphop-stream.h"
+
+#ifndef MIN
+	#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// the strips are never shorter than this many rows (see budget_get_strip_height())
+#define BUDGET_MIN_ROWS 8
+
+/*
+ * Maps the progress of the chain run on a strip to the progress of the whole image, in rows
+ */
+typedef struct {
+	MorphOpProgressFunc progress;
+	void* progress_data;
+	double base, weight, total;
+} BudgetProgress;
+
+static int chain_is_local(const MorphOpChain*);
+static int budget_get_strip_height(int, size_t, size_t, int);
+static int strip_progress(double, double, void*);
+
+/* morphop_run_budget()
+ *
+ *  - MorphOpContext* ctx: the context, it must not be used by another operation at the same time
+ *  - const MorphOpChain* chain: the steps, each one runs on the result of the previous
+ *  - int width, int height, PixelFormat format: the size and the format of the input (and of the output)
+ *  - size_t budget: the bytes that the pixels of the input and of the output can take in memory
+ *  - MorphOpStripFunc read, MorphOpStripFunc write, void* io_data: read the rows of the input, write the ones of
+ *    the output. Each row of the output is written once, in order
+ *
+ *  Runs a chain on an image that doesn't need to be in memory: it's split in horizontal strips, as tall as the
+ *  budget allows, and each one is read with a halo of the rows that can affect it (see morphop_stream_get_reach()),
+ *  run by morphop_run_chain() and written. The results are the same of morphop_run_chain() on the whole image.
+ *  The halo rows are read and computed by two strips, so the memory is taken from the budget at the cost of
+ *  some more work: the strips are never shorter than the halo, even if the budget is too small.
+ *  A skeletonization needs the whole image: a chain with one is run on a single strip, whose input and output
+ *  are allocated as temporary images (see MorphOpContext.temp_alloc: they can be in a file, out of the budget).
+ *  If the context has a selection (of the whole image), the strips with no selected pixel are not run nor written.
+ *  Returns MORPHOP_SOURCE_ERROR if 'read' or 'write' failed, MORPHOP_CANCELLED if the progress function stopped it.
+ */
+MorphOpStatus morphop_run_budget(
+	MorphOpContext* ctx,
+	const MorphOpChain* chain,
+	int width, int height, PixelFormat format,
+	size_t budget,
+	MorphOpStripFunc read, MorphOpStripFunc write, void* io_data
+){
+	const MorphOpSelection* selection = ctx->selection;
+	MorphOpSelection strip_selection;
+	BudgetProgress progress = { ctx->progress, ctx->progress_data, 0, 0, height };
+	MorphOpImage src = { NULL }, dst = { NULL }, rows_written;
+	MorphOpStatus status = MORPHOP_OK;
+	int local, halo, strip_height, in_height, y0, y1, i;
+
+	if (
+		chain->n_steps < 1 || chain->n_steps > MORPHOP_CHAIN_MAX_STEPS ||
+		width <= 0 || height <= 0 ||
+		format.type < 0 || format.type >= SAMPLE_END ||
+		format.channels != (format.is_rgb ? 3 : 1) + (format.has_alpha ? 1 : 0) ||
+		(selection != NULL && (selection->width != width || selection->height != height))
+	) return MORPHOP_INVALID;
+
+	for (i = 0; i < chain->n_steps; i++) {
+		if (!morphop_settings_are_valid(&chain->steps[i])) return MORPHOP_INVALID;
+	}
+
+	local = chain_is_local(chain);
+	halo = (local ? morphop_stream_get_reach(chain) : height);
+	strip_height = (local ? budget_get_strip_height(height, (size_t)width * pixel_format_get_bpp(format), budget, halo) : height);
+	in_height = MIN(strip_height + 2 * halo, height);
+
+	// all the strips use the same two images
+	if (local) {
+		if (morphop_image_alloc(&src, width, in_height, format) != MORPHOP_OK || morphop_image_alloc(&dst, width, in_height, format) != MORPHOP_OK) {
+			status = MORPHOP_NO_MEMORY;
+		}
+	}
+	else if (!temp_image_alloc(ctx, &src, width, height, format) || !temp_image_alloc(ctx, &dst, width, height, format)) {
+		status = MORPHOP_NO_MEMORY;
+	}
+
+	ctx->progress = (progress.progress != NULL ? strip_progress : NULL);
+	ctx->progress_data = &progress;
+
+	for (y0 = 0; y0 < height && status == MORPHOP_OK; y0 = y1) {
+		int in_y0 = MAX(y0 - halo, 0);
+		int in_y1;
+
+		y1 = MIN(y0 + strip_height, height);
+		in_y1 = MIN(y1 + halo, height);
+
+		if (selection != NULL && selection->first[y1] == selection->first[y0]) continue;
+
+		src.height = dst.height = in_y1 - in_y0;
+		if (!read(in_y0, in_y1, &src, io_data)) {
+			status = MORPHOP_SOURCE_ERROR;
+			break;
+		}
+
+		// the spans of the rows of the strip, that keep their place in the ones of the image
+		if (selection != NULL) {
+			strip_selection = *selection;
+			strip_selection.height = in_y1 - in_y0;
+			strip_selection.first = selection->first + in_y0;
+			ctx->selection = &strip_selection;
+		}
+
+		progress.base = y0;
+		progress.weight = y1 - y0;
+		status = morphop_run_chain(ctx, chain, &src, &dst);
+		ctx->selection = selection;
+		if (status != MORPHOP_OK) break;
+
+		rows_written = dst;
+		rows_written.data = dst.data + (size_t)(y0 - in_y0) * dst.stride;
+		rows_written.height = y1 - y0;
+		if (!write(y0, y1, &rows_written, io_data)) status = MORPHOP_SOURCE_ERROR;
+	}
+
+	ctx->progress = progress.progress;
+	ctx->progress_data = progress.progress_data;
+	ctx->done = (status == MORPHOP_OK ? height : progress.base);
+	ctx->total = height;
+	ctx->status = status;
+
+	if (local) {
+		morphop_image_free(&src);
+		morphop_image_free(&dst);
+	}
+	else {
+		temp_image_free(ctx, &src);
+		temp_image_free(ctx, &dst);
+	}
+
+	return status;
+}
+
+/* chain_is_local()
+ *
+ * Returns 1 if each pixel of the output depends only on the input rows within the reach of the chain, that is
+ * if it has no skeletonization
+ */
+static int chain_is_local(const MorphOpChain* chain)
+{
+	int i;
+
+	for (i = 0; i < chain->n_steps; i++) {
+		if (chain->steps[i].operator == OPERATOR_SKELETON) return 0;
+	}
+
+	return 1;
+}
+
+/* budget_get_strip_height()
+ *
+ * Returns the number of rows written by each strip: with the halo above and below, its input and its output
+ * fit the budget. It's at least the halo, and BUDGET_MIN_ROWS.
+ */
+static int budget_get_strip_height(int height, size_t row_size, size_t budget, int halo)
+{
+	size_t fit = budget / (2 * MAX(row_size, 1));
+	int strip_height = (fit >= (size_t)height + 2 * halo ? height : (int)fit - 2 * halo);
+
+	return MIN(MAX(strip_height, MAX(BUDGET_MIN_ROWS, halo)), height);
+}
+
+/* strip_progress()
+ *
+ * The progress function given to morphop_run_chain() for a strip (see BudgetProgress)
+ */
+static int strip_progress(double done, double total, void* data)
+{
+	BudgetProgress* progress = data;
+	return progress->progress(progress->base + progress->weight * MIN(done / total, 1), progress->total, progress->progress_data);
+}
@@ -0,0 +1,333 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-kernels.h"
+#include "morphop-stream.h"
+
+#ifndef MIN
+	#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define IMAGE_ROW(img, y) ((img)->data + (size_t)(y) * (img)->stride)
+
+// the strips are narrow enough for the rings of all their passes to fit in this much cache (a level 2 cache)...
+#define STRIP_CACHE_SIZE (1 << 20)
+// ...but not narrower than this, or than twice their halo (see strip_get_width())
+#define STRIP_MIN_WIDTH 16
+// if the context can run bands in parallel, the image is split in at least this many strips
+#define PARALLEL_STRIPS 16
+
+// all the strips advance by this many rows, then the progress is reported
+#define TILE_HEIGHT 64
+
+/*
+ * A vertical strip of the image, streamed through all the steps of a segment of the chain. It reads 'halo'
+ * more columns on each side than it writes: their results are wrong (the kernels skip the columns outside of
+ * the rows they are given), but they don't reach the columns written.
+ */
+typedef struct {
+	MorphOpStream stream;
+	const MorphOpImage* src;
+	MorphOpImage* dst;
+	int x0, x1; // the columns written
+	int in_x0; // the first column read
+} ChainStrip;
+
+typedef struct {
+	ChainStrip* strips;
+	int y0, y1; // the rows of the tile
+} ChainTile;
+
+/*
+ * Maps the progress of a step run by morphop_run() to the progress of the whole chain
+ */
+typedef struct {
+	MorphOpProgressFunc progress;
+	void* progress_data;
+	double base, weight, total;
+} ChainProgress;
+
+static MorphOpStatus run_strips(MorphOpContext*, const MorphOpChain*, const MorphOpImage*, MorphOpImage*, double, const MorphOpSelection*);
+static void tile_band(int, int, void*);
+static const unsigned char* strip_source_row(int, unsigned char*, void*);
+static int strip_get_width(const MorphOpContext*, const MorphOpChain*, const MorphOpImage*, int);
+static int step_progress(double, double, void*);
+static void chain_progress(MorphOpContext*, double);
+static void profile_chain(MorphOpContext*, int, const MorphOpImage*, size_t);
+
+/* morphop_run_chain()
+ *
+ *  - MorphOpContext* ctx: the context, it must not be used by another operation at the same time
+ *  - const MorphOpChain* chain: the steps, each one runs on the result of the previous
+ *  - const MorphOpImage* src: the input image
+ *  - MorphOpImage* dst: the output image, with the same size and format of the input. It can be the input itself.
+ *
+ *  Runs a chain of operators, with the same result of a morphop_run() for each step, without writing the
+ *  intermediate results to memory: the steps are streamed together (see morphop-stream.h) on vertical strips
+ *  of the image, narrow enough for all their rows in flight to stay in the cache. The strips advance together
+ *  by tiles of rows, run in parallel if the context can. Skeletonization needs the whole image, so it's run
+ *  alone by morphop_run(), and the steps before and after it are streamed separately (through full-size
+ *  temporary images, see MorphOpContext.temp_alloc).
+ *  If the context has a selection, the strips with no selected pixel are skipped (unless a skeletonization
+ *  reads them later): the pixels they would write are undefined.
+ *  Returns MORPHOP_CANCELLED if the progress function stopped it: in that case (and for any other error)
+ *  the content of 'dst' is undefined.
+ */
+MorphOpStatus morphop_run_chain(MorphOpContext* ctx, const MorphOpChain* chain, const MorphOpImage* src, MorphOpImage* dst)
+{
+	MorphOpImage temp[2] = { { NULL }, { NULL } };
+	MorphOpImage src_copy = { NULL };
+	const MorphOpImage* input = src;
+	int first, last, i;
+
+	if (
+		chain->n_steps < 1 || chain->n_steps > MORPHOP_CHAIN_MAX_STEPS ||
+		src->data == NULL || dst->data == NULL ||
+		src->width != dst->width || src->height != dst->height || src->width <= 0 || src->height <= 0 ||
+		memcmp(&src->format, &dst->format, sizeof(PixelFormat)) != 0 ||
+		(ctx->selection != NULL && (ctx->selection->width != src->width || ctx->selection->height != src->height))
+	) return MORPHOP_INVALID;
+
+	for (i = 0; i < chain->n_steps; i++) {
+		if (!morphop_settings_are_valid(&chain->steps[i])) return MORPHOP_INVALID;
+	}
+
+	// the strips read the input after other strips have written the output: if they are the same image, work on a copy
+	if (src->data == dst->data) {
+		if (!temp_image_alloc(ctx, &src_copy, src->width, src->height, src->format)) return MORPHOP_NO_MEMORY;
+
+		for (i = 0; i < src->height; i++) {
+			memcpy(IMAGE_ROW(&src_copy, i), IMAGE_ROW(src, i), (size_t)src->width * pixel_format_get_bpp(src->format));
+		}
+		input = &src_copy;
+	}
+
+	// the progress is counted in steps
+	ctx->done = 0;
+	ctx->total = chain->n_steps;
+	ctx->status = MORPHOP_OK;
+
+	for (first = 0; first < chain->n_steps && ctx->status == MORPHOP_OK; first = last) {
+		MorphOpChain segment;
+		MorphOpImage* output = dst;
+		const MorphOpSelection* selection = ctx->selection;
+
+		// a segment is a skeletonization alone, or all the steps until the next one
+		last = first + 1;
+		if (chain->steps[first].operator != OPERATOR_SKELETON) {
+			while (last < chain->n_steps && chain->steps[last].operator != OPERATOR_SKELETON) last++;
+		}
+
+		segment.n_steps = last - first;
+		memcpy(segment.steps, &chain->steps[first], segment.n_steps * sizeof(MorphOpSettings));
+
+		// the intermediate results alternate between two temporary images
+		if (last < chain->n_steps) {
+			output = (input == &temp[0] ? &temp[1] : &temp[0]);
+
+			if (output->data == NULL && !temp_image_alloc(ctx, output, src->width, src->height, src->format)) {
+				ctx->status = MORPHOP_NO_MEMORY;
+				break;
+			}
+		}
+
+		if (chain->steps[first].operator == OPERATOR_SKELETON) {
+			ChainProgress progress = { ctx->progress, ctx->progress_data, ctx->done, 1, ctx->total };
+			MorphOpStatus status;
+
+			// morphop_run() counts its own progress
+			ctx->progress = (progress.progress != NULL ? step_progress : NULL);
+			ctx->progress_data = &progress;
+
+			status = morphop_run(ctx, &segment.steps[0], input, output);
+
+			ctx->progress = progress.progress;
+			ctx->progress_data = progress.progress_data;
+			ctx->done = progress.base + progress.weight;
+			ctx->total = progress.total;
+			ctx->status = status;
+		}
+		else {
+			// a skeletonization after the segment reads all of its output
+			for (i = last; i < chain->n_steps && selection != NULL; i++) {
+				if (chain->steps[i].operator == OPERATOR_SKELETON) selection = NULL;
+			}
+
+			ctx->status = run_strips(ctx, &segment, input, output, segment.n_steps, selection);
+		}
+
+		input = output;
+	}
+
+	temp_image_free(ctx, &temp[0]);
+	temp_image_free(ctx, &temp[1]);
+	temp_image_free(ctx, &src_copy);
+
+	return ctx->status;
+}
+
+/* run_strips()
+ *
+ * Streams a segment of the chain (with no skeletonization) from 'src' to 'dst', a strip at a time.
+ * The segment is worth 'weight' steps of progress. If 'selection' is not NULL, only the strips with
+ * selected pixels are run.
+ */
+static MorphOpStatus run_strips(MorphOpContext* ctx, const MorphOpChain* segment, const MorphOpImage* src, MorphOpImage* dst, double weight, const MorphOpSelection* selection)
+{
+	int halo = morphop_stream_get_reach(segment);
+	int width = strip_get_width(ctx, segment, src, halo);
+	int n_strips = (src->width + width - 1) / width;
+	double base = ctx->done;
+	size_t bytes_allocated = 0;
+	ChainTile tile;
+	int i, s, ready = 0;
+
+	profile_chain(ctx, 0, src, 0);
+
+	tile.strips = malloc(n_strips * sizeof(ChainStrip));
+	if (tile.strips == NULL) return MORPHOP_NO_MEMORY;
+
+	for (s = 0; s < n_strips; s++) {
+		ChainStrip* strip = &tile.strips[ready];
+		int in_x1;
+
+		strip->src = src;
+		strip->dst = dst;
+		strip->x0 = s * width;
+		strip->x1 = MIN(strip->x0 + width, src->width);
+		strip->in_x0 = MAX(strip->x0 - halo, 0);
+		in_x1 = MIN(strip->x1 + halo, src->width);
+
+		if (selection != NULL && !selection_has_columns(selection, strip->x0, strip->x1)) continue;
+
+		if (morphop_stream_init_chain(&strip->stream, segment, in_x1 - strip->in_x0, src->height, src->format, strip_source_row, strip) != MORPHOP_OK) {
+			ctx->status = strip->stream.status;
+			morphop_stream_free(&strip->stream);
+			break;
+		}
+		morphop_stream_plan(&strip->stream, ctx->calibration);
+		bytes_allocated += strip->stream.arena.peak;
+		ready++;
+	}
+
+	for (tile.y1 = 0; tile.y1 < src->height && ctx->status == MORPHOP_OK; ) {
+		tile.y0 = tile.y1;
+		tile.y1 = MIN(tile.y0 + TILE_HEIGHT, src->height);
+
+		// the bands of the context are made of strips, not of rows
+		if (ctx->parallel != NULL) ctx->parallel(0, ready, tile_band, &tile, ctx->parallel_data);
+		else tile_band(0, ready, &tile);
+
+		for (i = 0; i < ready; i++) {
+			if (tile.strips[i].stream.status != MORPHOP_OK) ctx->status = tile.strips[i].stream.status;
+		}
+
+		if (ctx->status == MORPHOP_OK) chain_progress(ctx, base + weight * tile.y1 / src->height);
+	}
+
+	for (i = 0; i < ready; i++) {
+		morphop_stream_free(&tile.strips[i].stream);
+	}
+	free(tile.strips);
+
+	profile_chain(ctx, 1, src, bytes_allocated);
+
+	return ctx->status;
+}
+
+/* tile_band()
+ *
+ * Advances the strips [s0, s1) over the rows of the tile, writing their output
+ */
+static void tile_band(int s0, int s1, void* data)
+{
+	ChainTile* tile = data;
+	int s, y;
+
+	for (s = s0; s < s1; s++) {
+		ChainStrip* strip = &tile->strips[s];
+		size_t bpp = pixel_format_get_bpp(strip->src->format);
+
+		for (y = tile->y0; y < tile->y1; y++) {
+			const unsigned char* row = morphop_stream_next_row(&strip->stream);
+			if (row == NULL) break;
+
+			memcpy(IMAGE_ROW(strip->dst, y) + strip->x0 * bpp, row + (strip->x0 - strip->in_x0) * bpp, (strip->x1 - strip->x0) * bpp);
+		}
+	}
+}
+
+/* strip_source_row()
+ *
+ * The row source of the stream of a strip: the rows of the input image, from the first column of the strip.
+ * They are read where they are, with no copy.
+ */
+static const unsigned char* strip_source_row(int y, unsigned char* buffer, void* data)
+{
+	ChainStrip* strip = data;
+
+	(void)buffer; // the rows are not copied
+	return IMAGE_ROW(strip->src, y) + strip->in_x0 * pixel_format_get_bpp(strip->src->format);
+}
+
+/* strip_get_width()
+ *
+ * Returns the number of columns written by each strip: as many as fit STRIP_CACHE_SIZE, with the rows kept
+ * by all the passes of the segment. The halo columns are computed twice (by the two strips that share them),
+ * so the strips are never narrower than twice the halo.
+ */
+static int strip_get_width(const MorphOpContext* ctx, const MorphOpChain* segment, const MorphOpImage* image, int halo)
+{
+	size_t column_size = (size_t)morphop_stream_get_window(segment, image->height) * pixel_format_get_bpp(image->format);
+	int width = (int)(STRIP_CACHE_SIZE / MAX(column_size, 1)) - 2 * halo;
+
+	// enough strips for all the threads
+	if (ctx->parallel != NULL) width = MIN(width, (image->width + PARALLEL_STRIPS - 1) / PARALLEL_STRIPS);
+
+	return MIN(MAX(width, MAX(STRIP_MIN_WIDTH, 2 * halo)), image->width);
+}
+
+/* step_progress()
+ *
+ * The progress function given to morphop_run() for a step of the chain (see ChainProgress)
+ */
+static int step_progress(double done, double total, void* data)
+{
+	ChainProgress* progress = data;
+	return progress->progress(progress->base + progress->weight * MIN(done / total, 1), progress->total, progress->progress_data);
+}
+
+/* chain_progress()
+ *
+ * Sets the steps done so far and reports them to the progress function of the context, that can cancel the chain
+ */
+static void chain_progress(MorphOpContext* ctx, double done)
+{
+	ctx->done = done;
+
+	if (ctx->progress != NULL && !ctx->progress(ctx->done, ctx->total, ctx->progress_data)) {
+		ctx->status = MORPHOP_CANCELLED;
+	}
+}
+
+/* profile_chain()
+ *
+ * Tells the profile function of the context, if any, that a streamed segment starts or ends. It's a single pass
+ * that reads and writes each row once, whatever the number of its steps.
+ */
+static void profile_chain(MorphOpContext* ctx, int end, const MorphOpImage* image, size_t bytes_allocated)
+{
+	MorphOpPassInfo info = {
+		"chain", end,
+		(end ? (unsigned long)image->width * image->height : 0),
+		(end ? (unsigned long)image->height : 0),
+		(end ? (unsigned long)image->height : 0),
+		bytes_allocated,
+		NULL
+	};
+
+	if (ctx->profile != NULL) ctx->profile(&info, ctx->profile_data);
+}
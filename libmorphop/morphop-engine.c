@@ -0,0 +1,1289 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "morphop-engine.h"
+#include "morphop-kernels.h"
+
+#ifndef MIN
+	#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define IMAGE_ROW(img, y) ((img)->data + (size_t)(y) * (img)->stride)
+
+// relative cost of processing one row in the different kinds of pass (see progress_*)
+#define COST_MERGE_ROW 1.0
+#define COST_SCAN_ROW 0.5
+
+// passes process the rows in bands of about this size (in bytes), and report the progress after each slice: a band or,
+// if the context can run bands in parallel, PARALLEL_BANDS of them, to keep all the threads busy (see run_slices())
+#define BAND_SIZE (1 << 20)
+#define BAND_MAX_HEIGHT 64
+#define PARALLEL_BANDS 16
+
+// the highest number of temporary images of an operator: of its graph (see graph_schedule()), or of the skeletonization
+#define MAX_TEMP_IMAGES (GRAPH_MAX_NODES + 1)
+#define SKELETON_TEMP_IMAGES 3
+
+// side, in pixels, of the blocks of summarize_blocks(): not less than the radius of the element (see morph_band()),
+// the passes with wider custom elements don't look for them. The planner tells if the others do (see morph_plan())
+#define SUMMARY_BLOCK 16
+
+static void run_graph(MorphOpContext*, const MorphOpSettings*, const GraphSchedule*, const MorphOpImage*, MorphOpImage*, MorphOpImage*);
+static void run_skeleton(MorphOpContext*, const MorphOpSettings*, const MorphOpImage*, MorphOpImage*, MorphOpImage*);
+static const MorphOpImage* graph_get_image(const GraphSchedule*, int, const MorphOpImage*, MorphOpImage*, MorphOpImage*);
+static void do_morph_operation(MorphOpContext*, MorphOperator, const MorphOpImage*, MorphOpImage*, StructuringElement, SourceTansformation, ChannelMode, int);
+static void do_merge_operation(MorphOpContext*, MergeOperation, const MorphOpImage*, const MorphOpImage*, MorphOpImage*, SourceTansformation);
+static unsigned long count_non_black(MorphOpContext*, const MorphOpImage*);
+static void fill_black(MorphOpContext*, const MorphOpImage*, MorphOpImage*);
+static void morph_band(int, int, void*);
+static void merge_band(int, int, void*);
+static void group_band(int, int, void*);
+static void count_band(int, int, void*);
+static void fill_black_band(int, int, void*);
+static void summary_band(int, int, void*);
+static void run_slices(MorphOpContext*, const MorphOpImage*, MorphOpBandFunc, void*, double);
+static void slice_band(int, int, void*);
+static int image_get_band_height(const MorphOpImage*);
+static int image_prepare_temp(MorphOpContext*, const MorphOpImage*, MorphOpImage*);
+static void image_release_temps(MorphOpContext*, MorphOpImage*, int, MorphOpImage*);
+static int images_are_compatible(const MorphOpImage*, const MorphOpImage*);
+static int images_are_equal(const MorphOpImage*, const MorphOpImage*);
+static double morph_row_cost(StructuringElement);
+static double skeleton_iteration_cost(StructuringElement);
+static double operator_cost(MorphOpSettings, int, int);
+static void progress_advance(MorphOpContext*, double);
+static void progress_set_remaining(MorphOpContext*, double);
+static void profile_begin(MorphOpContext*, const char*, const char*);
+static void profile_end(MorphOpContext*, const char*, const char*, const MorphOpImage*, int, int, size_t);
+static const char* merge_get_name(MergeOperation);
+
+/*
+ * Parameters of the passes, shared by the bands
+ */
+typedef struct {
+	MorphOperator op;
+	const MorphOpImage* src;
+	MorphOpImage* dst;
+	ScaledElement element;
+	SourceTansformation srctransf;
+	ChannelMode channel_mode;
+	unsigned char* outside; // stands for the rows outside of the image
+	unsigned char* copied; // for each block of the output (see summarize_blocks()), 1 if it's the same as the input. NULL if none is
+	int block_cols;
+	const MorphOpSelection* spans; // the spans of each row that are computed, NULL for whole rows
+	MorphOpSelection halo_spans; // the selection widened by the reach of the next passes, if 'spans' is it
+	void* scratch[PARALLEL_BANDS]; // the scratch memory of morph_row(), one for each band of a slice (see run_slices())
+	int n_scratch;
+	int band_height;
+	MorphPlan plan;
+	double row_cost; // for the progress (see morph_row_cost())
+	size_t arena_start; // the memory of the pass is given back to the arena at its end
+} MorphPass;
+
+static void morph_span(const MorphPass*, unsigned char**, int, int, int, void*);
+
+typedef struct {
+	MergeOperation op;
+	const MorphOpImage* a, *b;
+	MorphOpImage* dst;
+	SourceTansformation srctransf;
+	const MorphOpSelection* spans; // the pixels merged, NULL for all of them
+	MorphOpSelection halo_spans;
+	size_t arena_start;
+} MergePass;
+
+/*
+ * The passes run together on the same slices of rows (see group_run()): the ones of a group of the graph of an
+ * operator, that don't read each other's output
+ */
+typedef struct {
+	MorphPass morph[GRAPH_MAX_NODES];
+	MergePass merge[GRAPH_MAX_NODES];
+	int is_morph[GRAPH_MAX_NODES];
+	int n_passes;
+} GroupPass;
+
+static void group_add_morph(MorphOpContext*, GroupPass*, MorphOperator, const MorphOpImage*, MorphOpImage*, StructuringElement, SourceTansformation, ChannelMode, int);
+static void group_add_merge(MorphOpContext*, GroupPass*, MergeOperation, const MorphOpImage*, const MorphOpImage*, MorphOpImage*, SourceTansformation, int);
+static void group_run(MorphOpContext*, GroupPass*, const MorphOpImage*);
+
+typedef struct {
+	const MorphOpImage* src;
+	MorphOpImage* dst;
+	unsigned long* row_counts; // count_non_black(): the result for each row, so bands never write the same value
+} ScanPass;
+
+typedef struct {
+	const MorphOpImage* src;
+	int cols;
+	const unsigned char** uniform; // for each block, its first pixel if all its pixels are the same, else NULL
+} SummaryPass;
+
+/* morphop_context_init()
+ *
+ * Inits a context with no progress function, no parallelism, no profiling and the default model of the planner
+ */
+void morphop_context_init(MorphOpContext* ctx)
+{
+	arena_init(&ctx->arena);
+	ctx->progress = NULL;
+	ctx->progress_data = NULL;
+	ctx->parallel = NULL;
+	ctx->parallel_data = NULL;
+	ctx->profile = NULL;
+	ctx->profile_data = NULL;
+	ctx->calibration = NULL;
+	ctx->selection = NULL;
+	ctx->temp_alloc = NULL;
+	ctx->temp_free = NULL;
+	ctx->temp_data = NULL;
+	ctx->done = 0;
+	ctx->total = 0;
+	ctx->status = MORPHOP_OK;
+}
+
+/* morphop_context_free()
+ *
+ * Frees the scratch memory of the context, that can still be used after this call
+ */
+void morphop_context_free(MorphOpContext* ctx)
+{
+	arena_free(&ctx->arena);
+}
+
+/* morphop_run()
+ *
+ *  - MorphOpContext* ctx: the context, it must not be used by another operation at the same time
+ *  - const MorphOpSettings* settings: the operator and its structuring element
+ *  - const MorphOpImage* src: the input image
+ *  - MorphOpImage* dst: the output image, with the same size and format of the input. It can be the input itself.
+ *
+ *  Runs a morphological operator on an entire image, as the graph of its passes (see operator_get_graph()). The
+ *  intermediate results are kept in temporary images taken from the arena of the context (or from its allocator
+ *  of temporary images, if it has one), reused once the passes that read them are done; the output is written by
+ *  the last pass of the operator.
+ *  If the context has a selection, each pass computes only the pixels within reach of it (all of them, for the
+ *  skeletonization): the work follows the selected area, and the other pixels of 'dst' are undefined.
+ *  Returns MORPHOP_CANCELLED if the progress function stopped it: in that case (and for any other error
+ *  found while running) the content of 'dst' is undefined.
+ */
+MorphOpStatus morphop_run(MorphOpContext* ctx, const MorphOpSettings* settings, const MorphOpImage* src, MorphOpImage* dst)
+{
+	const OperatorGraph* graph = operator_get_graph(settings->operator);
+	GraphSchedule schedule;
+	MorphOpImage temp[MAX_TEMP_IMAGES] = { { NULL } };
+	MorphOpImage src_copy = { NULL };
+	int n_temps, copy_input;
+	int i;
+
+	if (!morphop_settings_are_valid(settings) || !images_are_compatible(src, dst)) return MORPHOP_INVALID;
+	if (ctx->selection != NULL && (ctx->selection->width != src->width || ctx->selection->height != src->height)) return MORPHOP_INVALID;
+
+	// the passes of the operator, and where their outputs go. The skeletonization reads the source again after
+	// writing the destination: if they are the same image, it works on a copy. The graphs tell if they need it
+	if (graph->n_nodes > 0) {
+		graph_schedule(graph, morphop_settings_get_iterations(settings), element_get_radius(&settings->element), src->data == dst->data, &schedule);
+		n_temps = schedule.n_buffers;
+		copy_input = schedule.copy_input;
+		if (n_temps > MAX_TEMP_IMAGES) return MORPHOP_INVALID;
+	}
+	else {
+		n_temps = SKELETON_TEMP_IMAGES;
+		copy_input = (src->data == dst->data);
+	}
+
+	// all the buffers of the previous operation are given back to the arena
+	arena_reset(&ctx->arena);
+
+	ctx->done = 0;
+	ctx->total = MAX(operator_cost(*settings, src->width, src->height), 1);
+	ctx->status = MORPHOP_OK;
+
+	profile_begin(ctx, "temp", NULL);
+
+	if (copy_input) {
+		if (!image_prepare_temp(ctx, src, &src_copy)) return MORPHOP_NO_MEMORY;
+
+		for (i = 0; i < src->height; i++) {
+			memcpy(IMAGE_ROW(&src_copy, i), IMAGE_ROW(src, i), src->width * pixel_format_get_bpp(src->format));
+		}
+		src = &src_copy;
+	}
+
+	for (i = 0; i < n_temps; i++) {
+		if (!image_prepare_temp(ctx, src, &temp[i])) {
+			image_release_temps(ctx, temp, i, &src_copy);
+			return MORPHOP_NO_MEMORY;
+		}
+	}
+
+	profile_end(ctx, "temp", NULL, src, copy_input, copy_input, arena_mark(&ctx->arena));
+
+	if (graph->n_nodes > 0) run_graph(ctx, settings, &schedule, src, dst, temp);
+	else run_skeleton(ctx, settings, src, dst, temp);
+
+	image_release_temps(ctx, temp, n_temps, &src_copy);
+
+	return ctx->status;
+}
+
+/* run_graph()
+ *
+ * Runs the passes of an operator, a group at a time (see graph_schedule()): from 'src' to 'dst', through the
+ * temporary images. The passes of a group run on the same slices of rows, so with a parallel function the
+ * independent branches of the graph (e.g. the erosion and the dilation of the gradient) are computed at the same time.
+ */
+static void run_graph(MorphOpContext* ctx, const MorphOpSettings* settings, const GraphSchedule* schedule, const MorphOpImage* src, MorphOpImage* dst, MorphOpImage* temp)
+{
+	StructuringElement elements[GRAPH_ELEMENT_END];
+	GroupPass group;
+	int g, i;
+
+	// the white and black patterns of hit-or-miss
+	if (!graph_get_elements(operator_get_graph(settings->operator), &settings->element, elements, &ctx->arena)) {
+		ctx->status = MORPHOP_NO_MEMORY;
+		return;
+	}
+
+	for (g = 0; g < schedule->n_groups && ctx->status == MORPHOP_OK; g++) {
+		group.n_passes = 0;
+
+		for (i = 0; i < schedule->n_passes && ctx->status == MORPHOP_OK; i++) {
+			const GraphPass* pass = &schedule->passes[i];
+			const MorphOpImage* a, *output;
+
+			if (pass->group != g) continue;
+
+			a = graph_get_image(schedule, pass->a, src, dst, temp);
+			output = graph_get_image(schedule, i, src, dst, temp);
+
+			if (pass->node->kind == GRAPH_MORPH) {
+				group_add_morph(
+					ctx, &group, pass->node->op, a, (MorphOpImage*)output, elements[pass->node->element], pass->srctransf,
+					graph_node_get_channel_mode(pass->node, settings->channel_mode), pass->halo
+				);
+			}
+			else {
+				group_add_merge(
+					ctx, &group, pass->node->merge, a, graph_get_image(schedule, pass->b, src, dst, temp), (MorphOpImage*)output,
+					pass->srctransf, pass->halo
+				);
+			}
+		}
+
+		group_run(ctx, &group, src);
+	}
+}
+
+/* graph_get_image()
+ *
+ * Returns the image of the output of a pass (see GraphPass.buffer), or 'src' for GRAPH_INPUT
+ */
+static const MorphOpImage* graph_get_image(const GraphSchedule* schedule, int pass, const MorphOpImage* src, MorphOpImage* dst, MorphOpImage* temp)
+{
+	if (pass == GRAPH_INPUT) return src;
+
+	return (schedule->passes[pass].buffer == GRAPH_OUTPUT ? dst : &temp[schedule->passes[pass].buffer]);
+}
+
+/* run_skeleton()
+ *
+ * The skeletonization, with its SKELETON_TEMP_IMAGES temporary images: its passes are repeated until the image
+ * is black, so it's not a graph
+ */
+static void run_skeleton(MorphOpContext* ctx, const MorphOpSettings* settings, const MorphOpImage* src, MorphOpImage* dst, MorphOpImage* temp)
+{
+	int radius = element_get_radius(&settings->element);
+
+	// skeletonization follows this algorithm:
+	/*
+		skeleton = black_image();
+		do
+		{
+			eroded = erode(img);
+			opened = dilate(eroded);
+			diff = img - opened;
+			skeleton = skeleton U diff;
+			img = eroded;
+		} while (is_black(img) == FALSE);
+	*/
+
+	// the element is always flat: a non-flat erosion would never make the thresholded image black
+	StructuringElement element = settings->element;
+	morphop_element_set_weights(&element, WEIGHTS_FLAT, 0);
+
+	// the erosions go on until the image is black, their reach has no limit: all the pixels are computed
+	const MorphOpSelection* selection = ctx->selection;
+	ctx->selection = NULL;
+
+	// temp[0] and temp[1] store the erosions (the input and the output of each
+	// iteration swap their roles), temp[2] is for opening and difference
+	const MorphOpImage* img = src; // the first iteration starts from the original image
+	MorphOpImage* eroded = &temp[0];
+	MorphOpImage* next_eroded;
+	MorphOpImage* open = &temp[2];
+
+	// the destination image will be the final skeleton.
+	// start filling it black...
+	fill_black(ctx, src, dst);
+
+	// the number of iterations is not known in advance: it is estimated from how fast the area
+	// of the eroded image decreases (for a blob, its square root decreases linearly at each erosion)
+	unsigned long area = count_non_black(ctx, img), prev_area;
+	int stalled;
+	double iterations_left = ceil(MIN(src->width, src->height) / MAX(2.0 * radius, 1));
+
+	do {
+		// eroded = erosion(img) [must threshold 'img'!]
+		do_morph_operation(ctx, OPERATOR_EROSION, img, eroded, element, SRC_THRESHOLD, CHANNELS_LUMINOSITY, 0);
+		// open = dilate(eroded)
+		do_morph_operation(ctx, OPERATOR_DILATION, eroded, open, element, SRC_ORIGINAL, CHANNELS_LUMINOSITY, 0);
+
+		// diff = img - open [must threshold 'img'!]
+		do_merge_operation(ctx, MERGE_DIFF, img, open, open, SRC_THRESHOLD);
+
+		// skel = skel U diff
+		do_merge_operation(ctx, MERGE_UNION, dst, open, dst, SRC_ORIGINAL);
+
+		prev_area = area;
+		area = count_non_black(ctx, eroded);
+
+		// the skeleton is complete when the erosion doesn't remove pixels anymore: the next iterations would
+		// repeat this one, or cycle forever (e.g. an element that doesn't select the center can move the alpha
+		// channel around). The first erosion also thresholds the image, so it must leave it exactly the same
+		stalled = (img == src ? area == prev_area && images_are_equal(img, eroded) : area >= prev_area);
+
+		// the eroded image is the input of the next iteration, whose erosion will overwrite the old input
+		next_eroded = (img == src ? &temp[1] : (MorphOpImage*)img);
+		img = eroded;
+		eroded = next_eroded;
+
+		if (area < prev_area) {
+			iterations_left = ceil(sqrt(area) / (sqrt(prev_area) - sqrt(area)));
+		}
+		else if (iterations_left > 1) {
+			iterations_left--;
+		}
+		progress_set_remaining(ctx, iterations_left * skeleton_iteration_cost(element) * src->height);
+	}
+	while (area > 0 && !stalled && ctx->status == MORPHOP_OK); // algorithm ends when the eroded image becomes totally black
+
+	// here: dst is the final skeleton
+	ctx->selection = selection;
+}
+
+/* morphop_operator_get_name()
+ *
+ * Returns the identifier of the operator, as used by the tools that run the engine outside of GIMP
+ */
+const char* morphop_operator_get_name(MorphOperator op)
+{
+	switch (op) {
+		case OPERATOR_EROSION: return "erosion";
+		case OPERATOR_DILATION: return "dilation";
+		case OPERATOR_OPENING: return "opening";
+		case OPERATOR_CLOSING: return "closing";
+		case OPERATOR_BOUNDEXTR: return "boundary";
+		case OPERATOR_GRADIENT: return "gradient";
+		case OPERATOR_HITORMISS: return "hit-or-miss";
+		case OPERATOR_SKELETON: return "skeleton";
+		case OPERATOR_THICKENING: return "thickening";
+		case OPERATOR_THINNING: return "thinning";
+		case OPERATOR_WTOPHAT: return "white-top-hat";
+		case OPERATOR_BTOPHAT: return "black-top-hat";
+		default: return "unknown";
+	}
+}
+
+/* morphop_operator_from_name()
+ *
+ * Returns the operator with the given identifier (see morphop_operator_get_name()), or OPERATOR_END if there is none
+ */
+MorphOperator morphop_operator_from_name(const char* name)
+{
+	int op;
+
+	for (op = 0; op < OPERATOR_END; op++) {
+		if (strcmp(name, morphop_operator_get_name(op)) == 0) return op;
+	}
+
+	return OPERATOR_END;
+}
+
+/* morphop_channel_mode_get_name()
+ *
+ * Returns the identifier of the channel mode, as used by the tools that run the engine outside of GIMP
+ */
+const char* morphop_channel_mode_get_name(ChannelMode mode)
+{
+	switch (mode) {
+		case CHANNELS_LUMINOSITY: return "luminosity";
+		case CHANNELS_COLOR: return "color";
+		case CHANNELS_ALL: return "all";
+		default: return "unknown";
+	}
+}
+
+/* morphop_channel_mode_from_name()
+ *
+ * Returns the channel mode with the given identifier, or CHANNELS_END if there is none
+ */
+ChannelMode morphop_channel_mode_from_name(const char* name)
+{
+	int mode;
+
+	for (mode = 0; mode < CHANNELS_END; mode++) {
+		if (strcmp(name, morphop_channel_mode_get_name(mode)) == 0) return mode;
+	}
+
+	return CHANNELS_END;
+}
+
+/* morphop_operator_can_iterate()
+ *
+ * Returns 1 if the operator can be repeated by the 'iterations' of its settings
+ */
+int morphop_operator_can_iterate(MorphOperator op)
+{
+	return (op == OPERATOR_EROSION || op == OPERATOR_DILATION || op == OPERATOR_OPENING || op == OPERATOR_CLOSING);
+}
+
+/* morphop_settings_get_iterations()
+ *
+ * Returns how many times the operator of the settings applies its element: 1 for the operators that can't iterate
+ */
+int morphop_settings_get_iterations(const MorphOpSettings* settings)
+{
+	return (morphop_operator_can_iterate(settings->operator) ? settings->iterations : 1);
+}
+
+/* morphop_settings_are_valid()
+ *
+ * Returns 0 if the operator, the size of the element (or its custom runs, see shape_is_valid()), the number of
+ * iterations or the channel mode are out of range
+ */
+int morphop_settings_are_valid(const MorphOpSettings* settings)
+{
+	int iterations = morphop_settings_get_iterations(settings);
+
+	return (
+		settings->operator >= 0 && settings->operator < OPERATOR_END &&
+		(settings->element.shape != NULL ? shape_is_valid(settings->element.shape) : settings->element.size >= 0 && settings->element.size < SIZE_END) &&
+		iterations >= 1 && iterations <= MORPHOP_MAX_ITERATIONS &&
+		settings->channel_mode >= 0 && settings->channel_mode < CHANNELS_END
+	);
+}
+
+/* morphop_element_set_weights()
+ *
+ * Gives the element one of the ready-made non-flat profiles, 'height' 8-bit levels high (0 to 127): its center is at
+ * 0 and the cells around it go down to -height at the border of the 7x7 matrix (a circle, its corners are at
+ * -height too). The ball is a half sphere, the rolling ball of the background subtraction; the cone goes down
+ * linearly. WEIGHTS_FLAT, or a height of 0, makes the element flat.
+ */
+void morphop_element_set_weights(StructuringElement* element, ElementWeights weights, int height)
+{
+	const double radius = STRELEM_DEFAULT_SIZE / 2.0;
+	int i, j;
+
+	height = MAX(MIN(height, 127), 0);
+
+	for (i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
+		for (j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
+			double dy = i - STRELEM_DEFAULT_SIZE / 2, dx = j - STRELEM_DEFAULT_SIZE / 2;
+			double distance = MIN(sqrt(dx * dx + dy * dy) / radius, 1);
+			double depth = 0;
+
+			if (weights == WEIGHTS_BALL) depth = 1 - sqrt(1 - distance * distance);
+			else if (weights == WEIGHTS_CONE) depth = distance;
+
+			element->weights[i][j] = (signed char)-floor(height * depth + 0.5);
+		}
+	}
+}
+
+/* morphop_element_is_flat()
+ *
+ * Returns 1 if no cell of the element has a height
+ */
+int morphop_element_is_flat(const StructuringElement* element)
+{
+	int i, j;
+
+	for (i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
+		for (j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
+			if (element->weights[i][j] != 0) return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* morphop_image_alloc()
+ *
+ * Allocates a width x height image, with contiguous rows. Its content is undefined.
+ */
+MorphOpStatus morphop_image_alloc(MorphOpImage* image, int width, int height, PixelFormat format)
+{
+	image->width = width;
+	image->height = height;
+	image->format = format;
+	image->stride = (size_t)width * pixel_format_get_bpp(format);
+	image->data = malloc(MAX(image->stride * height, 1));
+
+	return (image->data != NULL ? MORPHOP_OK : MORPHOP_NO_MEMORY);
+}
+
+/* morphop_image_free()
+ *
+ * Frees an image allocated by morphop_image_alloc()
+ */
+void morphop_image_free(MorphOpImage* image)
+{
+	free(image->data);
+	image->data = NULL;
+}
+
+/* temp_image_alloc()
+ *
+ * Allocates a full-size temporary image with the allocator of the context, or on the heap if it has none.
+ * Returns 0 if there is no memory.
+ */
+int temp_image_alloc(MorphOpContext* ctx, MorphOpImage* image, int width, int height, PixelFormat format)
+{
+	if (ctx->temp_alloc == NULL) return (morphop_image_alloc(image, width, height, format) == MORPHOP_OK);
+
+	image->width = width;
+	image->height = height;
+	image->format = format;
+	image->data = NULL;
+
+	if (!ctx->temp_alloc(image, ctx->temp_data)) {
+		image->data = NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* temp_image_free()
+ *
+ * Frees an image of temp_image_alloc(), if it has been allocated
+ */
+void temp_image_free(MorphOpContext* ctx, MorphOpImage* image)
+{
+	if (image->data == NULL) return;
+
+	if (ctx->temp_alloc == NULL) morphop_image_free(image);
+	else ctx->temp_free(image, ctx->temp_data);
+
+	image->data = NULL;
+}
+
+/* do_morph_operation()
+ *
+ * Executes erosion or dilation using the given structuring element
+ *
+ *	- MorphOperator op: the operator, it can be OPERATOR_EROSION or OPERATOR_DILATION
+ *  - const MorphOpImage* src: source image
+ *  - MorphOpImage* dst: destination image, it must not be the source
+ *  - StructuringElement element: the structuring element
+ *  - SourceTansformation srctransf: a "source preprocessing" option, it can be:
+ *		- SRC_ORIGINAL (leaves source unchanged)
+ *		- SRC_INVERSE (invert source's colors, used by Hit-or-Miss)
+ *		- SRC_THRESHOLD (makes a threshold, if color < 127 => 0, else => 1, used by Skeletonization)
+ *  - ChannelMode channel_mode: how the channels of the neighbors are compared (see ChannelMode)
+ *  - int halo: if the context has a selection, the output is needed only within 'halo' pixels of it
+ *    (by the passes that read it next). The other pixels are not computed
+ */
+static void do_morph_operation(
+	MorphOpContext* ctx,
+	MorphOperator op,
+	const MorphOpImage* src, MorphOpImage* dst,
+	StructuringElement element,
+	SourceTansformation srctransf,
+	ChannelMode channel_mode,
+	int halo
+) {
+	GroupPass group;
+
+	group.n_passes = 0;
+	group_add_morph(ctx, &group, op, src, dst, element, srctransf, channel_mode, halo);
+	group_run(ctx, &group, src);
+}
+
+/* group_add_morph()
+ *
+ * Adds an erosion or a dilation to the passes run together (see do_morph_operation() for the parameters): chooses
+ * how it runs, and takes its memory from the arena. If there is no memory, the status of the context is set.
+ */
+static void group_add_morph(
+	MorphOpContext* ctx,
+	GroupPass* group,
+	MorphOperator op,
+	const MorphOpImage* src, MorphOpImage* dst,
+	StructuringElement element,
+	SourceTansformation srctransf,
+	ChannelMode channel_mode,
+	int halo
+) {
+	MorphPass* pass = &group->morph[group->n_passes];
+	int i;
+
+	group->is_morph[group->n_passes++] = 1;
+
+	pass->op = op;
+	pass->src = src;
+	pass->dst = dst;
+	pass->srctransf = srctransf;
+	pass->channel_mode = channel_mode;
+	pass->outside = NULL;
+	pass->copied = NULL;
+	pass->block_cols = 0;
+	pass->spans = NULL;
+	pass->row_cost = morph_row_cost(element);
+	element_scale(&element, &pass->element); // setting actual structuring element size
+
+	// where all the neighbors are the same pixel, a flat element gives that pixel back: the blocks whose neighbors
+	// are all in uniform blocks of the input can be just copied. Thresholding changes the pixel, unless it's black.
+	// The planner tells if finding them is worth it, and how the kernels apply the runs of the element
+	morph_plan(
+		&pass->element, ctx->calibration, src->format, srctransf, channel_mode,
+		ctx->selection == NULL && !pass->element.weighted && srctransf != SRC_INVERSE && pass->element.radius <= SUMMARY_BLOCK,
+		&pass->plan
+	);
+
+	profile_begin(ctx, morphop_operator_get_name(op), pass->plan.engine);
+
+	pass->arena_start = arena_mark(&ctx->arena);
+	pass->outside = arena_alloc(&ctx->arena, src->width * pixel_format_get_bpp(src->format));
+	if (pass->outside == NULL) {
+		ctx->status = MORPHOP_NO_MEMORY;
+		return;
+	}
+
+	// the rows outside the image are filled with useless pixels
+	fill_outside_row(op, src->format, pass->outside, src->width);
+
+	// the bands of a slice can run at the same time, each one has its own scratch memory
+	pass->n_scratch = (ctx->parallel != NULL ? PARALLEL_BANDS : 1);
+	pass->band_height = image_get_band_height(src);
+	for (i = 0; i < pass->n_scratch; i++) {
+		pass->scratch[i] = arena_alloc(&ctx->arena, morph_row_scratch_size(&pass->element, src->format, src->width));
+		if (pass->scratch[i] == NULL) {
+			ctx->status = MORPHOP_NO_MEMORY;
+			return;
+		}
+	}
+
+	// with a selection, each row is computed on the spans of the needed pixels, widened by the radius of the element:
+	// the kernels get the ends of a span wrong (they take the columns outside of it as outside of the image), but
+	// those pixels are not needed
+	if (ctx->selection != NULL) {
+		if (!selection_dilate(&ctx->arena, ctx->selection, halo + pass->element.radius, halo, &pass->halo_spans)) {
+			ctx->status = MORPHOP_NO_MEMORY;
+			return;
+		}
+		pass->spans = &pass->halo_spans;
+	}
+	else if (pass->plan.summary) {
+		pass->copied = summarize_blocks(ctx, src, MAX(pass->element.radius, pass->element.center), srctransf == SRC_THRESHOLD);
+		pass->block_cols = (src->width + SUMMARY_BLOCK - 1) / SUMMARY_BLOCK;
+	}
+}
+
+/* group_add_merge()
+ *
+ * Adds a merge to the passes run together (see do_merge_operation() for the parameters). With a selection, the
+ * merged pixels are the ones within 'halo' of it.
+ */
+static void group_add_merge(
+	MorphOpContext* ctx,
+	GroupPass* group,
+	MergeOperation op,
+	const MorphOpImage* a, const MorphOpImage* b, MorphOpImage* dst,
+	SourceTansformation srctransf,
+	int halo
+) {
+	MergePass* pass = &group->merge[group->n_passes];
+
+	group->is_morph[group->n_passes++] = 0;
+
+	pass->op = op;
+	pass->a = a;
+	pass->b = b;
+	pass->dst = dst;
+	pass->srctransf = srctransf;
+	pass->spans = ctx->selection;
+
+	profile_begin(ctx, merge_get_name(op), NULL);
+
+	pass->arena_start = arena_mark(&ctx->arena);
+	if (ctx->selection != NULL && halo > 0) {
+		if (!selection_dilate(&ctx->arena, ctx->selection, halo, halo, &pass->halo_spans)) {
+			ctx->status = MORPHOP_NO_MEMORY;
+			return;
+		}
+		pass->spans = &pass->halo_spans;
+	}
+}
+
+/* group_run()
+ *
+ * Runs the passes added to the group on the rows of 'image' (all of them have its size), unless one of them
+ * failed to start, and ends them: the last one added first, as the profile expects, and the memory each one took
+ * is given back to the arena
+ */
+static void group_run(MorphOpContext* ctx, GroupPass* group, const MorphOpImage* image)
+{
+	double row_cost = 0;
+	int i;
+
+	for (i = 0; i < group->n_passes; i++) {
+		row_cost += (group->is_morph[i] ? group->morph[i].row_cost : COST_MERGE_ROW);
+	}
+
+	if (ctx->status == MORPHOP_OK) run_slices(ctx, image, group_band, group, row_cost);
+
+	for (i = group->n_passes - 1; i >= 0; i--) {
+		if (group->is_morph[i]) {
+			MorphPass* pass = &group->morph[i];
+
+			profile_end(ctx, morphop_operator_get_name(pass->op), pass->plan.engine, pass->src, pass->element.size, 1, arena_mark(&ctx->arena) - pass->arena_start);
+			arena_release(&ctx->arena, pass->arena_start);
+		}
+		else {
+			MergePass* pass = &group->merge[i];
+
+			profile_end(ctx, merge_get_name(pass->op), NULL, pass->a, 2, 1, arena_mark(&ctx->arena) - pass->arena_start);
+			arena_release(&ctx->arena, pass->arena_start);
+		}
+	}
+}
+
+/* group_band()
+ *
+ * Runs the rows [y0, y1) of all the passes of a group, one after the other while the rows are in the cache
+ */
+static void group_band(int y0, int y1, void* data)
+{
+	GroupPass* group = data;
+	int i;
+
+	for (i = 0; i < group->n_passes; i++) {
+		if (group->is_morph[i]) morph_band(y0, y1, &group->morph[i]);
+		else merge_band(y0, y1, &group->merge[i]);
+	}
+}
+
+/* morph_band()
+ *
+ * Erodes or dilates the rows [y0, y1) of a MorphPass, a band of run_slices(): each output row (or each of its
+ * spans) is computed by morph_row() from the window of input rows centered on it
+ */
+static void morph_band(int y0, int y1, void* data)
+{
+	MorphPass* pass = data;
+	const MorphOpImage* src = pass->src;
+	const size_t bpp = pixel_format_get_bpp(src->format);
+	const int center = pass->element.center;
+	const int radius = pass->element.radius;
+	unsigned char* window[ELEMENT_MAX_ROWS]; // the input rows for masking
+	void* scratch = pass->scratch[(y0 / pass->band_height) % pass->n_scratch];
+	int y, i, bx, bx_end;
+
+	for (y = y0; y < y1; y++) {
+		const unsigned char* copied = (pass->copied != NULL ? pass->copied + (y / SUMMARY_BLOCK) * pass->block_cols : NULL);
+
+		for (i = 0; i < pass->element.size; i++) {
+			int this_row = y + i - pass->element.center;
+
+			if (this_row >= 0 && this_row < src->height) window[i] = IMAGE_ROW(src, this_row);
+			else window[i] = (pass->element.weighted ? NULL : pass->outside);
+		}
+
+		if (pass->spans != NULL) {
+			for (i = pass->spans->first[y]; i < pass->spans->first[y + 1]; i++) {
+				morph_span(pass, window, y, pass->spans->spans[2 * i], pass->spans->spans[2 * i + 1], scratch);
+			}
+			continue;
+		}
+
+		// near the top and the bottom, the rows outside of the image are neighbors too
+		if (copied == NULL || y < center || y >= src->height - center) {
+			morph_row(pass->op, src->format, &pass->element, pass->srctransf, pass->channel_mode, window, IMAGE_ROW(pass->dst, y), src->width, scratch);
+			continue;
+		}
+
+		// the spans of blocks that are not copied, each one with the neighbors of its pixels on both sides: their
+		// output is wrong, but it falls in the copied blocks around the span, that are written next
+		for (bx = 0; bx < pass->block_cols; bx = bx_end) {
+			bx_end = bx + 1;
+			if (copied[bx]) continue;
+
+			while (bx_end < pass->block_cols && !copied[bx_end]) bx_end++;
+			morph_span(pass, window, y, MAX(bx * SUMMARY_BLOCK - radius, 0), MIN(bx_end * SUMMARY_BLOCK + radius, src->width), scratch);
+		}
+
+		for (bx = 0; bx < pass->block_cols; bx = bx_end) {
+			bx_end = bx + 1;
+			if (!copied[bx]) continue;
+
+			while (bx_end < pass->block_cols && copied[bx_end]) bx_end++;
+			memcpy(
+				IMAGE_ROW(pass->dst, y) + bx * SUMMARY_BLOCK * bpp,
+				IMAGE_ROW(src, y) + bx * SUMMARY_BLOCK * bpp,
+				(MIN(bx_end * SUMMARY_BLOCK, src->width) - bx * SUMMARY_BLOCK) * bpp
+			);
+		}
+	}
+}
+
+/* morph_span()
+ *
+ * morph_row() on the pixels [x0, x1) of the row y: for the kernel, they are a whole row
+ */
+static void morph_span(const MorphPass* pass, unsigned char** window, int y, int x0, int x1, void* scratch)
+{
+	const size_t offset = x0 * pixel_format_get_bpp(pass->src->format);
+	unsigned char* span_window[ELEMENT_MAX_ROWS];
+	int i;
+
+	for (i = 0; i < pass->element.size; i++) {
+		span_window[i] = (window[i] != NULL ? window[i] + offset : NULL);
+	}
+
+	morph_row(pass->op, pass->src->format, &pass->element, pass->srctransf, pass->channel_mode, span_window, IMAGE_ROW(pass->dst, y) + offset, x1 - x0, scratch);
+}
+
+/* do_merge_operation()
+ *
+ * It saves an image that is a merge between the two inputs A and B. Merge can be
+ * - a "difference" between the two inputs (intended as abs(Ai - Bi)), where Ai is the ith pixel's value of A and Bi is the correspondent on B,
+ * - an "union" (min(Ai - Bi, 255)),
+ * - an "interseption", taking only the common pixels and setting the others to black.
+ *
+ *	- MergeOperation op: the merge operation, it can be MERGE_DIFF, MERGE_UNION or MERGE_INTERSEPT
+ *  - const MorphOpImage* a: first input image
+ *  - const MorphOpImage* b: second input image
+ *  - MorphOpImage* dst: destination image (it can be 'a' or 'b')
+ *  - SourceTansformation srctransf: a "source preprocessing" option applied to a, see do_morph_operation()
+ *
+ * If the context has a selection, only the selected pixels are merged.
+ */
+static void do_merge_operation(
+	MorphOpContext* ctx,
+	MergeOperation op,
+	const MorphOpImage* a, const MorphOpImage* b, MorphOpImage* dst,
+	SourceTansformation srctransf
+){
+	GroupPass group;
+
+	group.n_passes = 0;
+	group_add_merge(ctx, &group, op, a, b, dst, srctransf, 0);
+	group_run(ctx, &group, a);
+}
+
+static void merge_band(int y0, int y1, void* data)
+{
+	MergePass* pass = data;
+	const size_t bpp = pixel_format_get_bpp(pass->a->format);
+	int y, i;
+
+	for (y = y0; y < y1; y++) {
+		if (pass->spans == NULL) {
+			merge_row(pass->op, pass->a->format, pass->srctransf, IMAGE_ROW(pass->a, y), IMAGE_ROW(pass->b, y), IMAGE_ROW(pass->dst, y), pass->a->width);
+			continue;
+		}
+
+		for (i = pass->spans->first[y]; i < pass->spans->first[y + 1]; i++) {
+			const size_t offset = pass->spans->spans[2 * i] * bpp;
+			merge_row(
+				pass->op, pass->a->format, pass->srctransf,
+				IMAGE_ROW(pass->a, y) + offset, IMAGE_ROW(pass->b, y) + offset, IMAGE_ROW(pass->dst, y) + offset,
+				pass->spans->spans[2 * i + 1] - pass->spans->spans[2 * i]
+			);
+		}
+	}
+}
+
+/* count_non_black()
+ *
+ * Returns the number of pixels of the image that are not totally black (alpha channel is ignored).
+ * Used by Skeletonization, that ends when it reaches 0.
+ */
+static unsigned long count_non_black(MorphOpContext* ctx, const MorphOpImage* image)
+{
+	ScanPass pass = { image, NULL, NULL };
+	unsigned long count = 0;
+	int y;
+
+	profile_begin(ctx, "count", NULL);
+
+	size_t arena_start = arena_mark(&ctx->arena);
+	pass.row_counts = arena_alloc(&ctx->arena, image->height * sizeof(unsigned long));
+	if (pass.row_counts == NULL) {
+		ctx->status = MORPHOP_NO_MEMORY;
+		return 0;
+	}
+	memset(pass.row_counts, 0, image->height * sizeof(unsigned long));
+
+	run_slices(ctx, image, count_band, &pass, COST_SCAN_ROW);
+
+	for (y = 0; y < image->height; y++) {
+		count += pass.row_counts[y];
+	}
+
+	profile_end(ctx, "count", NULL, image, 1, 0, arena_mark(&ctx->arena) - arena_start);
+
+	arena_release(&ctx->arena, arena_start);
+	return count;
+}
+
+static void count_band(int y0, int y1, void* data)
+{
+	ScanPass* pass = data;
+	int y;
+
+	for (y = y0; y < y1; y++) {
+		pass->row_counts[y] = count_non_black_row(pass->src->format, IMAGE_ROW(pass->src, y), pass->src->width);
+	}
+}
+
+/* fill_black()
+ *
+ * Fills the destination image with black, keeping the alpha channel of the source
+ */
+static void fill_black(MorphOpContext* ctx, const MorphOpImage* src, MorphOpImage* dst)
+{
+	ScanPass pass = { src, dst, NULL };
+
+	profile_begin(ctx, "fill", NULL);
+	run_slices(ctx, src, fill_black_band, &pass, COST_SCAN_ROW);
+	profile_end(ctx, "fill", NULL, src, 1, 1, 0);
+}
+
+static void fill_black_band(int y0, int y1, void* data)
+{
+	ScanPass* pass = data;
+	int y;
+
+	for (y = y0; y < y1; y++) {
+		fill_black_row(pass->src->format, IMAGE_ROW(pass->src, y), IMAGE_ROW(pass->dst, y), pass->src->width);
+	}
+}
+
+/* summarize_blocks()
+ *
+ * Splits the image into blocks of SUMMARY_BLOCK x SUMMARY_BLOCK pixels, and finds the ones whose pixels are all the
+ * same. Returns, for each block, 1 if the block and all the blocks within 'radius' pixels of it are uniform, with the
+ * same pixel ('black_only': and it's black), so an erosion or a dilation with a flat element copies the block.
+ * The flags are taken from the arena. Returns NULL if no block is copied, or if there is no memory (with the status
+ * of the context set).
+ */
+unsigned char* summarize_blocks(MorphOpContext* ctx, const MorphOpImage* image, int radius, int black_only)
+{
+	const int cols = (image->width + SUMMARY_BLOCK - 1) / SUMMARY_BLOCK;
+	const int rows = (image->height + SUMMARY_BLOCK - 1) / SUMMARY_BLOCK;
+	const size_t bpp = pixel_format_get_bpp(image->format);
+	SummaryPass pass = { image, cols, NULL };
+	unsigned char* copied;
+	int any = 0;
+	int bx, by, nx, ny;
+
+	pass.uniform = arena_alloc(&ctx->arena, (size_t)cols * rows * sizeof(const unsigned char*));
+	copied = arena_alloc(&ctx->arena, (size_t)cols * rows);
+	if (pass.uniform == NULL || copied == NULL) {
+		ctx->status = MORPHOP_NO_MEMORY;
+		return NULL;
+	}
+
+	if (ctx->parallel != NULL) ctx->parallel(0, rows, summary_band, &pass, ctx->parallel_data);
+	else summary_band(0, rows, &pass);
+
+	for (by = 0; by < rows; by++) {
+		for (bx = 0; bx < cols; bx++) {
+			const unsigned char* pixel = pass.uniform[by * cols + bx];
+			int uniform = (pixel != NULL && (!black_only || count_non_black_row(image->format, pixel, 1) == 0));
+
+			for (ny = MAX(by * SUMMARY_BLOCK - radius, 0) / SUMMARY_BLOCK; uniform && ny <= MIN((by + 1) * SUMMARY_BLOCK - 1 + radius, image->height - 1) / SUMMARY_BLOCK; ny++) {
+				for (nx = MAX(bx * SUMMARY_BLOCK - radius, 0) / SUMMARY_BLOCK; uniform && nx <= MIN((bx + 1) * SUMMARY_BLOCK - 1 + radius, image->width - 1) / SUMMARY_BLOCK; nx++) {
+					const unsigned char* other = pass.uniform[ny * cols + nx];
+					uniform = (other != NULL && memcmp(other, pixel, bpp) == 0);
+				}
+			}
+
+			copied[by * cols + bx] = uniform;
+			any |= uniform;
+		}
+	}
+
+	return (any ? copied : NULL);
+}
+
+/* summary_band()
+ *
+ * Finds the uniform blocks of the rows of blocks [by0, by1): each row of a block must repeat its first pixel
+ * (it's equal to itself moved by a pixel), and be equal to the first row. The comparison stops at the first
+ * difference, so mixed blocks take little time.
+ */
+static void summary_band(int by0, int by1, void* data)
+{
+	SummaryPass* pass = data;
+	const MorphOpImage* image = pass->src;
+	const size_t bpp = pixel_format_get_bpp(image->format);
+	int bx, by, y;
+
+	for (by = by0; by < by1; by++) {
+		const int y_end = MIN((by + 1) * SUMMARY_BLOCK, image->height);
+
+		for (bx = 0; bx < pass->cols; bx++) {
+			const size_t x0 = (size_t)bx * SUMMARY_BLOCK * bpp;
+			const size_t size = (MIN((bx + 1) * SUMMARY_BLOCK, image->width) - bx * SUMMARY_BLOCK) * bpp;
+			const unsigned char* first = IMAGE_ROW(image, by * SUMMARY_BLOCK) + x0;
+			int uniform = (memcmp(first, first + bpp, size - bpp) == 0);
+
+			for (y = by * SUMMARY_BLOCK + 1; uniform && y < y_end; y++) {
+				uniform = (memcmp(IMAGE_ROW(image, y) + x0, first, size) == 0);
+			}
+
+			pass->uniform[by * pass->cols + bx] = (uniform ? first : NULL);
+		}
+	}
+}
+
+/*
+ * The bands of a slice, for the parallel function of the context (see slice_band())
+ */
+typedef struct {
+	MorphOpBandFunc func;
+	void* data;
+	int band_height;
+	int y1; // the end of the slice
+} SliceTask;
+
+/* run_slices()
+ *
+ * Runs a pass on all the rows of the image, a slice at a time: a band or, if the context can
+ * run them in parallel, PARALLEL_BANDS bands to keep the threads busy. After each slice, the progress is
+ * advanced by 'row_cost' for each row. Nothing is done once the operation has been stopped (see MorphOpContext.status).
+ * The bands are always the same, whatever the parallel function splits the slice in: the i-th band of a slice
+ * starts at a multiple of image_get_band_height(), so a pass can give it the i-th of its scratch buffers.
+ */
+static void run_slices(MorphOpContext* ctx, const MorphOpImage* image, MorphOpBandFunc func, void* data, double row_cost)
+{
+	SliceTask task = { func, data, image_get_band_height(image), 0 };
+	int slice_height = task.band_height * (ctx->parallel != NULL ? PARALLEL_BANDS : 1);
+	int y;
+
+	for (y = 0; y < image->height && ctx->status == MORPHOP_OK; y = task.y1) {
+		task.y1 = MIN(y + slice_height, image->height);
+
+		if (ctx->parallel != NULL) ctx->parallel(y, task.y1, slice_band, &task, ctx->parallel_data);
+		else func(y, task.y1, data);
+
+		progress_advance(ctx, row_cost * (task.y1 - y));
+	}
+}
+
+/* slice_band()
+ *
+ * Runs the bands of the slice (see run_slices()) that start in the rows [y0, y1) given by the parallel function:
+ * each band is run whole by the call that has its first row
+ */
+static void slice_band(int y0, int y1, void* data)
+{
+	const SliceTask* task = data;
+	int y = (y0 + task->band_height - 1) / task->band_height * task->band_height;
+
+	for (; y < y1; y += task->band_height) {
+		task->func(y, MIN(y + task->band_height, task->y1), task->data);
+	}
+}
+
+/* image_get_band_height()
+ *
+ * The rows of a band of the image, about BAND_SIZE bytes
+ */
+static int image_get_band_height(const MorphOpImage* image)
+{
+	size_t row_size = MAX(image->width * pixel_format_get_bpp(image->format), 1);
+
+	return (int)MIN(MAX(BAND_SIZE / row_size, 1), BAND_MAX_HEIGHT);
+}
+
+/* image_prepare_temp()
+ *
+ * Inits a temporary image, with the same size and format of 'like', taken from the arena of the context
+ * (or from its allocator of temporary images). Returns 0 if there is no memory.
+ */
+static int image_prepare_temp(MorphOpContext* ctx, const MorphOpImage* like, MorphOpImage* temp)
+{
+	if (ctx->temp_alloc != NULL) return temp_image_alloc(ctx, temp, like->width, like->height, like->format);
+
+	*temp = *like;
+	temp->stride = (size_t)like->width * pixel_format_get_bpp(like->format);
+	temp->data = arena_alloc(&ctx->arena, temp->stride * like->height);
+
+	return (temp->data != NULL);
+}
+
+/* image_release_temps()
+ *
+ * Gives back the first 'count' temporary images and the copy of the source, if they have been taken from the
+ * allocator of the context (the ones in the arena are given back by its next reset)
+ */
+static void image_release_temps(MorphOpContext* ctx, MorphOpImage* temp, int count, MorphOpImage* src_copy)
+{
+	int i;
+
+	if (ctx->temp_alloc == NULL) return;
+
+	for (i = 0; i < count; i++) temp_image_free(ctx, &temp[i]);
+	temp_image_free(ctx, src_copy);
+}
+
+static int images_are_compatible(const MorphOpImage* a, const MorphOpImage* b)
+{
+	return (
+		a->data != NULL && b->data != NULL &&
+		a->width > 0 && a->height > 0 &&
+		a->width == b->width && a->height == b->height &&
+		a->format.type >= 0 && a->format.type < SAMPLE_END &&
+		a->format.channels == (a->format.is_rgb ? 3 : 1) + (a->format.has_alpha ? 1 : 0) &&
+		a->format.type == b->format.type &&
+		a->format.channels == b->format.channels &&
+		a->format.is_rgb == b->format.is_rgb &&
+		a->format.has_alpha == b->format.has_alpha
+	);
+}
+
+static int images_are_equal(const MorphOpImage* a, const MorphOpImage* b)
+{
+	size_t row_size = a->width * pixel_format_get_bpp(a->format);
+	int y;
+
+	for (y = 0; y < a->height; y++) {
+		if (memcmp(IMAGE_ROW(a, y), IMAGE_ROW(b, y), row_size) != 0) return 0;
+	}
+
+	return 1;
+}
+
+/* morph_row_cost()
+ *
+ * Estimated cost of eroding or dilating one row with the given element: it's proportional to the
+ * whole-row passes of morph_row() (see element_get_cost()), one for each cell of a short run.
+ * The cost of a merge (COST_MERGE_ROW) is the unit.
+ */
+static double morph_row_cost(StructuringElement element)
+{
+	ScaledElement scaled;
+	element_scale(&element, &scaled);
+
+	return MAX(element_get_cost(&scaled), 1);
+}
+
+/* skeleton_iteration_cost()
+ *
+ * Estimated cost, per row, of one iteration of the skeletonization: an erosion, a dilation,
+ * two merges and the scan that looks for the remaining white pixels
+ */
+static double skeleton_iteration_cost(StructuringElement element)
+{
+	return 2 * morph_row_cost(element) + 2 * COST_MERGE_ROW + COST_SCAN_ROW;
+}
+
+/* operator_cost()
+ *
+ * Estimated cost of the whole operation on a width x height image, as the sum of the cost of its passes.
+ * For Skeletonization, the number of iterations is the worst case (the largest blob fits the entire image):
+ * the estimate is then refined while running, see progress_set_remaining().
+ */
+static double operator_cost(MorphOpSettings settings, int width, int height)
+{
+	const OperatorGraph* graph = operator_get_graph(settings.operator);
+	double passes = 0;
+	int i;
+
+	if (settings.operator == OPERATOR_SKELETON) {
+		passes = COST_MERGE_ROW + COST_SCAN_ROW +
+			ceil(MIN(width, height) / MAX(2.0 * element_get_radius(&settings.element), 1)) * skeleton_iteration_cost(settings.element);
+	}
+
+	for (i = 0; i < graph->n_nodes; i++) {
+		const GraphNode* node = &graph->nodes[i];
+
+		if (node->kind == GRAPH_MERGE) passes += COST_MERGE_ROW;
+		else passes += (node->iterated ? settings.iterations : 1) * morph_row_cost(settings.element);
+	}
+
+	return passes * height;
+}
+
+/* progress_advance()
+ *
+ * Adds 'cost' to the completed work and reports it to the progress function of the context,
+ * that can cancel the operation
+ */
+static void progress_advance(MorphOpContext* ctx, double cost)
+{
+	ctx->done += cost;
+
+	if (ctx->progress != NULL && !ctx->progress(ctx->done, ctx->total, ctx->progress_data)) {
+		ctx->status = MORPHOP_CANCELLED;
+	}
+}
+
+/* progress_set_remaining()
+ *
+ * Updates the estimated total cost, given the cost of the work still to be done
+ */
+static void progress_set_remaining(MorphOpContext* ctx, double cost)
+{
+	ctx->total = MAX(ctx->done + cost, 1);
+}
+
+/* profile_begin()
+ *
+ * Tells the profile function of the context, if any, that a pass starts, run by the given engine (NULL if it has no choice)
+ */
+static void profile_begin(MorphOpContext* ctx, const char* name, const char* engine)
+{
+	MorphOpPassInfo info = { name, 0, 0, 0, 0, 0, engine };
+
+	if (ctx->profile != NULL) ctx->profile(&info, ctx->profile_data);
+}
+
+/* profile_end()
+ *
+ * Tells the profile function of the context, if any, that a pass on 'image' has ended. For each row of the image,
+ * the pass has read 'rows_read' rows and written 'rows_written' rows.
+ */
+static void profile_end(MorphOpContext* ctx, const char* name, const char* engine, const MorphOpImage* image, int rows_read, int rows_written, size_t bytes_allocated)
+{
+	MorphOpPassInfo info = {
+		name, 1,
+		(unsigned long)image->width * image->height,
+		(unsigned long)image->height * rows_read,
+		(unsigned long)image->height * rows_written,
+		bytes_allocated,
+		engine
+	};
+
+	if (ctx->profile != NULL) ctx->profile(&info, ctx->profile_data);
+}
+
+static const char* merge_get_name(MergeOperation op)
+{
+	switch (op) {
+		case MERGE_DIFF: return "diff";
+		case MERGE_UNION: return "union";
+		case MERGE_INTERSEPT: return "intersept";
+		default: return "merge";
+	}
+}
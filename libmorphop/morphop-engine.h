@@ -0,0 +1,332 @@
+#ifndef __MORPHOP_ENGINE_H__
+#define __MORPHOP_ENGINE_H__
+
+/*
+ * libmorphop: the morphological operators, on plain images in memory.
+ * It doesn't depend on GIMP (nor on glib) and has no global state: everything an operation
+ * needs is in its MorphOpContext, so different contexts can be used at the same time by different threads.
+ */
+
+#include <stddef.h>
+#include "morphop-arena.h"
+
+#define STRELEM_DEFAULT_SIZE 7
+
+typedef enum {
+	OPERATOR_EROSION = 0,
+	OPERATOR_DILATION,
+	OPERATOR_OPENING,
+	OPERATOR_CLOSING,
+	OPERATOR_BOUNDEXTR,
+	OPERATOR_GRADIENT,
+	OPERATOR_HITORMISS,
+	OPERATOR_SKELETON,
+	OPERATOR_THICKENING,
+	OPERATOR_THINNING,
+	OPERATOR_WTOPHAT,
+	OPERATOR_BTOPHAT,
+
+	OPERATOR_END
+} MorphOperator;
+
+typedef enum {
+	SRC_ORIGINAL = 0,
+	SRC_INVERSE,
+	SRC_THRESHOLD,
+
+	SRC_END
+} SourceTansformation;
+
+typedef enum {
+	MERGE_DIFF = 0,
+	MERGE_UNION,
+	MERGE_INTERSEPT,
+
+	MERGE_END
+} MergeOperation;
+
+typedef enum {
+	SIZE_3x3 = 0,
+	SIZE_5x5,
+	SIZE_7x7,
+	SIZE_9x9,
+	SIZE_11x11,
+
+	SIZE_END
+} ElementSize;
+
+/*
+ * The ready-made weights of a non-flat element (see morphop_element_set_weights())
+ */
+typedef enum {
+	WEIGHTS_FLAT = 0,
+	WEIGHTS_BALL, // a half sphere: the rolling ball of the background subtraction
+	WEIGHTS_CONE,
+
+	WEIGHTS_END
+} ElementWeights;
+
+/*
+ * How the erosion and the dilation compare the neighbors of a color pixel (see MorphOpSettings)
+ */
+typedef enum {
+	CHANNELS_LUMINOSITY = 0, // the whole neighbor with the lowest (highest) luminosity
+	CHANNELS_COLOR, // each color channel on its own, the alpha of the pixel doesn't change
+	CHANNELS_ALL, // each channel on its own, the alpha too
+
+	CHANNELS_END
+} ChannelMode;
+
+// the largest side, in pixels, of a custom element (see MorphOpShape)
+#define MORPHOP_SHAPE_MAX_SIZE 511
+
+/*
+ * Consecutive cells on a row of an element: the columns [dx0, dx1) of the row dy, counted from the center
+ */
+typedef struct {
+	int dy;
+	int dx0, dx1;
+} MorphOpRun;
+
+/*
+ * A flat structuring element of any size up to MORPHOP_SHAPE_MAX_SIZE x MORPHOP_SHAPE_MAX_SIZE (e.g. a disk or a
+ * slanted line, read from a mask by morphop_shape_build()): its cells are stored as runs, sorted by row and then by
+ * column, so the kernels take time for the runs rather than for the cells. The center is the cell (width / 2, height / 2).
+ */
+typedef struct {
+	int width, height;
+	int n_runs;
+	MorphOpRun* runs;
+} MorphOpShape;
+
+typedef struct {
+	signed char matrix[STRELEM_DEFAULT_SIZE][STRELEM_DEFAULT_SIZE];
+	ElementSize size;
+	// non-flat elements: the height of each cell, in 8-bit levels (257 for 16-bit samples, 1/255 for float ones).
+	// The erosion takes the lowest neighbor minus its height, the dilation the highest plus it (saturated to black
+	// and white). All 0 for a flat element; hit-or-miss, thickening, thinning and skeletonization ignore them.
+	signed char weights[STRELEM_DEFAULT_SIZE][STRELEM_DEFAULT_SIZE];
+	// optional: a custom element, used instead of the matrix, its size and its weights. It must stay valid while
+	// the operators (or the streams) that use the element run. For hit-or-miss, thickening and thinning, its cells
+	// are the white pattern and the other cells of its rectangle the black one.
+	const MorphOpShape* shape;
+} StructuringElement;
+
+// the highest number of iterations of an operator (see MorphOpSettings)
+#define MORPHOP_MAX_ITERATIONS 32
+
+typedef struct {
+	MorphOperator operator;
+	StructuringElement element;
+	// erosion, dilation, opening and closing: how many times the element is applied (1 to MORPHOP_MAX_ITERATIONS),
+	// as if it was that many times bigger: e.g. an opening with 3 iterations is 3 erosions, then 3 dilations.
+	// It's ignored by the other operators.
+	int iterations;
+	// erosion, dilation, opening, closing, boundary extraction, gradient and top-hats: how the channels of the
+	// neighbors are compared. Hit-or-miss, thickening, thinning and skeletonization always use CHANNELS_LUMINOSITY.
+	ChannelMode channel_mode;
+} MorphOpSettings;
+
+#define MORPHOP_CHAIN_MAX_STEPS 8
+
+/*
+ * Operators applied one after the other, each one to the result of the previous (see morphop_run_chain())
+ */
+typedef struct {
+	int n_steps;
+	MorphOpSettings steps[MORPHOP_CHAIN_MAX_STEPS];
+} MorphOpChain;
+
+typedef enum {
+	SAMPLE_U8 = 0,
+	SAMPLE_U16,
+	SAMPLE_FLOAT,
+
+	SAMPLE_END
+} SampleType;
+
+/*
+ * How the pixels of a row are stored: 'channels' interleaved samples of the given type
+ * (gray, gray + alpha, RGB, RGB + alpha)
+ */
+typedef struct {
+	SampleType type;
+	int channels;
+	int is_rgb;
+	int has_alpha;
+} PixelFormat;
+
+#define MORPHOP_CALIBRATION_VERSION 1
+
+/*
+ * The speed of the kernels on a host, for each sample type, in nanoseconds for a sample of a whole-row pass (a pixel,
+ * for the luminosity kernel), measured by morphop_calibrate(). The planner estimates with them the cost of the ways a
+ * pass of erosion or dilation can run (see MorphOpContext.calibration), and picks the cheapest; they never change
+ * its result. It's plain data, that can be saved and loaded back: a calibration of a different 'version' is not valid
+ * (see morphop_calibration_is_valid()) and must be measured again.
+ */
+typedef struct {
+	int version; // MORPHOP_CALIBRATION_VERSION
+	double cell[SAMPLE_END]; // a cell of a run, in the channel kernels
+	double doubling[SAMPLE_END]; // a doubling pass of a long run, that builds the lowest (highest) of 2k samples from k
+	double stack[SAMPLE_END]; // merging a row of a stack, the same run on consecutive rows, before the run is applied once
+	double lum_row[SAMPLE_END]; // the luminosity kernel, per pixel: the luminosity of an input row and the output
+	double lum_cell[SAMPLE_END]; // a cell of a run
+	double lum_doubling[SAMPLE_END]; // a pass of the table of the best of 2k pixels
+	double summary[SAMPLE_END]; // finding the uniform blocks of an image, per sample
+} MorphOpCalibration;
+
+/*
+ * An image in memory: 'height' rows of 'width' pixels, each row starts 'stride' bytes after the previous one
+ */
+typedef struct {
+	unsigned char* data;
+	int width, height;
+	size_t stride;
+	PixelFormat format;
+} MorphOpImage;
+
+typedef enum {
+	MORPHOP_OK = 0,
+	MORPHOP_CANCELLED, // the progress function asked to stop
+	MORPHOP_INVALID, // wrong settings, or images of different size or format
+	MORPHOP_NO_MEMORY,
+	MORPHOP_SOURCE_ERROR, // the row source of a stream (see morphop-stream.h), or the strips of morphop_run_budget(), failed
+
+	MORPHOP_STATUS_END
+} MorphOpStatus;
+
+/*
+ * Called after each slice of rows with the cost of the work done so far and the estimated total
+ * (the estimate can change while running). Returns 0 to cancel the operation.
+ */
+typedef int (*MorphOpProgressFunc) (double, double, void*);
+
+/*
+ * Runs 'band' on bands of rows that cover [y0, y1) and returns when all of them are done. Bands can run
+ * concurrently: the engine never writes the same row from two bands.
+ */
+typedef void (*MorphOpBandFunc) (int, int, void*);
+typedef void (*MorphOpParallelFunc) (int, int, MorphOpBandFunc, void*, void*);
+
+/*
+ * What a pass of the engine did, for the profile function of the context. The function is called twice
+ * for each pass, from the calling thread: when the pass starts (with 'end' = 0 and no counters) and when it ends.
+ */
+typedef struct {
+	const char* name; // the kind of pass: "erosion", "dilation", "diff", "union", "intersept", "fill", "count", "temp", "chain", "reconstruct", "area-tree" or "watershed"
+	int end;
+	unsigned long pixels; // pixels computed by the pass
+	unsigned long rows_read; // rows of the input images read, counting each row once for every output row that reads it
+	unsigned long rows_written;
+	size_t bytes_allocated; // scratch memory taken by the pass
+	const char* engine; // erosion and dilation: how the planner runs the pass (e.g. "channels: 1 stack, blocks"), else NULL
+} MorphOpPassInfo;
+
+typedef void (*MorphOpProfileFunc) (const MorphOpPassInfo*, void*);
+
+/*
+ * The selected pixels of an image, as spans of columns on each row (see morphop_selection_build()): the spans of
+ * the row y are the pairs [x0, x1) of 'spans' from first[y] to first[y + 1] (excluded), sorted and separated
+ */
+typedef struct {
+	int width, height;
+	int* first; // height + 1 items
+	int* spans;
+} MorphOpSelection;
+
+/*
+ * Allocates a full-size temporary image of an operation somewhere else than the heap, e.g. in a memory-mapped
+ * scratch file: the size and the format of 'image' are set, the function sets its data and its stride.
+ * Returns 0 if there is no memory. The free function gives the pixels back.
+ */
+typedef int (*MorphOpTempAllocFunc) (MorphOpImage*, void*);
+typedef void (*MorphOpTempFreeFunc) (MorphOpImage*, void*);
+
+/*
+ * Reads (or writes) the rows [y0, y1) of an image that is not in memory (see morphop_run_budget()): 'image' is as
+ * tall as them. Returns 0 if they can't be read (written).
+ */
+typedef int (*MorphOpStripFunc) (int, int, MorphOpImage*, void*);
+
+typedef struct {
+	MorphOpArena arena; // scratch memory, kept between two operations
+
+	MorphOpProgressFunc progress; // optional
+	void* progress_data;
+
+	MorphOpParallelFunc parallel; // optional: if NULL, all the rows are processed by the calling thread
+	void* parallel_data;
+
+	MorphOpProfileFunc profile; // optional
+	void* profile_data;
+
+	// optional: the speed of the kernels on this host (see morphop_calibrate()), the planner of the passes uses it
+	// to choose their engine. If NULL, it uses a default model
+	const MorphOpCalibration* calibration;
+
+	// optional: morphop_run() and morphop_run_chain() compute only the selected pixels of the output (and the ones
+	// they depend on), the others are undefined. It must have the size of the images
+	const MorphOpSelection* selection;
+
+	// optional: the full-size temporary images of morphop_run() and morphop_run_chain() (and the whole image of
+	// morphop_run_budget(), when it can't be split) are allocated by these, instead of the arena or the heap
+	MorphOpTempAllocFunc temp_alloc;
+	MorphOpTempFreeFunc temp_free;
+	void* temp_data;
+
+	double done, total; // progress of the running operation, in cost units
+	MorphOpStatus status; // as soon as it's not MORPHOP_OK, the running operation stops
+} MorphOpContext;
+
+/*
+ * The component trees of an image, one for each color channel, for the area opening or closing
+ * (see morphop_area_tree_build()). All the arrays have a plane of width x height items for each channel.
+ */
+typedef struct {
+	int width, height;
+	PixelFormat format;
+	MorphOperator op; // OPERATOR_OPENING (max-trees) or OPERATOR_CLOSING (min-trees, of the negated image)
+
+	float* value; // the samples, negated for the closing (all the channels, with the alpha)
+	int* parent; // the parent of each pixel: the first pixel of its node, or of the node below
+	int* order; // the pixels, from the leaves to the root
+	unsigned int* area; // for the first pixel of each node: the pixels of its component
+} MorphOpAreaTree;
+
+void morphop_context_init(MorphOpContext*);
+void morphop_context_free(MorphOpContext*);
+MorphOpStatus morphop_run(MorphOpContext*, const MorphOpSettings*, const MorphOpImage*, MorphOpImage*);
+MorphOpStatus morphop_run_chain(MorphOpContext*, const MorphOpChain*, const MorphOpImage*, MorphOpImage*);
+MorphOpStatus morphop_run_budget(MorphOpContext*, const MorphOpChain*, int, int, PixelFormat, size_t, MorphOpStripFunc, MorphOpStripFunc, void*);
+MorphOpStatus morphop_reconstruct(MorphOpContext*, MorphOperator, const MorphOpImage*, const MorphOpImage*, MorphOpImage*);
+
+MorphOpStatus morphop_watershed(MorphOpContext*, const StructuringElement*, const MorphOpImage*, const MorphOpImage*, MorphOpImage*);
+
+void morphop_calibration_init(MorphOpCalibration*);
+MorphOpStatus morphop_calibrate(MorphOpCalibration*);
+int morphop_calibration_is_valid(const MorphOpCalibration*);
+
+MorphOpStatus morphop_selection_build(MorphOpSelection*, const unsigned char*, size_t, int, int, MorphOpArena*);
+MorphOpStatus morphop_shape_build(MorphOpShape*, const unsigned char*, size_t, int, int, MorphOpArena*);
+
+void morphop_area_tree_init(MorphOpAreaTree*);
+MorphOpStatus morphop_area_tree_build(MorphOpContext*, MorphOperator, const MorphOpImage*, MorphOpAreaTree*);
+MorphOpStatus morphop_area_tree_filter(const MorphOpAreaTree*, unsigned long, MorphOpImage*);
+void morphop_area_tree_free(MorphOpAreaTree*);
+
+const char* morphop_operator_get_name(MorphOperator);
+MorphOperator morphop_operator_from_name(const char*);
+int morphop_operator_can_iterate(MorphOperator);
+int morphop_settings_get_iterations(const MorphOpSettings*);
+int morphop_settings_are_valid(const MorphOpSettings*);
+const char* morphop_channel_mode_get_name(ChannelMode);
+ChannelMode morphop_channel_mode_from_name(const char*);
+void morphop_element_set_weights(StructuringElement*, ElementWeights, int);
+int morphop_element_is_flat(const StructuringElement*);
+
+MorphOpStatus morphop_image_alloc(MorphOpImage*, int, int, PixelFormat);
+void morphop_image_free(MorphOpImage*);
+int pixel_format_get_bpp(PixelFormat);
+
+#endif
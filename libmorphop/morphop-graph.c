@@ -0,0 +1,290 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-kernels.h"
+
+#ifndef MAX
+	#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// a pass whose output has no buffer yet (see graph_schedule())
+#define BUFFER_NONE -2
+
+// the nodes of the graphs: an erosion or a dilation of the element of the settings, iterated or not, an erosion with
+// a pattern of hit-or-miss (that compares the pixels by luminosity), and a merge
+#define MORPH(op, input, iterated) { GRAPH_MORPH, op, GRAPH_ELEMENT, SRC_ORIGINAL, iterated, 0, MERGE_END, input, GRAPH_INPUT }
+#define PATTERN(element, srctransf) { GRAPH_MORPH, OPERATOR_EROSION, element, srctransf, 0, 1, MERGE_END, GRAPH_INPUT, GRAPH_INPUT }
+#define MERGE(merge, a, b) { GRAPH_MERGE, OPERATOR_END, GRAPH_ELEMENT, SRC_ORIGINAL, 0, 0, merge, a, b }
+
+/*
+ * The operators: each node reads the input (GRAPH_INPUT) or the nodes before it, the last one is the result.
+ * A new operator made of erosions, dilations and merges is a new graph here, morphop_run() and the streams run it.
+ */
+static const OperatorGraph operator_graphs[OPERATOR_END] = {
+	[OPERATOR_EROSION] = { 1, { MORPH(OPERATOR_EROSION, GRAPH_INPUT, 1) } },
+	[OPERATOR_DILATION] = { 1, { MORPH(OPERATOR_DILATION, GRAPH_INPUT, 1) } },
+
+	// opening is an erosion followed by a dilation (each one repeated, with more iterations), closing is its dual
+	[OPERATOR_OPENING] = { 2, { MORPH(OPERATOR_EROSION, GRAPH_INPUT, 1), MORPH(OPERATOR_DILATION, 0, 1) } },
+	[OPERATOR_CLOSING] = { 2, { MORPH(OPERATOR_DILATION, GRAPH_INPUT, 1), MORPH(OPERATOR_EROSION, 0, 1) } },
+
+	// boundary extraction is the difference between the original image and its erosion
+	[OPERATOR_BOUNDEXTR] = { 2, { MORPH(OPERATOR_EROSION, GRAPH_INPUT, 0), MERGE(MERGE_DIFF, GRAPH_INPUT, 0) } },
+
+	// gradient is the difference between the eroded and the dilated image
+	[OPERATOR_GRADIENT] = { 3, {
+		MORPH(OPERATOR_EROSION, GRAPH_INPUT, 0), MORPH(OPERATOR_DILATION, GRAPH_INPUT, 0), MERGE(MERGE_DIFF, 0, 1)
+	} },
+
+	// hit-or-miss is the intersection of two erosions: of the image with the white pattern, and of its inverse
+	// with the black one. Thickening adds the patterns found to the image, thinning removes them
+	[OPERATOR_HITORMISS] = { 3, {
+		PATTERN(GRAPH_WHITE, SRC_ORIGINAL), PATTERN(GRAPH_BLACK, SRC_INVERSE), MERGE(MERGE_INTERSEPT, 0, 1)
+	} },
+	[OPERATOR_THICKENING] = { 4, {
+		PATTERN(GRAPH_WHITE, SRC_ORIGINAL), PATTERN(GRAPH_BLACK, SRC_INVERSE), MERGE(MERGE_INTERSEPT, 0, 1),
+		MERGE(MERGE_UNION, GRAPH_INPUT, 2)
+	} },
+	[OPERATOR_THINNING] = { 4, {
+		PATTERN(GRAPH_WHITE, SRC_ORIGINAL), PATTERN(GRAPH_BLACK, SRC_INVERSE), MERGE(MERGE_INTERSEPT, 0, 1),
+		MERGE(MERGE_DIFF, GRAPH_INPUT, 2)
+	} },
+
+	// the iterations of the skeletonization depend on the image (see morphop_run())
+	[OPERATOR_SKELETON] = { 0 },
+
+	// white top-hat is the difference between the image and its opening, black top-hat between its closing and the image
+	[OPERATOR_WTOPHAT] = { 3, {
+		MORPH(OPERATOR_EROSION, GRAPH_INPUT, 0), MORPH(OPERATOR_DILATION, 0, 0), MERGE(MERGE_DIFF, GRAPH_INPUT, 1)
+	} },
+	[OPERATOR_BTOPHAT] = { 3, {
+		MORPH(OPERATOR_DILATION, GRAPH_INPUT, 0), MORPH(OPERATOR_EROSION, 0, 0), MERGE(MERGE_DIFF, 1, GRAPH_INPUT)
+	} },
+};
+
+static int node_get_repeat(const GraphNode*, int);
+static int pass_reads(const GraphPass*, int);
+static int passes_conflict(const GraphSchedule*, int, int);
+static int buffer_is_free(const GraphSchedule*, int, int, int);
+
+/* operator_get_graph()
+ *
+ * Returns the graph of the passes of an operator
+ */
+const OperatorGraph* operator_get_graph(MorphOperator op)
+{
+	return &operator_graphs[(op >= 0 && op < OPERATOR_END ? op : OPERATOR_EROSION)];
+}
+
+/* graph_get_elements()
+ *
+ * Fills the elements of the nodes of a graph (see GraphElement) from the one of the settings. The black pattern of
+ * a custom element is taken from the arena: returns 0 if there is no memory.
+ */
+int graph_get_elements(const OperatorGraph* graph, const StructuringElement* element, StructuringElement* elements, MorphOpArena* arena)
+{
+	int i;
+
+	elements[GRAPH_ELEMENT] = *element;
+
+	for (i = 0; i < graph->n_nodes; i++) {
+		if (graph->nodes[i].kind == GRAPH_MORPH && graph->nodes[i].element != GRAPH_ELEMENT) {
+			return element_get_patterns(element, &elements[GRAPH_WHITE], &elements[GRAPH_BLACK], arena);
+		}
+	}
+
+	return 1;
+}
+
+ChannelMode graph_node_get_channel_mode(const GraphNode* node, ChannelMode channel_mode)
+{
+	return (node->by_luminosity ? CHANNELS_LUMINOSITY : channel_mode);
+}
+
+/* graph_count_passes()
+ *
+ * The number of passes of the graph, with its iterated nodes repeated 'iterations' times
+ */
+int graph_count_passes(const OperatorGraph* graph, int iterations)
+{
+	int passes = 0, i;
+
+	for (i = 0; i < graph->n_nodes; i++) {
+		passes += node_get_repeat(&graph->nodes[i], iterations);
+	}
+
+	return passes;
+}
+
+/* graph_get_depth()
+ *
+ * The highest number of erosions and dilations, one after the other, between the input and the result of the graph
+ */
+int graph_get_depth(const OperatorGraph* graph, int iterations)
+{
+	int depth[GRAPH_MAX_NODES];
+	int i;
+
+	if (graph->n_nodes == 0) return 1;
+
+	for (i = 0; i < graph->n_nodes; i++) {
+		const GraphNode* node = &graph->nodes[i];
+
+		depth[i] = (node->a == GRAPH_INPUT ? 0 : depth[node->a]);
+		if (node->kind == GRAPH_MERGE && node->b != GRAPH_INPUT) depth[i] = MAX(depth[i], depth[node->b]);
+		if (node->kind == GRAPH_MORPH) depth[i] += node_get_repeat(node, iterations);
+	}
+
+	return depth[graph->n_nodes - 1];
+}
+
+/* graph_schedule()
+ *
+ *  - const OperatorGraph* graph: the operator, with at least one node
+ *  - int iterations, int radius: of the element of the settings (its patterns have the same radius)
+ *  - int in_place: 1 if the output of the operator is its input
+ *  - GraphSchedule* schedule: the result
+ *
+ *  Unrolls the iterated nodes of the graph and plans how it runs:
+ *  - each pass goes in the first group after the ones of its inputs: the passes of a group are independent, and the
+ *    executor runs them on the same rows at the same time;
+ *  - the output of each pass is needed until the last group that reads it: the outputs that are never needed at the
+ *    same time share a buffer, the output of the operator or a temporary image, so the operator takes the fewest
+ *    images. A merge writes its output pixel by pixel where it reads its inputs, so it can take the buffer of one of
+ *    them. The buffers are given from the last pass backwards, and the last one writes the output;
+ *  - in place, the input stays in the output until it's read for the last time, unless the last pass needs it
+ *    after that (it's copied first, see 'copy_input');
+ *  - with a selection, each pass is needed within the reach of the passes that read it.
+ */
+void graph_schedule(const OperatorGraph* graph, int iterations, int radius, int in_place, GraphSchedule* schedule)
+{
+	int last_pass[GRAPH_MAX_NODES]; // of each node
+	int order[GRAPH_MAX_PASSES];
+	int i, j, k, n = 0;
+
+	schedule->n_groups = 0;
+	schedule->input_last_use = -1;
+
+	for (i = 0; i < graph->n_nodes; i++) {
+		const GraphNode* node = &graph->nodes[i];
+
+		for (k = 0; k < node_get_repeat(node, iterations); k++, n++) {
+			GraphPass* pass = &schedule->passes[n];
+
+			pass->node = node;
+			pass->srctransf = (k == 0 ? node->srctransf : SRC_ORIGINAL);
+			pass->a = (k > 0 ? n - 1 : node->a == GRAPH_INPUT ? GRAPH_INPUT : last_pass[node->a]);
+			pass->b = (node->kind != GRAPH_MERGE || node->b == GRAPH_INPUT ? GRAPH_INPUT : last_pass[node->b]);
+			pass->last_use = -1;
+			pass->buffer = BUFFER_NONE;
+			pass->halo = 0;
+
+			pass->group = (pass->a == GRAPH_INPUT ? 0 : schedule->passes[pass->a].group + 1);
+			if (pass->b != GRAPH_INPUT) pass->group = MAX(pass->group, schedule->passes[pass->b].group + 1);
+			schedule->n_groups = MAX(schedule->n_groups, pass->group + 1);
+
+			// the inputs are needed up to this group
+			if (pass_reads(pass, GRAPH_INPUT)) schedule->input_last_use = MAX(schedule->input_last_use, pass->group);
+			if (pass->a != GRAPH_INPUT) schedule->passes[pass->a].last_use = MAX(schedule->passes[pass->a].last_use, pass->group);
+			if (pass->b != GRAPH_INPUT) schedule->passes[pass->b].last_use = MAX(schedule->passes[pass->b].last_use, pass->group);
+		}
+		last_pass[i] = n - 1;
+	}
+	schedule->n_passes = n;
+	schedule->passes[n - 1].last_use = schedule->n_groups;
+
+	// the passes after each one are in its reach
+	for (i = n - 1; i >= 0; i--) {
+		const GraphPass* pass = &schedule->passes[i];
+		int reach = pass->halo + (pass->node->kind == GRAPH_MORPH ? radius : 0);
+
+		if (pass->a != GRAPH_INPUT) schedule->passes[pass->a].halo = MAX(schedule->passes[pass->a].halo, reach);
+		if (pass->b != GRAPH_INPUT) schedule->passes[pass->b].halo = MAX(schedule->passes[pass->b].halo, reach);
+	}
+
+	// the buffers, from the output needed the latest: the last pass, that writes the output of the operator
+	for (i = 0; i < n; i++) {
+		for (j = i; j > 0 && schedule->passes[order[j - 1]].last_use < schedule->passes[i].last_use; j--) order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	schedule->copy_input = (in_place && passes_conflict(schedule, GRAPH_INPUT, n - 1));
+	schedule->n_buffers = 0;
+
+	for (i = 0; i < n; i++) {
+		GraphPass* pass = &schedule->passes[order[i]];
+		int buffer = GRAPH_OUTPUT;
+
+		if (order[i] != n - 1) {
+			while (!buffer_is_free(schedule, buffer, order[i], in_place && !schedule->copy_input)) buffer++;
+		}
+
+		pass->buffer = buffer;
+		schedule->n_buffers = MAX(schedule->n_buffers, buffer + 1);
+	}
+}
+
+/* node_get_repeat()
+ *
+ * How many passes a node is unrolled to
+ */
+static int node_get_repeat(const GraphNode* node, int iterations)
+{
+	return (node->kind == GRAPH_MORPH && node->iterated ? iterations : 1);
+}
+
+/* pass_reads()
+ *
+ * Returns 1 if a pass reads the output of the pass 'value', or the input of the operator (GRAPH_INPUT)
+ */
+static int pass_reads(const GraphPass* pass, int value)
+{
+	return (pass->a == value || (pass->node->kind == GRAPH_MERGE && pass->b == value));
+}
+
+/* passes_conflict()
+ *
+ * Returns 1 if the outputs of two passes (or the input of the operator, GRAPH_INPUT) are needed at the same time,
+ * so they can't share a buffer. The output of a pass can take the place of an input it reads for the last time only
+ * if it's a merge, and no other pass of its group reads that input.
+ */
+static int passes_conflict(const GraphSchedule* schedule, int u, int v)
+{
+	int u_group = (u == GRAPH_INPUT ? -1 : schedule->passes[u].group);
+	int u_last_use = (u == GRAPH_INPUT ? schedule->input_last_use : schedule->passes[u].last_use);
+	const GraphPass* writer;
+	int i;
+
+	// 'u' is the one written first
+	if (v == GRAPH_INPUT || (u != GRAPH_INPUT && schedule->passes[v].group < u_group)) return passes_conflict(schedule, v, u);
+
+	writer = &schedule->passes[v];
+	if (u_group == writer->group || u_last_use > writer->group) return 1;
+	if (u_last_use < writer->group) return 0;
+
+	if (writer->node->kind != GRAPH_MERGE || !pass_reads(writer, u)) return 1;
+
+	for (i = 0; i < schedule->n_passes; i++) {
+		if (i != v && schedule->passes[i].group == writer->group && pass_reads(&schedule->passes[i], u)) return 1;
+	}
+
+	return 0;
+}
+
+/* buffer_is_free()
+ *
+ * Returns 1 if the output of the pass 'p' can go to the buffer: it doesn't conflict with the outputs already there,
+ * nor with the input of the operator, if it's kept in the output ('input_in_output')
+ */
+static int buffer_is_free(const GraphSchedule* schedule, int buffer, int p, int input_in_output)
+{
+	int i;
+
+	if (buffer == GRAPH_OUTPUT && input_in_output && passes_conflict(schedule, GRAPH_INPUT, p)) return 0;
+
+	for (i = 0; i < schedule->n_passes; i++) {
+		if (schedule->passes[i].buffer == buffer && passes_conflict(schedule, i, p)) return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,688 @@
+/*
+ * Row kernels for one sample type. This file is included by morphop-kernels.c once per 
+ * type, with these macros defined:
+ *  - SAMPLE: the C type of a sample
+ *  - SAMPLE_MAX: the value of white
+ *  - SAMPLE_THRESHOLD: the threshold used by SRC_THRESHOLD (127 for 8-bit samples)
+ *  - SAMPLE_IS_INTEGER: 1 if no value can go beyond 0 and SAMPLE_MAX
+ *  - SAMPLE_SUM: the type that holds a sample plus or minus the height of a cell of a non-flat element
+ *  - SAMPLE_FROM_LEVEL(w): the height of 'w' 8-bit levels, as a SAMPLE_SUM
+ *  - KERNEL(name): the name of the function for this type
+ */
+
+// the integer samples are kept between black and white, the float ones can go beyond them
+#if SAMPLE_IS_INTEGER
+	#define SATURATE(v) ((SAMPLE)((v) < 0 ? 0 : ((v) > SAMPLE_MAX ? SAMPLE_MAX : (v))))
+#else
+	#define SATURATE(v) ((SAMPLE)(v))
+#endif
+
+// the values that the lowest (highest) of some samples never takes: they stand for the pixels outside of the row,
+// see apply_runs(). The float samples can go beyond black and white
+#if SAMPLE_IS_INTEGER
+	#define SAMPLE_LOWEST 0
+	#define SAMPLE_HIGHEST SAMPLE_MAX
+#else
+	#define SAMPLE_LOWEST (-INFINITY)
+	#define SAMPLE_HIGHEST INFINITY
+#endif
+
+// 1 if the luminosity 'a' beats 'b': lower for the erosion, higher for the dilation
+#define BETTER(a, b) (erosion ? (a) < (b) : (a) > (b))
+
+// the whole-row loops of apply_cell() run 'statement' for each sample l of 'in' and 'out': in blocks of 64 bytes,
+// whose length the compiler knows, then one at a time for the rest. 'in' and 'out' move to each block
+#define BLOCK_SAMPLES ((int)(64 / sizeof(SAMPLE)))
+#define FOR_BLOCKS(count, statement) \
+	for (j = 0; j + BLOCK_SAMPLES <= (count); j += BLOCK_SAMPLES, in += BLOCK_SAMPLES, out += BLOCK_SAMPLES) { \
+		for (l = 0; l < BLOCK_SAMPLES; l++) statement; \
+	} \
+	for (l = 0; l < (count) - j; l++) statement
+
+// the samples [0, n) of 'block' = 'a' <op> 'b', see merge_samples()
+#define MERGE_SAMPLES(op, n) \
+	switch (op) { \
+		case MERGE_DIFF: for (l = 0; l < (n); l++) block[l] = (a[l] > b[l] ? a[l] - b[l] : b[l] - a[l]); break; \
+		case MERGE_UNION: for (l = 0; l < (n); l++) block[l] = (a[l] > SAMPLE_MAX - b[l] ? SAMPLE_MAX : a[l] + b[l]); break; \
+		default: for (l = 0; l < (n); l++) block[l] = (a[l] != b[l] ? 0 : a[l]); break; \
+	}
+
+/* transform_pixel()
+ * 
+ * Copies the pixel 'in' to 'pixel' as the luminosity kernels see it, after the source transformation,
+ * and returns its luminosity
+ */
+static SAMPLE KERNEL(transform_pixel) (PixelFormat format, SourceTansformation srctransf, const SAMPLE* in, SAMPLE* pixel)
+{
+	SAMPLE lum;
+	int i;
+	
+	for (i = 0; i < format.channels; i++) {
+		if (srctransf == SRC_INVERSE) pixel[i] = SAMPLE_MAX - in[i];
+		else pixel[i] = in[i];
+	}
+	
+	if (format.is_rgb) {
+		lum = (SAMPLE)(pixel[0] * 0.2126 + pixel[1] * 0.7152 + pixel[2] * 0.0722);
+		if (srctransf == SRC_THRESHOLD) {
+			lum = (lum < SAMPLE_THRESHOLD ? 0 : SAMPLE_MAX);
+			pixel[0] = pixel[1] = pixel[2] = lum;
+		}
+	}
+	else {
+		lum = pixel[0];
+		if (srctransf == SRC_THRESHOLD) {
+			lum = (lum < SAMPLE_THRESHOLD ? 0 : SAMPLE_MAX);
+			pixel[0] = lum;
+		}
+	}
+	
+	return lum;
+}
+
+/* morph_row()
+ * 
+ * Computes one row of the erosion/dilation of do_morph_operation(): every output pixel is the one with
+ * the lowest (erosion) or highest (dilation) luminosity among the neighbors selected by the element
+ * (CHANNELS_LUMINOSITY, see morph_row_channels() for the other modes). The first one found, scanning the
+ * element by rows and then by columns, wins over the ones with the same luminosity.
+ * 'window' points to the element->size input rows centered on the output row.
+ * The luminosity of an input row is computed once for all the runs on it, and each run is applied to the whole
+ * row: the best of its pixels is found by scanning them or, for a run of at least element->double_min cells (see
+ * morph_plan()), from a table of the best of each k consecutive pixels (built by doubling k), where two lookups cover the run.
+ */
+static void KERNEL(morph_row) (
+	MorphOperator op, 
+	PixelFormat format, 
+	const ScaledElement* element, 
+	SourceTansformation srctransf,
+	unsigned char** window, 
+	unsigned char* out_row,
+	int width,
+	void* scratch
+) {
+	const int channels = format.channels;
+	const int erosion = (op == OPERATOR_EROSION);
+	const MorphOpRun* runs = element_get_runs(element);
+	const SAMPLE* center = (const SAMPLE*)window[element->center];
+	SAMPLE* out = (SAMPLE*)out_row;
+	// the scratch memory: the best neighbor found so far for each pixel, the two tables of the doubling (they take turns),
+	// the luminosity of the best neighbors and the one of the pixels of the current input row
+	const SAMPLE** best = scratch;
+	int* tables[2] = { (int*)(best + width), (int*)(best + width) + width };
+	SAMPLE* best_lum = (SAMPLE*)(tables[1] + width);
+	SAMPLE* lum = best_lum + width;
+	const SAMPLE* row = NULL; // the row of 'lum'
+	SAMPLE pixel[4];
+	int x, i, r, k, n;
+	
+	for (x = 0; x < width; x++) best[x] = NULL;
+	
+	for (r = 0; r < element->n_runs; r++) {
+		const SAMPLE* run_row = (const SAMPLE*)window[runs[r].dy + element->center];
+		const int dx0 = runs[r].dx0, dx1 = runs[r].dx1;
+		const int* table = NULL; // the best of the k pixels from each one, if the run is long
+		
+		if (run_row == NULL) continue;
+		
+		if (run_row != row) {
+			row = run_row;
+			for (x = 0; x < width; x++) lum[x] = KERNEL(transform_pixel)(format, srctransf, row + x * channels, pixel);
+		}
+		
+		k = 1;
+		if (dx1 - dx0 >= element->double_min) {
+			int* to = tables[0];
+			
+			for (x = 0; x + 1 < width; x++) to[x] = (BETTER(lum[x + 1], lum[x]) ? x + 1 : x);
+			for (k = 2, n = 1; 2 * k <= dx1 - dx0; k *= 2, n ^= 1) {
+				const int* from = to;
+				
+				to = tables[n];
+				for (x = 0; x + 2 * k <= width; x++) to[x] = (BETTER(lum[from[x + k]], lum[from[x]]) ? from[x + k] : from[x]);
+			}
+			table = to;
+		}
+		
+		for (x = 0; x < width; x++) {
+			// the pixels of the run that are in the row
+			int lo = (x + dx0 > 0 ? x + dx0 : 0), hi = (x + dx1 < width ? x + dx1 : width);
+			int found;
+			
+			if (lo >= hi) continue;
+			
+			if (table != NULL && hi - lo >= k) {
+				// the two windows of k pixels overlap, the left one wins the ties
+				int a = table[lo], b = table[hi - k];
+				found = (BETTER(lum[b], lum[a]) ? b : a);
+			}
+			else {
+				for (found = lo, i = lo + 1; i < hi; i++) {
+					if (BETTER(lum[i], lum[found])) found = i;
+				}
+			}
+			
+			if (best[x] == NULL || BETTER(lum[found], best_lum[x])) {
+				best[x] = row + found * channels;
+				best_lum[x] = lum[found];
+			}
+		}
+	}
+	
+	for (x = 0; x < width; x++) {
+		if (best[x] == NULL) {
+			// a valid pixel was not found (e.g. the scaled element is totally black): the pixel doesn't change
+			for (i = 0; i < channels; i++) {
+				out[x * channels + i] = center[x * channels + i];
+			}
+		}
+		else {
+			KERNEL(transform_pixel)(format, srctransf, best[x], out + x * channels);
+		}
+	}
+}
+
+/* morph_row_weighted()
+ * 
+ * morph_row() for a non-flat element: every neighbor is first raised (dilation) or lowered (erosion) by the height
+ * of its cell, saturating to black and white, then the one with the highest (lowest) luminosity is taken, as in
+ * morph_row(). The heights don't change the alpha channel. The rows of 'window' outside of the image are NULL:
+ * their neighbors are skipped, like the ones outside of the row.
+ * Only the 7x7 matrix has heights, so the element is small: each pixel visits its cells one at a time.
+ */
+static void KERNEL(morph_row_weighted) (
+	MorphOperator op, 
+	PixelFormat format, 
+	const ScaledElement* element, 
+	unsigned char** window, 
+	unsigned char* out_row,
+	int width
+) {
+	const int channels = format.channels;
+	const int color_channels = channels - (format.has_alpha ? 1 : 0);
+	const MorphOpRun* runs = element_get_runs(element);
+	const SAMPLE* center = (const SAMPLE*)window[element->center];
+	SAMPLE* out = (SAMPLE*)out_row;
+	int x, i, r;
+	
+	for (x = 0; x < width; x++) {
+		SAMPLE this_pixel[4], best_pixel[4];
+		SAMPLE this_lum, best_lum = 0;
+		int found = 0;
+		
+		for (r = 0; r < element->n_runs; r++) {
+			const SAMPLE* row = (const SAMPLE*)window[runs[r].dy + element->center];
+			const SAMPLE_SUM offset = (op == OPERATOR_EROSION ? -SAMPLE_FROM_LEVEL(element->own_weights[r]) : SAMPLE_FROM_LEVEL(element->own_weights[r]));
+			int neigh_x = (x + runs[r].dx0 > 0 ? x + runs[r].dx0 : 0);
+			const int end = (x + runs[r].dx1 < width ? x + runs[r].dx1 : width);
+			
+			if (row == NULL) continue;
+			
+			for (; neigh_x < end; neigh_x++) {
+				const SAMPLE* pixel = row + neigh_x * channels;
+				
+				for (i = 0; i < channels; i++) {
+					if (i < color_channels) {
+						SAMPLE_SUM value = pixel[i] + offset;
+						this_pixel[i] = SATURATE(value);
+					}
+					else this_pixel[i] = pixel[i];
+				}
+				
+				if (format.is_rgb) this_lum = (SAMPLE)(this_pixel[0] * 0.2126 + this_pixel[1] * 0.7152 + this_pixel[2] * 0.0722);
+				else this_lum = this_pixel[0];
+				
+				if (
+					!found ||
+					(op == OPERATOR_EROSION && this_lum < best_lum) ||
+					(op == OPERATOR_DILATION && this_lum > best_lum)
+				) {
+					for (i = 0; i < channels; i++) {
+						best_pixel[i] = this_pixel[i];
+					}
+					best_lum = this_lum;
+					found = 1;
+				}
+			}
+		}
+		
+		// no neighbor at all: the pixel doesn't change, as in morph_row()
+		for (i = 0; i < channels; i++) {
+			out[x * channels + i] = (found ? best_pixel[i] : center[x * channels + i]);
+		}
+	}
+}
+
+/* apply_cell()
+ * 
+ * The whole-row loop of morph_row_channels() for one cell of the element: each sample of 'out' becomes the lowest
+ * (erosion) or highest (dilation) of itself and of the sample of 'in', lowered or raised by the height of the cell,
+ * or just that one for the first cell. 'in' is never 'out' (the output row is not in the window): with 'restrict'
+ * the compiler knows it without checking it while running, and the blocks of FOR_BLOCKS have a length it knows too,
+ * so even at -O2, where it only vectorizes the loops it can do with no scalar remainder, they become packed instructions.
+ */
+static void KERNEL(apply_cell) (int erosion, int weighted, int first, const SAMPLE* restrict in, SAMPLE* restrict out, SAMPLE_SUM offset, int count)
+{
+	int j, l;
+	
+	if (!weighted) {
+		if (first) {
+			FOR_BLOCKS(count, out[l] = in[l]);
+		}
+		else if (erosion) {
+			FOR_BLOCKS(count, out[l] = (in[l] < out[l] ? in[l] : out[l]));
+		}
+		else {
+			FOR_BLOCKS(count, out[l] = (in[l] > out[l] ? in[l] : out[l]));
+		}
+	}
+	else {
+		// the alpha is raised or lowered too, morph_row_channels() fixes it
+		if (first) {
+			FOR_BLOCKS(count, {
+				SAMPLE_SUM value = in[l] + offset;
+				out[l] = SATURATE(value);
+			});
+		}
+		else if (erosion) {
+			FOR_BLOCKS(count, {
+				SAMPLE_SUM value = in[l] + offset;
+				SAMPLE sample = SATURATE(value);
+				out[l] = (sample < out[l] ? sample : out[l]);
+			});
+		}
+		else {
+			FOR_BLOCKS(count, {
+				SAMPLE_SUM value = in[l] + offset;
+				SAMPLE sample = SATURATE(value);
+				out[l] = (sample > out[l] ? sample : out[l]);
+			});
+		}
+	}
+}
+
+/* double_cells()
+ * 
+ * A pass of the doubling of apply_runs(): each sample of 'out' becomes the lowest (erosion) or highest (dilation)
+ * of the same sample of 'in' and of the one 'shift' samples after it, in blocks as in apply_cell()
+ */
+static void KERNEL(double_cells) (int erosion, const SAMPLE* restrict in, int shift, SAMPLE* restrict out, int count)
+{
+	int j, l;
+	
+	if (erosion) {
+		FOR_BLOCKS(count, out[l] = (in[l + shift] < in[l] ? in[l + shift] : in[l]));
+	}
+	else {
+		FOR_BLOCKS(count, out[l] = (in[l + shift] > in[l] ? in[l + shift] : in[l]));
+	}
+}
+
+/* apply_runs()
+ * 
+ * Applies the runs of the element to the pixels [x0, x1) of the output row, with the whole-row loops of apply_cell():
+ * a cell at a time or, for a run of at least element->double_min cells, on the lowest (highest) of each k consecutive
+ * pixels, built by doubling k: the rows of the k pixels from both ends of the run cover it. A flat run repeated on the
+ * rows below it can be applied once for the whole stack (see run_get_stack()), to the lowest (highest) of its rows. All the neighbors of the pixels must be in the row, unless it's 'padded':
+ * then each input row is first copied to the scratch memory with 'radius' pixels on both sides, and the ones outside
+ * of the image take a value that the erosion (dilation) never picks (not for a non-flat element).
+ * Returns 0 if all the rows of the runs are NULL: then the output is not written.
+ */
+static int KERNEL(apply_runs) (
+	int erosion,
+	PixelFormat format,
+	const ScaledElement* element,
+	unsigned char** window,
+	int padded,
+	int x0, int x1, int width,
+	SAMPLE* out,
+	SAMPLE* scratch
+) {
+	const int channels = format.channels;
+	const int radius = element->radius;
+	const int count = (x1 - x0) * channels; // the samples written
+	const size_t buffer = (size_t)(x1 - x0 + 2 * radius) * channels; // the samples of each row of the scratch memory
+	const MorphOpRun* runs = element_get_runs(element);
+	SAMPLE* copy = scratch;
+	SAMPLE* tables[2] = { scratch + buffer, scratch + 2 * buffer };
+	SAMPLE* stack = scratch + 3 * buffer; // the lowest (highest) of the rows of a stack, padded as 'copy'
+	const unsigned char* copied = NULL; // the row in 'copy'
+	int applied = 0, plain_end = 0;
+	int r, x, i, k, n, rows;
+	
+	if (x0 >= x1) return 1;
+	
+	for (r = 0; r < element->n_runs; r += rows) {
+		const unsigned char* row = window[runs[r].dy + element->center];
+		const int length = runs[r].dx1 - runs[r].dx0;
+		const SAMPLE_SUM offset = (!element->weighted ? 0 : (erosion ? -SAMPLE_FROM_LEVEL(element->own_weights[r]) : SAMPLE_FROM_LEVEL(element->own_weights[r])));
+		const SAMPLE* in; // the neighbor of the pixel x0 at the start of the run
+		
+		rows = run_get_stack(element, r, &plain_end);
+		
+		if (rows > 1) {
+			// the columns of the neighbors of [x0, x1) in the stack, and the ones of them in the image
+			const int c0 = x0 + runs[r].dx0, c1 = x1 + runs[r].dx1 - 1;
+			const int lo = (c0 > 0 ? c0 : 0), hi = (c1 < width ? c1 : width);
+			
+			for (i = 0; i < rows; i++) {
+				const unsigned char* stack_row = window[runs[r + i].dy + element->center];
+				
+				if (lo < hi) KERNEL(apply_cell)(erosion, 0, i == 0, (const SAMPLE*)stack_row + lo * channels, stack + (lo - x0 + radius) * channels, 0, (hi - lo) * channels);
+			}
+			for (x = c0; x < c1; x++) {
+				if (x >= lo && x < hi) continue;
+				for (i = 0; i < channels; i++) stack[(x - x0 + radius) * channels + i] = (erosion ? SAMPLE_HIGHEST : SAMPLE_LOWEST);
+			}
+			in = stack + (radius + runs[r].dx0) * channels;
+		}
+		else if (row == NULL) continue;
+		else if (padded) {
+			if (row != copied) {
+				const SAMPLE* samples = (const SAMPLE*)row;
+				
+				for (x = x0 - radius; x < x1 + radius; x++) {
+					for (i = 0; i < channels; i++) {
+						copy[(x - x0 + radius) * channels + i] = (x >= 0 && x < width ? samples[x * channels + i] : (erosion ? SAMPLE_HIGHEST : SAMPLE_LOWEST));
+					}
+				}
+				copied = row;
+			}
+			in = copy + (radius + runs[r].dx0) * channels;
+		}
+		else in = (const SAMPLE*)row + (x0 + runs[r].dx0) * channels;
+		
+		if (length >= element->double_min) {
+			const SAMPLE* table = in;
+			
+			for (k = 1, n = 0; 2 * k <= length; k *= 2, n ^= 1) {
+				KERNEL(double_cells)(erosion, table, k * channels, tables[n], count + (length - 2 * k) * channels);
+				table = tables[n];
+			}
+			
+			KERNEL(apply_cell)(erosion, element->weighted, !applied, table, out + x0 * channels, offset, count);
+			KERNEL(apply_cell)(erosion, element->weighted, 0, table + (length - k) * channels, out + x0 * channels, offset, count);
+		}
+		else {
+			for (i = 0; i < length; i++) {
+				KERNEL(apply_cell)(erosion, element->weighted, !applied && i == 0, in + i * channels, out + x0 * channels, offset, count);
+			}
+		}
+		
+		applied = 1;
+	}
+	
+	return applied;
+}
+
+/* morph_row_channels()
+ * 
+ * morph_row() for the channel modes CHANNELS_COLOR and CHANNELS_ALL, and for gray images with no alpha (where
+ * there is only one channel to compare): each channel of the output is the lowest (erosion) or highest (dilation)
+ * of the same channel of the neighbors, lowered or raised by the height of their cell for a non-flat element
+ * (not the alpha, as in morph_row_weighted()). With CHANNELS_COLOR the alpha is the one of the center pixel.
+ * The rows of 'window' outside of the image can be NULL (only for a non-flat element), and their neighbors are skipped.
+ * The samples of a pixel don't need to be kept together: the interleaved row is already a contiguous array of
+ * samples, and each run is applied to all of them at once by apply_runs(), with packed (saturating, for the non-flat
+ * elements) min/max instructions. Near the ends of the row, where some neighbors are outside of it, a flat element
+ * works on a padded copy of the rows, a non-flat one goes one pixel at a time.
+ */
+static void KERNEL(morph_row_channels) (
+	MorphOperator op, 
+	PixelFormat format, 
+	const ScaledElement* element, 
+	ChannelMode channel_mode,
+	unsigned char** window, 
+	unsigned char* out_row,
+	int width,
+	void* scratch
+) {
+	const int channels = format.channels;
+	const int color_channels = channels - (format.has_alpha ? 1 : 0);
+	const int erosion = (op == OPERATOR_EROSION);
+	const MorphOpRun* runs = element_get_runs(element);
+	const SAMPLE* center = (const SAMPLE*)window[element->center];
+	SAMPLE* out = (SAMPLE*)out_row;
+	const int x_start = (element->radius < width ? element->radius : width); // the pixels whose neighbors are all in the row
+	const int x_end = (width - element->radius > x_start ? width - element->radius : x_start);
+	int x, i, r, s, neigh_x;
+	
+	if (!KERNEL(apply_runs)(erosion, format, element, window, 0, x_start, x_end, width, out, scratch)) {
+		memcpy(out + x_start * channels, center + x_start * channels, (x_end - x_start) * channels * sizeof(SAMPLE));
+	}
+	
+	for (s = 0; s < 2; s++) {
+		const int x0 = (s == 0 ? 0 : x_end), x1 = (s == 0 ? x_start : width);
+		
+		if (!element->weighted) {
+			KERNEL(apply_runs)(erosion, format, element, window, 1, x0, x1, width, out, scratch);
+			
+			// a pixel with no neighbor in the row got the padding: it doesn't change
+			for (x = x0; x < x1; x++) {
+				for (r = 0; r < element->n_runs; r++) {
+					if (window[runs[r].dy + element->center] != NULL && x + runs[r].dx1 > 0 && x + runs[r].dx0 < width) break;
+				}
+				if (r == element->n_runs) memcpy(out + x * channels, center + x * channels, channels * sizeof(SAMPLE));
+			}
+			continue;
+		}
+		
+		for (x = x0; x < x1; x++) {
+			for (i = 0; i < channels; i++) {
+				SAMPLE best = center[x * channels + i]; // if there is no neighbor, the sample doesn't change
+				int found = 0;
+				
+				if (i >= color_channels && channel_mode != CHANNELS_ALL) {
+					out[x * channels + i] = best;
+					continue;
+				}
+				
+				for (r = 0; r < element->n_runs; r++) {
+					const SAMPLE* row = (const SAMPLE*)window[runs[r].dy + element->center];
+					const SAMPLE_SUM offset = (i >= color_channels ? 0 : (erosion ? -SAMPLE_FROM_LEVEL(element->own_weights[r]) : SAMPLE_FROM_LEVEL(element->own_weights[r])));
+					const int end = (x + runs[r].dx1 < width ? x + runs[r].dx1 : width);
+					
+					if (row == NULL) continue;
+					
+					for (neigh_x = (x + runs[r].dx0 > 0 ? x + runs[r].dx0 : 0); neigh_x < end; neigh_x++) {
+						SAMPLE_SUM value = row[neigh_x * channels + i] + offset;
+						SAMPLE sample = SATURATE(value);
+						
+						if (!found || (erosion ? sample < best : sample > best)) best = sample;
+						found = 1;
+					}
+				}
+				
+				out[x * channels + i] = best;
+			}
+		}
+	}
+	
+	if (format.has_alpha && channel_mode != CHANNELS_ALL) {
+		for (x = 0; x < width; x++) out[x * channels + color_channels] = center[x * channels + color_channels];
+	}
+	else if (format.has_alpha && element->weighted) {
+		// the alpha of the neighbors, with no height (the pixels near the ends already have it)
+		for (x = x_start; x < x_end; x++) {
+			SAMPLE best = 0;
+			int found = 0;
+			
+			for (r = 0; r < element->n_runs; r++) {
+				const SAMPLE* row = (const SAMPLE*)window[runs[r].dy + element->center];
+				
+				if (row == NULL) continue;
+				
+				for (neigh_x = x + runs[r].dx0; neigh_x < x + runs[r].dx1; neigh_x++) {
+					SAMPLE sample = row[neigh_x * channels + color_channels];
+					
+					if (!found || (erosion ? sample < best : sample > best)) best = sample;
+					found = 1;
+				}
+			}
+			
+			if (found) out[x * channels + color_channels] = best;
+		}
+	}
+}
+
+/* merge_samples()
+ * 
+ * merge_row() with no preprocessing on 'a': each sample depends only on the same sample of 'a' and 'b', so the
+ * row is done as in apply_cell(), a block of samples at a time. 'out' can be 'a' or 'b': each block is computed
+ * in 'block', where the alpha samples are copied back from 'a', and then stored.
+ */
+static void KERNEL(merge_samples) (MergeOperation op, PixelFormat format, const SAMPLE* a, const SAMPLE* b, SAMPLE* out, int count)
+{
+	const int channels = format.channels;
+	SAMPLE block[BLOCK_SAMPLES];
+	int j, l, n;
+	
+	for (j = 0; j < count; j += n, a += n, b += n, out += n) {
+		n = (count - j < BLOCK_SAMPLES ? count - j : BLOCK_SAMPLES);
+		
+		if (n == BLOCK_SAMPLES) {
+			MERGE_SAMPLES(op, BLOCK_SAMPLES);
+		}
+		else {
+			MERGE_SAMPLES(op, n);
+		}
+		
+		if (format.has_alpha) {
+			for (l = channels - 1 - j % channels; l < n; l += channels) block[l] = a[l];
+		}
+		
+		memcpy(out, block, n * sizeof(SAMPLE));
+	}
+}
+
+/* merge_row()
+ * 
+ * Computes one row of do_merge_operation(), out = a <op> b. The alpha channel is copied from 'a'.
+ * 'out' can be the same buffer as 'a' or 'b'.
+ */
+static void KERNEL(merge_row) (
+	MergeOperation op, 
+	PixelFormat format, 
+	SourceTansformation srctransf,
+	const unsigned char* a_row, 
+	const unsigned char* b_row, 
+	unsigned char* out_row,
+	int width
+) {
+	const int channels = format.channels;
+	const int color_channels = channels - (format.has_alpha ? 1 : 0);
+	const SAMPLE* a = (const SAMPLE*)a_row;
+	const SAMPLE* b = (const SAMPLE*)b_row;
+	SAMPLE* out = (SAMPLE*)out_row;
+	SAMPLE this_a[4];
+	int x, i;
+	
+	if (srctransf == SRC_ORIGINAL) {
+		KERNEL(merge_samples)(op, format, a, b, out, width * channels);
+		return;
+	}
+	
+	for (x = 0; x < width; x++) {
+		
+		for (i = 0; i < channels; i++) {
+			this_a[i] = a[x * channels + i];
+		}
+		
+		// preprocessing on a
+		if (srctransf == SRC_THRESHOLD) {
+			if (format.is_rgb) {
+				SAMPLE this_lum = (SAMPLE)(this_a[0] * 0.2126 + this_a[1] * 0.7152 + this_a[2] * 0.0722);
+				this_a[0] = this_a[1] = this_a[2] = (this_lum < SAMPLE_THRESHOLD ? 0 : SAMPLE_MAX);
+			}
+			else {
+				for (i = 0; i < color_channels; i++) {
+					this_a[i] = this_a[i] < SAMPLE_THRESHOLD ? 0 : SAMPLE_MAX;
+				}
+			}
+		}
+		
+		// merge here, skipping alpha channel if present
+		for (i = 0; i < color_channels; i++) {
+			SAMPLE this_b = b[x * channels + i];
+			
+			if (op == MERGE_DIFF) {
+				this_a[i] = (this_a[i] > this_b ? this_a[i] - this_b : this_b - this_a[i]);
+			}
+			else if (op == MERGE_UNION) {
+				this_a[i] = (this_a[i] > SAMPLE_MAX - this_b ? SAMPLE_MAX : this_a[i] + this_b);
+			}
+			else if (op == MERGE_INTERSEPT) {
+				if (this_a[i] != this_b) this_a[i] = 0;
+			}
+		}
+		
+		for (i = 0; i < channels; i++) {
+			out[x * channels + i] = this_a[i];
+		}
+	}
+}
+
+/* fill_black_row()
+ * 
+ * Copies 'src' to 'dst', turning all the colors to black (alpha is kept)
+ */
+static void KERNEL(fill_black_row) (PixelFormat format, const unsigned char* src_row, unsigned char* dst_row, int width)
+{
+	const int channels = format.channels;
+	const int color_channels = channels - (format.has_alpha ? 1 : 0);
+	const SAMPLE* src = (const SAMPLE*)src_row;
+	SAMPLE* dst = (SAMPLE*)dst_row;
+	int x, i;
+	
+	for (x = 0; x < width; x++) {
+		for (i = 0; i < channels; i++) {
+			dst[x * channels + i] = (i < color_channels ? 0 : src[x * channels + i]);
+		}
+	}
+}
+
+/* fill_outside_row()
+ * 
+ * Fills a row that lies outside of the image, so that it doesn't affect the operator: white for erosion, black for dilation
+ */
+static void KERNEL(fill_outside_row) (MorphOperator op, PixelFormat format, unsigned char* row_buffer, int width)
+{
+	SAMPLE* row = (SAMPLE*)row_buffer;
+	int i;
+	
+	for (i = 0; i < width * format.channels; i++) {
+		row[i] = (op == OPERATOR_EROSION ? SAMPLE_MAX : 0);
+	}
+}
+
+/* count_non_black_row()
+ * 
+ * Returns the number of pixels that are not totally black (alpha is ignored)
+ */
+static unsigned long KERNEL(count_non_black_row) (PixelFormat format, const unsigned char* row_buffer, int width)
+{
+	const int channels = format.channels;
+	const int color_channels = channels - (format.has_alpha ? 1 : 0);
+	const SAMPLE* row = (const SAMPLE*)row_buffer;
+	unsigned long count = 0;
+	int x, i;
+	
+	for (x = 0; x < width; x++) {
+		for (i = 0; i < color_channels; i++) {
+			if (row[x * channels + i] != 0) {
+				count++;
+				break;
+			}
+		}
+	}
+	
+	return count;
+}
+
+#undef SATURATE
+#undef SAMPLE_LOWEST
+#undef SAMPLE_HIGHEST
+#undef BETTER
+#undef BLOCK_SAMPLES
+#undef FOR_BLOCKS
+#undef MERGE_SAMPLES
@@ -0,0 +1,346 @@
+
+#include <string.h>
+#include <math.h>
+#include "morphop-kernels.h"
+
+#define SAMPLE unsigned char
+#define SAMPLE_MAX 255
+#define SAMPLE_THRESHOLD 127
+#define SAMPLE_IS_INTEGER 1
+#define SAMPLE_SUM int
+#define SAMPLE_FROM_LEVEL(w) (w)
+#define KERNEL(name) name ## _u8
+#include "morphop-kernels-impl.h"
+#undef SAMPLE
+#undef SAMPLE_MAX
+#undef SAMPLE_THRESHOLD
+#undef SAMPLE_IS_INTEGER
+#undef SAMPLE_SUM
+#undef SAMPLE_FROM_LEVEL
+#undef KERNEL
+
+#define SAMPLE unsigned short
+#define SAMPLE_MAX 65535
+#define SAMPLE_THRESHOLD (127 * 257)
+#define SAMPLE_IS_INTEGER 1
+#define SAMPLE_SUM int
+#define SAMPLE_FROM_LEVEL(w) ((w) * 257)
+#define KERNEL(name) name ## _u16
+#include "morphop-kernels-impl.h"
+#undef SAMPLE
+#undef SAMPLE_MAX
+#undef SAMPLE_THRESHOLD
+#undef SAMPLE_IS_INTEGER
+#undef SAMPLE_SUM
+#undef SAMPLE_FROM_LEVEL
+#undef KERNEL
+
+#define SAMPLE float
+#define SAMPLE_MAX 1.0f
+#define SAMPLE_THRESHOLD (127 / 255.0f)
+#define SAMPLE_IS_INTEGER 0
+#define SAMPLE_SUM float
+#define SAMPLE_FROM_LEVEL(w) ((float)((w) / 255.0))
+#define KERNEL(name) name ## _float
+#include "morphop-kernels-impl.h"
+#undef SAMPLE
+#undef SAMPLE_MAX
+#undef SAMPLE_THRESHOLD
+#undef SAMPLE_IS_INTEGER
+#undef SAMPLE_SUM
+#undef SAMPLE_FROM_LEVEL
+#undef KERNEL
+
+/* element_get_final_size()
+ * 
+ * Returns the side, in pixels, of the structuring element scaled to the given size
+ */
+unsigned int element_get_final_size(ElementSize size)
+{
+	switch (size) {
+		case SIZE_3x3: return 3;
+		case SIZE_5x5: return 5;
+		case SIZE_9x9: return 9;
+		case SIZE_11x11: return 11;
+		case SIZE_7x7: 
+		default: return 7;
+	}
+}
+
+/* element_scale()
+ * 
+ * Scales the 7x7 element (and its weights) to its final size (nearest neighbor) and splits it in runs, where
+ * a cell is not visited or the height changes, once for all the rows of a pass. A custom element already has its runs.
+ */
+void element_scale(const StructuringElement* element, ScaledElement* scaled)
+{
+	int i;
+	
+	scaled->shape = element->shape;
+	scaled->n_runs = 0;
+	scaled->cells = 0;
+	scaled->weighted = 0;
+	
+	if (element->shape != NULL) {
+		scaled->center = element->shape->height / 2;
+		scaled->radius = element->shape->width / 2;
+		scaled->n_runs = element->shape->n_runs;
+		
+		for (i = 0; i < scaled->n_runs; i++) {
+			scaled->cells += element->shape->runs[i].dx1 - element->shape->runs[i].dx0;
+		}
+	}
+	else {
+		unsigned int final_elem_size = element_get_final_size(element->size);
+		float scale = (float)STRELEM_DEFAULT_SIZE / final_elem_size;
+		unsigned int mask_x, mask_y;
+		
+		scaled->center = scaled->radius = final_elem_size / 2; // coordinates of the center element in the matrix
+		
+		for (mask_y = 0; mask_y < final_elem_size; mask_y++) {
+			for (mask_x = 0; mask_x < final_elem_size; mask_x++) {
+				int cell_y = (int)floor(mask_y * scale), cell_x = (int)floor(mask_x * scale);
+				int dy = mask_y - scaled->center, dx = mask_x - scaled->center;
+				signed char weight = element->weights[cell_y][cell_x];
+				
+				if (element->matrix[cell_y][cell_x] == 0) continue;
+				
+				// the cell continues the last run, if it's next to it with the same height
+				i = scaled->n_runs - 1;
+				if (i >= 0 && scaled->own_runs[i].dy == dy && scaled->own_runs[i].dx1 == dx && scaled->own_weights[i] == weight) {
+					scaled->own_runs[i].dx1++;
+				}
+				else {
+					scaled->own_runs[++i].dy = dy;
+					scaled->own_runs[i].dx0 = dx;
+					scaled->own_runs[i].dx1 = dx + 1;
+					scaled->own_weights[i] = weight;
+					scaled->n_runs++;
+				}
+				
+				scaled->cells++;
+				if (weight != 0) scaled->weighted = 1;
+			}
+		}
+	}
+	
+	scaled->size = 2 * scaled->center + 1;
+	
+	// if morph_plan() is not called: the doubling where it takes fewer passes (see run_get_cost()), and no stacks
+	scaled->double_min = 5;
+	scaled->cell_cost = scaled->doubling_cost = 1;
+	scaled->stack_cost = 0;
+}
+
+/* element_get_runs()
+ * 
+ * Returns the runs of the scaled element
+ */
+const MorphOpRun* element_get_runs(const ScaledElement* element)
+{
+	return (element->shape != NULL ? element->shape->runs : element->own_runs);
+}
+
+/* run_get_cost()
+ * 
+ * Returns the whole-row passes that a run of 'length' cells takes in the kernels: one for each cell or, if it's
+ * fewer, the passes that build the lowest (highest) of each 'k' consecutive pixels, doubling 'k' each time up to
+ * the largest power of 2 within the length, and the two passes that read it at both ends of the run.
+ * It's a rough measure of the work of the kernels, for the progress: the planner (see morph_plan()) weighs the passes
+ * of each kind with the speed of the host.
+ */
+int run_get_cost(int length)
+{
+	int passes = 2, k;
+	
+	for (k = 2; k <= length; k *= 2) passes++;
+	
+	return (passes < length ? passes : length);
+}
+
+/* element_get_cost()
+ * 
+ * Returns the whole-row passes that the kernels take for each output row (see run_get_cost())
+ */
+int element_get_cost(const ScaledElement* element)
+{
+	const MorphOpRun* runs = element_get_runs(element);
+	int i, cost = 0;
+	
+	for (i = 0; i < element->n_runs; i++) {
+		cost += run_get_cost(runs[i].dx1 - runs[i].dx0);
+	}
+	
+	return cost;
+}
+
+/* element_get_radius()
+ * 
+ * Returns how many rows or columns away from the center the cells of the element can be
+ */
+int element_get_radius(const StructuringElement* element)
+{
+	if (element->shape != NULL) {
+		return (element->shape->width > element->shape->height ? element->shape->width : element->shape->height) / 2;
+	}
+	
+	return element_get_final_size(element->size) / 2;
+}
+
+/* pixel_format_get_bpp()
+ * 
+ * Returns the bytes per pixel of the given format
+ */
+int pixel_format_get_bpp(PixelFormat format)
+{
+	switch (format.type) {
+		case SAMPLE_U16: return format.channels * sizeof(unsigned short);
+		case SAMPLE_FLOAT: return format.channels * sizeof(float);
+		case SAMPLE_U8: 
+		default: return format.channels;
+	}
+}
+
+/*
+ * The following functions just call the kernel for the sample type of the format, see morphop-kernels-impl.h
+ */
+
+/* morph_row_uses_channels()
+ *
+ * Returns 1 if morph_row() compares each channel on its own, with the whole-row loops of morph_row_channels()
+ */
+int morph_row_uses_channels(PixelFormat format, SourceTansformation srctransf, ChannelMode channel_mode)
+{
+	// gray images with no alpha give the same result in any mode
+	return (srctransf == SRC_ORIGINAL && (channel_mode != CHANNELS_LUMINOSITY || format.channels == 1));
+}
+
+/* morph_row_scratch_size()
+ *
+ * Returns the bytes of the scratch memory that morph_row() needs for a row of 'width' pixels, with the element
+ */
+size_t morph_row_scratch_size(const ScaledElement* element, PixelFormat format, int width)
+{
+	// the channel kernels copy the row and build three more with the neighbors around it (two tables of the doubling and
+	// a stack), the luminosity one has tables of the whole row
+	size_t channels = 4 * (size_t)(width + 2 * element->radius) * format.channels * sizeof(float);
+	size_t luminosity = (size_t)width * (sizeof(void*) + 2 * sizeof(int) + 2 * sizeof(float));
+
+	return (channels > luminosity ? channels : luminosity) + 2 * sizeof(void*);
+}
+
+void morph_row(MorphOperator op, PixelFormat format, const ScaledElement* element, SourceTansformation srctransf, ChannelMode channel_mode, unsigned char** window, unsigned char* out, int width, void* scratch)
+{
+	if (morph_row_uses_channels(format, srctransf, channel_mode)) {
+		switch (format.type) {
+			case SAMPLE_U8: morph_row_channels_u8(op, format, element, channel_mode, window, out, width, scratch); break;
+			case SAMPLE_U16: morph_row_channels_u16(op, format, element, channel_mode, window, out, width, scratch); break;
+			case SAMPLE_FLOAT: morph_row_channels_float(op, format, element, channel_mode, window, out, width, scratch); break;
+			default: break;
+		}
+		return;
+	}
+
+	// the non-flat elements have their own kernel (the source is never transformed for them)
+	if (element->weighted) {
+		switch (format.type) {
+			case SAMPLE_U8: morph_row_weighted_u8(op, format, element, window, out, width); break;
+			case SAMPLE_U16: morph_row_weighted_u16(op, format, element, window, out, width); break;
+			case SAMPLE_FLOAT: morph_row_weighted_float(op, format, element, window, out, width); break;
+			default: break;
+		}
+		return;
+	}
+
+	switch (format.type) {
+		case SAMPLE_U8: morph_row_u8(op, format, element, srctransf, window, out, width, scratch); break;
+		case SAMPLE_U16: morph_row_u16(op, format, element, srctransf, window, out, width, scratch); break;
+		case SAMPLE_FLOAT: morph_row_float(op, format, element, srctransf, window, out, width, scratch); break;
+		default: break;
+	}
+}
+
+void merge_row(MergeOperation op, PixelFormat format, SourceTansformation srctransf, const unsigned char* a, const unsigned char* b, unsigned char* out, int width)
+{
+	switch (format.type) {
+		case SAMPLE_U8: merge_row_u8(op, format, srctransf, a, b, out, width); break;
+		case SAMPLE_U16: merge_row_u16(op, format, srctransf, a, b, out, width); break;
+		case SAMPLE_FLOAT: merge_row_float(op, format, srctransf, a, b, out, width); break;
+		default: break;
+	}
+}
+
+void fill_black_row(PixelFormat format, const unsigned char* src, unsigned char* dst, int width)
+{
+	switch (format.type) {
+		case SAMPLE_U8: fill_black_row_u8(format, src, dst, width); break;
+		case SAMPLE_U16: fill_black_row_u16(format, src, dst, width); break;
+		case SAMPLE_FLOAT: fill_black_row_float(format, src, dst, width); break;
+		default: break;
+	}
+}
+
+void fill_outside_row(MorphOperator op, PixelFormat format, unsigned char* row, int width)
+{
+	switch (format.type) {
+		case SAMPLE_U8: fill_outside_row_u8(op, format, row, width); break;
+		case SAMPLE_U16: fill_outside_row_u16(op, format, row, width); break;
+		case SAMPLE_FLOAT: fill_outside_row_float(op, format, row, width); break;
+		default: break;
+	}
+}
+
+unsigned long count_non_black_row(PixelFormat format, const unsigned char* row, int width)
+{
+	switch (format.type) {
+		case SAMPLE_U8: return count_non_black_row_u8(format, row, width);
+		case SAMPLE_U16: return count_non_black_row_u16(format, row, width);
+		case SAMPLE_FLOAT: return count_non_black_row_float(format, row, width);
+		default: return 0;
+	}
+}
+
+/* plane_get()
+ *
+ * Copies a channel of the image to a plane of floats (width x height, with no padding). The operators that work
+ * on whole images, one channel at a time (see morphop_reconstruct()), use them: floats hold the 8 and 16-bit samples exactly
+ */
+void plane_get(const MorphOpImage* image, int channel, float* plane)
+{
+	const int channels = image->format.channels;
+	int x, y;
+
+	for (y = 0; y < image->height; y++) {
+		const unsigned char* row = image->data + (size_t)y * image->stride;
+		float* out = plane + (size_t)y * image->width;
+
+		for (x = 0; x < image->width; x++) {
+			switch (image->format.type) {
+				case SAMPLE_U8: out[x] = row[x * channels + channel]; break;
+				case SAMPLE_U16: out[x] = ((const unsigned short*)row)[x * channels + channel]; break;
+				case SAMPLE_FLOAT: out[x] = ((const float*)row)[x * channels + channel]; break;
+				default: break;
+			}
+		}
+	}
+}
+
+void plane_put(const float* plane, int channel, MorphOpImage* image)
+{
+	const int channels = image->format.channels;
+	int x, y;
+
+	for (y = 0; y < image->height; y++) {
+		unsigned char* row = image->data + (size_t)y * image->stride;
+		const float* in = plane + (size_t)y * image->width;
+
+		for (x = 0; x < image->width; x++) {
+			switch (image->format.type) {
+				case SAMPLE_U8: row[x * channels + channel] = (unsigned char)in[x]; break;
+				case SAMPLE_U16: ((unsigned short*)row)[x * channels + channel] = (unsigned short)in[x]; break;
+				case SAMPLE_FLOAT: ((float*)row)[x * channels + channel] = in[x]; break;
+				default: break;
+			}
+		}
+	}
+}
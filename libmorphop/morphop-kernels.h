@@ -0,0 +1,150 @@
+#ifndef __MORPHOP_KERNELS_H__
+#define __MORPHOP_KERNELS_H__
+
+#include "morphop-engine.h"
+
+#define STRELEM_MAX_SIZE 11
+
+// the most rows of the window of an element: 2 * center + 1 (see ScaledElement)
+#define ELEMENT_MAX_ROWS (MORPHOP_SHAPE_MAX_SIZE / 2 * 2 + 1)
+
+/*
+ * A structuring element ready for the kernels: its cells as runs of consecutive columns (see MorphOpRun),
+ * sorted by row and then by column, of a custom element or of the 7x7 matrix scaled to its final size.
+ * The kernels get the 'size' input rows centered on the output row, and the runs don't go farther than
+ * 'radius' columns from the output pixel.
+ */
+typedef struct {
+	int size; // 2 * center + 1
+	int center;
+	int radius;
+	const MorphOpShape* shape; // the runs of a custom element, NULL if they are in own_runs (see element_get_runs())
+	MorphOpRun own_runs[STRELEM_MAX_SIZE * STRELEM_MAX_SIZE];
+	signed char own_weights[STRELEM_MAX_SIZE * STRELEM_MAX_SIZE]; // the height of the cells of each run (the matrix only)
+	int n_runs;
+	int cells;
+	int weighted; // 1 if a cell has a height: morph_row() takes the rows outside of the image as NULL
+	// how the kernels apply the runs, chosen by morph_plan(): the runs at least 'double_min' cells long by doubling.
+	// A flat run repeated on the rows below is applied once for all of them if it's cheaper (see run_get_stack()),
+	// with the cost per pixel of a cell, of a doubling pass and of merging a row of the stack (0: never)
+	int double_min;
+	double cell_cost, doubling_cost, stack_cost;
+} ScaledElement;
+
+// the longest name of an engine (see MorphPlan)
+#define MORPH_ENGINE_NAME_SIZE 96
+
+/*
+ * The engine chosen by morph_plan() for a pass, besides the fields of its element
+ */
+typedef struct {
+	int summary; // 1 if the uniform blocks of the input are copied (see summarize_blocks())
+	double cost; // estimated nanoseconds per pixel, with the model of the planner
+	char engine[MORPH_ENGINE_NAME_SIZE]; // e.g. "channels: 1 stack, blocks", for the profile
+} MorphPlan;
+
+// the most nodes of the graph of an operator, and the most passes it's unrolled to (all of them iterated)
+#define GRAPH_MAX_NODES 4
+#define GRAPH_MAX_PASSES (GRAPH_MAX_NODES * MORPHOP_MAX_ITERATIONS)
+
+// a node (or a pass) that reads the input of the operator, and a pass that writes its output
+#define GRAPH_INPUT -1
+#define GRAPH_OUTPUT -1
+
+typedef enum {
+	GRAPH_MORPH = 0, // erosion or dilation
+	GRAPH_MERGE
+} GraphNodeKind;
+
+typedef enum {
+	GRAPH_ELEMENT = 0, // the element of the settings
+	GRAPH_WHITE, // the white and the black pattern of the element (see element_get_patterns())
+	GRAPH_BLACK,
+
+	GRAPH_ELEMENT_END
+} GraphElement;
+
+/*
+ * A node of the graph of an operator: an erosion or a dilation of the input or of an earlier node, repeated as many
+ * times as the iterations of the settings if 'iterated' (the source transformation is applied by the first one), or
+ * a merge of two of them
+ */
+typedef struct {
+	GraphNodeKind kind;
+	MorphOperator op;
+	GraphElement element;
+	SourceTansformation srctransf;
+	int iterated;
+	int by_luminosity; // the pixels are compared as a whole, whatever the channel mode of the settings
+	MergeOperation merge;
+	int a, b; // the inputs: GRAPH_INPUT or the index of an earlier node ('b' only for a merge)
+} GraphNode;
+
+/*
+ * An operator as a graph of passes (see operator_get_graph()), the last node gives its result. The skeletonization
+ * has no nodes: it repeats its passes until the image is black.
+ */
+typedef struct {
+	int n_nodes;
+	GraphNode nodes[GRAPH_MAX_NODES];
+} OperatorGraph;
+
+/*
+ * A node of a graph, or one of its iterations, as the executor runs it (see graph_schedule())
+ */
+typedef struct {
+	const GraphNode* node;
+	SourceTansformation srctransf;
+	int a, b; // the input passes, or GRAPH_INPUT
+	int group; // the passes of a group don't read each other: they run together, after the groups before
+	int last_use; // the last group that reads the output, the number of groups for the last pass
+	int buffer; // where the output goes: GRAPH_OUTPUT, or a temporary image
+	int halo; // with a selection, the output is needed within 'halo' pixels of it (by the passes that read it)
+} GraphPass;
+
+typedef struct {
+	GraphPass passes[GRAPH_MAX_PASSES];
+	int n_passes;
+	int n_groups;
+	int n_buffers; // the temporary images
+	int input_last_use; // the last group that reads the input, -1 if none does
+	int copy_input; // the operator runs in place, and the input must be copied before the output is written
+} GraphSchedule;
+
+const OperatorGraph* operator_get_graph(MorphOperator);
+int graph_get_elements(const OperatorGraph*, const StructuringElement*, StructuringElement*, MorphOpArena*);
+ChannelMode graph_node_get_channel_mode(const GraphNode*, ChannelMode);
+int graph_count_passes(const OperatorGraph*, int);
+int graph_get_depth(const OperatorGraph*, int);
+void graph_schedule(const OperatorGraph*, int, int, int, GraphSchedule*);
+
+unsigned int element_get_final_size(ElementSize);
+void element_scale(const StructuringElement*, ScaledElement*);
+const MorphOpRun* element_get_runs(const ScaledElement*);
+int element_get_cost(const ScaledElement*);
+int element_get_radius(const StructuringElement*);
+int element_get_patterns(const StructuringElement*, StructuringElement*, StructuringElement*, MorphOpArena*);
+int shape_is_valid(const MorphOpShape*);
+int run_get_cost(int);
+void morph_plan(ScaledElement*, const MorphOpCalibration*, PixelFormat, SourceTansformation, ChannelMode, int, MorphPlan*);
+int run_get_stack(const ScaledElement*, int, int*);
+unsigned char* summarize_blocks(MorphOpContext*, const MorphOpImage*, int, int);
+
+int morph_row_uses_channels(PixelFormat, SourceTansformation, ChannelMode);
+size_t morph_row_scratch_size(const ScaledElement*, PixelFormat, int);
+void morph_row(MorphOperator, PixelFormat, const ScaledElement*, SourceTansformation, ChannelMode, unsigned char**, unsigned char*, int, void*);
+void merge_row(MergeOperation, PixelFormat, SourceTansformation, const unsigned char*, const unsigned char*, unsigned char*, int);
+void fill_black_row(PixelFormat, const unsigned char*, unsigned char*, int);
+void fill_outside_row(MorphOperator, PixelFormat, unsigned char*, int);
+unsigned long count_non_black_row(PixelFormat, const unsigned char*, int);
+
+int temp_image_alloc(MorphOpContext*, MorphOpImage*, int, int, PixelFormat);
+void temp_image_free(MorphOpContext*, MorphOpImage*);
+
+int selection_dilate(MorphOpArena*, const MorphOpSelection*, int, int, MorphOpSelection*);
+int selection_has_columns(const MorphOpSelection*, int, int);
+
+void plane_get(const MorphOpImage*, int, float*);
+void plane_put(const float*, int, MorphOpImage*);
+
+#endif
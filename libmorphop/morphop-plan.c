@@ -0,0 +1,394 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "morphop-kernels.h"
+
+#ifndef MIN
+	#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// the longest run of an element: no run is applied by doubling if double_min is beyond it
+#define PLAN_MAX_RUN MORPHOP_SHAPE_MAX_SIZE
+
+// the micro-benchmarks of morphop_calibrate(): rows of this many pixels, computed again and again for CALIBRATION_TIME
+// (a batch of CALIBRATION_BATCH rows between two readings of the clock). The fastest of CALIBRATION_TRIALS is kept
+#define CALIBRATION_WIDTH 1024
+#define CALIBRATION_TIME (CLOCKS_PER_SEC / 1000)
+#define CALIBRATION_BATCH 16
+#define CALIBRATION_TRIALS 3
+#define CALIBRATION_SUMMARY_HEIGHT 64
+
+// the least time of a pass, in nanoseconds per sample: a measure below it is noise
+#define CALIBRATION_MIN_TIME 0.001
+
+// the default model of the planner, for the contexts with no calibration: measured on an x86-64 desktop
+static const MorphOpCalibration default_calibration = {
+	MORPHOP_CALIBRATION_VERSION,
+	{ 0.14, 0.22, 0.30 }, // cell (u8, u16, float)
+	{ 0.19, 0.28, 0.35 }, // doubling
+	{ 0.34, 0.44, 0.51 }, // stack
+	{ 15.0, 15.0, 13.0 }, // lum_row
+	{ 1.2, 1.2, 1.5 }, // lum_cell
+	{ 1.7, 1.9, 1.8 }, // lum_doubling
+	{ 0.32, 0.34, 0.38 } // summary
+};
+
+static double run_get_plan_cost(const ScaledElement*, int, int);
+static int get_log2(int);
+static void plan_append(char*, const char*, int);
+static MorphOpStatus calibrate_type(SampleType, MorphOpCalibration*);
+static void calibration_element(MorphOpShape*, MorphOpRun*, int, int, int, double, ScaledElement*);
+static double time_rows(PixelFormat, const ScaledElement*, unsigned char**, unsigned char*, void*);
+static double time_summary(const MorphOpImage*);
+
+/* morph_plan()
+ *
+ *  - ScaledElement* element: the element of the pass, whose 'double_min' and costs are set
+ *  - const MorphOpCalibration* calibration: the speed of the host, NULL for the default model
+ *  - PixelFormat format, SourceTansformation srctransf, ChannelMode channel_mode: the pass, as given to morph_row()
+ *  - int can_summarize: 1 if the pass can copy the uniform blocks of its input (see do_morph_operation())
+ *  - MorphPlan* plan: the result
+ *
+ *  Chooses how a pass of erosion or dilation runs: each run of the element is estimated applying it a cell at a time
+ *  and by doubling (with the whole-row loops of the channel kernels, or with the tables of the luminosity one), each
+ *  stack of runs merging its rows first or not (see run_get_stack()), and the cheapest way wins. The whole pass is
+ *  then worth finding the uniform blocks if it costs more than that (it takes the same time, whatever the element).
+ *  The result is always the same.
+ */
+void morph_plan(ScaledElement* element, const MorphOpCalibration* calibration, PixelFormat format, SourceTansformation srctransf, ChannelMode channel_mode, int can_summarize, MorphPlan* plan)
+{
+	const MorphOpCalibration* model = (calibration != NULL && morphop_calibration_is_valid(calibration) ? calibration : &default_calibration);
+	const SampleType type = (format.type >= 0 && format.type < SAMPLE_END ? format.type : SAMPLE_U8);
+	const int channels = morph_row_uses_channels(format, srctransf, channel_mode);
+	const MorphOpRun* runs = element_get_runs(element);
+	int by_cells = 0, by_doubling = 0, stacks = 0, plain_end = 0;
+	int length, r, rows;
+
+	// the cost of the passes, per pixel. Only the channel kernels merge stacks, of flat runs
+	element->cell_cost = (channels ? model->cell[type] * format.channels : model->lum_cell[type]);
+	element->doubling_cost = (channels ? model->doubling[type] * format.channels : model->lum_doubling[type]);
+	element->stack_cost = (channels && !element->weighted ? model->stack[type] * format.channels : 0);
+
+	// the doubling takes a pass for each power of 2 within the run, and two to read it at both ends
+	for (length = 2; length <= PLAN_MAX_RUN && run_get_plan_cost(element, length, 1) >= run_get_plan_cost(element, length, 0); length++);
+	element->double_min = length;
+
+	plan->cost = 0;
+	for (r = 0; r < element->n_runs; r += rows) {
+		length = runs[r].dx1 - runs[r].dx0;
+		rows = run_get_stack(element, r, &plain_end);
+
+		// the luminosity kernel computes the luminosity of each input row once (and the one of the output)
+		if (!channels && (r == 0 || runs[r].dy != runs[r - 1].dy)) plan->cost += model->lum_row[type];
+		if (rows > 1) {
+			plan->cost += rows * element->stack_cost;
+			stacks++;
+		}
+
+		// the non-flat kernel of the luminosity visits all the cells
+		if (length >= element->double_min && (channels || !element->weighted)) by_doubling++;
+		else by_cells++;
+		plan->cost += run_get_plan_cost(element, length, length >= element->double_min && (channels || !element->weighted));
+	}
+	if (!channels) plan->cost += model->lum_row[type];
+
+	plan->summary = (can_summarize && plan->cost > model->summary[type] * format.channels);
+
+	strcpy(plan->engine, (channels ? "channels:" : (element->weighted ? "weighted:" : "luminosity:")));
+	plan_append(plan->engine, "run%s by cells", by_cells);
+	plan_append(plan->engine, "run%s by doubling", by_doubling);
+	plan_append(plan->engine, "stack%s", stacks);
+	if (plan->summary) strcat(plan->engine, (by_cells + by_doubling > 0 ? ", blocks" : " blocks"));
+}
+
+/* run_get_stack()
+ *
+ *  - const ScaledElement* element: the element, with its plan
+ *  - int r: a run of the element
+ *  - int* plain_end: the run after the last stack found not worth merging; the caller starts it at 0 and keeps it
+ *    for all the runs of the element, so the runs of a stack are looked at once
+ *
+ *  Returns how many rows the kernels apply the run to at once: the runs after it in the list with the same columns,
+ *  each one on the row below the previous (so the only run of the rows between), are merged first if the merges and
+ *  the run cost less than the run on each row. It's 1 if they don't, or if there is no such run.
+ */
+int run_get_stack(const ScaledElement* element, int r, int* plain_end)
+{
+	const MorphOpRun* runs = element_get_runs(element);
+	const int length = runs[r].dx1 - runs[r].dx0;
+	double run;
+	int rows = 1;
+
+	if (element->stack_cost <= 0 || r < *plain_end) return 1;
+
+	while (
+		r + rows < element->n_runs &&
+		runs[r + rows].dy == runs[r].dy + rows && runs[r + rows].dx0 == runs[r].dx0 && runs[r + rows].dx1 == runs[r].dx1
+	) rows++;
+
+	run = run_get_plan_cost(element, length, length >= element->double_min);
+	if (rows * element->stack_cost + run < rows * run) return rows;
+
+	// the rest of the stack is shorter, and not worth merging either
+	*plain_end = r + rows;
+	return 1;
+}
+
+/* run_get_plan_cost()
+ *
+ * Returns the estimated cost of a run of 'length' cells, per pixel: applied a cell at a time or 'by_doubling'
+ */
+static double run_get_plan_cost(const ScaledElement* element, int length, int by_doubling)
+{
+	if (by_doubling) return get_log2(length) * element->doubling_cost + 2 * element->cell_cost;
+
+	return length * element->cell_cost;
+}
+
+/* get_log2()
+ *
+ * Returns the doubling passes of a run of 'length' cells: the largest k such that 2^k <= length
+ */
+static int get_log2(int length)
+{
+	int passes = 0;
+
+	for (; length > 1; length /= 2) passes++;
+
+	return passes;
+}
+
+/* plan_append()
+ *
+ * Appends "<count> <what>" to the name of an engine, separated by a comma from what's before it. 'what' has a "%s",
+ * for the plural. Nothing is appended if 'count' is 0.
+ */
+static void plan_append(char* engine, const char* what, int count)
+{
+	size_t used = strlen(engine);
+	char format[32];
+
+	if (count == 0) return;
+
+	snprintf(format, sizeof(format), "%s %%d %s", (engine[used - 1] == ':' ? "" : ","), what);
+	snprintf(engine + used, MORPH_ENGINE_NAME_SIZE - used, format, count, (count > 1 ? "s" : ""));
+}
+
+/* morphop_calibration_init()
+ *
+ * Sets a calibration to the default model, the one of the contexts with no calibration
+ */
+void morphop_calibration_init(MorphOpCalibration* calibration)
+{
+	*calibration = default_calibration;
+}
+
+/* morphop_calibration_is_valid()
+ *
+ * Returns 1 if the calibration has been measured by this version of the library (e.g. after loading it back)
+ */
+int morphop_calibration_is_valid(const MorphOpCalibration* calibration)
+{
+	int t;
+
+	if (calibration->version != MORPHOP_CALIBRATION_VERSION) return 0;
+
+	for (t = 0; t < SAMPLE_END; t++) {
+		// NaN fails the comparisons too
+		if (!(
+			calibration->cell[t] > 0 && calibration->doubling[t] > 0 && calibration->stack[t] > 0 &&
+			calibration->lum_row[t] > 0 && calibration->lum_cell[t] > 0 && calibration->lum_doubling[t] > 0 &&
+			calibration->summary[t] > 0
+		)) return 0;
+	}
+
+	return 1;
+}
+
+/* morphop_calibrate()
+ *
+ * Measures the speed of the kernels on this host, with short micro-benchmarks on rows of random samples (about a
+ * tenth of a second in all, on the calling thread). Returns MORPHOP_NO_MEMORY if they can't be allocated: then the
+ * calibration is the default model.
+ */
+MorphOpStatus morphop_calibrate(MorphOpCalibration* calibration)
+{
+	int t;
+
+	morphop_calibration_init(calibration);
+
+	for (t = 0; t < SAMPLE_END; t++) {
+		if (calibrate_type(t, calibration) != MORPHOP_OK) {
+			morphop_calibration_init(calibration);
+			return MORPHOP_NO_MEMORY;
+		}
+	}
+
+	return MORPHOP_OK;
+}
+
+/* calibrate_type()
+ *
+ * Measures the passes of the kernels for a sample type: a row with a run of 1 cell, then of 9 cells, gives the time
+ * of 8 cells; a run of 16 cells by doubling, 4 doubling passes and one cell more; a stack of three rows of 1 cell,
+ * 3 merges. The channel kernels run on gray rows, the luminosity one on RGB rows.
+ */
+static MorphOpStatus calibrate_type(SampleType type, MorphOpCalibration* calibration)
+{
+	const PixelFormat gray = { type, 1, 0, 0 }, rgb = { type, 3, 1, 0 };
+	const size_t row_size = (size_t)CALIBRATION_WIDTH * pixel_format_get_bpp(rgb);
+	unsigned char* rows[3];
+	unsigned char* data = malloc(4 * row_size);
+	unsigned char* out = data + 3 * row_size;
+	MorphOpShape shape;
+	MorphOpRun shape_runs[3];
+	ScaledElement element;
+	MorphOpImage uniform;
+	void* scratch = NULL;
+	double gray_one, lum_one, time;
+	unsigned int seed = 1;
+	size_t i;
+
+	if (data == NULL) return MORPHOP_NO_MEMORY;
+
+	// random samples, so that the comparisons can't be predicted
+	for (i = 0; i < 3 * CALIBRATION_WIDTH * 3; i++) {
+		seed = seed * 1103515245 + 12345;
+		switch (type) {
+			case SAMPLE_U8: data[i] = (unsigned char)(seed >> 16); break;
+			case SAMPLE_U16: ((unsigned short*)data)[i] = (unsigned short)(seed >> 8); break;
+			case SAMPLE_FLOAT: ((float*)data)[i] = (float)((seed >> 8) & 0xFFFF) / 65535; break;
+			default: break;
+		}
+	}
+	for (i = 0; i < 3; i++) rows[i] = data + i * row_size;
+
+	// the widest element measured, in the widest format, takes the most scratch memory
+	calibration_element(&shape, shape_runs, 16, 1, PLAN_MAX_RUN + 1, 0, &element);
+	scratch = malloc(morph_row_scratch_size(&element, rgb, CALIBRATION_WIDTH));
+	if (scratch == NULL || morphop_image_alloc(&uniform, CALIBRATION_WIDTH, CALIBRATION_SUMMARY_HEIGHT, gray) != MORPHOP_OK) {
+		free(scratch);
+		free(data);
+		return MORPHOP_NO_MEMORY;
+	}
+
+	calibration_element(&shape, shape_runs, 1, 1, PLAN_MAX_RUN + 1, 0, &element);
+	gray_one = time_rows(gray, &element, rows, out, scratch);
+	lum_one = time_rows(rgb, &element, rows, out, scratch);
+
+	calibration_element(&shape, shape_runs, 9, 1, PLAN_MAX_RUN + 1, 0, &element);
+	calibration->cell[type] = MAX((time_rows(gray, &element, rows, out, scratch) - gray_one) / 8, CALIBRATION_MIN_TIME);
+	calibration->lum_cell[type] = MAX((time_rows(rgb, &element, rows, out, scratch) - lum_one) / 8, CALIBRATION_MIN_TIME);
+	calibration->lum_row[type] = MAX(lum_one - calibration->lum_cell[type], CALIBRATION_MIN_TIME);
+
+	calibration_element(&shape, shape_runs, 16, 1, 2, 0, &element);
+	time = time_rows(gray, &element, rows, out, scratch);
+	calibration->doubling[type] = MAX((time - gray_one - calibration->cell[type]) / 4, CALIBRATION_MIN_TIME);
+	time = time_rows(rgb, &element, rows, out, scratch);
+	calibration->lum_doubling[type] = MAX((time - lum_one - calibration->lum_cell[type]) / 4, CALIBRATION_MIN_TIME);
+
+	calibration_element(&shape, shape_runs, 1, 3, PLAN_MAX_RUN + 1, CALIBRATION_MIN_TIME, &element);
+	calibration->stack[type] = MAX((time_rows(gray, &element, rows, out, scratch) - gray_one) / 3, CALIBRATION_MIN_TIME);
+
+	memset(uniform.data, 0, uniform.stride * uniform.height);
+	calibration->summary[type] = MAX(time_summary(&uniform), CALIBRATION_MIN_TIME);
+
+	morphop_image_free(&uniform);
+	free(scratch);
+	free(data);
+
+	return MORPHOP_OK;
+}
+
+/* calibration_element()
+ *
+ * Builds, in 'shape' and 'runs', an element of 'height' rows with a run of 'length' cells on each one, and scales it
+ * with the given 'double_min' and 'stack_cost' (instead of the ones of the planner: a tiny cost merges the stacks)
+ */
+static void calibration_element(MorphOpShape* shape, MorphOpRun* runs, int length, int height, int double_min, double stack_cost, ScaledElement* scaled)
+{
+	StructuringElement element;
+	int i;
+
+	memset(&element, 0, sizeof(StructuringElement));
+	for (i = 0; i < height; i++) {
+		runs[i].dy = i - height / 2;
+		runs[i].dx0 = -(length / 2);
+		runs[i].dx1 = length - length / 2;
+	}
+	shape->width = length;
+	shape->height = height;
+	shape->n_runs = height;
+	shape->runs = runs;
+	element.shape = shape;
+
+	element_scale(&element, scaled);
+	scaled->double_min = double_min;
+	scaled->stack_cost = stack_cost;
+}
+
+/* time_rows()
+ *
+ * Returns the time of an erosion of a row with the element, in nanoseconds per pixel: the window is the first
+ * rows of 'rows'
+ */
+static double time_rows(PixelFormat format, const ScaledElement* element, unsigned char** window, unsigned char* out, void* scratch)
+{
+	double best = -1;
+	int trial, i;
+
+	for (trial = 0; trial < CALIBRATION_TRIALS; trial++) {
+		clock_t start = clock(), elapsed;
+		double rows = 0;
+
+		do {
+			for (i = 0; i < CALIBRATION_BATCH; i++) {
+				morph_row(OPERATOR_EROSION, format, element, SRC_ORIGINAL, CHANNELS_LUMINOSITY, window, out, CALIBRATION_WIDTH, scratch);
+			}
+			rows += CALIBRATION_BATCH;
+		} while ((elapsed = clock() - start) < CALIBRATION_TIME);
+
+		double time = (double)elapsed / CLOCKS_PER_SEC * 1e9 / (rows * CALIBRATION_WIDTH);
+		if (best < 0 || time < best) best = time;
+	}
+
+	return best;
+}
+
+/* time_summary()
+ *
+ * Returns the time that summarize_blocks() takes on the image, in nanoseconds per sample
+ */
+static double time_summary(const MorphOpImage* image)
+{
+	const double samples = (double)image->width * image->height * image->format.channels;
+	MorphOpContext ctx;
+	double best = -1;
+	int trial;
+
+	morphop_context_init(&ctx);
+
+	for (trial = 0; trial < CALIBRATION_TRIALS; trial++) {
+		clock_t start = clock(), elapsed;
+		double runs = 0;
+
+		do {
+			size_t mark = arena_mark(&ctx.arena);
+			summarize_blocks(&ctx, image, 1, 0);
+			arena_release(&ctx.arena, mark);
+			runs++;
+		} while ((elapsed = clock() - start) < CALIBRATION_TIME);
+
+		double time = (double)elapsed / CLOCKS_PER_SEC * 1e9 / (runs * samples);
+		if (best < 0 || time < best) best = time;
+	}
+
+	morphop_context_free(&ctx);
+
+	return best;
+}
@@ -0,0 +1,276 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "morphop-kernels.h"
+
+#ifndef MIN
+	#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// the first size of the queue of the propagation, in pixels (it grows when needed)
+#define QUEUE_MIN_SIZE 4096
+
+// how many pixels the propagation takes from the queue between two checks of the progress function
+#define QUEUE_CHECK_INTERVAL (1 << 18)
+
+/*
+ * The FIFO queue of the pixels whose value must still be propagated to their neighbors (indexes in the plane).
+ * A pixel can be in it more than once.
+ */
+typedef struct {
+	int* items;
+	size_t capacity;
+	size_t head, count;
+} PixelQueue;
+
+static int reconstruct_plane(MorphOpContext*, float*, const float*, int, int, PixelQueue*);
+static int queue_push(PixelQueue*, int);
+static void reconstruct_progress(MorphOpContext*, double);
+static void profile_reconstruct(MorphOpContext*, int, const MorphOpImage*, size_t);
+
+/* morphop_reconstruct()
+ *
+ *  - MorphOpContext* ctx: the context, it must not be used by another operation at the same time
+ *  - MorphOperator op: OPERATOR_DILATION for the reconstruction by dilation, OPERATOR_EROSION for the one by erosion
+ *  - const MorphOpImage* marker: where the reconstruction starts from
+ *  - const MorphOpImage* mask: the limit of the reconstruction
+ *  - MorphOpImage* dst: the result. All the images must have the same size and format, and 'dst' can be one of the others.
+ *
+ *  Geodesic reconstruction: the marker is dilated (eroded) again and again, each time limited to the mask
+ *  (the darkest, or the brightest, of the two), until it doesn't change anymore. The neighbors of a pixel are
+ *  the 8 around it, the structuring element of the other operators is not used. Each color channel is
+ *  reconstructed on its own, the alpha channel is the one of the mask.
+ *  Instead of repeating the dilations, it uses the hybrid algorithm of L. Vincent ("Morphological grayscale
+ *  reconstruction in image analysis", 1993): a raster and an anti-raster sweep, that propagate the values along
+ *  the scan order, then a FIFO queue of the pixels that can still raise their neighbors. The result is the same,
+ *  in a few passes over the image instead of one for each pixel of the longest path.
+ *  Returns MORPHOP_CANCELLED if the progress function stopped it: in that case (and for any other error)
+ *  the content of 'dst' is undefined.
+ */
+MorphOpStatus morphop_reconstruct(MorphOpContext* ctx, MorphOperator op, const MorphOpImage* marker, const MorphOpImage* mask, MorphOpImage* dst)
+{
+	const int color_channels = marker->format.channels - (marker->format.has_alpha ? 1 : 0);
+	const size_t pixels = (size_t)marker->width * marker->height;
+	const float sign = (op == OPERATOR_EROSION ? -1 : 1);
+	PixelQueue queue = { NULL, 0, 0, 0 };
+	float* J, *I;
+	int c;
+	size_t p;
+
+	if (
+		(op != OPERATOR_DILATION && op != OPERATOR_EROSION) ||
+		marker->data == NULL || mask->data == NULL || dst->data == NULL ||
+		marker->width != mask->width || marker->height != mask->height ||
+		marker->width != dst->width || marker->height != dst->height ||
+		marker->width <= 0 || marker->height <= 0 || pixels > INT_MAX ||
+		memcmp(&marker->format, &mask->format, sizeof(PixelFormat)) != 0 ||
+		memcmp(&marker->format, &dst->format, sizeof(PixelFormat)) != 0
+	) return MORPHOP_INVALID;
+
+	arena_reset(&ctx->arena);
+
+	ctx->done = 0;
+	ctx->total = 3 * color_channels; // the two sweeps and the queue, for each channel
+	ctx->status = MORPHOP_OK;
+
+	profile_reconstruct(ctx, 0, marker, 0);
+
+	// a channel at a time, as floats: they hold the 8 and 16-bit samples exactly. The reconstruction by erosion
+	// is the one by dilation of the negated images
+	J = arena_alloc(&ctx->arena, pixels * sizeof(float));
+	I = arena_alloc(&ctx->arena, pixels * sizeof(float));
+	if (J == NULL || I == NULL) return MORPHOP_NO_MEMORY;
+
+	for (c = 0; c < color_channels && ctx->status == MORPHOP_OK; c++) {
+		plane_get(mask, c, I);
+		plane_get(marker, c, J);
+
+		for (p = 0; p < pixels; p++) {
+			I[p] *= sign;
+			J[p] = MIN(J[p] * sign, I[p]);
+		}
+
+		if (!reconstruct_plane(ctx, J, I, marker->width, marker->height, &queue)) break;
+
+		for (p = 0; p < pixels; p++) {
+			J[p] *= sign;
+		}
+		plane_put(J, c, dst);
+	}
+
+	// each channel is read before it's written, so 'dst' can be one of the inputs. The alpha is already there if it's the mask
+	if (marker->format.has_alpha && ctx->status == MORPHOP_OK && dst->data != mask->data) {
+		plane_get(mask, color_channels, I);
+		plane_put(I, color_channels, dst);
+	}
+
+	free(queue.items);
+
+	profile_reconstruct(ctx, 1, marker, arena_mark(&ctx->arena) + queue.capacity * sizeof(int));
+
+	return ctx->status;
+}
+
+/* reconstruct_plane()
+ *
+ * Reconstruction by dilation of the plane J under the plane I (J <= I everywhere). Returns 0 if the context
+ * has been stopped (cancelled, or no memory for the queue).
+ */
+static int reconstruct_plane(MorphOpContext* ctx, float* J, const float* I, int width, int height, PixelQueue* queue)
+{
+	static const int dx[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+	static const int dy[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+	unsigned long taken = 0;
+	int x, y, k;
+
+	// raster sweep: each pixel takes the highest of itself and of its neighbors already visited
+	// (the 4 of them above and on the left, k = 0..3), within the mask
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			int p = y * width + x;
+			float value = J[p];
+
+			for (k = 0; k < 4; k++) {
+				int nx = x + dx[k], ny = y + dy[k];
+				if (nx >= 0 && nx < width && ny >= 0) value = MAX(value, J[ny * width + nx]);
+			}
+
+			J[p] = MIN(value, I[p]);
+		}
+	}
+
+	reconstruct_progress(ctx, ctx->done + 1);
+	if (ctx->status != MORPHOP_OK) return 0;
+
+	// anti-raster sweep, with the neighbors below and on the right (k = 4..7). A pixel that could still raise
+	// one of them goes in the queue
+	queue->head = queue->count = 0;
+
+	for (y = height - 1; y >= 0; y--) {
+		for (x = width - 1; x >= 0; x--) {
+			int p = y * width + x;
+			float value = J[p];
+
+			for (k = 4; k < 8; k++) {
+				int nx = x + dx[k], ny = y + dy[k];
+				if (nx >= 0 && nx < width && ny < height) value = MAX(value, J[ny * width + nx]);
+			}
+
+			J[p] = value = MIN(value, I[p]);
+
+			for (k = 4; k < 8; k++) {
+				int nx = x + dx[k], ny = y + dy[k];
+				int q = ny * width + nx;
+
+				if (nx >= 0 && nx < width && ny < height && J[q] < value && J[q] < I[q]) {
+					if (!queue_push(queue, p)) {
+						ctx->status = MORPHOP_NO_MEMORY;
+						return 0;
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	reconstruct_progress(ctx, ctx->done + 1);
+	if (ctx->status != MORPHOP_OK) return 0;
+
+	// propagation: the values of the pixels in the queue flow to their neighbors, as long as the mask allows it
+	while (queue->count > 0) {
+		int p = queue->items[queue->head];
+
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+
+		x = p % width;
+		y = p / width;
+
+		for (k = 0; k < 8; k++) {
+			int nx = x + dx[k], ny = y + dy[k];
+			int q = ny * width + nx;
+
+			if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+
+			if (J[q] < J[p] && J[q] != I[q]) {
+				J[q] = MIN(J[p], I[q]);
+
+				if (!queue_push(queue, q)) {
+					ctx->status = MORPHOP_NO_MEMORY;
+					return 0;
+				}
+			}
+		}
+
+		// the length of the propagation is not known: just give a chance to cancel it
+		if (++taken % QUEUE_CHECK_INTERVAL == 0) {
+			reconstruct_progress(ctx, ctx->done);
+			if (ctx->status != MORPHOP_OK) return 0;
+		}
+	}
+
+	reconstruct_progress(ctx, ctx->done + 1);
+
+	return (ctx->status == MORPHOP_OK);
+}
+
+/* queue_push()
+ *
+ * Adds a pixel at the end of the queue, making it bigger if it's full. Returns 0 if there is no memory.
+ */
+static int queue_push(PixelQueue* queue, int p)
+{
+	if (queue->count == queue->capacity) {
+		size_t capacity = MAX(2 * queue->capacity, QUEUE_MIN_SIZE);
+		int* items = realloc(queue->items, capacity * sizeof(int));
+
+		if (items == NULL) return 0;
+
+		// the items before the head were after the end of the old buffer: they go after it again
+		memcpy(items + queue->capacity, items, queue->head * sizeof(int));
+
+		queue->items = items;
+		queue->capacity = capacity;
+	}
+
+	queue->items[(queue->head + queue->count) % queue->capacity] = p;
+	queue->count++;
+
+	return 1;
+}
+
+/* reconstruct_progress()
+ *
+ * Sets the phases done so far and reports them to the progress function of the context, that can cancel the reconstruction
+ */
+static void reconstruct_progress(MorphOpContext* ctx, double done)
+{
+	ctx->done = done;
+
+	if (ctx->progress != NULL && !ctx->progress(ctx->done, ctx->total, ctx->progress_data)) {
+		ctx->status = MORPHOP_CANCELLED;
+	}
+}
+
+/* profile_reconstruct()
+ *
+ * Tells the profile function of the context, if any, that the reconstruction starts or ends. It's counted as a
+ * single pass, that reads the marker and the mask and writes the result.
+ */
+static void profile_reconstruct(MorphOpContext* ctx, int end, const MorphOpImage* image, size_t bytes_allocated)
+{
+	MorphOpPassInfo info = {
+		"reconstruct", end,
+		(end ? (unsigned long)image->width * image->height : 0),
+		(end ? 2 * (unsigned long)image->height : 0),
+		(end ? (unsigned long)image->height : 0),
+		bytes_allocated,
+		NULL
+	};
+
+	if (ctx->profile != NULL) ctx->profile(&info, ctx->profile_data);
+}
@@ -0,0 +1,812 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "morphop-reference.h"
+
+// samples are handled as doubles, and brought back to the sample type after each arithmetic operation
+// (see to_sample()): this gives the same values of the typed kernels, for all the sample types
+static double get_sample(const MorphOpImage*, int, int, int);
+static void set_sample(MorphOpImage*, int, int, int, double);
+static double to_sample(SampleType, double);
+static double sample_max(SampleType);
+static double sample_threshold(SampleType);
+static double get_luminance(PixelFormat, const double*);
+
+/*
+ * The cells of an element (or of one of the patterns of hit-or-miss) as a dense mask, centered in (width / 2, height / 2)
+ */
+typedef struct {
+	int width, height;
+	unsigned char* cells;
+	signed char* weights;
+} RefMask;
+
+typedef enum {
+	REF_ELEMENT = 0, // the cells of the element, with their heights
+	REF_WHITE, // the white pattern of hit-or-miss
+	REF_BLACK // the black one
+} RefPattern;
+
+static int ref_mask_build(RefMask*, const StructuringElement*, RefPattern, int);
+static void ref_mask_free(RefMask*);
+static void ref_morph(MorphOperator, const MorphOpImage*, MorphOpImage*, const RefMask*, SourceTansformation, ChannelMode);
+static void ref_iterated_morph(MorphOperator, const MorphOpImage*, MorphOpImage*, MorphOpImage*, const RefMask*, int, ChannelMode);
+static void ref_merge(MergeOperation, const MorphOpImage*, const MorphOpImage*, MorphOpImage*, SourceTansformation);
+static void ref_fill_black(const MorphOpImage*, MorphOpImage*);
+static unsigned long ref_count_non_black(const MorphOpImage*);
+static int ref_image_alloc(MorphOpImage*, const MorphOpImage*);
+static void ref_image_copy(const MorphOpImage*, MorphOpImage*);
+static int ref_images_equal(const MorphOpImage*, const MorphOpImage*);
+
+/* morphop_reference_run()
+ *
+ * Same as morphop_run(), with no context: no progress, no parallelism, and temporary images allocated with malloc
+ */
+MorphOpStatus morphop_reference_run(const MorphOpSettings* settings, const MorphOpImage* src_image, MorphOpImage* dst)
+{
+	MorphOpImage src, temp, temp2, temp3;
+	RefMask element, B1, B2, flat;
+	unsigned long area, prev_area;
+	int iterations = morphop_settings_get_iterations(settings);
+	int first, stop;
+
+	if (
+		!morphop_settings_are_valid(settings) ||
+		src_image->width != dst->width || src_image->height != dst->height
+	) return MORPHOP_INVALID;
+
+	// always work on a copy of the source, so it can be the destination
+	if (
+		!ref_image_alloc(&src, src_image) || !ref_image_alloc(&temp, src_image) ||
+		!ref_image_alloc(&temp2, src_image) || !ref_image_alloc(&temp3, src_image)
+	) return MORPHOP_NO_MEMORY;
+
+	ref_image_copy(src_image, &src);
+
+	// the skeletonization ignores the heights of the element
+	if (
+		!ref_mask_build(&element, &settings->element, REF_ELEMENT, 1) || !ref_mask_build(&flat, &settings->element, REF_ELEMENT, 0) ||
+		!ref_mask_build(&B1, &settings->element, REF_WHITE, 0) || !ref_mask_build(&B2, &settings->element, REF_BLACK, 0)
+	) return MORPHOP_NO_MEMORY;
+
+	switch (settings->operator) {
+		case OPERATOR_EROSION:
+		case OPERATOR_DILATION:
+			ref_iterated_morph(settings->operator, &src, dst, &temp, &element, iterations, settings->channel_mode);
+			break;
+
+		case OPERATOR_OPENING:
+			ref_iterated_morph(OPERATOR_EROSION, &src, &temp, &temp2, &element, iterations, settings->channel_mode);
+			ref_iterated_morph(OPERATOR_DILATION, &temp, dst, &temp2, &element, iterations, settings->channel_mode);
+			break;
+
+		case OPERATOR_CLOSING:
+			ref_iterated_morph(OPERATOR_DILATION, &src, &temp, &temp2, &element, iterations, settings->channel_mode);
+			ref_iterated_morph(OPERATOR_EROSION, &temp, dst, &temp2, &element, iterations, settings->channel_mode);
+			break;
+
+		case OPERATOR_GRADIENT:
+			ref_morph(OPERATOR_EROSION, &src, dst, &element, SRC_ORIGINAL, settings->channel_mode);
+			ref_morph(OPERATOR_DILATION, &src, &temp, &element, SRC_ORIGINAL, settings->channel_mode);
+			ref_merge(MERGE_DIFF, dst, &temp, dst, SRC_ORIGINAL);
+			break;
+
+		case OPERATOR_BOUNDEXTR:
+			ref_morph(OPERATOR_EROSION, &src, dst, &element, SRC_ORIGINAL, settings->channel_mode);
+			ref_merge(MERGE_DIFF, &src, dst, dst, SRC_ORIGINAL);
+			break;
+
+		case OPERATOR_HITORMISS:
+		case OPERATOR_THICKENING:
+		case OPERATOR_THINNING:
+			ref_morph(OPERATOR_EROSION, &src, dst, &B1, SRC_ORIGINAL, CHANNELS_LUMINOSITY);
+			ref_morph(OPERATOR_EROSION, &src, &temp, &B2, SRC_INVERSE, CHANNELS_LUMINOSITY);
+			ref_merge(MERGE_INTERSEPT, dst, &temp, dst, SRC_ORIGINAL);
+
+			if (settings->operator == OPERATOR_THICKENING) ref_merge(MERGE_UNION, &src, dst, dst, SRC_ORIGINAL);
+			else if (settings->operator == OPERATOR_THINNING) ref_merge(MERGE_DIFF, &src, dst, dst, SRC_ORIGINAL);
+			break;
+
+		case OPERATOR_SKELETON:
+			// temp: the image to erode, temp2: its erosion, temp3: opening and difference
+			ref_fill_black(&src, dst);
+			ref_image_copy(&src, &temp);
+
+			// it ends when the eroded image is black, or when the erosion doesn't remove pixels anymore
+			// (the first erosion must not change the image at all, since it also thresholds it)
+			area = ref_count_non_black(&temp);
+			first = 1;
+			do {
+				ref_morph(OPERATOR_EROSION, &temp, &temp2, &flat, SRC_THRESHOLD, CHANNELS_LUMINOSITY);
+				ref_morph(OPERATOR_DILATION, &temp2, &temp3, &flat, SRC_ORIGINAL, CHANNELS_LUMINOSITY);
+				ref_merge(MERGE_DIFF, &temp, &temp3, &temp3, SRC_THRESHOLD);
+				ref_merge(MERGE_UNION, dst, &temp3, dst, SRC_ORIGINAL);
+
+				prev_area = area;
+				area = ref_count_non_black(&temp2);
+				stop = (first ? area == prev_area && ref_images_equal(&temp, &temp2) : area >= prev_area);
+
+				ref_image_copy(&temp2, &temp);
+				first = 0;
+			}
+			while (area > 0 && !stop);
+			break;
+
+		case OPERATOR_WTOPHAT:
+			ref_morph(OPERATOR_EROSION, &src, &temp, &element, SRC_ORIGINAL, settings->channel_mode);
+			ref_morph(OPERATOR_DILATION, &temp, dst, &element, SRC_ORIGINAL, settings->channel_mode);
+			ref_merge(MERGE_DIFF, &src, dst, dst, SRC_ORIGINAL);
+			break;
+
+		case OPERATOR_BTOPHAT:
+			ref_morph(OPERATOR_DILATION, &src, &temp, &element, SRC_ORIGINAL, settings->channel_mode);
+			ref_morph(OPERATOR_EROSION, &temp, dst, &element, SRC_ORIGINAL, settings->channel_mode);
+			ref_merge(MERGE_DIFF, dst, &src, dst, SRC_ORIGINAL);
+			break;
+
+		default:
+			break;
+	}
+
+	morphop_image_free(&src);
+	morphop_image_free(&temp);
+	morphop_image_free(&temp2);
+	morphop_image_free(&temp3);
+	ref_mask_free(&element);
+	ref_mask_free(&flat);
+	ref_mask_free(&B1);
+	ref_mask_free(&B2);
+
+	return MORPHOP_OK;
+}
+
+/* morphop_reference_reconstruct()
+ *
+ * Same as morphop_reconstruct(), the slow way: each pixel of the marker (limited to the mask) takes the highest
+ * of its 3x3 neighbors, limited to the mask again, until nothing changes. The pixels are updated in place, with
+ * sweeps alternately forward and backward, so it takes a few sweeps instead of one for each pixel of the longest path
+ */
+MorphOpStatus morphop_reference_reconstruct(MorphOperator op, const MorphOpImage* marker, const MorphOpImage* mask, MorphOpImage* dst)
+{
+	const int color_channels = marker->format.channels - (marker->format.has_alpha ? 1 : 0);
+	const double sign = (op == OPERATOR_EROSION ? -1 : 1);
+	MorphOpImage cur;
+	int x, y, c, i, j, n, sweep, changed;
+
+	if (
+		(op != OPERATOR_DILATION && op != OPERATOR_EROSION) ||
+		marker->width != mask->width || marker->height != mask->height ||
+		marker->width != dst->width || marker->height != dst->height
+	) return MORPHOP_INVALID;
+
+	if (!ref_image_alloc(&cur, mask)) return MORPHOP_NO_MEMORY;
+
+	// the alpha (if any) is the one of the mask, the colors start from the marker within the mask
+	ref_image_copy(mask, &cur);
+	for (y = 0; y < cur.height; y++) {
+		for (x = 0; x < cur.width; x++) {
+			for (c = 0; c < color_channels; c++) {
+				double m = sign * get_sample(marker, x, y, c), limit = sign * get_sample(mask, x, y, c);
+				set_sample(&cur, x, y, c, sign * (m < limit ? m : limit));
+			}
+		}
+	}
+
+	sweep = 0;
+	do {
+		changed = 0;
+
+		for (n = 0; n < cur.width * cur.height; n++) {
+			int p = (sweep % 2 == 0 ? n : cur.width * cur.height - 1 - n);
+			x = p % cur.width;
+			y = p / cur.width;
+
+			for (c = 0; c < color_channels; c++) {
+				double value = sign * get_sample(&cur, x, y, c), limit = sign * get_sample(mask, x, y, c);
+				double old = value;
+
+				for (i = -1; i <= 1; i++) {
+					for (j = -1; j <= 1; j++) {
+						if (x + j < 0 || x + j >= cur.width || y + i < 0 || y + i >= cur.height) continue;
+						if (sign * get_sample(&cur, x + j, y + i, c) > value) value = sign * get_sample(&cur, x + j, y + i, c);
+					}
+				}
+
+				if (value > limit) value = limit;
+				if (value != old) {
+					set_sample(&cur, x, y, c, sign * value);
+					changed = 1;
+				}
+			}
+		}
+
+		sweep++;
+	}
+	while (changed);
+
+	ref_image_copy(&cur, dst);
+	morphop_image_free(&cur);
+
+	return MORPHOP_OK;
+}
+
+/* morphop_reference_area()
+ *
+ * Same as morphop_area_tree_build() and morphop_area_tree_filter(), the slow way: from the brightest value of the
+ * image to the darkest, the pixels at least as bright are grouped in connected components (8 neighbors), and the
+ * pixels of the components with at least 'min_area' pixels that don't have a value yet take that one. The
+ * pixels that never get one take the darkest value (the whole image is smaller than 'min_area').
+ */
+MorphOpStatus morphop_reference_area(MorphOperator op, unsigned long min_area, const MorphOpImage* src, MorphOpImage* dst)
+{
+	const int color_channels = src->format.channels - (src->format.has_alpha ? 1 : 0);
+	const double sign = (op == OPERATOR_CLOSING ? -1 : 1);
+	const int pixels = src->width * src->height;
+	double* value, *levels, *out;
+	int* label, *stack;
+	int c, p, i, k, n_levels;
+
+	if ((op != OPERATOR_OPENING && op != OPERATOR_CLOSING) || src->width != dst->width || src->height != dst->height) return MORPHOP_INVALID;
+
+	value = malloc(pixels * sizeof(double));
+	levels = malloc(pixels * sizeof(double));
+	out = malloc(pixels * sizeof(double));
+	label = malloc(pixels * sizeof(int));
+	stack = malloc(pixels * sizeof(int));
+	if (value == NULL || levels == NULL || out == NULL || label == NULL || stack == NULL) return MORPHOP_NO_MEMORY;
+
+	ref_image_copy(src, dst);
+
+	for (c = 0; c < color_channels; c++) {
+		n_levels = 0;
+		for (p = 0; p < pixels; p++) {
+			value[p] = sign * get_sample(src, p % src->width, p / src->width, c);
+			out[p] = -HUGE_VAL;
+
+			for (i = 0; i < n_levels && levels[i] != value[p]; i++);
+			if (i == n_levels) levels[n_levels++] = value[p];
+		}
+
+		while (n_levels > 0) {
+			double h;
+
+			// the brightest level left
+			for (i = 0, k = 1; k < n_levels; k++) if (levels[k] > levels[i]) i = k;
+			h = levels[i];
+			levels[i] = levels[--n_levels];
+
+			for (p = 0; p < pixels; p++) label[p] = -1;
+
+			for (p = 0; p < pixels; p++) {
+				int size = 0, top = 0, first;
+
+				if (value[p] < h || label[p] >= 0) continue;
+
+				// flood fill of the component of 'p'. The stack keeps all of its pixels (it only grows)
+				label[p] = p;
+				stack[top++] = p;
+				for (first = 0; first < top; first++) {
+					int x = stack[first] % src->width, y = stack[first] / src->width, dx, dy;
+
+					size++;
+					for (dy = -1; dy <= 1; dy++) {
+						for (dx = -1; dx <= 1; dx++) {
+							int q = (y + dy) * src->width + (x + dx);
+
+							if (x + dx < 0 || x + dx >= src->width || y + dy < 0 || y + dy >= src->height) continue;
+							if (value[q] < h || label[q] >= 0) continue;
+
+							label[q] = p;
+							stack[top++] = q;
+						}
+					}
+				}
+
+				if ((unsigned long)size >= min_area) {
+					for (i = 0; i < top; i++) {
+						if (out[stack[i]] == -HUGE_VAL) out[stack[i]] = h;
+					}
+				}
+			}
+		}
+
+		for (p = 0; p < pixels; p++) {
+			if (out[p] == -HUGE_VAL) {
+				out[p] = value[0];
+				for (i = 1; i < pixels; i++) if (value[i] < out[p]) out[p] = value[i];
+			}
+			set_sample(dst, p % src->width, p / src->width, c, sign * out[p]);
+		}
+	}
+
+	free(value);
+	free(levels);
+	free(out);
+	free(label);
+	free(stack);
+
+	return MORPHOP_OK;
+}
+
+/* morphop_reference_watershed()
+ *
+ * Same as morphop_watershed(), the slow way: the seeds are found by flood fills, and the queue is a list of the
+ * pixels with the level they have been pushed at, searched for the lowest (the first pushed, between equals)
+ */
+MorphOpStatus morphop_reference_watershed(const StructuringElement* element, const MorphOpImage* src, const MorphOpImage* markers, MorphOpImage* dst)
+{
+	const int color_channels = src->format.channels - (src->format.has_alpha ? 1 : 0);
+	const int width = src->width, height = src->height, pixels = width * height;
+	MorphOpSettings gradient = { OPERATOR_GRADIENT, *element, 1, CHANNELS_LUMINOSITY };
+	MorphOpImage grad;
+	int* level, *label, *queue, *queue_level;
+	int p, q, i, c, dx, dy, n_labels = 0, n_queued = 0, current = 0;
+
+	if (
+		src->width != dst->width || src->height != dst->height ||
+		(markers != NULL && (markers->width != width || markers->height != height))
+	) return MORPHOP_INVALID;
+
+	level = malloc(pixels * sizeof(int));
+	label = malloc(pixels * sizeof(int));
+	queue = malloc(pixels * sizeof(int));
+	queue_level = malloc(pixels * sizeof(int));
+	if (level == NULL || label == NULL || queue == NULL || queue_level == NULL || !ref_image_alloc(&grad, src)) return MORPHOP_NO_MEMORY;
+
+	morphop_reference_run(&gradient, src, &grad);
+
+	// the levels: luminosity of the gradient, in 8 bits
+	for (p = 0; p < pixels; p++) {
+		double pixel[3], value;
+
+		for (i = 0; i < (src->format.is_rgb ? 3 : 1); i++) {
+			pixel[i] = get_sample(&grad, p % width, p / width, i);
+			if (src->format.type == SAMPLE_U16) pixel[i] = pixel[i] / 257.0;
+			else if (src->format.type == SAMPLE_FLOAT) pixel[i] = pixel[i] * 255.0;
+		}
+
+		value = (src->format.is_rgb ? pixel[0] * 0.2126 + pixel[1] * 0.7152 + pixel[2] * 0.0722 : pixel[0]);
+		level[p] = (int)(unsigned char)(value < 0 ? 0 : (value > 255 ? 255 : value + 0.5));
+		label[p] = 0;
+	}
+
+	// the seeds: the groups of pixels of the markers that are not black, or the regional minima
+	for (p = 0; p < pixels; p++) {
+		int is_seed = 0, top = 1, first;
+
+		if (label[p] != 0) continue;
+
+		if (markers != NULL) {
+			for (c = 0; c < markers->format.channels - (markers->format.has_alpha ? 1 : 0); c++) {
+				if (get_sample(markers, p % width, p / width, c) > 0) is_seed = 1;
+			}
+			if (!is_seed) continue;
+		}
+
+		// flood fill of the group of 'p' (the same level, or not black), in 'queue'
+		is_seed = 1;
+		label[p] = -1;
+		queue[0] = p;
+		for (first = 0; first < top; first++) {
+			int x = queue[first] % width, y = queue[first] / width;
+
+			for (dy = -1; dy <= 1; dy++) {
+				for (dx = -1; dx <= 1; dx++) {
+					int same = 0;
+
+					if ((dx == 0 && dy == 0) || x + dx < 0 || x + dx >= width || y + dy < 0 || y + dy >= height) continue;
+					q = (y + dy) * width + (x + dx);
+
+					if (markers != NULL) {
+						for (c = 0; c < markers->format.channels - (markers->format.has_alpha ? 1 : 0); c++) {
+							if (get_sample(markers, x + dx, y + dy, c) > 0) same = 1;
+						}
+					}
+					else {
+						if (level[q] < level[p]) is_seed = 0;
+						same = (level[q] == level[p]);
+					}
+
+					if (same && label[q] == 0) {
+						label[q] = -1;
+						queue[top++] = q;
+					}
+				}
+			}
+		}
+
+		// the groups that are not minima are marked as seen (-1), then cleared
+		if (is_seed) n_labels++;
+		for (i = 0; i < top; i++) label[queue[i]] = (is_seed ? n_labels : -1);
+	}
+	for (p = 0; p < pixels; p++) if (label[p] == -1) label[p] = 0;
+
+	// the flooding: -1 is a queued pixel, -2 a line
+	for (p = 0; p < pixels; p++) {
+		if (label[p] <= 0) continue;
+
+		for (dy = -1; dy <= 1; dy++) {
+			for (dx = -1; dx <= 1; dx++) {
+				int x = p % width + dx, y = p / width + dy;
+
+				if ((dx == 0 && dy == 0) || x < 0 || x >= width || y < 0 || y >= height || label[y * width + x] != 0) continue;
+
+				label[y * width + x] = -1;
+				queue[n_queued] = y * width + x;
+				queue_level[n_queued++] = level[y * width + x];
+			}
+		}
+	}
+
+	while (n_queued > 0) {
+		int best = 0, basin = 0;
+
+		for (i = 1; i < n_queued; i++) if (queue_level[i] < queue_level[best]) best = i;
+		p = queue[best];
+		current = queue_level[best];
+		memmove(queue + best, queue + best + 1, (n_queued - best - 1) * sizeof(int));
+		memmove(queue_level + best, queue_level + best + 1, (n_queued - best - 1) * sizeof(int));
+		n_queued--;
+
+		for (dy = -1; dy <= 1; dy++) {
+			for (dx = -1; dx <= 1; dx++) {
+				int x = p % width + dx, y = p / width + dy;
+
+				if ((dx == 0 && dy == 0) || x < 0 || x >= width || y < 0 || y >= height || label[y * width + x] <= 0) continue;
+
+				if (basin == 0) basin = label[y * width + x];
+				else if (label[y * width + x] != basin) basin = -2;
+			}
+		}
+
+		label[p] = basin;
+		if (basin == -2) continue;
+
+		for (dy = -1; dy <= 1; dy++) {
+			for (dx = -1; dx <= 1; dx++) {
+				int x = p % width + dx, y = p / width + dy;
+
+				if ((dx == 0 && dy == 0) || x < 0 || x >= width || y < 0 || y >= height || label[y * width + x] != 0) continue;
+
+				label[y * width + x] = -1;
+				queue[n_queued] = y * width + x;
+				queue_level[n_queued++] = (level[y * width + x] > current ? level[y * width + x] : current);
+			}
+		}
+	}
+
+	// white lines on black, with the alpha of the gradient
+	ref_image_copy(&grad, dst);
+	for (p = 0; p < pixels; p++) {
+		for (c = 0; c < color_channels; c++) set_sample(dst, p % width, p / width, c, (label[p] == -2 ? sample_max(src->format.type) : 0));
+	}
+
+	morphop_image_free(&grad);
+	free(level);
+	free(label);
+	free(queue);
+	free(queue_level);
+
+	return MORPHOP_OK;
+}
+
+/* ref_iterated_morph()
+ *
+ * Erodes (or dilates) 'src' into 'dst', then erodes 'dst' again, until the number of iterations.
+ * 'temp' holds the input of each iteration after the first.
+ */
+static void ref_iterated_morph(MorphOperator op, const MorphOpImage* src, MorphOpImage* dst, MorphOpImage* temp, const RefMask* element, int iterations, ChannelMode channel_mode)
+{
+	int i;
+
+	ref_morph(op, src, dst, element, SRC_ORIGINAL, channel_mode);
+
+	for (i = 1; i < iterations; i++) {
+		ref_image_copy(dst, temp);
+		ref_morph(op, temp, dst, element, SRC_ORIGINAL, channel_mode);
+	}
+}
+
+/* ref_morph()
+ *
+ * Erosion (or dilation): every pixel becomes the darkest (brightest) of its neighbors selected by the element.
+ * The first one found, scanning the element by rows, wins over the ones with the same luminosity.
+ * Rows outside of the image are white for erosion and black for dilation (before the source transformation),
+ * columns outside of the image are ignored. If no neighbor is selected, the pixel doesn't change.
+ * With a non-flat element, each neighbor is lowered (erosion) or raised (dilation) by the height of its cell first,
+ * between black and white; then the rows outside of the image are ignored too.
+ * With CHANNELS_COLOR and CHANNELS_ALL, each channel takes the darkest (brightest) of the same channel of the
+ * neighbors instead; with CHANNELS_COLOR, the alpha doesn't change.
+ */
+static void ref_morph(MorphOperator op, const MorphOpImage* src, MorphOpImage* dst, const RefMask* element, SourceTansformation srctransf, ChannelMode channel_mode)
+{
+	const PixelFormat format = src->format;
+	const double max = sample_max(format.type);
+	int weighted = 0;
+	int x, y, i, mask_x, mask_y;
+
+	for (i = 0; i < element->width * element->height; i++) {
+		if (element->cells[i] != 0 && element->weights[i] != 0) weighted = 1;
+	}
+
+	for (y = 0; y < src->height; y++) {
+		for (x = 0; x < src->width; x++) {
+			double best[4], best_lum = 0;
+			int found = 0;
+
+			for (mask_y = 0; mask_y < element->height; mask_y++) {
+				for (mask_x = 0; mask_x < element->width; mask_x++) {
+					int neigh_x = x + mask_x - element->width / 2;
+					int neigh_y = y + mask_y - element->height / 2;
+					int weight = element->weights[mask_y * element->width + mask_x];
+					double pixel[4], lum;
+
+					if (element->cells[mask_y * element->width + mask_x] == 0) continue;
+					if (neigh_x < 0 || neigh_x >= src->width) continue;
+					if (weighted && (neigh_y < 0 || neigh_y >= src->height)) continue;
+
+					for (i = 0; i < format.channels; i++) {
+						if (neigh_y < 0 || neigh_y >= src->height) pixel[i] = (op == OPERATOR_EROSION ? max : 0);
+						else pixel[i] = get_sample(src, neigh_x, neigh_y, i);
+
+						if (srctransf == SRC_INVERSE) pixel[i] = to_sample(format.type, max - pixel[i]);
+
+						// the height, in the units of the samples
+						if (weighted && i < (format.is_rgb ? 3 : 1)) {
+							double height = (format.type == SAMPLE_U16 ? weight * 257 : (format.type == SAMPLE_FLOAT ? to_sample(SAMPLE_FLOAT, weight / 255.0) : weight));
+
+							pixel[i] += (op == OPERATOR_EROSION ? -height : height);
+							if (format.type != SAMPLE_FLOAT) pixel[i] = (pixel[i] < 0 ? 0 : (pixel[i] > max ? max : pixel[i]));
+							pixel[i] = to_sample(format.type, pixel[i]);
+						}
+					}
+
+					lum = get_luminance(format, pixel);
+					if (srctransf == SRC_THRESHOLD) {
+						lum = (lum < sample_threshold(format.type) ? 0 : max);
+						for (i = 0; i < (format.is_rgb ? 3 : 1); i++) pixel[i] = lum;
+					}
+
+					if (channel_mode != CHANNELS_LUMINOSITY) {
+						for (i = 0; i < format.channels; i++) {
+							if (!found || (op == OPERATOR_EROSION && pixel[i] < best[i]) || (op == OPERATOR_DILATION && pixel[i] > best[i])) best[i] = pixel[i];
+						}
+						found = 1;
+					}
+					else if (!found || (op == OPERATOR_EROSION && lum < best_lum) || (op == OPERATOR_DILATION && lum > best_lum)) {
+						memcpy(best, pixel, sizeof(best));
+						best_lum = lum;
+						found = 1;
+					}
+				}
+			}
+
+			for (i = 0; i < format.channels; i++) {
+				int keep = (!found || (channel_mode == CHANNELS_COLOR && format.has_alpha && i == format.channels - 1));
+				set_sample(dst, x, y, i, (keep ? get_sample(src, x, y, i) : best[i]));
+			}
+		}
+	}
+}
+
+/* ref_mask_build()
+ *
+ * The cells of the element, or of a pattern of hit-or-miss: the 7x7 matrix scaled to the size of the element
+ * (nearest neighbor), or the runs of a custom element. The black pattern is the cells of the matrix that are 0,
+ * or the cells of the rectangle of a custom element that are not in it. The heights are kept only for REF_ELEMENT,
+ * if 'heights' is 1. Returns 0 if there is no memory.
+ */
+static int ref_mask_build(RefMask* mask, const StructuringElement* element, RefPattern pattern, int heights)
+{
+	const MorphOpShape* shape = element->shape;
+	int x, y, i;
+
+	if (shape != NULL) {
+		mask->width = shape->width;
+		mask->height = shape->height;
+	}
+	else mask->width = mask->height = 3 + 2 * element->size; // 3x3, 5x5, 7x7, 9x9, 11x11
+
+	mask->cells = calloc(mask->width * mask->height, 1);
+	mask->weights = calloc(mask->width * mask->height, 1);
+	if (mask->cells == NULL || mask->weights == NULL) return 0;
+
+	if (shape != NULL) {
+		for (i = 0; i < shape->n_runs; i++) {
+			for (x = shape->runs[i].dx0; x < shape->runs[i].dx1; x++) {
+				mask->cells[(shape->runs[i].dy + mask->height / 2) * mask->width + x + mask->width / 2] = 1;
+			}
+		}
+
+		if (pattern == REF_BLACK) {
+			for (i = 0; i < mask->width * mask->height; i++) mask->cells[i] = !mask->cells[i];
+		}
+		return 1;
+	}
+
+	for (y = 0; y < mask->height; y++) {
+		for (x = 0; x < mask->width; x++) {
+			float scale = (float)STRELEM_DEFAULT_SIZE / mask->width;
+			int cell_y = (int)(y * scale), cell_x = (int)(x * scale);
+			int value = element->matrix[cell_y][cell_x];
+
+			mask->cells[y * mask->width + x] = (pattern == REF_WHITE ? value == 1 : (pattern == REF_BLACK ? value == 0 : value != 0));
+			if (pattern == REF_ELEMENT && heights) mask->weights[y * mask->width + x] = element->weights[cell_y][cell_x];
+		}
+	}
+
+	return 1;
+}
+
+static void ref_mask_free(RefMask* mask)
+{
+	free(mask->cells);
+	free(mask->weights);
+}
+
+/* ref_merge()
+ *
+ * dst = a <op> b on the color channels, the alpha channel is the one of 'a'. The source transformation
+ * (threshold only) is applied to 'a'. 'dst' can be 'a' or 'b'.
+ */
+static void ref_merge(MergeOperation op, const MorphOpImage* a, const MorphOpImage* b, MorphOpImage* dst, SourceTansformation srctransf)
+{
+	const PixelFormat format = a->format;
+	const int color_channels = format.channels - (format.has_alpha ? 1 : 0);
+	const double max = sample_max(format.type);
+	int x, y, i;
+
+	for (y = 0; y < a->height; y++) {
+		for (x = 0; x < a->width; x++) {
+			double pixel_a[4], pixel_b[4];
+
+			for (i = 0; i < format.channels; i++) {
+				pixel_a[i] = get_sample(a, x, y, i);
+				pixel_b[i] = get_sample(b, x, y, i);
+			}
+
+			if (srctransf == SRC_THRESHOLD) {
+				if (format.is_rgb) {
+					double lum = get_luminance(format, pixel_a);
+					pixel_a[0] = pixel_a[1] = pixel_a[2] = (lum < sample_threshold(format.type) ? 0 : max);
+				}
+				else {
+					for (i = 0; i < color_channels; i++) pixel_a[i] = (pixel_a[i] < sample_threshold(format.type) ? 0 : max);
+				}
+			}
+
+			for (i = 0; i < color_channels; i++) {
+				if (op == MERGE_DIFF) {
+					pixel_a[i] = to_sample(format.type, pixel_a[i] > pixel_b[i] ? pixel_a[i] - pixel_b[i] : pixel_b[i] - pixel_a[i]);
+				}
+				else if (op == MERGE_UNION) {
+					pixel_a[i] = (pixel_a[i] > to_sample(format.type, max - pixel_b[i]) ? max : to_sample(format.type, pixel_a[i] + pixel_b[i]));
+				}
+				else if (op == MERGE_INTERSEPT) {
+					if (pixel_a[i] != pixel_b[i]) pixel_a[i] = 0;
+				}
+			}
+
+			for (i = 0; i < format.channels; i++) {
+				set_sample(dst, x, y, i, pixel_a[i]);
+			}
+		}
+	}
+}
+
+static void ref_fill_black(const MorphOpImage* src, MorphOpImage* dst)
+{
+	const int color_channels = src->format.channels - (src->format.has_alpha ? 1 : 0);
+	int x, y, i;
+
+	for (y = 0; y < src->height; y++) {
+		for (x = 0; x < src->width; x++) {
+			for (i = 0; i < src->format.channels; i++) {
+				set_sample(dst, x, y, i, (i < color_channels ? 0 : get_sample(src, x, y, i)));
+			}
+		}
+	}
+}
+
+static unsigned long ref_count_non_black(const MorphOpImage* image)
+{
+	const int color_channels = image->format.channels - (image->format.has_alpha ? 1 : 0);
+	unsigned long count = 0;
+	int x, y, i;
+
+	for (y = 0; y < image->height; y++) {
+		for (x = 0; x < image->width; x++) {
+			for (i = 0; i < color_channels && get_sample(image, x, y, i) == 0; i++);
+			if (i < color_channels) count++;
+		}
+	}
+
+	return count;
+}
+
+static double get_luminance(PixelFormat format, const double* pixel)
+{
+	if (!format.is_rgb) return pixel[0];
+	return to_sample(format.type, pixel[0] * 0.2126 + pixel[1] * 0.7152 + pixel[2] * 0.0722);
+}
+
+static double get_sample(const MorphOpImage* image, int x, int y, int channel)
+{
+	const unsigned char* row = image->data + (size_t)y * image->stride;
+	int i = x * image->format.channels + channel;
+
+	switch (image->format.type) {
+		case SAMPLE_U16: return ((const unsigned short*)row)[i];
+		case SAMPLE_FLOAT: return ((const float*)row)[i];
+		default: return row[i];
+	}
+}
+
+static void set_sample(MorphOpImage* image, int x, int y, int channel, double value)
+{
+	unsigned char* row = image->data + (size_t)y * image->stride;
+	int i = x * image->format.channels + channel;
+
+	switch (image->format.type) {
+		case SAMPLE_U16: ((unsigned short*)row)[i] = (unsigned short)value; break;
+		case SAMPLE_FLOAT: ((float*)row)[i] = (float)value; break;
+		default: row[i] = (unsigned char)value; break;
+	}
+}
+
+/* to_sample()
+ *
+ * Converts a value to the sample type (truncating, as a C cast does) and back to double
+ */
+static double to_sample(SampleType type, double value)
+{
+	switch (type) {
+		case SAMPLE_U16: return (unsigned short)value;
+		case SAMPLE_FLOAT: return (float)value;
+		default: return (unsigned char)value;
+	}
+}
+
+static double sample_max(SampleType type)
+{
+	switch (type) {
+		case SAMPLE_U16: return 65535;
+		case SAMPLE_FLOAT: return 1.0f;
+		default: return 255;
+	}
+}
+
+static double sample_threshold(SampleType type)
+{
+	switch (type) {
+		case SAMPLE_U16: return 127 * 257;
+		case SAMPLE_FLOAT: return 127 / 255.0f;
+		default: return 127;
+	}
+}
+
+static int ref_image_alloc(MorphOpImage* image, const MorphOpImage* like)
+{
+	return (morphop_image_alloc(image, like->width, like->height, like->format) == MORPHOP_OK);
+}
+
+static void ref_image_copy(const MorphOpImage* src, MorphOpImage* dst)
+{
+	int y;
+
+	for (y = 0; y < src->height; y++) {
+		memcpy(dst->data + (size_t)y * dst->stride, src->data + (size_t)y * src->stride, src->width * pixel_format_get_bpp(src->format));
+	}
+}
+
+static int ref_images_equal(const MorphOpImage* a, const MorphOpImage* b)
+{
+	int y;
+
+	for (y = 0; y < a->height; y++) {
+		if (memcmp(a->data + (size_t)y * a->stride, b->data + (size_t)y * b->stride, a->width * pixel_format_get_bpp(a->format)) != 0) return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,17 @@
+#ifndef __MORPHOP_REFERENCE_H__
+#define __MORPHOP_REFERENCE_H__
+
+#include "morphop-engine.h"
+
+/*
+ * The reference implementation of the operators: a plain, pixel by pixel version of the original
+ * algorithms, with no bands, no scratch arena and no shortcut. It's slow, and it must stay this way:
+ * every faster path of the engine must give exactly the same results (see "morphop-bench --check").
+ */
+
+MorphOpStatus morphop_reference_run(const MorphOpSettings*, const MorphOpImage*, MorphOpImage*);
+MorphOpStatus morphop_reference_reconstruct(MorphOperator, const MorphOpImage*, const MorphOpImage*, MorphOpImage*);
+MorphOpStatus morphop_reference_area(MorphOperator, unsigned long, const MorphOpImage*, MorphOpImage*);
+MorphOpStatus morphop_reference_watershed(const StructuringElement*, const MorphOpImage*, const MorphOpImage*, MorphOpImage*);
+
+#endif
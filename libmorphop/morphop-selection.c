@@ -0,0 +1,168 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-kernels.h"
+
+#ifndef MIN
+	#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// selection_dilate() sorts the spans around a row if there are less than one for this many columns, else it counts
+// them on a row of counters (sorting many spans would cost more than going through the row)
+#define SORT_COLUMNS_PER_SPAN 8
+
+static int compare_spans(const void*, const void*);
+
+/* morphop_selection_build()
+ *
+ *  - MorphOpSelection* selection: the result
+ *  - const unsigned char* mask: 'height' rows of 'width' bytes, each one starts 'stride' bytes after the previous.
+ *    A pixel is selected if its byte is not 0 (even if it's only partially selected)
+ *  - MorphOpArena* arena: the memory of the spans, they are valid until it's reset
+ *
+ *  Finds the spans of selected pixels of each row of the mask. Returns MORPHOP_NO_MEMORY if they don't fit the arena.
+ */
+MorphOpStatus morphop_selection_build(MorphOpSelection* selection, const unsigned char* mask, size_t stride, int width, int height, MorphOpArena* arena)
+{
+	size_t n_spans = 0;
+	int x, y, n;
+
+	// the spans are counted first, to take their memory at once
+	for (y = 0; y < height; y++) {
+		const unsigned char* row = mask + y * stride;
+
+		for (x = 0; x < width; x++) {
+			if (row[x] != 0 && (x == 0 || row[x - 1] == 0)) n_spans++;
+		}
+	}
+
+	selection->width = width;
+	selection->height = height;
+	selection->first = arena_alloc(arena, (height + 1) * sizeof(int));
+	selection->spans = arena_alloc(arena, MAX(2 * n_spans, 1) * sizeof(int));
+	if (selection->first == NULL || selection->spans == NULL) return MORPHOP_NO_MEMORY;
+
+	for (y = 0, n = 0; y < height; y++) {
+		const unsigned char* row = mask + y * stride;
+
+		selection->first[y] = n;
+
+		for (x = 0; x < width; x++) {
+			if (row[x] == 0) continue;
+
+			selection->spans[2 * n] = x;
+			while (x < width && row[x] != 0) x++;
+			selection->spans[2 * n + 1] = x;
+			n++;
+		}
+	}
+	selection->first[height] = n;
+
+	return MORPHOP_OK;
+}
+
+/* selection_dilate()
+ *
+ * Makes 'out' the pixels within 'dx' columns and 'dy' rows of a selected pixel (a rectangle around each one),
+ * taking the memory from the arena. Returns 0 if there is no memory.
+ */
+int selection_dilate(MorphOpArena* arena, const MorphOpSelection* selection, int dx, int dy, MorphOpSelection* out)
+{
+	const int width = selection->width, height = selection->height;
+	size_t n_spans = 0, max_gathered = 0;
+	int* gathered, *counts = NULL;
+	int use_counts, x, y, r, i, n, k;
+
+	// a row of the result has no more spans than the rows around it, nor than the row can hold
+	for (y = 0; y < height; y++) {
+		size_t around = selection->first[MIN(y + dy, height - 1) + 1] - selection->first[MAX(y - dy, 0)];
+
+		n_spans += MIN(around, (size_t)(width + 1) / 2);
+		max_gathered = MAX(max_gathered, around);
+	}
+
+	out->width = width;
+	out->height = height;
+	out->first = arena_alloc(arena, (height + 1) * sizeof(int));
+	out->spans = arena_alloc(arena, MAX(2 * n_spans, 1) * sizeof(int));
+	gathered = arena_alloc(arena, MAX(2 * max_gathered, 1) * sizeof(int));
+
+	use_counts = (max_gathered * SORT_COLUMNS_PER_SPAN > (size_t)width);
+	if (use_counts) counts = arena_alloc(arena, (width + 1) * sizeof(int));
+
+	if (out->first == NULL || out->spans == NULL || gathered == NULL || (use_counts && counts == NULL)) return 0;
+
+	for (y = 0, n = 0; y < height; y++) {
+		int r0 = MAX(y - dy, 0), r1 = MIN(y + dy, height - 1);
+		int around = selection->first[r1 + 1] - selection->first[r0];
+
+		out->first[y] = n;
+		if (around == 0) continue;
+
+		if (around * SORT_COLUMNS_PER_SPAN <= width) {
+			// the spans of the rows around, widened and sorted by their first column, are joined where they touch
+			for (r = r0, k = 0; r <= r1; r++) {
+				for (i = selection->first[r]; i < selection->first[r + 1]; i++, k++) {
+					gathered[2 * k] = MAX(selection->spans[2 * i] - dx, 0);
+					gathered[2 * k + 1] = MIN(selection->spans[2 * i + 1] + dx, width);
+				}
+			}
+			qsort(gathered, around, 2 * sizeof(int), compare_spans);
+
+			for (k = 0; k < around; k++) {
+				if (n > out->first[y] && gathered[2 * k] <= out->spans[2 * n - 1]) {
+					out->spans[2 * n - 1] = MAX(out->spans[2 * n - 1], gathered[2 * k + 1]);
+				}
+				else {
+					out->spans[2 * n] = gathered[2 * k];
+					out->spans[2 * n + 1] = gathered[2 * k + 1];
+					n++;
+				}
+			}
+		}
+		else {
+			// each span adds 1 to the counters from its first column, and takes it back after its last one
+			memset(counts, 0, (width + 1) * sizeof(int));
+			for (i = selection->first[r0]; i < selection->first[r1 + 1]; i++) {
+				counts[MAX(selection->spans[2 * i] - dx, 0)]++;
+				counts[MIN(selection->spans[2 * i + 1] + dx, width)]--;
+			}
+
+			for (x = 0, k = 0; x < width; x++) {
+				int inside = (k > 0);
+
+				k += counts[x];
+				if (k > 0 && !inside) out->spans[2 * n] = x;
+				else if (k == 0 && inside) out->spans[2 * n++ + 1] = x;
+			}
+			if (k > 0) out->spans[2 * n++ + 1] = width;
+		}
+	}
+	out->first[height] = n;
+
+	return 1;
+}
+
+/* selection_has_columns()
+ *
+ * Returns 1 if a pixel of the columns [x0, x1) is selected, on any row
+ */
+int selection_has_columns(const MorphOpSelection* selection, int x0, int x1)
+{
+	int i;
+
+	for (i = selection->first[0]; i < selection->first[selection->height]; i++) {
+		if (selection->spans[2 * i] < x1 && selection->spans[2 * i + 1] > x0) return 1;
+	}
+
+	return 0;
+}
+
+static int compare_spans(const void* a, const void* b)
+{
+	const int* sa = a, *sb = b;
+	return (sa[0] > sb[0]) - (sa[0] < sb[0]);
+}
@@ -0,0 +1,153 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-kernels.h"
+
+/* morphop_shape_build()
+ *
+ *  - MorphOpShape* shape: the result
+ *  - const unsigned char* mask: 'height' rows of 'width' bytes, each one starts 'stride' bytes after the previous.
+ *    A cell belongs to the element if its byte is not 0
+ *  - MorphOpArena* arena: the memory of the runs, they are valid until it's reset
+ *
+ *  Finds the runs of cells of each row of the mask. Returns MORPHOP_INVALID if the mask is larger than
+ *  MORPHOP_SHAPE_MAX_SIZE on a side (or empty), MORPHOP_NO_MEMORY if the runs don't fit the arena.
+ */
+MorphOpStatus morphop_shape_build(MorphOpShape* shape, const unsigned char* mask, size_t stride, int width, int height, MorphOpArena* arena)
+{
+	const int cx = width / 2, cy = height / 2;
+	int n_runs = 0;
+	int x, y, n;
+
+	if (width < 1 || height < 1 || width > MORPHOP_SHAPE_MAX_SIZE || height > MORPHOP_SHAPE_MAX_SIZE) return MORPHOP_INVALID;
+
+	// the runs are counted first, to take their memory at once
+	for (y = 0; y < height; y++) {
+		const unsigned char* row = mask + y * stride;
+
+		for (x = 0; x < width; x++) {
+			if (row[x] != 0 && (x == 0 || row[x - 1] == 0)) n_runs++;
+		}
+	}
+
+	shape->width = width;
+	shape->height = height;
+	shape->n_runs = n_runs;
+	shape->runs = arena_alloc(arena, (n_runs > 0 ? n_runs : 1) * sizeof(MorphOpRun));
+	if (shape->runs == NULL) return MORPHOP_NO_MEMORY;
+
+	for (y = 0, n = 0; y < height; y++) {
+		const unsigned char* row = mask + y * stride;
+
+		for (x = 0; x < width; x++) {
+			if (row[x] == 0) continue;
+
+			shape->runs[n].dy = y - cy;
+			shape->runs[n].dx0 = x - cx;
+			while (x < width && row[x] != 0) x++;
+			shape->runs[n].dx1 = x - cx;
+			n++;
+		}
+	}
+
+	return MORPHOP_OK;
+}
+
+/* shape_is_valid()
+ *
+ * Returns 1 if the shape fits MORPHOP_SHAPE_MAX_SIZE, and its runs are inside its rectangle, sorted and separated
+ * (as morphop_shape_build() makes them)
+ */
+int shape_is_valid(const MorphOpShape* shape)
+{
+	const int cx = shape->width / 2, cy = shape->height / 2;
+	int i;
+
+	if (
+		shape->width < 1 || shape->height < 1 || shape->width > MORPHOP_SHAPE_MAX_SIZE || shape->height > MORPHOP_SHAPE_MAX_SIZE ||
+		shape->n_runs < 0 || (shape->n_runs > 0 && shape->runs == NULL)
+	) return 0;
+
+	for (i = 0; i < shape->n_runs; i++) {
+		const MorphOpRun* run = &shape->runs[i];
+
+		if (run->dy < -cy || run->dy >= shape->height - cy || run->dx0 < -cx || run->dx0 >= run->dx1 || run->dx1 > shape->width - cx) return 0;
+		if (i > 0 && (run->dy < run[-1].dy || (run->dy == run[-1].dy && run->dx0 <= run[-1].dx1))) return 0;
+	}
+
+	return 1;
+}
+
+/* shape_complement()
+ *
+ * Returns the cells of the rectangle of the shape that are not in it, as a shape with the same size and center
+ * (the black pattern of hit-or-miss). Both the shape and its runs are taken from the arena: NULL if there is no memory.
+ */
+static MorphOpShape* shape_complement(const MorphOpShape* shape, MorphOpArena* arena)
+{
+	const int cx = shape->width / 2, cy = shape->height / 2;
+	MorphOpShape* complement = arena_alloc(arena, sizeof(MorphOpShape));
+	int y, i = 0, n = 0;
+
+	// a row has at most one gap more than its runs
+	if (complement == NULL) return NULL;
+	complement->runs = arena_alloc(arena, (shape->n_runs + shape->height) * sizeof(MorphOpRun));
+	if (complement->runs == NULL) return NULL;
+
+	complement->width = shape->width;
+	complement->height = shape->height;
+
+	for (y = -cy; y < shape->height - cy; y++) {
+		int x = -cx;
+
+		for (; i < shape->n_runs && shape->runs[i].dy == y; i++) {
+			if (shape->runs[i].dx0 > x) {
+				complement->runs[n].dy = y;
+				complement->runs[n].dx0 = x;
+				complement->runs[n].dx1 = shape->runs[i].dx0;
+				n++;
+			}
+			x = shape->runs[i].dx1;
+		}
+
+		if (x < shape->width - cx) {
+			complement->runs[n].dy = y;
+			complement->runs[n].dx0 = x;
+			complement->runs[n].dx1 = shape->width - cx;
+			n++;
+		}
+	}
+	complement->n_runs = n;
+
+	return complement;
+}
+
+/* element_get_patterns()
+ *
+ * Splits the element of hit-or-miss, thickening and thinning in its white pattern (the cells that must be white,
+ * 1 in the matrix, or the cells of a custom element) and its black one (0 in the matrix, or the rest of the
+ * rectangle of a custom element). The patterns are flat. The black pattern of a custom element is taken from
+ * the arena: returns 0 if there is no memory.
+ */
+int element_get_patterns(const StructuringElement* element, StructuringElement* white, StructuringElement* black, MorphOpArena* arena)
+{
+	int i, j;
+
+	for (i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
+		for (j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
+			white->matrix[i][j] = (element->matrix[i][j] == 1 ? 1 : 0);
+			black->matrix[i][j] = (element->matrix[i][j] == 0 ? 1 : 0);
+			white->weights[i][j] = black->weights[i][j] = 0;
+		}
+	}
+	white->size = black->size = element->size;
+	white->shape = black->shape = NULL;
+
+	if (element->shape != NULL) {
+		white->shape = element->shape;
+		black->shape = shape_complement(element->shape, arena);
+		if (black->shape == NULL) return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,508 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-stream.h"
+
+#ifndef MIN
+	#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+static MorphOpStatus stream_build(MorphOpStream*);
+static int add_operator(MorphOpStream*, const MorphOpSettings*, int);
+static int add_source(MorphOpStream*);
+static int add_morph(MorphOpStream*, MorphOperator, StructuringElement, SourceTansformation, ChannelMode, int);
+static int add_iterated_morph(MorphOpStream*, MorphOperator, StructuringElement, int, SourceTansformation, ChannelMode, int);
+static int add_merge(MorphOpStream*, MergeOperation, SourceTansformation, int, int);
+static void stream_set_capacities(MorphOpStream*);
+static void node_add_reader(MorphOpStreamNode*, int, int);
+static int chain_is_valid(const MorphOpChain*);
+static int chain_has_skeleton(const MorphOpChain*);
+static MorphOpStatus stream_alloc_rings(MorphOpStream*);
+static const unsigned char* node_get_row(MorphOpStream*, int, int);
+static void node_compute_row(MorphOpStream*, MorphOpStreamNode*, int);
+static const unsigned char* whole_next_row(MorphOpStream*);
+static void node_plan(const MorphOpStream*, MorphOpStreamNode*, const MorphOpCalibration*);
+
+/* morphop_stream_init()
+ *
+ *  - MorphOpStream* stream: the stream to init
+ *  - const MorphOpSettings* settings: the operator and its structuring element
+ *  - int width, int height, PixelFormat format: the size and the format of the input (and of the output)
+ *  - MorphOpRowSource source, void* source_data: gives the rows of the input
+ *
+ *  Builds the passes of the operator, in the same order of morphop_run(). No row is read yet.
+ */
+MorphOpStatus morphop_stream_init(
+	MorphOpStream* stream,
+	const MorphOpSettings* settings,
+	int width, int height, PixelFormat format,
+	MorphOpRowSource source, void* source_data
+){
+	MorphOpChain chain;
+
+	chain.n_steps = 1;
+	chain.steps[0] = *settings;
+
+	return morphop_stream_init_chain(stream, &chain, width, height, format, source, source_data);
+}
+
+/* morphop_stream_init_chain()
+ *
+ * The same of morphop_stream_init(), for a chain of operators: the output is the result of the last step
+ */
+MorphOpStatus morphop_stream_init_chain(
+	MorphOpStream* stream,
+	const MorphOpChain* chain,
+	int width, int height, PixelFormat format,
+	MorphOpRowSource source, void* source_data
+){
+	memset(stream, 0, sizeof(MorphOpStream));
+	arena_init(&stream->arena);
+
+	stream->chain = *chain;
+	stream->width = width;
+	stream->height = height;
+	stream->format = format;
+	stream->row_size = (size_t)width * pixel_format_get_bpp(format);
+	stream->source = source;
+	stream->source_data = source_data;
+	stream->status = MORPHOP_OK;
+
+	if (
+		!chain_is_valid(chain) ||
+		width <= 0 || height <= 0 ||
+		format.type < 0 || format.type >= SAMPLE_END ||
+		format.channels != (format.is_rgb ? 3 : 1) + (format.has_alpha ? 1 : 0)
+	) return (stream->status = MORPHOP_INVALID);
+
+	if (chain_has_skeleton(chain)) {
+		// read entirely by whole_next_row()
+		if (
+			morphop_image_alloc(&stream->whole_src, width, height, format) != MORPHOP_OK ||
+			morphop_image_alloc(&stream->whole_dst, width, height, format) != MORPHOP_OK
+		) stream->status = MORPHOP_NO_MEMORY;
+
+		return stream->status;
+	}
+
+	if ((stream->status = stream_build(stream)) != MORPHOP_OK) return stream->status;
+
+	return (stream->status = stream_alloc_rings(stream));
+}
+
+/* morphop_stream_next_row()
+ *
+ * Returns the next row of the output, that stays valid until the next call. Returns NULL after the
+ * last row, or if an error occurred (see MorphOpStream.status).
+ */
+const unsigned char* morphop_stream_next_row(MorphOpStream* stream)
+{
+	const unsigned char* row;
+
+	if (stream->status != MORPHOP_OK || stream->next_row >= stream->height) return NULL;
+
+	if (stream->whole_src.data != NULL) return whole_next_row(stream);
+
+	row = node_get_row(stream, stream->output, stream->next_row);
+	stream->next_row++;
+
+	return row;
+}
+
+/* morphop_stream_plan()
+ *
+ * Chooses the engine of each erosion and dilation of the stream again, with the speed of the host (see
+ * morphop_calibrate()) instead of the default model. It must be called before the first row; the calibration
+ * must stay valid until the end of the stream.
+ */
+void morphop_stream_plan(MorphOpStream* stream, const MorphOpCalibration* calibration)
+{
+	int i;
+
+	stream->calibration = calibration;
+
+	for (i = 0; i < stream->n_nodes; i++) {
+		if (stream->nodes[i].kind == STREAM_MORPH) node_plan(stream, &stream->nodes[i], calibration);
+	}
+}
+
+/* node_plan()
+ *
+ * Sets how the kernels apply the element of an erosion or a dilation (see morph_plan()). The stream never copies
+ * the uniform blocks: its rows come one at a time.
+ */
+static void node_plan(const MorphOpStream* stream, MorphOpStreamNode* node, const MorphOpCalibration* calibration)
+{
+	MorphPlan plan;
+
+	morph_plan(&node->element, calibration, stream->format, node->srctransf, node->channel_mode, 0, &plan);
+}
+
+void morphop_stream_free(MorphOpStream* stream)
+{
+	arena_free(&stream->arena);
+	morphop_image_free(&stream->whole_src);
+	morphop_image_free(&stream->whole_dst);
+}
+
+/* morphop_stream_get_reach()
+ *
+ * How many rows above and below (and columns left and right of) an output pixel the input can affect it, through
+ * all the steps of the chain: the radius of each element, on its larger side, times the number of erosions and
+ * dilations of its operator, one after the other
+ */
+int morphop_stream_get_reach(const MorphOpChain* chain)
+{
+	int reach = 0, i;
+
+	for (i = 0; i < chain->n_steps; i++) {
+		const MorphOpSettings* step = &chain->steps[i];
+
+		reach += element_get_radius(&step->element) * graph_get_depth(operator_get_graph(step->operator), morphop_settings_get_iterations(step));
+	}
+
+	return reach;
+}
+
+/* morphop_stream_get_window()
+ *
+ * The number of rows that all the passes of a stream of the chain keep in memory, on an image of the given height
+ * (their memory is this number times the size of a row)
+ */
+int morphop_stream_get_window(const MorphOpChain* chain, int height)
+{
+	MorphOpStream probe;
+	int window = 0, i;
+
+	if (!chain_is_valid(chain) || chain_has_skeleton(chain) || height <= 0) return height;
+
+	// the passes are built, but their rings are not allocated
+	memset(&probe, 0, sizeof(MorphOpStream));
+	arena_init(&probe.arena);
+	probe.chain = *chain;
+	probe.height = height;
+
+	if (stream_build(&probe) != MORPHOP_OK) window = height;
+
+	for (i = 0; i < probe.n_nodes; i++) {
+		window += probe.nodes[i].capacity;
+	}
+
+	arena_free(&probe.arena);
+
+	return window;
+}
+
+/* stream_build()
+ *
+ * Builds the passes of the steps of the chain, each one reading the output of the previous, and sizes their rings
+ */
+static MorphOpStatus stream_build(MorphOpStream* stream)
+{
+	int input, n_nodes = 1, i;
+
+	for (i = 0; i < stream->chain.n_steps; i++) {
+		const MorphOpSettings* step = &stream->chain.steps[i];
+
+		n_nodes += graph_count_passes(operator_get_graph(step->operator), morphop_settings_get_iterations(step));
+	}
+
+	stream->nodes = arena_alloc(&stream->arena, n_nodes * sizeof(MorphOpStreamNode));
+	if (stream->nodes == NULL) return MORPHOP_NO_MEMORY;
+	memset(stream->nodes, 0, n_nodes * sizeof(MorphOpStreamNode));
+
+	input = add_source(stream);
+
+	for (i = 0; i < stream->chain.n_steps; i++) {
+		input = add_operator(stream, &stream->chain.steps[i], input);
+		if (input < 0) return MORPHOP_NO_MEMORY;
+	}
+
+	stream->output = input;
+	stream_set_capacities(stream);
+
+	return MORPHOP_OK;
+}
+
+/* add_operator()
+ *
+ * Adds the passes of the graph of an operator (see operator_get_graph()) that reads pass 'src', as morphop_run()
+ * runs them. Returns its last pass, or -1 if there is no memory for the patterns of a custom element
+ * (see element_get_patterns()).
+ */
+static int add_operator(MorphOpStream* stream, const MorphOpSettings* settings, int src)
+{
+	const OperatorGraph* graph = operator_get_graph(settings->operator);
+	StructuringElement elements[GRAPH_ELEMENT_END];
+	int output[GRAPH_MAX_NODES]; // the last pass of each node
+	int i;
+
+	if (graph->n_nodes == 0) return src;
+	if (!graph_get_elements(graph, &settings->element, elements, &stream->arena)) return -1;
+
+	for (i = 0; i < graph->n_nodes; i++) {
+		const GraphNode* node = &graph->nodes[i];
+		int a = (node->a == GRAPH_INPUT ? src : output[node->a]);
+
+		if (node->kind == GRAPH_MORPH) {
+			output[i] = add_iterated_morph(
+				stream, node->op, elements[node->element], (node->iterated ? morphop_settings_get_iterations(settings) : 1),
+				node->srctransf, graph_node_get_channel_mode(node, settings->channel_mode), a
+			);
+		}
+		else {
+			output[i] = add_merge(stream, node->merge, node->srctransf, a, (node->b == GRAPH_INPUT ? src : output[node->b]));
+		}
+	}
+
+	return output[graph->n_nodes - 1];
+}
+
+static int add_source(MorphOpStream* stream)
+{
+	MorphOpStreamNode* node = &stream->nodes[stream->n_nodes];
+
+	node->kind = STREAM_SOURCE;
+	return stream->n_nodes++;
+}
+
+static int add_morph(MorphOpStream* stream, MorphOperator op, StructuringElement element, SourceTansformation srctransf, ChannelMode channel_mode, int input)
+{
+	MorphOpStreamNode* node = &stream->nodes[stream->n_nodes];
+
+	node->kind = STREAM_MORPH;
+	node->op = op;
+	node->srctransf = srctransf;
+	node->channel_mode = channel_mode;
+	node->a = input;
+	element_scale(&element, &node->element);
+	node_plan(stream, node, NULL);
+
+	return stream->n_nodes++;
+}
+
+/* add_iterated_morph()
+ *
+ * Adds 'iterations' erosions (or dilations), each one reading the previous: the first one applies the source
+ * transformation. Returns the last one.
+ */
+static int add_iterated_morph(
+	MorphOpStream* stream, MorphOperator op, StructuringElement element, int iterations,
+	SourceTansformation srctransf, ChannelMode channel_mode, int input
+) {
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		input = add_morph(stream, op, element, (i == 0 ? srctransf : SRC_ORIGINAL), channel_mode, input);
+	}
+
+	return input;
+}
+
+static int add_merge(MorphOpStream* stream, MergeOperation op, SourceTansformation srctransf, int a, int b)
+{
+	MorphOpStreamNode* node = &stream->nodes[stream->n_nodes];
+
+	node->kind = STREAM_MERGE;
+	node->merge = op;
+	node->srctransf = srctransf;
+	node->a = a;
+	node->b = b;
+
+	return stream->n_nodes++;
+}
+
+static int chain_is_valid(const MorphOpChain* chain)
+{
+	int i;
+
+	if (chain->n_steps < 1 || chain->n_steps > MORPHOP_CHAIN_MAX_STEPS) return 0;
+
+	for (i = 0; i < chain->n_steps; i++) {
+		if (!morphop_settings_are_valid(&chain->steps[i])) return 0;
+	}
+
+	return 1;
+}
+
+static int chain_has_skeleton(const MorphOpChain* chain)
+{
+	int i;
+
+	for (i = 0; i < chain->n_steps; i++) {
+		if (chain->steps[i].operator == OPERATOR_SKELETON) return 1;
+	}
+
+	return 0;
+}
+
+/* stream_set_capacities()
+ *
+ * Sizes the ring of every pass. When the output is at row y, a pass is computed at most up to row y + lead,
+ * its lead being the highest lead of the passes that read it, plus their radius (0 for a merge).
+ * A pass read by a single other one is computed only when that one needs it: it keeps the rows of a window
+ * of the reader (2 * radius + 1). A pass read by more than one can be taken ahead by one reader while another
+ * still needs its older rows: it keeps all the rows from y - radius up to its lead.
+ * One more row is kept for the one being computed.
+ */
+static void stream_set_capacities(MorphOpStream* stream)
+{
+	int i;
+
+	// the passes are in the order they are computed: each one is after its inputs
+	for (i = stream->n_nodes - 1; i >= 0; i--) {
+		MorphOpStreamNode* node = &stream->nodes[i];
+
+		if (node->kind == STREAM_MORPH) {
+			node_add_reader(&stream->nodes[node->a], node->lead + node->element.center, node->element.center);
+		}
+		else if (node->kind == STREAM_MERGE) {
+			node_add_reader(&stream->nodes[node->a], node->lead, 0);
+			node_add_reader(&stream->nodes[node->b], node->lead, 0);
+		}
+	}
+
+	for (i = 0; i < stream->n_nodes; i++) {
+		MorphOpStreamNode* node = &stream->nodes[i];
+		int capacity = (node->readers <= 1 ? 2 * node->reader_radius + 1 : node->lead + node->reader_radius + 1) + 1;
+
+		node->capacity = MIN(capacity, stream->height);
+	}
+}
+
+static void node_add_reader(MorphOpStreamNode* node, int lead, int radius)
+{
+	if (lead > node->lead) node->lead = lead;
+	if (radius > node->reader_radius) node->reader_radius = radius;
+	node->readers++;
+}
+
+/* stream_alloc_rings()
+ *
+ * Allocates the rings of the passes (see stream_set_capacities()), the memory their kernels work in, and the rows
+ * outside of the image
+ */
+static MorphOpStatus stream_alloc_rings(MorphOpStream* stream)
+{
+	int i, y;
+
+	for (i = 0; i < 2; i++) {
+		stream->outside[i] = arena_alloc(&stream->arena, stream->row_size);
+		if (stream->outside[i] == NULL) return MORPHOP_NO_MEMORY;
+
+		fill_outside_row((i == 0 ? OPERATOR_EROSION : OPERATOR_DILATION), stream->format, stream->outside[i], stream->width);
+	}
+
+	for (i = 0; i < stream->n_nodes; i++) {
+		MorphOpStreamNode* node = &stream->nodes[i];
+
+		node->next_row = 0;
+		node->ring = arena_alloc(&stream->arena, stream->row_size * node->capacity);
+		node->rows = arena_alloc(&stream->arena, sizeof(unsigned char*) * node->capacity);
+		if (node->ring == NULL || node->rows == NULL) return MORPHOP_NO_MEMORY;
+
+		if (node->kind == STREAM_MORPH) {
+			node->scratch = arena_alloc(&stream->arena, morph_row_scratch_size(&node->element, stream->format, stream->width));
+			if (node->scratch == NULL) return MORPHOP_NO_MEMORY;
+		}
+
+		for (y = 0; y < node->capacity; y++) {
+			node->rows[y] = node->ring + y * stream->row_size;
+		}
+	}
+
+	return MORPHOP_OK;
+}
+
+/* node_get_row()
+ *
+ * Returns row 'y' of a pass, computing it (and the rows before it) if needed. Returns NULL if an error occurred.
+ */
+static const unsigned char* node_get_row(MorphOpStream* stream, int index, int y)
+{
+	MorphOpStreamNode* node = &stream->nodes[index];
+
+	while (node->next_row <= y && stream->status == MORPHOP_OK) {
+		node_compute_row(stream, node, node->next_row);
+		node->next_row++;
+	}
+
+	return (stream->status == MORPHOP_OK ? node->rows[y % node->capacity] : NULL);
+}
+
+static void node_compute_row(MorphOpStream* stream, MorphOpStreamNode* node, int y)
+{
+	unsigned char* out = node->ring + (y % node->capacity) * stream->row_size;
+	unsigned char* window[ELEMENT_MAX_ROWS];
+	const unsigned char* a, *b;
+	int i;
+
+	switch (node->kind) {
+		case STREAM_SOURCE:
+			a = stream->source(y, out, stream->source_data);
+			if (a == NULL) stream->status = MORPHOP_SOURCE_ERROR;
+			node->rows[y % node->capacity] = a;
+			break;
+
+		case STREAM_MORPH:
+			// the input must be ready down to the last row of the window
+			if (node_get_row(stream, node->a, MIN(y + node->element.center, stream->height - 1)) == NULL) return;
+
+			for (i = 0; i < node->element.size; i++) {
+				int this_row = y + i - node->element.center;
+
+				if (this_row >= 0 && this_row < stream->height) {
+					window[i] = (unsigned char*)stream->nodes[node->a].rows[this_row % stream->nodes[node->a].capacity];
+				}
+				else {
+					// the non-flat kernel skips the rows outside of the image
+					window[i] = (node->element.weighted ? NULL : stream->outside[node->op == OPERATOR_EROSION ? 0 : 1]);
+				}
+			}
+
+			morph_row(node->op, stream->format, &node->element, node->srctransf, node->channel_mode, window, out, stream->width, node->scratch);
+			break;
+
+		case STREAM_MERGE:
+			b = node_get_row(stream, node->b, y);
+			a = node_get_row(stream, node->a, y);
+			if (a == NULL || b == NULL) return;
+
+			merge_row(node->merge, stream->format, node->srctransf, a, b, out, stream->width);
+			break;
+	}
+}
+
+/* whole_next_row()
+ *
+ * For the chains that can't be streamed: the first call reads the whole image and runs the chain on it
+ */
+static const unsigned char* whole_next_row(MorphOpStream* stream)
+{
+	int y;
+
+	if (!stream->whole_ready) {
+		MorphOpContext ctx;
+
+		for (y = 0; y < stream->height; y++) {
+			unsigned char* row = stream->whole_src.data + y * stream->whole_src.stride;
+			const unsigned char* read = stream->source(y, row, stream->source_data);
+
+			if (read == NULL) {
+				stream->status = MORPHOP_SOURCE_ERROR;
+				return NULL;
+			}
+			if (read != row) memcpy(row, read, stream->row_size);
+		}
+
+		morphop_context_init(&ctx);
+		ctx.calibration = stream->calibration;
+		stream->status = morphop_run_chain(&ctx, &stream->chain, &stream->whole_src, &stream->whole_dst);
+		morphop_context_free(&ctx);
+
+		stream->whole_ready = 1;
+		if (stream->status != MORPHOP_OK) return NULL;
+	}
+
+	return stream->whole_dst.data + (stream->next_row++) * stream->whole_dst.stride;
+}
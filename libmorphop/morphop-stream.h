@@ -0,0 +1,89 @@
+#ifndef __MORPHOP_STREAM_H__
+#define __MORPHOP_STREAM_H__
+
+#include "morphop-engine.h"
+#include "morphop-kernels.h"
+
+/*
+ * Streaming execution of an operator: the output is produced one row at a time, and the input is read
+ * one row at a time, when needed. Each pass of the operator keeps only the window of rows that the passes
+ * reading it still need (a few times the height of the element), so the memory doesn't depend on the height
+ * of the image. The results are the same of morphop_run().
+ * A chain of operators (see MorphOpChain) is streamed as a single graph of passes, so each row goes through
+ * all the steps while it's still in the cache.
+ *
+ * Skeletonization can't be streamed (the number of its iterations depends on the whole image): if a chain
+ * has one, the stream reads the entire image before giving the first row.
+ */
+
+/*
+ * Gives row 'y' of the input. The rows are asked in order, each one only once. The source can copy it
+ * to 'buffer' (row_size bytes) and return it, or return a pointer to its own memory, that must stay valid
+ * until the end of the stream (e.g. a memory-mapped file). Returns NULL if the row can't be read.
+ */
+typedef const unsigned char* (*MorphOpRowSource) (int, unsigned char*, void*);
+
+typedef enum {
+	STREAM_SOURCE = 0, // the input rows
+	STREAM_MORPH, // erosion or dilation of another pass
+	STREAM_MERGE // merge of two other passes
+} StreamNodeKind;
+
+/*
+ * A pass of the stream, with the ring of its last output rows
+ */
+typedef struct {
+	StreamNodeKind kind;
+	MorphOperator op;
+	ScaledElement element;
+	SourceTansformation srctransf;
+	ChannelMode channel_mode;
+	MergeOperation merge;
+	int a, b; // the input passes (only 'a' for STREAM_MORPH)
+	void* scratch; // the memory of morph_row() (only for STREAM_MORPH)
+
+	// how many rows ahead of the output this pass can be computed, and the passes that read it (see stream_set_capacities())
+	int lead;
+	int readers, reader_radius;
+
+	int capacity; // number of rows in the ring
+	unsigned char* ring;
+	const unsigned char** rows; // rows[y % capacity] is row y, for the last 'capacity' rows computed
+	int next_row; // the next row to compute
+} MorphOpStreamNode;
+
+typedef struct {
+	MorphOpChain chain;
+	int width, height;
+	PixelFormat format;
+	size_t row_size;
+
+	MorphOpRowSource source;
+	void* source_data;
+
+	MorphOpStreamNode* nodes;
+	int n_nodes;
+	int output; // the last pass, whose rows are given by morphop_stream_next_row()
+	unsigned char* outside[2]; // the rows outside of the image, for erosion and for dilation
+
+	MorphOpArena arena; // the passes and their rings
+
+	// chains with a skeletonization: the whole image and its result
+	MorphOpImage whole_src, whole_dst;
+	int whole_ready;
+
+	const MorphOpCalibration* calibration; // the model of the planner (see morphop_stream_plan()), NULL for the default one
+
+	int next_row;
+	MorphOpStatus status;
+} MorphOpStream;
+
+MorphOpStatus morphop_stream_init(MorphOpStream*, const MorphOpSettings*, int, int, PixelFormat, MorphOpRowSource, void*);
+MorphOpStatus morphop_stream_init_chain(MorphOpStream*, const MorphOpChain*, int, int, PixelFormat, MorphOpRowSource, void*);
+const unsigned char* morphop_stream_next_row(MorphOpStream*);
+void morphop_stream_plan(MorphOpStream*, const MorphOpCalibration*);
+void morphop_stream_free(MorphOpStream*);
+int morphop_stream_get_reach(const MorphOpChain*);
+int morphop_stream_get_window(const MorphOpChain*, int);
+
+#endif
@@ -0,0 +1,396 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "morphop-kernels.h"
+
+// the levels of the priority queue: the gradient is quantized to 8 bits
+#define WATERSHED_LEVELS 256
+
+// the labels of the pixels that are not in a basin
+#define LABEL_NONE 0
+#define LABEL_QUEUED -1
+#define LABEL_LINE -2
+
+// the phases after the gradient: the levels, the markers, the flooding and the result
+#define WATERSHED_PHASES 4
+
+/*
+ * The hierarchical queue of the flooding: a FIFO list of pixels for each level, linked through 'next'
+ * (a pixel is in the queue at most once)
+ */
+typedef struct {
+	int head[WATERSHED_LEVELS];
+	int tail[WATERSHED_LEVELS];
+	int* next;
+	int level; // the lowest level that can have pixels
+} LevelQueue;
+
+/*
+ * The progress function of the context, while the gradient runs (see gradient_progress())
+ */
+typedef struct {
+	MorphOpProgressFunc progress;
+	void* data;
+} GradientProgress;
+
+static void get_levels(const MorphOpImage*, unsigned char*);
+static int label_markers(const MorphOpImage*, int*, int*);
+static int label_minima(const unsigned char*, int, int, int*, int*, unsigned char*);
+static void queue_push(LevelQueue*, int, int);
+static int queue_pop(LevelQueue*);
+static int gradient_progress(double, double, void*);
+static void watershed_progress(MorphOpContext*, double);
+static void profile_watershed(MorphOpContext*, int, const MorphOpImage*, size_t);
+
+static const int dx[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+static const int dy[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+
+/* morphop_watershed()
+ *
+ *  - MorphOpContext* ctx: the context, it must not be used by another operation at the same time
+ *  - const StructuringElement* element: the element of the gradient
+ *  - const MorphOpImage* src: the image
+ *  - const MorphOpImage* markers: the markers (same size of the image, any format): each connected group of pixels
+ *    that are not black is the seed of a basin. If NULL, the seeds are the regional minima of the gradient.
+ *  - MorphOpImage* dst: the result, with the size and format of the image. It can be the image, but not the markers.
+ *
+ *  Watershed segmentation of the morphological gradient of the image (OPERATOR_GRADIENT, computed in memory): the
+ *  basins grow from their seeds in the order of the gradient, as water rising from them, and the pixels where two
+ *  basins meet are the watershed lines. The flooding is the one of F. Meyer ("Topographic distance and watershed
+ *  lines", 1994), with a hierarchical queue of 256 levels: the gradient is quantized to 8 bits (luminosity, for RGB),
+ *  so it takes linear time. The lines are white in 'dst' and the rest is black; the alpha is the one of the gradient.
+ */
+MorphOpStatus morphop_watershed(MorphOpContext* ctx, const StructuringElement* element, const MorphOpImage* src, const MorphOpImage* markers, MorphOpImage* dst)
+{
+	const int color_channels = dst->format.channels - (dst->format.has_alpha ? 1 : 0);
+	const size_t pixels = (size_t)src->width * src->height;
+	const int width = src->width, height = src->height;
+	MorphOpSettings gradient = { OPERATOR_GRADIENT, *element, 1, CHANNELS_LUMINOSITY };
+	GradientProgress progress = { ctx->progress, ctx->progress_data };
+	LevelQueue queue;
+	unsigned char* level, *seen;
+	int* label, *stack;
+	float* line;
+	MorphOpStatus status;
+	int c, k, l;
+	size_t p;
+
+	if (
+		src->data == NULL || dst->data == NULL || pixels > INT_MAX ||
+		(markers != NULL && (markers->data == NULL || markers->width != width || markers->height != height || markers->data == dst->data))
+	) return MORPHOP_INVALID;
+
+	// the gradient goes to 'dst' (morphop_run() checks the sizes and formats). It counts as one phase of the progress
+	ctx->progress = (progress.progress != NULL ? gradient_progress : NULL);
+	ctx->progress_data = &progress;
+	status = morphop_run(ctx, &gradient, src, dst);
+	ctx->progress = progress.progress;
+	ctx->progress_data = progress.data;
+
+	if (status != MORPHOP_OK) return status;
+
+	// the arena of the gradient is given back
+	arena_reset(&ctx->arena);
+
+	ctx->done = 1;
+	ctx->total = 1 + WATERSHED_PHASES;
+
+	profile_watershed(ctx, 0, dst, 0);
+
+	level = arena_alloc(&ctx->arena, pixels);
+	seen = arena_alloc(&ctx->arena, pixels);
+	label = arena_alloc(&ctx->arena, pixels * sizeof(int));
+	stack = arena_alloc(&ctx->arena, pixels * sizeof(int));
+	queue.next = arena_alloc(&ctx->arena, pixels * sizeof(int));
+	line = arena_alloc(&ctx->arena, pixels * sizeof(float));
+	if (level == NULL || seen == NULL || label == NULL || stack == NULL || queue.next == NULL || line == NULL) return MORPHOP_NO_MEMORY;
+
+	get_levels(dst, level);
+	watershed_progress(ctx, ctx->done + 1);
+	if (ctx->status != MORPHOP_OK) return ctx->status;
+
+	// the seeds of the basins
+	for (p = 0; p < pixels; p++) label[p] = LABEL_NONE;
+	if (markers != NULL) label_markers(markers, label, stack);
+	else label_minima(level, width, height, label, stack, seen);
+
+	watershed_progress(ctx, ctx->done + 1);
+	if (ctx->status != MORPHOP_OK) return ctx->status;
+
+	// the flooding starts from the neighbors of the seeds
+	for (l = 0; l < WATERSHED_LEVELS; l++) queue.head[l] = queue.tail[l] = -1;
+	queue.level = 0;
+
+	for (p = 0; p < pixels; p++) {
+		int x = (int)p % width, y = (int)p / width;
+
+		if (label[p] <= 0) continue;
+
+		for (k = 0; k < 8; k++) {
+			int nx = x + dx[k], ny = y + dy[k];
+			int q = ny * width + nx;
+
+			if (nx < 0 || nx >= width || ny < 0 || ny >= height || label[q] != LABEL_NONE) continue;
+
+			label[q] = LABEL_QUEUED;
+			queue_push(&queue, q, level[q]);
+		}
+	}
+
+	for (;;) {
+		int p = queue_pop(&queue);
+		int x, y, basin = LABEL_NONE;
+
+		if (p < 0) break;
+
+		x = p % width;
+		y = p / width;
+
+		// the pixel joins the basin of its neighbors, if they all are in the same one. Else it's on a line
+		for (k = 0; k < 8; k++) {
+			int nx = x + dx[k], ny = y + dy[k];
+			int q = ny * width + nx;
+
+			if (nx < 0 || nx >= width || ny < 0 || ny >= height || label[q] <= 0) continue;
+
+			if (basin == LABEL_NONE) basin = label[q];
+			else if (label[q] != basin) basin = LABEL_LINE;
+		}
+
+		label[p] = basin;
+		if (basin == LABEL_LINE) continue;
+
+		// the water of the basin goes on to the neighbors, never below the current level
+		for (k = 0; k < 8; k++) {
+			int nx = x + dx[k], ny = y + dy[k];
+			int q = ny * width + nx;
+
+			if (nx < 0 || nx >= width || ny < 0 || ny >= height || label[q] != LABEL_NONE) continue;
+
+			label[q] = LABEL_QUEUED;
+			queue_push(&queue, q, (level[q] > queue.level ? level[q] : queue.level));
+		}
+	}
+
+	watershed_progress(ctx, ctx->done + 1);
+	if (ctx->status != MORPHOP_OK) return ctx->status;
+
+	// the lines are white, the basins (and the pixels that no basin reached) black
+	for (p = 0; p < pixels; p++) {
+		line[p] = (label[p] == LABEL_LINE ? (dst->format.type == SAMPLE_U8 ? 255 : (dst->format.type == SAMPLE_U16 ? 65535 : 1)) : 0);
+	}
+	for (c = 0; c < color_channels; c++) plane_put(line, c, dst);
+
+	watershed_progress(ctx, ctx->done + 1);
+
+	profile_watershed(ctx, 1, dst, arena_mark(&ctx->arena));
+
+	return ctx->status;
+}
+
+/* get_levels()
+ *
+ * The levels of the flooding: the luminosity of the gradient, quantized to 8 bits
+ */
+static void get_levels(const MorphOpImage* image, unsigned char* level)
+{
+	const int channels = image->format.channels;
+	int x, y, i;
+
+	for (y = 0; y < image->height; y++) {
+		const unsigned char* row = image->data + (size_t)y * image->stride;
+
+		for (x = 0; x < image->width; x++) {
+			double pixel[3], value;
+
+			for (i = 0; i < (image->format.is_rgb ? 3 : 1); i++) {
+				switch (image->format.type) {
+					case SAMPLE_U8: pixel[i] = row[x * channels + i]; break;
+					case SAMPLE_U16: pixel[i] = ((const unsigned short*)row)[x * channels + i] / 257.0; break;
+					case SAMPLE_FLOAT: default: pixel[i] = ((const float*)row)[x * channels + i] * 255.0; break;
+				}
+			}
+
+			value = (image->format.is_rgb ? pixel[0] * 0.2126 + pixel[1] * 0.7152 + pixel[2] * 0.0722 : pixel[0]);
+			level[(size_t)y * image->width + x] = (unsigned char)(value < 0 ? 0 : (value > 255 ? 255 : value + 0.5));
+		}
+	}
+}
+
+/* label_markers()
+ *
+ * Gives a label (from 1) to each connected group of pixels of the markers that are not black. Returns the number of labels.
+ */
+static int label_markers(const MorphOpImage* markers, int* label, int* stack)
+{
+	const int width = markers->width, height = markers->height;
+	const int color_channels = markers->format.channels - (markers->format.has_alpha ? 1 : 0);
+	int n_labels = 0;
+	int x, y, c, k;
+
+	// first, the pixels that are not black are marked
+	for (y = 0; y < height; y++) {
+		const unsigned char* row = markers->data + (size_t)y * markers->stride;
+
+		for (x = 0; x < width; x++) {
+			for (c = 0; c < color_channels; c++) {
+				int i = x * markers->format.channels + c;
+
+				if (
+					(markers->format.type == SAMPLE_U8 && row[i] > 0) ||
+					(markers->format.type == SAMPLE_U16 && ((const unsigned short*)row)[i] > 0) ||
+					(markers->format.type == SAMPLE_FLOAT && ((const float*)row)[i] > 0)
+				) {
+					label[y * width + x] = LABEL_QUEUED;
+					break;
+				}
+			}
+		}
+	}
+
+	// then each group of them gets its label
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			int top = 0;
+
+			if (label[y * width + x] != LABEL_QUEUED) continue;
+
+			n_labels++;
+			label[y * width + x] = n_labels;
+			stack[top++] = y * width + x;
+
+			while (top > 0) {
+				int p = stack[--top];
+
+				for (k = 0; k < 8; k++) {
+					int nx = p % width + dx[k], ny = p / width + dy[k];
+					int q = ny * width + nx;
+
+					if (nx < 0 || nx >= width || ny < 0 || ny >= height || label[q] != LABEL_QUEUED) continue;
+
+					label[q] = n_labels;
+					stack[top++] = q;
+				}
+			}
+		}
+	}
+
+	return n_labels;
+}
+
+/* label_minima()
+ *
+ * Gives a label (from 1) to each regional minimum of the levels: a connected group of pixels of the same level,
+ * with no darker neighbor. 'seen' marks the pixels whose group has been visited. Returns the number of labels.
+ */
+static int label_minima(const unsigned char* level, int width, int height, int* label, int* stack, unsigned char* seen)
+{
+	const size_t pixels = (size_t)width * height;
+	int n_labels = 0;
+	size_t p;
+	int k, i;
+
+	memset(seen, 0, pixels);
+
+	for (p = 0; p < pixels; p++) {
+		int top = 1, is_minimum = 1;
+
+		if (seen[p]) continue;
+
+		// the stack keeps all the pixels of the group (it only grows)
+		seen[p] = 1;
+		stack[0] = (int)p;
+
+		for (i = 0; i < top; i++) {
+			int x = stack[i] % width, y = stack[i] / width;
+
+			for (k = 0; k < 8; k++) {
+				int nx = x + dx[k], ny = y + dy[k];
+				int q = ny * width + nx;
+
+				if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+
+				if (level[q] < level[p]) is_minimum = 0;
+				else if (level[q] == level[p] && !seen[q]) {
+					seen[q] = 1;
+					stack[top++] = q;
+				}
+			}
+		}
+
+		if (is_minimum) {
+			n_labels++;
+			for (i = 0; i < top; i++) label[stack[i]] = n_labels;
+		}
+	}
+
+	return n_labels;
+}
+
+static void queue_push(LevelQueue* queue, int p, int level)
+{
+	queue->next[p] = -1;
+
+	if (queue->tail[level] < 0) queue->head[level] = p;
+	else queue->next[queue->tail[level]] = p;
+
+	queue->tail[level] = p;
+}
+
+/* queue_pop()
+ *
+ * Takes the first pixel of the lowest level that has pixels, or returns -1 if the queue is empty.
+ * The levels below it are empty for good: the pixels are never pushed below the current level.
+ */
+static int queue_pop(LevelQueue* queue)
+{
+	int p;
+
+	while (queue->level < WATERSHED_LEVELS && queue->head[queue->level] < 0) queue->level++;
+	if (queue->level == WATERSHED_LEVELS) return -1;
+
+	p = queue->head[queue->level];
+	queue->head[queue->level] = queue->next[p];
+	if (queue->head[queue->level] < 0) queue->tail[queue->level] = -1;
+
+	return p;
+}
+
+/* gradient_progress()
+ *
+ * The progress of the gradient is the first phase of the watershed
+ */
+static int gradient_progress(double done, double total, void* data)
+{
+	GradientProgress* progress = data;
+
+	return progress->progress(done / total, 1 + WATERSHED_PHASES, progress->data);
+}
+
+static void watershed_progress(MorphOpContext* ctx, double done)
+{
+	ctx->done = done;
+
+	if (ctx->progress != NULL && !ctx->progress(ctx->done, ctx->total, ctx->progress_data)) {
+		ctx->status = MORPHOP_CANCELLED;
+	}
+}
+
+/* profile_watershed()
+ *
+ * Tells the profile function of the context, if any, that the flooding starts or ends (the gradient has its own passes)
+ */
+static void profile_watershed(MorphOpContext* ctx, int end, const MorphOpImage* image, size_t bytes_allocated)
+{
+	MorphOpPassInfo info = {
+		"watershed", end,
+		(end ? (unsigned long)image->width * image->height : 0),
+		(end ? (unsigned long)image->height : 0),
+		(end ? (unsigned long)image->height : 0),
+		bytes_allocated,
+		NULL
+	};
+
+	if (ctx->profile != NULL) ctx->profile(&info, ctx->profile_data);
+}
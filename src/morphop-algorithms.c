@@ -1,43 +1,154 @@
 
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
-#include <math.h>
 #include <string.h>
 #include <stdlib.h>
 #include "morphop-algorithms.h"
+#include "morphop-region.h"
+#include "morphop-profile.h"
+#include "morphop-stream.h"
+#include "morphop-scratch.h"
+#include "morphop-tiles.h"
+#include "morphop-calibration.h"
 #include "morphop-gui.h"
 
-#define min(a,b) a < b ? a : b
-#define USE_2_7_API (!(defined _WIN32 || (!defined _WIN32 && (GIMP_MAJOR_VERSION == 2) && (GIMP_MINOR_VERSION <= 6))))
+// the batch computes a drawable in another thread while the main one reads and writes the others
+#define BATCH_OVERLAP_IO GLIB_CHECK_VERSION(2, 32, 0)
 
-#if USE_2_7_API
-	// in the new 2.7 API, the function 'gimp_drawable_get_image' has been replaced by 'gimp_item_get_image'
-	#define gimp_drawable_get_image gimp_item_get_image
-#endif
+// minimum interval, in seconds, between two updates of the progress bar
+#define PROGRESS_UPDATE_INTERVAL 0.25
+
+// how often, in seconds, the batch checks its worker thread (see batch_wait())
+#define BATCH_POLL_INTERVAL 0.05
+
+// the memory, in MB, that the pixels of an operation can take: beyond it, the drawable is processed a strip at a
+// time (see run_out_of_core()). The environment variable MORPHOP_MEMORY_BUDGET can change it
+#define MEMORY_BUDGET 1024
+
+static MorphOpStatus chain_run(MorphOpContext*, const MorphOpChain*, const MorphOpImage*, MorphOpImage*);
+static MorphOpStatus run_out_of_core(GimpDrawable*, MorphOpRegion*, const MorphOpChain*);
+static int out_of_core_read(int, int, MorphOpImage*, void*);
+static int out_of_core_write(int, int, MorphOpImage*, void*);
+static gsize get_memory_budget(void);
+static gchar* chain_get_label(const MorphOpChain*, gboolean);
+static void progress_start(gchar*);
+static int progress_update(double, double, void*);
+static void progress_end(gboolean);
+
+/*
+ * State of the progress bar for a full-image (non-preview) operation.
+ * libmorphop reports the cost of the work done by all the passes of the operator, so the bar
+ * moves once, from 0 to 1, whatever the number of passes.
+ * The plugin never sees the "cancel" button of the bar: GIMP ends the call and closes the plugin, without
+ * telling it, and its cleanup closes the undo group left open. The engine always runs to the end.
+ */
+typedef struct {
+	gchar* label; // name of the running operator (or operators, for a chain)
+	double shown; // last fraction sent to GIMP, it never decreases
+	double last_update; // time (from 'timer') of the last update sent to GIMP
+	GTimer* timer; // measures the elapsed time, used for the ETA
+} MorphOpProgress;
+
+static MorphOpProgress progress = { NULL, 0, 0, NULL };
+
+/*
+ * A drawable of a batch (see start_batch_operation()), from the moment its pixels are read to the
+ * moment its result is written back. Each slot has its own memory and context, so the engine can work on one
+ * slot while GIMP reads or writes the other.
+ */
+typedef struct {
+	GimpDrawable* drawable; // NULL if the slot is empty
+	MorphOpRegion region;
+	MorphOpArena scratch;
+	MorphOpContext context;
+	const MorphOpChain* chain;
+	gboolean undo_step; // TRUE if the result is written as an undo step of its own
+	MorphOpStatus status;
 
-static void do_morph_operation(MorphOperator, GimpPixelRgn*, GimpPixelRgn*, guchar*, guchar*, StructuringElement, SourceTansformation);
-static void do_merge_operation(MergeOperation, GimpPixelRgn*, GimpPixelRgn*, GimpPixelRgn*, guchar*, guchar*, guchar*, SourceTansformation);
-static gboolean is_black(GimpPixelRgn*, guchar*);
-static void fill_black(GimpPixelRgn*, GimpPixelRgn*, guchar*, guchar*); 
-static void prepare_image_buffers(GimpDrawable*, GimpPixelRgn*, GimpPixelRgn*, guchar**, guchar**, int, int, int, int, gboolean);
+	GThread* worker; // the thread running the engine, if any
+	volatile gint finished; // set by the worker when the engine returns
+	volatile gint permille; // progress of the engine on this drawable, in thousandths
+} BatchSlot;
 
+static MorphOpStatus run_batch(const gint32*, int, const MorphOpChain*, gboolean);
+static void layers_collect(const gint32*, int, MorphOpLayers, GArray*);
+static gboolean batch_prepare(BatchSlot*, gint32);
+static void batch_start(BatchSlot*);
+static void batch_wait(BatchSlot*, int, int);
+static void batch_commit(BatchSlot*);
+static gpointer batch_worker(gpointer);
+static int batch_progress(double, double, void*);
+
+// memory for the selected pixels and for the result. It's kept between
+// two operations, so updating the preview doesn't allocate again
+static MorphOpArena scratch = { NULL, NULL, 0, 0, 0, NULL };
+
+// the libmorphop context, whose scratch memory is kept between two operations too
+static MorphOpContext context;
+static gboolean context_ready = FALSE;
+
+/*
+ * The drawable of an operation that runs out of core, and the region read and written by the strips
+ */
+typedef struct {
+	GimpDrawable* drawable;
+	const MorphOpRegion* region;
+} OutOfCoreIO;
+
+/*
+ * The trees of the last area opening or closing, and the pixels they were built from: when only the threshold
+ * changes, the preview filters them again instead of building them (see start_area_operation())
+ */
+typedef struct {
+	MorphOpAreaTree tree; // empty (no values) if there is no tree
+	gint32 drawable_id;
+	int x, y;
+	gboolean is_preview;
+} AreaTreeCache;
+
+static AreaTreeCache area_cache = { { 0 }, -1, 0, 0, FALSE };
 
 /* start_operation()
- *  - GimpDrawable *drawable: the original, entire GIMP input drawable 
+ *  - GimpDrawable *drawable: the original, entire GIMP input drawable
  *  - GimpPreview *preview: the (optional) preview object. It is != NULL when the operation is used to update the preview window
  *  - MorphOpSettings settings: the settings object
- * 
- * 	Called when the user requests to start a morphological operation. It prepares the graphic buffers (or "regions")
- *  and calls the right operator using the given settings. 
+ *
+ * 	Called when the user requests to start a morphological operation. It copies the selection to memory,
+ *  runs the operator of the given settings with libmorphop and writes the result back. If the selection is not
+ *  a rectangle, only its pixels are computed (see region_read_selection()).
+ *  If it fails, the drawable is left untouched.
+ */
+MorphOpStatus start_operation(GimpDrawable *drawable, GimpPreview *preview, MorphOpSettings settings)
+{
+	MorphOpChain chain;
+
+	chain.n_steps = 1;
+	chain.steps[0] = settings;
+
+	return start_chain_operation(drawable, preview, &chain);
+}
+
+/* start_chain_operation()
+ *  - GimpDrawable *drawable: the original, entire GIMP input drawable
+ *  - GimpPreview *preview: the (optional) preview object, see start_operation()
+ *  - const MorphOpChain* chain: the operators to run, one after the other
+ *
+ *  The same of start_operation() for a chain of operators: the selection is read once, all the steps run
+ *  in memory (see morphop_run_chain()) and the result is written back once, as a single undo step.
+ *  If the selection doesn't fit the memory budget, it's processed a strip at a time (see run_out_of_core()).
  */
-void start_operation(GimpDrawable *drawable, GimpPreview *preview, MorphOpSettings settings)
+MorphOpStatus start_chain_operation(GimpDrawable *drawable, GimpPreview *preview, const MorphOpChain* chain)
 {
-	GimpPixelRgn src_rgn, dst_rgn; // input and output regions
-	guchar* src_preview = NULL, *dst_preview = NULL; // preview buffers (used only when preview != NULL)
+	MorphOpRegion region; // the selection, in memory
+	MorphOpStatus status;
 	int sel_x, sel_y, sel_w, sel_h; // selection boundaries (will work on a subimage)
-	
+
 	gboolean is_preview = (preview != NULL);
-	
+
+	gchar* label = chain_get_label(chain, TRUE);
+	profile_operation_begin(label, is_preview);
+	g_free(label);
+
 	// init selection boundaries
 	if (is_preview) {
 		gimp_preview_get_position (preview, &sel_x, &sel_y);
@@ -45,830 +156,779 @@ void start_operation(GimpDrawable *drawable, GimpPreview *preview, MorphOpSettin
 	}
 	else {
 		gimp_drawable_mask_intersect (drawable->drawable_id, &sel_x, &sel_y, &sel_w, &sel_h);
-		gimp_progress_init (operator_get_string(settings.operator)); // init progress bar
-		
+		progress_start (chain_get_label(chain, FALSE)); // init progress bar
+
 		// from this point, subsequent changes to the drawable will result in a unique modification
 		// so, to go back, the user will have to press "undo" only once.
-		gimp_image_undo_group_start (gimp_drawable_get_image(drawable->drawable_id)); 
+		gimp_image_undo_group_start (gimp_drawable_get_image(drawable->drawable_id));
 	}
-	
-	// init GIMP tiles cache and buffers
-	gimp_tile_cache_ntiles (2 * ((sel_w * drawable->bpp) / gimp_tile_width() + 1));
-	prepare_image_buffers(drawable, &src_rgn, &dst_rgn, &src_preview, &dst_preview, sel_x, sel_y, sel_w, sel_h, is_preview);
-	
-	// start the requested operation...
-	
-	if (settings.operator == OPERATOR_EROSION) {
-		
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn, src_preview, dst_preview, settings.element, SRC_ORIGINAL);
-		
+
+	if (!context_ready) {
+		morphop_context_init(&context);
+		context_ready = TRUE;
 	}
-	else if (settings.operator == OPERATOR_DILATION) {
-		
-		do_morph_operation(OPERATOR_DILATION, &src_rgn, &dst_rgn, src_preview, dst_preview, settings.element, SRC_ORIGINAL);
-		
+
+	// the buffers of the previous operation are given back to the arena
+	arena_reset(&scratch);
+
+	// the preview can't be cancelled, so it doesn't report its progress
+	context.progress = (is_preview ? NULL : progress_update);
+	context.progress_data = NULL;
+	context.profile = (profile_is_enabled() ? profile_pass : NULL);
+	context.calibration = calibration_get();
+
+#if USE_GEGL_API
+	// the bands of each pass are processed by the GEGL threads
+	context.parallel = region_parallel_for;
+	context.parallel_data = &region;
+#endif
+
+	// the input and the output of the whole selection don't fit the memory budget: strip by strip
+	region_init(drawable, &region, sel_x, sel_y, sel_w, sel_h, is_preview);
+	gboolean out_of_core = (!is_preview && 2 * region.src.stride * sel_h > get_memory_budget());
+
+	// the tiles of the drawable, of its selection and of its shadow. The strips out of core read the rows of their
+	// halo again, the preview reads the same region at each update
+	gint32 image_id = gimp_drawable_get_image(drawable->drawable_id);
+	int window = (is_preview ? sel_h : out_of_core ? MIN(2 * morphop_stream_get_reach(chain), sel_h) : 0);
+	tiles_cache_init(sel_x, sel_w, (gimp_selection_is_empty(image_id) ? 2 : 3), window);
+
+	if (out_of_core) {
+		profile_stage_begin("run");
+		status = run_out_of_core(drawable, &region, chain);
+		profile_stage_end("run", (gulong)sel_w * sel_h, 0, 0, context.arena.peak);
 	}
-	else if (settings.operator == OPERATOR_OPENING) {
-		
-		// opening is an erosion followed by a dilation
-		
-		guchar* temp_preview = NULL;
-		if (is_preview) {
-			// in case of preview, be need an intermediate buffer
-			temp_preview = g_new(guchar, sel_w * sel_h * drawable->bpp);
-			memcpy(src_preview, src_preview, sel_w * sel_h * drawable->bpp);
+	else {
+		// copy the selection
+		profile_stage_begin("fetch");
+		gboolean prepared = region_prepare(drawable, &region, sel_x, sel_y, sel_w, sel_h, is_preview, &scratch);
+		gboolean selected = prepared && region_read_selection(image_id, drawable, &region, &scratch);
+		profile_stage_end("fetch", (gulong)sel_w * sel_h, sel_h, 0, arena_mark(&scratch));
+
+		if (prepared) {
+			// with an irregular selection, the engine works only around its pixels
+			context.selection = (selected ? &region.selection : NULL);
+
+			profile_stage_begin("run");
+			status = chain_run(&context, chain, &region.src, &region.dst);
+			profile_stage_end("run", (gulong)sel_w * sel_h, 0, 0, context.arena.peak);
+
+			context.selection = NULL;
 		}
-		
-		// do erosion
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn, src_preview, temp_preview, settings.element, SRC_ORIGINAL);
-		
-		if (!is_preview) {
-			// if not a preview, save the contents of the destination buffer to the real image
-			// the subsequent dilation will be applied to the updated drawable
-			gimp_drawable_flush (drawable);
-			gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-			gimp_drawable_update (drawable->drawable_id, dst_rgn.x, dst_rgn.y, dst_rgn.w, dst_rgn.h);
+		else {
+			status = MORPHOP_NO_MEMORY;
 		}
-		
-		// now dilate
-		do_morph_operation(OPERATOR_DILATION, &src_rgn, &dst_rgn, temp_preview, dst_preview, settings.element, SRC_ORIGINAL);
-		
-		if (is_preview) g_free(temp_preview);
-		
 	}
-	else if (settings.operator == OPERATOR_CLOSING) {
-		
-		// closing is the dual of the opening
-		
-		guchar* temp_preview = NULL;
-		if (is_preview) {
-			temp_preview = g_new(guchar, sel_w * sel_h * drawable->bpp);
-			memcpy(src_preview, src_preview, sel_w * sel_h * drawable->bpp);
-		}
-		
-		do_morph_operation(OPERATOR_DILATION, &src_rgn, &dst_rgn, src_preview, temp_preview, settings.element, SRC_ORIGINAL);
-		
-		if (!is_preview) {
-			gimp_drawable_flush (drawable);
-			gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-			gimp_drawable_update (drawable->drawable_id, dst_rgn.x, dst_rgn.y, dst_rgn.w, dst_rgn.h);
+
+	// end of the chosen operation, now save it back...
+
+	if (is_preview) {
+		// if preview, simply write to the preview object
+		// (the buffers stay in the scratch arena, they will be reused by the next update)
+		if (status == MORPHOP_OK) {
+			profile_stage_begin("draw");
+			gimp_preview_draw_buffer (preview, region.dst.data, region.dst.stride);
+			profile_stage_end("draw", (gulong)sel_w * sel_h, sel_h, 0, 0);
 		}
-		
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn, temp_preview, dst_preview, settings.element, SRC_ORIGINAL);
-		
-		if (is_preview) g_free(temp_preview);
+
+		profile_operation_end();
+		return status;
 	}
-	else if (settings.operator == OPERATOR_GRADIENT) {
-		
-		// gradient is an image that is a difference between its eroded and its dilated versions
-		
-		// need to double the input: the first one will be eroded, the second will be dilated
-		int drawable_d_id;
-		GimpDrawable* drawable_d;
-		GimpPixelRgn src_rgn_d, dst_rgn_d;
-		guchar* src_preview_d = NULL, *dst_preview_d = NULL;
-		
-		drawable_d_id = gimp_layer_new_from_drawable(drawable->drawable_id, gimp_drawable_get_image(drawable->drawable_id));
-		drawable_d = gimp_drawable_get(drawable_d_id);
-		
-		// prepare buffers for the dilation drawable
-		prepare_image_buffers(drawable_d, &src_rgn_d, &dst_rgn_d, &src_preview_d, &dst_preview_d, sel_x, sel_y, sel_w, sel_h, is_preview);
-		
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn, src_preview, dst_preview, settings.element, SRC_ORIGINAL);
-		do_morph_operation(OPERATOR_DILATION, &src_rgn_d, &dst_rgn_d, src_preview_d, dst_preview_d, settings.element, SRC_ORIGINAL);
-		
-		// save the difference
-		do_merge_operation(MERGE_DIFF, &dst_rgn, &dst_rgn_d, &dst_rgn, dst_preview, dst_preview_d, dst_preview, SRC_ORIGINAL);
-		
-		if (is_preview) {
-			g_free(src_preview_d);
-			g_free(dst_preview_d);
-		}
-		else {
-			gimp_drawable_detach (drawable_d);
-		}
+
+	// if direct manipulation, merge all the changes to the screen. If the user stopped the operation,
+	// the result is simply dropped, so the drawable doesn't change (the strips already stored stay in the shadow)
+	if (status == MORPHOP_OK) {
+		if (out_of_core) region_merge(drawable, &region);
+		else region_commit(drawable, &region);
 	}
-	else if (settings.operator == OPERATOR_BOUNDEXTR) {
-		
-		// boundary extraction is the difference between the original image and its erosion
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn, src_preview, dst_preview, settings.element, SRC_ORIGINAL);
-		do_merge_operation(MERGE_DIFF, &src_rgn, &dst_rgn, &dst_rgn, src_preview, dst_preview, dst_preview, SRC_ORIGINAL);
-		
+
+	// also finalize the progress bar and close the undo group
+	progress_end(status == MORPHOP_OK);
+	gimp_image_undo_group_end (gimp_drawable_get_image(drawable->drawable_id));
+	gimp_drawable_detach (drawable);
+
+	profile_operation_end();
+	return status;
+}
+
+/* start_batch_operation()
+ *  - const gint32* drawable_ids: the drawables to process
+ *  - int n_drawables: their number
+ *  - MorphOpSettings settings: the settings object, the same for all the drawables
+ *
+ *  Runs the operator on many drawables in one invocation of the plugin, with a single progress bar (see run_batch()).
+ *  Each drawable gets its own undo step. If the user cancels, the drawables already done keep the result
+ *  (GIMP closes the plugin, see MorphOpProgress).
+ *  Returns MORPHOP_INVALID if one of the IDs is not a drawable (nothing is done in that case).
+ */
+MorphOpStatus start_batch_operation(const gint32* drawable_ids, int n_drawables, MorphOpSettings settings)
+{
+	MorphOpChain chain;
+
+	chain.n_steps = 1;
+	chain.steps[0] = settings;
+
+	return run_batch(drawable_ids, n_drawables, &chain, TRUE);
+}
+
+/* start_layers_operation()
+ *  - gint32 image_id: the image
+ *  - MorphOpLayers layers: which of its layers get the operator
+ *  - const MorphOpChain* chain: the operators to run on each layer (see start_chain_operation())
+ *
+ *  Runs the chain on the layers of the image, within the selection, the same way of a batch (see run_batch()):
+ *  a layer is read while the previous one is computed. All of them are a single undo step. If the user
+ *  cancels, the layers already done keep the result: GIMP closes the plugin and the undo group (see
+ *  MorphOpProgress), so the undo step reverts them too.
+ */
+MorphOpStatus start_layers_operation(gint32 image_id, MorphOpLayers layers, const MorphOpChain* chain)
+{
+	GArray* layer_ids = g_array_new(FALSE, FALSE, sizeof(gint32));
+	gint n_layers;
+	gint32* top_layers = gimp_image_get_layers(image_id, &n_layers);
+	MorphOpStatus status;
+
+	layers_collect(top_layers, n_layers, layers, layer_ids);
+	g_free(top_layers);
+
+	gimp_image_undo_group_start (image_id);
+	status = run_batch((const gint32*)layer_ids->data, layer_ids->len, chain, FALSE);
+	gimp_image_undo_group_end (image_id);
+
+	g_array_free(layer_ids, TRUE);
+	return status;
+}
+
+/* run_batch()
+ *
+ * Runs the chain on each drawable, with a single progress bar. The scratch memory of the engine is reused from
+ * one drawable to the next. The reading and the writing of the pixels (that go through GIMP, so they must stay in
+ * the main thread) overlap with the computation: while the engine works on a drawable in a worker thread, the
+ * previous result is written back and the next drawable is read. If 'undo_steps' is TRUE, each drawable gets its
+ * own undo step, else the caller groups them.
+ * Returns MORPHOP_INVALID if one of the IDs is not a drawable (nothing is done in that case).
+ */
+static MorphOpStatus run_batch(const gint32* drawable_ids, int n_drawables, const MorphOpChain* chain, gboolean undo_steps)
+{
+	static BatchSlot slots[2];
+	MorphOpStatus status = MORPHOP_OK;
+	int i;
+
+	for (i = 0; i < n_drawables; i++) {
+		if (!gimp_drawable_is_valid(drawable_ids[i])) return MORPHOP_INVALID;
 	}
-	else if (settings.operator == OPERATOR_HITORMISS) {
-		
-		// hit-or-miss is an interception between two erosions: the first is the erosion of the original image with
-		// the structuring element composed by "white points", the second is the inverted image eroded with "black points" (see the GUI)
-		
-		StructuringElement B1, B2;
-		int drawable_c_id;
-		GimpDrawable* drawable_c;
-		GimpPixelRgn src_rgn_c, dst_rgn_c;
-		guchar* src_preview_c = NULL, *dst_preview_c = NULL;
-		
-		int i, j;
-		// white structuring element
-		for(i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
-			for(j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
-				if (settings.element.matrix[i][j] == 1) B1.matrix[i][j] = 1;
-				else B1.matrix[i][j] = 0;
-			}
-		}
-		B1.size = settings.element.size;
-		
-		// black structuring element
-		for(i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
-			for(j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
-				if (settings.element.matrix[i][j] == 0) B2.matrix[i][j] = 1;
-				else B2.matrix[i][j] = 0;
-			}
-		}
-		B2.size = settings.element.size;
-		
-		// prepare the "complement" drawable
-		drawable_c_id = gimp_layer_new_from_drawable(drawable->drawable_id, gimp_drawable_get_image(drawable->drawable_id));
-		drawable_c = gimp_drawable_get(drawable_c_id);
-		prepare_image_buffers(drawable_c, &src_rgn_c, &dst_rgn_c, &src_preview_c, &dst_preview_c, sel_x, sel_y, sel_w, sel_h, is_preview);
-		
-		// do erosions
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn, src_preview, dst_preview, B1, SRC_ORIGINAL);
-		// the second one is the erosion of the absolute set complement of the source image, so the flag 'SRC_INVERSE'
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn_c, src_preview_c, dst_preview_c, B2, SRC_INVERSE);
-		
-		// do interception (take only the common values)
-		do_merge_operation(MERGE_INTERSEPT, &dst_rgn, &dst_rgn_c, &dst_rgn, dst_preview, dst_preview_c, dst_preview, SRC_ORIGINAL);
-		
-		if (is_preview) {
-			g_free(src_preview_c);
-			g_free(dst_preview_c);
-		}
-		else {
-			gimp_drawable_detach (drawable_c);
-		}
+
+	for (i = 0; i < 2; i++) {
+		slots[i].drawable = NULL;
+		slots[i].chain = chain;
+		slots[i].undo_step = undo_steps;
+		arena_init(&slots[i].scratch);
+		morphop_context_init(&slots[i].context);
+		slots[i].context.progress = batch_progress;
+		slots[i].context.progress_data = &slots[i];
+		slots[i].context.calibration = calibration_get();
 	}
-	else if (settings.operator == OPERATOR_THICKENING) {
-
-		StructuringElement B1, B2;
-		int drawable_c_id;
-		GimpDrawable* drawable_c;
-		GimpPixelRgn src_rgn_c, dst_rgn_c;
-		guchar* src_preview_c = NULL, *dst_preview_c = NULL;
-		
-		int i, j;
-		for(i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
-			for(j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
-				if (settings.element.matrix[i][j] == 1) B1.matrix[i][j] = 1;
-				else B1.matrix[i][j] = 0;
-			}
-		}
-		B1.size = settings.element.size;
-		
-		for(i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
-			for(j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
-				if (settings.element.matrix[i][j] == 0) B2.matrix[i][j] = 1;
-				else B2.matrix[i][j] = 0;
-			}
-		}
-		B2.size = settings.element.size;
-		
-		drawable_c_id = gimp_layer_new_from_drawable(drawable->drawable_id, gimp_drawable_get_image(drawable->drawable_id));
-		drawable_c = gimp_drawable_get(drawable_c_id);
-		prepare_image_buffers(drawable_c, &src_rgn_c, &dst_rgn_c, &src_preview_c, &dst_preview_c, sel_x, sel_y, sel_w, sel_h, is_preview);
-		
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn, src_preview, dst_preview, B1, SRC_ORIGINAL);
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn_c, src_preview_c, dst_preview_c, B2, SRC_INVERSE);
-		
-		do_merge_operation(MERGE_INTERSEPT, &dst_rgn, &dst_rgn_c, &dst_rgn, dst_preview, dst_preview_c, dst_preview, SRC_ORIGINAL);
-		do_merge_operation(MERGE_UNION, &src_rgn, &dst_rgn, &dst_rgn, src_preview, dst_preview, dst_preview, SRC_ORIGINAL);
-		
-		if (is_preview) {
-			g_free(src_preview_c);
-			g_free(dst_preview_c);
-		}
-		else {
-			gimp_drawable_detach (drawable_c);
-		}
-	
+
+	progress_start(chain_get_label(chain, FALSE));
+
+	gchar* label = chain_get_label(chain, TRUE);
+	profile_operation_begin(label, FALSE);
+	g_free(label);
+
+	// the pipeline: drawable i is computed while i - 1 is written and i + 1 is read
+	if (n_drawables > 0 && !batch_prepare(&slots[0], drawable_ids[0])) status = MORPHOP_NO_MEMORY;
+
+	for (i = 0; i < n_drawables && status == MORPHOP_OK; i++) {
+		BatchSlot* current = &slots[i % 2];
+		BatchSlot* other = &slots[(i + 1) % 2];
+
+		batch_start(current);
+
+		if (other->drawable != NULL) batch_commit(other);
+		if (i + 1 < n_drawables && !batch_prepare(other, drawable_ids[i + 1])) status = MORPHOP_NO_MEMORY;
+
+		batch_wait(current, i, n_drawables);
+		if (status == MORPHOP_OK) status = current->status;
 	}
-	else if (settings.operator == OPERATOR_THINNING) {
-	
-		StructuringElement B1, B2;
-		int drawable_c_id;
-		GimpDrawable* drawable_c;
-		GimpPixelRgn src_rgn_c, dst_rgn_c;
-		guchar* src_preview_c = NULL, *dst_preview_c = NULL;
-		
-		int i, j;
-		for(i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
-			for(j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
-				if (settings.element.matrix[i][j] == 1) B1.matrix[i][j] = 1;
-				else B1.matrix[i][j] = 0;
-			}
-		}
-		B1.size = settings.element.size;
-		
-		for(i = 0; i < STRELEM_DEFAULT_SIZE; i++) {
-			for(j = 0; j < STRELEM_DEFAULT_SIZE; j++) {
-				if (settings.element.matrix[i][j] == 0) B2.matrix[i][j] = 1;
-				else B2.matrix[i][j] = 0;
-			}
-		}
-		B2.size = settings.element.size;
-		
-		drawable_c_id = gimp_layer_new_from_drawable(drawable->drawable_id, gimp_drawable_get_image(drawable->drawable_id));
-		drawable_c = gimp_drawable_get(drawable_c_id);
-		prepare_image_buffers(drawable_c, &src_rgn_c, &dst_rgn_c, &src_preview_c, &dst_preview_c, sel_x, sel_y, sel_w, sel_h, is_preview);
-		
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn, src_preview, dst_preview, B1, SRC_ORIGINAL);
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn_c, src_preview_c, dst_preview_c, B2, SRC_INVERSE);
-		
-		do_merge_operation(MERGE_INTERSEPT, &dst_rgn, &dst_rgn_c, &dst_rgn, dst_preview, dst_preview_c, dst_preview, SRC_ORIGINAL);
-		do_merge_operation(MERGE_DIFF, &src_rgn, &dst_rgn, &dst_rgn, src_preview, dst_preview, dst_preview, SRC_ORIGINAL);
-		
-		if (is_preview) {
-			g_free(src_preview_c);
-			g_free(dst_preview_c);
-		}
+
+	// the last result. If the batch stopped on an error, the drawable that was being computed is written only if
+	// the engine completed it, and the one read in advance is dropped
+	for (i = 0; i < 2; i++) {
+		if (slots[i].drawable == NULL) continue;
+
+		if (slots[i].finished && slots[i].status == MORPHOP_OK) batch_commit(&slots[i]);
 		else {
-			gimp_drawable_detach (drawable_c);
+			gimp_drawable_detach(slots[i].drawable);
+			slots[i].drawable = NULL;
 		}
-	
 	}
-	else if (settings.operator == OPERATOR_SKELETON) {
-		
-		// skeletonization follows this algorithm:
-		/*	
-			skeleton = black_image();
-			do
-			{
-				eroded = erode(img);
-				opened = dilate(eroded);
-				diff = img - opened;
-				skeleton = skeleton U diff;
-				img = eroded;
-			} while (is_black(img) == FALSE);
-		*/
-		
-		// we need some temporary buffers...
-		// ...for erosions
-		int drawable_erod_id;
-		GimpDrawable* drawable_erod;
-		GimpPixelRgn src_rgn_erod, dst_rgn_erod;
-		guchar* src_preview_erod = NULL, *dst_preview_erod = NULL;
-		
-		drawable_erod_id = gimp_layer_new_from_drawable(drawable->drawable_id, gimp_drawable_get_image(drawable->drawable_id));
-		drawable_erod = gimp_drawable_get(drawable_erod_id);
-		prepare_image_buffers(drawable_erod, &src_rgn_erod, &dst_rgn_erod, &src_preview_erod, &dst_preview_erod, sel_x, sel_y, sel_w, sel_h, is_preview);
-		if (!preview) {
-			#if USE_2_7_API
-				// in the new 2.7 API, the function 'gimp_image_add_layer' has been replaced by 'gimp_image_insert_layer'
-				gimp_image_insert_layer (gimp_drawable_get_image (drawable_erod->drawable_id), drawable_erod_id, 0, 0);
-			#else
-				gimp_image_add_layer (gimp_drawable_get_image (drawable_erod->drawable_id), drawable_erod_id, 0);
-			#endif
-		}
-	
-		// ...for opening and difference
-		int drawable_open_id;
-		GimpDrawable* drawable_open;
-		GimpPixelRgn src_rgn_open, dst_rgn_open;
-		guchar* src_preview_open = NULL, *dst_preview_open = NULL;
-		
-		drawable_open_id = gimp_layer_new_from_drawable(drawable->drawable_id, gimp_drawable_get_image(drawable->drawable_id));
-		drawable_open = gimp_drawable_get(drawable_open_id);
-		prepare_image_buffers(drawable_open, &src_rgn_open, &dst_rgn_open, &src_preview_open, &dst_preview_open, sel_x, sel_y, sel_w, sel_h, is_preview);
-		
-		// the destination region will be the final skeleton. 
-		// start filling it black...
-		fill_black(&src_rgn, &dst_rgn, src_preview, dst_preview);
-		
-		do {
-			// eroded = erosion(img) [must threshold 'img'!]
-			do_morph_operation(OPERATOR_EROSION, &src_rgn_erod, &dst_rgn_erod, src_preview_erod, dst_preview_erod, settings.element, SRC_THRESHOLD);
-			// open = dilate(eroded)
-			do_morph_operation(OPERATOR_DILATION, &dst_rgn_erod, &dst_rgn_open, dst_preview_erod, dst_preview_open, settings.element, SRC_ORIGINAL);
-			
-			// diff = img - open [must threshold 'img'!]
-			do_merge_operation(MERGE_DIFF, &src_rgn_erod, &dst_rgn_open, &dst_rgn_open, src_preview_erod, dst_preview_open, dst_preview_open, SRC_THRESHOLD);
-			
-			// skel = skel U diff
-			do_merge_operation(MERGE_UNION, &dst_rgn, &dst_rgn_open, &dst_rgn, dst_preview, dst_preview_open, dst_preview, SRC_ORIGINAL);
-			
-			// must update the eroded drawable for the next iteration
-			if (!is_preview) {
-				gimp_drawable_flush (drawable_erod);
-				gimp_drawable_merge_shadow (drawable_erod->drawable_id, FALSE);
-				gimp_drawable_update (drawable_erod_id, dst_rgn.x, dst_rgn.y, dst_rgn.w, dst_rgn.h);
-				prepare_image_buffers(drawable_erod, &src_rgn_erod, &dst_rgn_erod, &src_preview_erod, &dst_preview_erod, sel_x, sel_y, sel_w, sel_h, is_preview);
-			}
-			else {
-				memcpy(src_preview_erod, dst_preview_erod, sel_w * sel_h * drawable->bpp);
-			}
-		}
-		while (!is_black(&src_rgn_erod, src_preview_erod)); // algorithm ends when the eroded image becomes totally black
-		
-		// here: dst_rgn/dst_preview is the final skeleton
-		
-		if (is_preview) {
-			g_free(src_preview_erod);
-			g_free(dst_preview_erod);
-			g_free(src_preview_open);
-			g_free(dst_preview_open);
-		}
-		else {
-			gimp_image_remove_layer (gimp_drawable_get_image (drawable_erod->drawable_id), drawable_erod_id);
-			gimp_drawable_detach (drawable_erod);
-			gimp_drawable_detach (drawable_open);
-		}
-	
+
+	for (i = 0; i < 2; i++) {
+		morphop_context_free(&slots[i].context);
+		arena_free(&slots[i].scratch);
 	}
-	else if (settings.operator == OPERATOR_WTOPHAT) {
-		
-		// white top-hat is the difference between the original image and its opening
-		int drawable_o_id;
-		GimpDrawable* drawable_o;
-		GimpPixelRgn src_rgn_o, dst_rgn_o;
-		guchar* src_preview_o = NULL, *dst_preview_o = NULL;
-		
-		drawable_o_id = gimp_layer_new_from_drawable(drawable->drawable_id, gimp_drawable_get_image(drawable->drawable_id));
-		drawable_o = gimp_drawable_get(drawable_o_id);
-		prepare_image_buffers(drawable_o, &src_rgn_o, &dst_rgn_o, &src_preview_o, &dst_preview_o, sel_x, sel_y, sel_w, sel_h, is_preview);
-		
-		// create opening
-		do_morph_operation(OPERATOR_EROSION, &src_rgn, &dst_rgn_o, src_preview, dst_preview_o, settings.element, SRC_ORIGINAL);
-		do_morph_operation(OPERATOR_DILATION, &dst_rgn_o, &dst_rgn, dst_preview_o, dst_preview, settings.element, SRC_ORIGINAL);
-		
-		// and subtract it to the original image
-		do_merge_operation(MERGE_DIFF, &src_rgn, &dst_rgn, &dst_rgn, src_preview, dst_preview, dst_preview, SRC_ORIGINAL);
-		
-		if (is_preview) {
-			g_free(src_preview_o);
-			g_free(dst_preview_o);
-		}
-		else {
-			gimp_drawable_detach (drawable_o);
-		}
-		
+
+	progress_end(status == MORPHOP_OK);
+	profile_operation_end();
+
+	return status;
+}
+
+/* start_reconstruct_operation()
+ *  - GimpDrawable *drawable: the drawable that gets the result
+ *  - MorphOpReconstruction reconstruction: the operator, the marker and the mask
+ *
+ *  Reconstructs the marker under (or over, for the reconstruction by erosion) the mask, with libmorphop,
+ *  within the selection of 'drawable'. The marker and the mask can be any drawable of the same size, also 'drawable'
+ *  itself. The result is a single undo step.
+ *  Returns MORPHOP_INVALID if the marker or the mask are not drawables of the same size (nothing is done in that
+ *  case). If it fails, the drawable is left untouched.
+ */
+MorphOpStatus start_reconstruct_operation(GimpDrawable *drawable, MorphOpReconstruction reconstruction)
+{
+	MorphOpRegion region;
+	MorphOpStatus status;
+	int sel_x, sel_y, sel_w, sel_h;
+	int i;
+
+	gint32 inputs[2] = { reconstruction.marker_id, reconstruction.mask_id };
+	for (i = 0; i < 2; i++) {
+		if (
+			!gimp_drawable_is_valid(inputs[i]) ||
+			gimp_drawable_width(inputs[i]) != drawable->width || gimp_drawable_height(inputs[i]) != drawable->height
+		) return MORPHOP_INVALID;
 	}
-	else if (settings.operator == OPERATOR_BTOPHAT) {
-		
-		// black top-hat is the difference between the closing and the original image		
-		int drawable_c_id;
-		GimpDrawable* drawable_c;
-		GimpPixelRgn src_rgn_c, dst_rgn_c;
-		guchar* src_preview_c = NULL, *dst_preview_c = NULL;
-		
-		drawable_c_id = gimp_layer_new_from_drawable(drawable->drawable_id, gimp_drawable_get_image(drawable->drawable_id));
-		drawable_c = gimp_drawable_get(drawable_c_id);
-		prepare_image_buffers(drawable_c, &src_rgn_c, &dst_rgn_c, &src_preview_c, &dst_preview_c, sel_x, sel_y, sel_w, sel_h, is_preview);
-		
-		do_morph_operation(OPERATOR_DILATION, &src_rgn, &dst_rgn_c, src_preview, dst_preview_c, settings.element, SRC_ORIGINAL);
-		do_morph_operation(OPERATOR_EROSION, &dst_rgn_c, &dst_rgn, dst_preview_c, dst_preview, settings.element, SRC_ORIGINAL);
-		
-		do_merge_operation(MERGE_DIFF, &dst_rgn, &src_rgn, &dst_rgn, dst_preview, src_preview, dst_preview, SRC_ORIGINAL);
-		
-		if (is_preview) {
-			g_free(src_preview_c);
-			g_free(dst_preview_c);
-		}
-		else {
-			gimp_drawable_detach (drawable_c);
-		}
-		
+
+	gchar* label = g_strdup_printf("reconstruct-%s", morphop_operator_get_name(reconstruction.operator));
+	profile_operation_begin(label, FALSE);
+	g_free(label);
+
+	gimp_drawable_mask_intersect (drawable->drawable_id, &sel_x, &sel_y, &sel_w, &sel_h);
+	progress_start (g_strdup(reconstruction_get_string(reconstruction.operator)));
+	gimp_image_undo_group_start (gimp_drawable_get_image(drawable->drawable_id));
+
+	if (!context_ready) {
+		morphop_context_init(&context);
+		context_ready = TRUE;
 	}
-	
-	// end of the chosen operation, now save it back...
-	
+
+	arena_reset(&scratch);
+
+	// the tiles of the drawable, of the marker and of the mask (if they are other drawables) and of the shadow
+	tiles_cache_init(sel_x, sel_w, 2 + (reconstruction.marker_id != drawable->drawable_id) + (reconstruction.mask_id != drawable->drawable_id), 0);
+
+	// the marker goes in the source of the region and the mask in its destination, where it's reconstructed in place
+	// (the region already has the drawable itself, if it's the marker)
+	profile_stage_begin("fetch");
+	if (!region_prepare(drawable, &region, sel_x, sel_y, sel_w, sel_h, FALSE, &scratch)) status = MORPHOP_NO_MEMORY;
+	else if (
+		(reconstruction.marker_id != drawable->drawable_id && !region_read_drawable(reconstruction.marker_id, &region, &region.src)) ||
+		!region_read_drawable(reconstruction.mask_id, &region, &region.dst)
+	) status = MORPHOP_INVALID;
+	else status = MORPHOP_OK;
+	profile_stage_end("fetch", 2 * (gulong)sel_w * sel_h, 2 * sel_h, 0, arena_mark(&scratch));
+
+	if (status == MORPHOP_OK) {
+		// the propagation follows the image in any direction, it's not split in bands: no parallel function
+		context.progress = progress_update;
+		context.progress_data = NULL;
+		context.profile = (profile_is_enabled() ? profile_pass : NULL);
+
+		profile_stage_begin("run");
+		status = morphop_reconstruct(&context, reconstruction.operator, &region.src, &region.dst, &region.dst);
+		profile_stage_end("run", (gulong)sel_w * sel_h, 0, 0, context.arena.peak);
+	}
+
+	if (status == MORPHOP_OK) region_commit(drawable, &region);
+
+	progress_end(status == MORPHOP_OK);
+	gimp_image_undo_group_end (gimp_drawable_get_image(drawable->drawable_id));
+	gimp_drawable_detach (drawable);
+
+	profile_operation_end();
+	return status;
+}
+
+/* start_area_operation()
+ *  - GimpDrawable *drawable: the original, entire GIMP input drawable
+ *  - GimpPreview *preview: the (optional) preview object, see start_operation()
+ *  - MorphOpAreaSettings settings: the operator and the area threshold
+ *
+ *  Area opening or closing of the selection. The trees of the pixels are kept after the operation: if the next
+ *  one is on the same pixels with the same operator (the preview, when only the threshold changes), they are
+ *  just filtered with the new threshold.
+ */
+MorphOpStatus start_area_operation(GimpDrawable *drawable, GimpPreview *preview, MorphOpAreaSettings settings)
+{
+	MorphOpRegion region;
+	MorphOpStatus status = MORPHOP_OK;
+	int sel_x, sel_y, sel_w, sel_h;
+
+	gboolean is_preview = (preview != NULL);
+
+	gchar* label = g_strdup_printf("area-%s", morphop_operator_get_name(settings.operator));
+	profile_operation_begin(label, is_preview);
+	g_free(label);
+
 	if (is_preview) {
-		// if preview, simply write to the preview object
-		gimp_preview_draw_buffer (preview, dst_preview, dst_rgn.w * dst_rgn.bpp);
-		g_free(src_preview);
-		g_free(dst_preview);
+		gimp_preview_get_position (preview, &sel_x, &sel_y);
+		gimp_preview_get_size (preview, &sel_w, &sel_h);
 	}
 	else {
-		// if direct manipulation, merge all the changes to the screen
-		gimp_drawable_flush (drawable);
-		gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-		gimp_drawable_update (drawable->drawable_id, dst_rgn.x, dst_rgn.y, dst_rgn.w, dst_rgn.h);
-		
-		// also finalize the progress bar and close the undo group
-		gimp_progress_update(1.0);
-		gimp_image_undo_group_end (gimp_drawable_get_image(drawable->drawable_id));
-		gimp_drawable_detach (drawable);
+		gimp_drawable_mask_intersect (drawable->drawable_id, &sel_x, &sel_y, &sel_w, &sel_h);
+		progress_start (g_strdup(area_get_string(settings.operator)));
+		gimp_image_undo_group_start (gimp_drawable_get_image(drawable->drawable_id));
 	}
-}
 
-/* do_morph_operation()
- * 
- * Executes erosion or dilation using the given structuring element
- * 
- *	- MorphOperator op: the operator, it can be OPERATOR_EROSION or OPERATOR_DILATION
- *  - GimpPixelRgn* src: source region
- *  - GimpPixelRgn* dst: destination region
- *  - guchar* src_prev: source preview buffer (if any)
- *  - guchar* dst_prev: destination preview buffer
- *  - StructuringElement element: the structuring element
- *  - SourceTansformation srctransf: a "source preprocessing" option, it can be:
- *		- SRC_ORIGINAL (leaves source unchanged)
- *		- SRC_INVERSE (invert source's colors, used by Hit-or-Miss)
- *		- SRC_THRESHOLD (makes a threshold, if color < 127 => 0, else => 1, used by Skeletonization)
- */
-static void do_morph_operation(
-	MorphOperator op, 
-	GimpPixelRgn *src, GimpPixelRgn *dst, 
-	guchar* src_prev, guchar* dst_prev, 
-	StructuringElement element,
-	SourceTansformation srctransf
-) {
-	if (!(
-		op == OPERATOR_EROSION || 
-		op == OPERATOR_DILATION
-	)) return; // this function works only in operations derived from erosion or dilation
-	
-	// setting actual structuring element size
-	unsigned int final_elem_size;
-	if (element.size == SIZE_3x3) final_elem_size = 3;
-	if (element.size == SIZE_5x5) final_elem_size = 5;
-	if (element.size == SIZE_7x7) final_elem_size = 7;
-	if (element.size == SIZE_9x9) final_elem_size = 9;
-	if (element.size == SIZE_11x11) final_elem_size = 11;
-	
-	float scale = (float)STRELEM_DEFAULT_SIZE / final_elem_size;
-	int elem_center = ceil(final_elem_size / 2); // coordinates of the center element in the matrix
-	unsigned int i, y, x;	
-	
-	GimpImageType image_type = gimp_drawable_type (src->drawable->drawable_id);
-	gboolean is_preview = (src_prev != NULL || dst_prev != NULL);
-	
-	guchar row_buffer[src->w * src->bpp]; // will store the results, they are written row-by-row 
-	guchar row_buffer_mask[final_elem_size][src->w * src->bpp]; // will store the input pixel in a "big" row (for masking)
-	
-	guchar this_pixel[src->bpp]; // the visited pixel
-	guchar this_lum; // the luminosity of the visited pixel
-	guchar best_pixel[src->bpp]; // the best pixel found to be copied on the center pixel
-	unsigned int best_lum; // the luminosity of the best pixel
-	
-	// start looping on image
-	for (y = src->y; y < src->y + src->h; y ++) {
-		
-		// simply update the progress bar every 50 rows
-		if (!is_preview && y % 50 == 0) gimp_progress_update ((double)y / (src->y + src->h)); 
-		
-		// extracts input pixel for masking
-		int row_offset;
-		for (row_offset = -elem_center; row_offset <= elem_center; row_offset++) {
-			
-			int this_row = y + row_offset;
-			if (this_row >= src->y && this_row < src->y + src->h) {
-				
-				// difference if in "preview" or "direct" mode: if preview, will read the inputs from the src_preview buffer
-				// else, takes input pixel directly from the drawable
-				if (is_preview) {
-					memcpy(&row_buffer_mask[row_offset + elem_center], &src_prev[(this_row - src->y) * src->w * src->bpp], src->w * src->bpp);
-				}
-				else {
-					gimp_pixel_rgn_get_row (
-						src, 
-						row_buffer_mask[row_offset + elem_center], 
-						src->x, 
-						this_row, 
-						src->w
-					);
-				}
-			}
-			else {
-				// case in which we are outside the image: the input row is filled with useless pixels
-				for (i = 0; i < src->w * src->bpp; i++) {
-					row_buffer_mask[row_offset + elem_center][i] = (op == OPERATOR_EROSION ? 255 : 0);
-				}
-			}
-		}
-		
-		// start looping on each pixel in this row
-		for (x = 0; x < src->w; x++) {
-			
-			best_lum = -1; // reset the best luminosity
-			
-			// start looping on neighbors of pixel x;y
-			unsigned short mask_x, mask_y, neigh_x, neigh_y, mask_i, mask_j;
-			for (mask_y = 0; mask_y < final_elem_size; mask_y++) {
-				for (mask_x = 0; mask_x < final_elem_size; mask_x++) {
-					
-					// coordinates of this neighbor relative to row_buffer_mask
-					neigh_x = (x + mask_x - elem_center) * src->bpp;
-					neigh_y = mask_y;
-					
-					mask_i = floor(mask_y * scale);
-					mask_j = floor(mask_x * scale);
-					
-					// this neighbor will be considered only if...
-					if (
-						// it's part of the structuring element (it's not a black spot)
-						element.matrix[mask_i][mask_j] != 0 &&
-						// and it's inside the image bounds
-						neigh_x >= 0 &&
-						neigh_x < src->w * src->bpp						
-					){
-						// get this pixel's values
-						for(i = 0; i < src->bpp; i++) {
-							if (srctransf == SRC_ORIGINAL || srctransf == SRC_THRESHOLD) this_pixel[i] = row_buffer_mask[neigh_y][neigh_x + i];
-							else if (srctransf == SRC_INVERSE) this_pixel[i] = abs(row_buffer_mask[neigh_y][neigh_x + i] - 255);
-						}
-						
-						// and calc its luminosity (different ways for different image types)
-						if (image_type == GIMP_RGB_IMAGE || image_type == GIMP_RGBA_IMAGE) {
-							this_lum = this_pixel[0] * 0.2126 + this_pixel[1] * 0.7152 + this_pixel[2] * 0.0722;
-							if (srctransf == SRC_THRESHOLD) {
-								this_lum = (this_lum < 127 ? 0 : 255);
-								this_pixel[0] = this_pixel[1] = this_pixel[2] = this_lum;
-							}
-						}
-						else {
-							this_lum = this_pixel[0];
-							if (srctransf == SRC_THRESHOLD) {
-								this_lum = (this_lum < 127 ? 0 : 255);
-								this_pixel[0] = this_lum;
-							}
-						}
-						
-						// now check if this luminosity is better than the best found so far
-						if (
-							(best_lum == -1) ||
-							(op == OPERATOR_EROSION && this_lum < best_lum) ||	// erosion takes the darkest pixel
-							(op == OPERATOR_DILATION && this_lum > best_lum) 	// dilation takes the brightest
-						) {
-							// if better, save it
-							for(i = 0; i < src->bpp; i++) {
-								best_pixel[i] = this_pixel[i];
-							}
-							best_lum = this_lum;
-							
-							// check if the very best value have been reached before the end
-							// this should gain some speed...
-							if (
-								(op == OPERATOR_EROSION && best_lum == 0) ||
-								(op == OPERATOR_DILATION && best_lum == 255)
-							) {
-								goto end_mask;
-							} 
-							
-						}
-					}
-				}
-			}
-			
-end_mask:
-			
-			// finished checking pixels in the mask, now set the center to the best value found
-			if (best_lum == -1) {
-				// error case: a valid pixel was not found. For example, scaling a small structuring element 
-				// to small dimensions could produce a totally black matrix. Solution: pixels don't change.
-				for(i = 0; i < src->bpp; i++) {
-					// copy the original
-					row_buffer[x * src->bpp + i] = row_buffer_mask[elem_center][x * src->bpp + i];
-				}
-			}
-			else {
-				for(i = 0; i < src->bpp; i++) {
-					row_buffer[x * src->bpp + i] = best_pixel[i];
-				}
-			}
+	if (!context_ready) {
+		morphop_context_init(&context);
+		context_ready = TRUE;
+	}
+
+	arena_reset(&scratch);
+
+	// the preview reads the same region at each update
+	tiles_cache_init(sel_x, sel_w, 2, (is_preview ? sel_h : 0));
+
+	profile_stage_begin("fetch");
+	if (!region_prepare(drawable, &region, sel_x, sel_y, sel_w, sel_h, is_preview, &scratch)) status = MORPHOP_NO_MEMORY;
+	profile_stage_end("fetch", (gulong)sel_w * sel_h, sel_h, 0, arena_mark(&scratch));
+
+	if (status == MORPHOP_OK) {
+		MorphOpAreaTree* tree = &area_cache.tree;
+
+		if (
+			tree->value == NULL || tree->op != settings.operator ||
+			area_cache.drawable_id != drawable->drawable_id || area_cache.is_preview != is_preview ||
+			area_cache.x != sel_x || area_cache.y != sel_y || tree->width != sel_w || tree->height != sel_h
+		) {
+			// the union-find goes through the whole image in any order: it's not split in bands
+			context.progress = (is_preview ? NULL : progress_update);
+			context.progress_data = NULL;
+			context.profile = (profile_is_enabled() ? profile_pass : NULL);
+
+			profile_stage_begin("tree");
+			status = morphop_area_tree_build(&context, settings.operator, &region.src, tree);
+			profile_stage_end("tree", (gulong)sel_w * sel_h, 0, 0, context.arena.peak);
+
+			area_cache.drawable_id = drawable->drawable_id;
+			area_cache.is_preview = is_preview;
+			area_cache.x = sel_x;
+			area_cache.y = sel_y;
 		}
-		
-		// Finished checking this row, save it now in the preview buffer (for the GimpPreview widget), or in the real drawable
-		if (is_preview) {
-			memcpy(&dst_prev[(y - src->y) * src->w * src->bpp], row_buffer, src->w * src->bpp);
+
+		if (status == MORPHOP_OK) {
+			profile_stage_begin("run");
+			status = morphop_area_tree_filter(tree, MAX(settings.min_area, 1), &region.dst);
+			profile_stage_end("run", (gulong)sel_w * sel_h, 0, 0, 0);
 		}
-		else {
-			gimp_pixel_rgn_set_row (dst, row_buffer, src->x, y, src->w);
+	}
+
+	if (is_preview) {
+		if (status == MORPHOP_OK) {
+			profile_stage_begin("draw");
+			gimp_preview_draw_buffer (preview, region.dst.data, region.dst.stride);
+			profile_stage_end("draw", (gulong)sel_w * sel_h, sel_h, 0, 0);
 		}
+
+		profile_operation_end();
+		return status;
 	}
+
+	if (status == MORPHOP_OK) region_commit(drawable, &region);
+
+	// the trees of the whole selection won't be filtered again
+	morphop_area_tree_free(&area_cache.tree);
+
+	progress_end(status == MORPHOP_OK);
+	gimp_image_undo_group_end (gimp_drawable_get_image(drawable->drawable_id));
+	gimp_drawable_detach (drawable);
+
+	profile_operation_end();
+	return status;
 }
 
-/* do_merge_operation()
- * 
- * It saves an image that is a merge between the two inputs A and B. Merge can be 
- * - a "difference" between the two inputs (intended as abs(Ai - Bi)), where Ai is the ith pixel's value of A and Bi is the correspondent on B,
- * - an "union" (min(Ai - Bi, 255)),
- * - an "interseption", taking only the common pixels and setting the others to black.
- * 
- *	- MergeOperation op: the merge operation, it can be MERGE_DIFF, MERGE_UNION or MERGE_INTERSEPT
- *  - GimpPixelRgn* a: first input region
- *  - GimpPixelRgn* b: second input region
- *  - GimpPixelRgn* dst: destination region
- *  - guchar* a_prev: first input preview buffer (if any)
- *  - guchar* b_prev: second input preview buffer
- *  - guchar* dst_prev: destination preview buffer
- *  - SourceTansformation srctransf: a "source preprocessing" option applied to a/a_prev, see do_morph_operation()
+/* start_watershed_operation()
+ *  - GimpDrawable *drawable: the original, entire GIMP input drawable
+ *  - MorphOpWatershedSettings settings: the element of the gradient and the markers
+ *
+ *  Watershed segmentation of the selection: the gradient and the flooding run one after the other in memory
+ *  (see morphop_watershed()), and the watershed lines replace the pixels, as a single undo step.
+ *  The markers can be any drawable of the same size, also 'drawable' itself.
+ *  Returns MORPHOP_INVALID if the markers are not a drawable of the same size (nothing is done in that case).
+ *  If it fails, the drawable is left untouched.
  */
-static void do_merge_operation(
-	MergeOperation op, 
-	GimpPixelRgn* a, GimpPixelRgn* b, GimpPixelRgn* dst, 
-	guchar* a_prev, guchar* b_prev, 
-	guchar* dst_prev,
-	SourceTansformation srctransf
-){
-	gboolean is_preview = (a_prev != NULL || b_prev != NULL);
-	guchar row_buffer_a[a->w * a->bpp];
-	guchar row_buffer_b[b->w * b->bpp];
-	
-	GimpImageType image_type = gimp_drawable_type (a->drawable->drawable_id);
-	
-	unsigned int x, y, i;
-	int ignore_alpha = gimp_drawable_has_alpha(a->drawable->drawable_id) ? 1 : 0;
-	
-	for (y = a->y; y < a->y + a->h; y ++) {
-		
-		if (!is_preview && y % 50 == 0) gimp_progress_update ((double)y / (a->y + a->h)); 
-		
-		if (is_preview) {
-			memcpy(&row_buffer_a, &a_prev[(y - a->y) * a->w * a->bpp], a->w * a->bpp);
-			memcpy(&row_buffer_b, &b_prev[(y - b->y) * b->w * b->bpp], b->w * b->bpp);
-		}
-		else {
-			gimp_pixel_rgn_get_row (
-				a, 
-				row_buffer_a, 
-				a->x, 
-				y, 
-				a->w
-			);
-			
-			gimp_pixel_rgn_get_row (
-				b, 
-				row_buffer_b, 
-				b->x, 
-				y, 
-				b->w
-			);
-		}
-		
-		for (x = 0; x < a->w; x++) {
-		
-			// preoprocessing on a/a_prev
-			if (srctransf == SRC_THRESHOLD) {
-				for(i = 0; i < a->bpp - ignore_alpha; i++) {
-					if (image_type == GIMP_RGB_IMAGE || image_type == GIMP_RGBA_IMAGE) {
-						unsigned char this_lum = row_buffer_a[x * a->bpp + 0] * 0.2126 + row_buffer_a[x * a->bpp + 1] * 0.7152 + row_buffer_a[x * a->bpp + 2] * 0.0722;
-						row_buffer_a[x * a->bpp + 0] = row_buffer_a[x * a->bpp + 1] = row_buffer_a[x * a->bpp + 2] = (this_lum < 127 ? 0 : 255);
-						break;
-					}
-					else {
-						row_buffer_a[x * a->bpp + i] = row_buffer_a[x * a->bpp + i] < 127 ? 0 : 255;
-					}
-				}
-			}
-		
-			// merge here, skipping alpha channel if present
-			for(i = 0; i < a->bpp - ignore_alpha; i++) {
-				if (op == MERGE_DIFF) {
-					row_buffer_a[x * a->bpp + i] = abs(row_buffer_a[x * a->bpp + i] - row_buffer_b[x * a->bpp + i]);
-				}
-				else if (op == MERGE_UNION) {
-					row_buffer_a[x * a->bpp + i] = min(row_buffer_a[x * a->bpp + i] + row_buffer_b[x * a->bpp + i], 255);
-				}
-				else if (op == MERGE_INTERSEPT) {
-					// guchar inter_pixel[a->bpp]; ??
-					if (row_buffer_a[x * a->bpp + i] != row_buffer_b[x * b->bpp + i]) {
-						row_buffer_a[x * a->bpp + i] = 0;
-					}
-				}
-			}
-		}
-		
-		if (is_preview) {
-			memcpy(&dst_prev[(y - a->y) * a->w * a->bpp], row_buffer_a, a->w * a->bpp);
-		}
-		else {
-			gimp_pixel_rgn_set_row (dst, row_buffer_a, a->x, y, a->w);
-		}
+MorphOpStatus start_watershed_operation(GimpDrawable *drawable, MorphOpWatershedSettings settings)
+{
+	MorphOpRegion region;
+	MorphOpImage markers;
+	MorphOpStatus status;
+	int sel_x, sel_y, sel_w, sel_h;
+
+	gboolean has_markers = (settings.markers_id != -1);
+
+	if (
+		has_markers &&
+		(!gimp_drawable_is_valid(settings.markers_id) ||
+		gimp_drawable_width(settings.markers_id) != drawable->width || gimp_drawable_height(settings.markers_id) != drawable->height)
+	) return MORPHOP_INVALID;
+
+	profile_operation_begin((has_markers ? "watershed-markers" : "watershed"), FALSE);
+
+	gimp_drawable_mask_intersect (drawable->drawable_id, &sel_x, &sel_y, &sel_w, &sel_h);
+	progress_start (g_strdup("Watershed"));
+	gimp_image_undo_group_start (gimp_drawable_get_image(drawable->drawable_id));
+
+	if (!context_ready) {
+		morphop_context_init(&context);
+		context_ready = TRUE;
+	}
+
+	arena_reset(&scratch);
+	tiles_cache_init(sel_x, sel_w, 2 + (has_markers && settings.markers_id != drawable->drawable_id), 0);
+
+	// the markers are read in the format of the region: any pixel that is not black is part of one
+	profile_stage_begin("fetch");
+	if (!region_prepare(drawable, &region, sel_x, sel_y, sel_w, sel_h, FALSE, &scratch)) status = MORPHOP_NO_MEMORY;
+	else if (has_markers) {
+		markers = region.src;
+		markers.data = arena_alloc(&scratch, markers.stride * sel_h);
+
+		if (markers.data == NULL) status = MORPHOP_NO_MEMORY;
+		else status = (region_read_drawable(settings.markers_id, &region, &markers) ? MORPHOP_OK : MORPHOP_INVALID);
 	}
+	else status = MORPHOP_OK;
+	profile_stage_end("fetch", (has_markers ? 2 : 1) * (gulong)sel_w * sel_h, (has_markers ? 2 : 1) * sel_h, 0, arena_mark(&scratch));
+
+	if (status == MORPHOP_OK) {
+		// the bands of the gradient are processed by the GEGL threads, the flooding is not split
+		context.progress = progress_update;
+		context.progress_data = NULL;
+		context.profile = (profile_is_enabled() ? profile_pass : NULL);
+		context.calibration = calibration_get();
+
+#if USE_GEGL_API
+		context.parallel = region_parallel_for;
+		context.parallel_data = &region;
+#endif
+
+		profile_stage_begin("run");
+		status = morphop_watershed(&context, &settings.element, &region.src, (has_markers ? &markers : NULL), &region.dst);
+		profile_stage_end("run", (gulong)sel_w * sel_h, 0, 0, context.arena.peak);
+	}
+
+	if (status == MORPHOP_OK) region_commit(drawable, &region);
+
+	progress_end(status == MORPHOP_OK);
+	gimp_image_undo_group_end (gimp_drawable_get_image(drawable->drawable_id));
+	gimp_drawable_detach (drawable);
+
+	profile_operation_end();
+	return status;
 }
 
-static gboolean is_black(GimpPixelRgn* rgn, guchar* prev) 
+/* batch_prepare()
+ *
+ * Reads a drawable of the batch in a slot. Returns FALSE if there is no memory for it.
+ */
+static gboolean batch_prepare(BatchSlot* slot, gint32 drawable_id)
 {
-	gboolean is_preview = (prev != NULL);
-	guchar row_buffer[rgn->w * rgn->bpp];
-	
-	unsigned int x, y, i, tot_color;
-	int ignore_alpha = gimp_drawable_has_alpha(rgn->drawable->drawable_id) ? 1 : 0;
-	
-	for (y = rgn->y; y < rgn->y + rgn->h; y ++) {
-		
-		if (!is_preview && y % 50 == 0) gimp_progress_update ((double)y / (rgn->y + rgn->h)); 
-		
-		if (is_preview) {
-			memcpy(&row_buffer, &prev[(y - rgn->y) * rgn->w * rgn->bpp], rgn->w * rgn->bpp);
-		}
-		else {
-			gimp_pixel_rgn_get_row (
-				rgn, 
-				row_buffer, 
-				rgn->x, 
-				y, 
-				rgn->w
-			);
-		}
-		
-		for (x = 0; x < rgn->w; x++) {
-			tot_color = 0;
-			for(i = 0; i < rgn->bpp - ignore_alpha; i++) {
-				tot_color += row_buffer[x * rgn->bpp + i];
-			}
-			if (tot_color != 0) return FALSE;
-		}
+	int sel_x, sel_y, sel_w, sel_h;
+	GimpDrawable* drawable = gimp_drawable_get(drawable_id);
+
+	slot->status = MORPHOP_OK;
+	slot->finished = FALSE;
+
+	// the drawables with an empty selection are simply left as they are
+	if (!gimp_drawable_mask_intersect(drawable_id, &sel_x, &sel_y, &sel_w, &sel_h)) {
+		gimp_drawable_detach(drawable);
+		slot->drawable = NULL;
+		return TRUE;
+	}
+
+	arena_reset(&slot->scratch);
+	tiles_cache_init(sel_x, sel_w, (gimp_selection_is_empty(gimp_drawable_get_image(drawable_id)) ? 2 : 3), 0);
+
+	profile_stage_begin("fetch");
+	gboolean prepared = region_prepare(drawable, &slot->region, sel_x, sel_y, sel_w, sel_h, FALSE, &slot->scratch);
+	gboolean selected = prepared && region_read_selection(gimp_drawable_get_image(drawable_id), drawable, &slot->region, &slot->scratch);
+	profile_stage_end("fetch", (gulong)sel_w * sel_h, sel_h, 0, arena_mark(&slot->scratch));
+
+	slot->context.selection = (selected ? &slot->region.selection : NULL);
+
+	if (!prepared) {
+		gimp_drawable_detach(drawable);
+		slot->drawable = NULL;
+		return FALSE;
 	}
+
+	slot->drawable = drawable;
 	return TRUE;
 }
 
-static void fill_black(GimpPixelRgn* src, GimpPixelRgn* dst, guchar* src_prev, guchar* dst_prev) 
+/* batch_start()
+ *
+ * Starts the engine on the drawable of the slot, in a worker thread if possible
+ */
+static void batch_start(BatchSlot* slot)
 {
-	gboolean is_preview = (src_prev != NULL || dst_prev != NULL);
-	guchar row_buffer[src->w * src->bpp];
-	
-	unsigned int x, y, i;
-	int ignore_alpha = gimp_drawable_has_alpha(src->drawable->drawable_id) ? 1 : 0;
-	
-	for (y = src->y; y < src->y + src->h; y ++) {
-		
-		if (!is_preview && y % 50 == 0) gimp_progress_update ((double)y / (src->y + src->h)); 
-		
-		if (is_preview) {
-			memcpy(&row_buffer, &src_prev[(y - src->y) * src->w * src->bpp], src->w * src->bpp);
-		}
-		else {
-			gimp_pixel_rgn_get_row (
-				src, 
-				row_buffer, 
-				src->x, 
-				y, 
-				src->w
-			);
-		}
-		
-		for (x = 0; x < src->w; x++) {
-			for(i = 0; i < src->bpp - ignore_alpha; i++) {
-				row_buffer[x * src->bpp + i] = 0;
-			}
-		}
-		
-		if (is_preview) {
-			memcpy(&dst_prev[(y - src->y) * src->w * src->bpp], row_buffer, src->w * src->bpp);
-		}
-		else {
-			gimp_pixel_rgn_set_row (dst, row_buffer, src->x, y, src->w);
+	slot->finished = FALSE;
+	slot->permille = 0;
+	slot->worker = NULL;
+
+	if (slot->drawable == NULL) {
+		slot->finished = TRUE;
+		return;
+	}
+
+#if USE_GEGL_API
+	slot->context.parallel = region_parallel_for;
+	slot->context.parallel_data = &slot->region;
+#endif
+
+#if BATCH_OVERLAP_IO
+	slot->worker = g_thread_new("morphop-batch", batch_worker, slot);
+#else
+	batch_worker(slot);
+#endif
+}
+
+/* batch_wait()
+ *
+ * Waits for the engine to finish the drawable of the slot (the 'index'-th of 'count'), updating the
+ * progress bar meanwhile
+ */
+static void batch_wait(BatchSlot* slot, int index, int count)
+{
+	profile_stage_begin("wait");
+
+	while (!g_atomic_int_get(&slot->finished)) {
+		progress_update(index * 1000.0 + g_atomic_int_get(&slot->permille), count * 1000.0, NULL);
+		g_usleep(BATCH_POLL_INTERVAL * G_USEC_PER_SEC);
+	}
+
+	if (slot->worker != NULL) g_thread_join(slot->worker);
+	slot->worker = NULL;
+
+	profile_stage_end("wait", 0, 0, 0, 0);
+
+	progress_update(index + 1.0, count, NULL);
+}
+
+/* batch_commit()
+ *
+ * Writes the result of the slot back to its drawable (as one undo step, if the slot says so) and empties the slot
+ */
+static void batch_commit(BatchSlot* slot)
+{
+	gint32 image_id = gimp_drawable_get_image(slot->drawable->drawable_id);
+
+	if (slot->undo_step) gimp_image_undo_group_start (image_id);
+	region_commit(slot->drawable, &slot->region);
+	if (slot->undo_step) gimp_image_undo_group_end (image_id);
+
+	gimp_drawable_detach(slot->drawable);
+	slot->drawable = NULL;
+}
+
+static gpointer batch_worker(gpointer data)
+{
+	BatchSlot* slot = data;
+
+	slot->status = chain_run(&slot->context, slot->chain, &slot->region.src, &slot->region.dst);
+	g_atomic_int_set(&slot->finished, TRUE);
+
+	return NULL;
+}
+
+/* batch_progress()
+ *
+ * The progress function of the contexts of the batch. It runs in the worker thread, so it can't talk
+ * to GIMP: it only stores the progress, that batch_wait() shows from the main thread.
+ */
+static int batch_progress(double done, double total, void* data)
+{
+	BatchSlot* slot = data;
+
+	g_atomic_int_set(&slot->permille, (gint)(1000 * MIN(done / total, 1)));
+	return TRUE;
+}
+
+/* layers_collect()
+ *
+ * Appends to 'ids' the layers of the list that get the operator, taking the ones inside the layer groups
+ * (whose pixels are made by GIMP) instead of the groups
+ */
+static void layers_collect(const gint32* layer_ids, int n_layers, MorphOpLayers layers, GArray* ids)
+{
+	int i;
+
+	for (i = 0; i < n_layers; i++) {
+#if USE_2_7_API
+		if (gimp_item_is_group(layer_ids[i])) {
+			gint n_children;
+			gint32* children = gimp_item_get_children(layer_ids[i], &n_children);
+
+			layers_collect(children, n_children, layers, ids);
+			g_free(children);
+			continue;
 		}
+#endif
+
+		if (layers == LAYERS_ALL || gimp_drawable_get_linked(layer_ids[i])) g_array_append_val(ids, layer_ids[i]);
 	}
 }
 
-/* prepare_image_buffers()
- * 
- * Inits all the buffers so they can be read and written by GIMP
- * 
- * - GimpDrawable* drawable: the input drawable
- * - GimpPixelRgn* src_rgn, GimpPixelRgn* dst_rgn: input and destination regions (to be initialized) 
- * - guchar** src_preview, guchar** dst_preview: input and destination preview buffers (to be initialized) 
- * - int sel_x, int sel_y, int sel_w, int sel_h: selection boundaries
- * - gboolean is_preview: initialize preview buffers?
+/* chain_run()
+ *
+ * Runs the chain with libmorphop, from 'src' to 'dst'
  */
-static void prepare_image_buffers(
-	GimpDrawable* drawable,
-	GimpPixelRgn* src_rgn, GimpPixelRgn* dst_rgn, 
-	guchar** src_preview, guchar** dst_preview,
-	int sel_x, int sel_y, int sel_w, int sel_h,
-	gboolean is_preview
-){
-	gimp_pixel_rgn_init (
-		src_rgn, 
-		drawable,
-		sel_x, sel_y, 
-		sel_w, sel_h, 
-		FALSE, FALSE
-	);
+static MorphOpStatus chain_run(MorphOpContext* ctx, const MorphOpChain* chain, const MorphOpImage* src, MorphOpImage* dst)
+{
+	// a step with iterations is streamed as well: its repetitions don't need full size temporary images
+	if (chain->n_steps == 1 && morphop_settings_get_iterations(&chain->steps[0]) == 1) {
+		return morphop_run(ctx, &chain->steps[0], src, dst);
+	}
+
+	return morphop_run_chain(ctx, chain, src, dst);
+}
+
+/* run_out_of_core()
+ *
+ * Runs the chain on a region too big for the memory budget (see morphop_run_budget()): the region is read, computed
+ * and stored in the shadow of the drawable a strip at a time, with the rows around it that the chain needs. The
+ * temporary images that can't be split, the ones of a skeletonization, are mapped from scratch files.
+ * All the pixels of the region are computed: the selection mask is applied by region_merge().
+ */
+static MorphOpStatus run_out_of_core(GimpDrawable* drawable, MorphOpRegion* region, const MorphOpChain* chain)
+{
+	OutOfCoreIO io = { drawable, region };
+	MorphOpStatus status;
+
+	context.temp_alloc = scratch_image_alloc;
+	context.temp_free = scratch_image_free;
 
-	gimp_pixel_rgn_init (
-		dst_rgn, 
-		drawable,
-		sel_x, sel_y, 
-		sel_w, sel_h,
-		!is_preview, TRUE
+	status = morphop_run_budget(
+		&context, chain, region->w, region->h, region->src.format, get_memory_budget(),
+		out_of_core_read, out_of_core_write, &io
 	);
-	
-	if (is_preview) {
-		*src_preview = g_new(guchar, sel_w * sel_h * drawable->bpp);
-		*dst_preview = g_new(guchar, sel_w * sel_h * drawable->bpp);
-		
-		gimp_pixel_rgn_get_rect (
-			src_rgn,
-			*src_preview,
-			sel_x, sel_y,
-			sel_w, sel_h
-		);
-		
-		memcpy(*dst_preview, *src_preview, sel_w * sel_h * drawable->bpp);
+
+	context.temp_alloc = NULL;
+	context.temp_free = NULL;
+
+	return status;
+}
+
+/* out_of_core_read(), out_of_core_write()
+ *
+ * The strips of run_out_of_core() (see MorphOpStripFunc): 'data' is its OutOfCoreIO
+ */
+static int out_of_core_read(int y0, int y1, MorphOpImage* strip, void* data)
+{
+	OutOfCoreIO* io = data;
+
+	profile_stage_begin("fetch");
+	region_read_rows(io->drawable, io->region, y0, y1, strip);
+	profile_stage_end("fetch", (gulong)io->region->w * (y1 - y0), y1 - y0, 0, 0);
+
+	return 1;
+}
+
+static int out_of_core_write(int y0, int y1, MorphOpImage* strip, void* data)
+{
+	OutOfCoreIO* io = data;
+
+	profile_stage_begin("store");
+	region_store_rows(io->drawable, io->region, y0, y1, strip);
+	profile_stage_end("store", (gulong)io->region->w * (y1 - y0), 0, y1 - y0, 0);
+
+	return 1;
+}
+
+/* get_memory_budget()
+ *
+ * The memory budget of an operation, in bytes: MEMORY_BUDGET, or the MB in the environment variable MORPHOP_MEMORY_BUDGET
+ */
+static gsize get_memory_budget(void)
+{
+	const gchar* value = g_getenv("MORPHOP_MEMORY_BUDGET");
+	guint64 megabytes = (value != NULL ? g_ascii_strtoull(value, NULL, 10) : 0);
+
+	return (gsize)(megabytes > 0 ? megabytes : MEMORY_BUDGET) << 20;
+}
+
+/* chain_get_label()
+ *
+ * The names of the operators of the chain (with their iterations, if more than one), to be freed:
+ * their identifiers for the profile, or their names as shown to the user
+ */
+static gchar* chain_get_label(const MorphOpChain* chain, gboolean for_profile)
+{
+	GString* label = g_string_new(NULL);
+	int i;
+
+	for (i = 0; i < chain->n_steps; i++) {
+		MorphOperator op = chain->steps[i].operator;
+
+		if (i > 0) g_string_append(label, (for_profile ? "+" : ", "));
+		g_string_append(label, (for_profile ? morphop_operator_get_name(op) : operator_get_string(op)));
+		if (morphop_settings_get_iterations(&chain->steps[i]) > 1) g_string_append_printf(label, " x%d", chain->steps[i].iterations);
 	}
-	else {
-		*src_preview = NULL;
-		*dst_preview = NULL;
+
+	return g_string_free(label, FALSE);
+}
+
+/* progress_start()
+ *
+ * Shows the progress bar with the given label (it takes it, and frees it at the next call)
+ */
+static void progress_start(gchar* label)
+{
+	g_free(progress.label);
+	progress.label = label;
+	progress.shown = 0;
+	progress.last_update = 0;
+
+	if (progress.timer == NULL) progress.timer = g_timer_new();
+	else g_timer_start(progress.timer);
+
+	gimp_progress_init (progress.label);
+}
+
+/* progress_update()
+ *
+ * The progress function of the libmorphop context (see MorphOpProgressFunc): at most every PROGRESS_UPDATE_INTERVAL
+ * seconds, it updates the progress bar with the fraction done and the estimated remaining time.
+ * Always returns TRUE: the plugin can't stop the engine (see MorphOpProgress).
+ */
+static int progress_update(double done, double total, void* data)
+{
+	double elapsed = g_timer_elapsed(progress.timer, NULL);
+	if (elapsed - progress.last_update < PROGRESS_UPDATE_INTERVAL) return TRUE;
+	progress.last_update = elapsed;
+
+	// the fraction never goes back, even if the estimate of the total grows. It never reaches 1 before the end, too
+	double fraction = CLAMP(done / total, progress.shown, 0.99);
+	progress.shown = fraction;
+
+	gimp_progress_update (fraction);
+
+	// show the ETA after a few seconds, when the speed estimate is good enough
+	if (elapsed > 2 && fraction > 0.01) {
+		int remaining = (int)(elapsed * (1 - fraction) / fraction);
+		gchar* text = g_strdup_printf("%s (%d:%02d remaining)", progress.label, remaining / 60, remaining % 60);
+		gimp_progress_set_text (text);
+		g_free(text);
 	}
+
+	return TRUE;
+}
+
+/* progress_end()
+ *
+ * Fills the progress bar if the operation completed
+ */
+static void progress_end(gboolean completed)
+{
+	if (completed) gimp_progress_update (1.0);
 }
@@ -3,63 +3,64 @@
 
 #include <gtk/gtk.h>
 #include <libgimp/gimpui.h>
+#include "morphop-engine.h"
 
-#define STRELEM_DEFAULT_SIZE 7
+// GIMP 2.10 gives access to the drawables through GEGL buffers, in their native precision
+#define USE_GEGL_API (GIMP_CHECK_VERSION(2, 10, 10))
 
-typedef enum {
-	OPERATOR_EROSION = 0,
-	OPERATOR_DILATION,
-	OPERATOR_OPENING,
-	OPERATOR_CLOSING,
-	OPERATOR_BOUNDEXTR,
-	OPERATOR_GRADIENT,
-	OPERATOR_HITORMISS,
-	OPERATOR_SKELETON,
-	OPERATOR_THICKENING,
-	OPERATOR_THINNING,
-	OPERATOR_WTOPHAT,
-	OPERATOR_BTOPHAT,
-	
-	OPERATOR_END
-} MorphOperator;
-
-typedef enum {
-	SRC_ORIGINAL = 0,
-	SRC_INVERSE,
-	SRC_THRESHOLD,
-	
-	SRC_END
-} SourceTansformation;
+#define USE_2_7_API (!(defined _WIN32 || (!defined _WIN32 && (GIMP_MAJOR_VERSION == 2) && (GIMP_MINOR_VERSION <= 6))))
 
-typedef enum {
-	MERGE_DIFF = 0,
-	MERGE_UNION,
-	MERGE_INTERSEPT,
-	
-	MERGE_END
-} MergeOperation;
-
-typedef enum {
-	SIZE_3x3 = 0,
-	SIZE_5x5,
-	SIZE_7x7,
-	SIZE_9x9,
-	SIZE_11x11,
-	
-	SIZE_END
-} ElementSize;
+#if USE_2_7_API
+	// in the new 2.7 API, the drawable functions that work on any item have been replaced by the 'gimp_item_' ones
+	// (removed with GIMP_DISABLE_DEPRECATED): every source file uses the old names through these
+	#define gimp_drawable_get_image gimp_item_get_image
+	#define gimp_drawable_is_valid gimp_item_is_valid
+	#define gimp_drawable_get_linked gimp_item_get_linked
+	#define gimp_drawable_is_channel gimp_item_is_channel
+#endif
 
+/*
+ * The settings of a morphological reconstruction (see morphop_reconstruct())
+ */
+typedef struct {
+	MorphOperator operator; // OPERATOR_EROSION or OPERATOR_DILATION
+	gint32 marker_id; // the drawable the reconstruction starts from
+	gint32 mask_id; // the drawable that limits it
+} MorphOpReconstruction;
 
+/*
+ * The settings of an area opening or closing (see morphop_area_tree_filter())
+ */
 typedef struct {
-	signed char matrix[STRELEM_DEFAULT_SIZE][STRELEM_DEFAULT_SIZE];
-	ElementSize size;
-} StructuringElement;
+	MorphOperator operator; // OPERATOR_OPENING or OPERATOR_CLOSING
+	gint32 min_area; // the components smaller than this, in pixels, are removed
+} MorphOpAreaSettings;
 
+/*
+ * The settings of a watershed segmentation (see morphop_watershed())
+ */
 typedef struct {
-	MorphOperator operator;
-	StructuringElement element;
-} MorphOpSettings;
+	StructuringElement element; // the element of the gradient
+	gint32 markers_id; // the drawable with the markers, -1 to start from the regional minima of the gradient
+} MorphOpWatershedSettings;
+
+/*
+ * The layers the dialog applies the operator to (see start_layers_operation())
+ */
+typedef enum {
+	LAYERS_ACTIVE = 0, // only the drawable the plugin has been called on
+	LAYERS_ALL, // all the layers of the image (the ones in the layer groups too)
+	LAYERS_LINKED, // the layers with the chain icon on
+
+	LAYERS_END
+} MorphOpLayers;
 
-void start_operation(GimpDrawable*, GimpPreview*, MorphOpSettings);
+MorphOpStatus start_operation(GimpDrawable*, GimpPreview*, MorphOpSettings);
+MorphOpStatus start_chain_operation(GimpDrawable*, GimpPreview*, const MorphOpChain*);
+MorphOpStatus start_batch_operation(const gint32*, int, MorphOpSettings);
+MorphOpStatus start_layers_operation(gint32, MorphOpLayers, const MorphOpChain*);
+MorphOpStatus start_reconstruct_operation(GimpDrawable*, MorphOpReconstruction);
+MorphOpStatus start_area_operation(GimpDrawable*, GimpPreview*, MorphOpAreaSettings);
+MorphOpStatus start_watershed_operation(GimpDrawable*, MorphOpWatershedSettings);
 
 #endif
@@ -0,0 +1,38 @@
+
+#include <libgimp/gimp.h>
+#include "morphop-calibration.h"
+#include "morphop-profile.h"
+
+static MorphOpCalibration calibration;
+static gboolean calibration_ready = FALSE;
+
+/* calibration_get()
+ *
+ * Returns the calibration of the host, for MorphOpContext.calibration: the one kept in the data of GIMP if a previous
+ * run measured it (with this version of libmorphop), else it's measured now and kept. NULL (the default model of the
+ * planner) if there is no memory to measure it.
+ */
+const MorphOpCalibration* calibration_get(void)
+{
+	MorphOpStatus status;
+
+	if (calibration_ready) return &calibration;
+
+	if (
+		gimp_get_data_size(MORPHOP_CALIBRATION_DATA) == sizeof(MorphOpCalibration) &&
+		gimp_get_data(MORPHOP_CALIBRATION_DATA, &calibration) && morphop_calibration_is_valid(&calibration)
+	) {
+		calibration_ready = TRUE;
+		return &calibration;
+	}
+
+	profile_stage_begin("calibration");
+	status = morphop_calibrate(&calibration);
+	profile_stage_end("calibration", 0, 0, 0, 0);
+	if (status != MORPHOP_OK) return NULL;
+
+	gimp_set_data(MORPHOP_CALIBRATION_DATA, &calibration, sizeof(MorphOpCalibration));
+	calibration_ready = TRUE;
+
+	return &calibration;
+}
@@ -0,0 +1,17 @@
+#ifndef __MORPHOP_CALIBRATION_H__
+#define __MORPHOP_CALIBRATION_H__
+
+#include <libgimp/gimp.h>
+#include "morphop-engine.h"
+
+// the key of the calibration in the data of GIMP (see calibration_get())
+#define MORPHOP_CALIBRATION_DATA "plug-in-morphop-calibration"
+
+/*
+ * The speed of the host, for the planner of libmorphop (see morphop_calibrate()): measured by the first operation
+ * of the GIMP session, then kept with the data of the plugin, so the next ones don't measure it again
+ */
+
+const MorphOpCalibration* calibration_get(void);
+
+#endif
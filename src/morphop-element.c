@@ -0,0 +1,114 @@
+
+#include <libgimp/gimp.h>
+#include <string.h>
+#include "morphop-element.h"
+#include "morphop-algorithms.h"
+
+#if USE_GEGL_API
+	#include <gegl.h>
+#endif
+
+// the memory of the custom elements: one arena for each step of the chain, and one for the element of the dialog
+// (ELEMENT_SLOT_CURRENT). An element read again replaces the previous one of its slot (a zeroed arena is an
+// empty one, see arena_init())
+static MorphOpArena element_arenas[ELEMENT_SLOT_CURRENT + 1];
+
+static guchar* channel_read_mask(gint32, gint*, gint*);
+static guchar* brush_read_mask(const gchar*, gint*, gint*);
+
+/* element_source_attach()
+ *
+ * Reads the custom element of a source and makes it the one of 'element' (the matrix, its size and its heights are
+ * not used anymore). With ELEMENT_MATRIX, the element goes back to its matrix. Returns FALSE if the channel or the
+ * brush don't exist anymore, or are larger than MORPHOP_SHAPE_MAX_SIZE: then the element keeps its matrix.
+ * The element is kept in the memory of 'slot', the index of a step of the chain or ELEMENT_SLOT_CURRENT: the one
+ * read before in the same slot is freed, so no other element must point to it.
+ */
+gboolean element_source_attach(const ElementSource* source, gint slot, StructuringElement* element)
+{
+	MorphOpArena* arena = &element_arenas[slot];
+	MorphOpShape* shape;
+	guchar* mask = NULL;
+	gint width = 0, height = 0;
+	gint i;
+
+	element->shape = NULL;
+
+	switch (source->kind) {
+		case ELEMENT_MATRIX: return TRUE;
+		case ELEMENT_CHANNEL: mask = channel_read_mask(source->channel_id, &width, &height); break;
+		case ELEMENT_BRUSH: mask = brush_read_mask(source->brush, &width, &height); break;
+		default: return FALSE;
+	}
+
+	if (mask == NULL) return FALSE;
+
+	// the cells are the pixels at least half white
+	for (i = 0; i < width * height; i++) mask[i] = (mask[i] >= 128);
+
+	arena_reset(arena);
+	shape = arena_alloc(arena, sizeof(MorphOpShape));
+	if (shape == NULL || morphop_shape_build(shape, mask, width, width, height, arena) != MORPHOP_OK) {
+		g_free(mask);
+		return FALSE;
+	}
+
+	g_free(mask);
+	element->shape = shape;
+
+	return TRUE;
+}
+
+/* channel_read_mask()
+ *
+ * Returns the 8-bit pixels of a channel (to free with g_free()), or NULL if it's not a channel or it's too big
+ */
+static guchar* channel_read_mask(gint32 channel_id, gint* width, gint* height)
+{
+	guchar* mask;
+
+	if (!gimp_drawable_is_valid(channel_id) || !gimp_drawable_is_channel(channel_id)) return NULL;
+
+	*width = gimp_drawable_width(channel_id);
+	*height = gimp_drawable_height(channel_id);
+	if (*width > MORPHOP_SHAPE_MAX_SIZE || *height > MORPHOP_SHAPE_MAX_SIZE) return NULL;
+
+	mask = g_try_malloc((gsize)*width * *height);
+	if (mask == NULL) return NULL;
+
+#if USE_GEGL_API
+	GeglRectangle rect = { 0, 0, *width, *height };
+	GeglBuffer* buffer = gimp_drawable_get_buffer(channel_id);
+	gegl_buffer_get(buffer, &rect, 1.0, babl_format("Y u8"), mask, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+	g_object_unref(buffer);
+#else
+	GimpDrawable* drawable = gimp_drawable_get(channel_id);
+	GimpPixelRgn rgn;
+
+	gimp_pixel_rgn_init (&rgn, drawable, 0, 0, *width, *height, FALSE, FALSE);
+	gimp_pixel_rgn_get_rect (&rgn, mask, 0, 0, *width, *height);
+	gimp_drawable_detach(drawable);
+#endif
+
+	return mask;
+}
+
+/* brush_read_mask()
+ *
+ * Returns the mask of a brush (to free with g_free()), or NULL if there is no brush with that name or it's too big
+ */
+static guchar* brush_read_mask(const gchar* name, gint* width, gint* height)
+{
+	gint mask_bpp, mask_size, color_bpp, color_size;
+	guint8* mask = NULL, *color = NULL;
+
+	if (!gimp_brush_get_pixels(name, width, height, &mask_bpp, &mask_size, &mask, &color_bpp, &color_size, &color)) return NULL;
+	g_free(color);
+
+	if (mask_bpp != 1 || mask_size != *width * *height || *width > MORPHOP_SHAPE_MAX_SIZE || *height > MORPHOP_SHAPE_MAX_SIZE) {
+		g_free(mask);
+		return NULL;
+	}
+
+	return mask;
+}
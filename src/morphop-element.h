@@ -0,0 +1,42 @@
+#ifndef __MORPHOP_ELEMENT_H__
+#define __MORPHOP_ELEMENT_H__
+
+#include <libgimp/gimp.h>
+#include "morphop-engine.h"
+
+// the longest name of a brush kept in the data of the last run
+#define ELEMENT_BRUSH_NAME_SIZE 256
+
+/*
+ * Where the structuring element comes from: the 7x7 matrix of the dialog, or a custom element of any size (see
+ * MorphOpShape), the pixels of a channel or of the mask of a brush that are at least half white
+ */
+typedef enum {
+	ELEMENT_MATRIX = 0,
+	ELEMENT_CHANNEL,
+	ELEMENT_BRUSH,
+
+	ELEMENT_SOURCE_END
+} ElementSourceKind;
+
+typedef struct {
+	ElementSourceKind kind;
+	gint32 channel_id; // ELEMENT_CHANNEL
+	gchar brush[ELEMENT_BRUSH_NAME_SIZE]; // ELEMENT_BRUSH
+} ElementSource;
+
+/*
+ * The sources of the elements of the dialog, kept with the data of the last run: the settings keep only a pointer
+ * to a custom element, that is read again from its source at each run (see element_source_attach())
+ */
+typedef struct {
+	ElementSource current; // the operator shown in the dialog
+	ElementSource steps[MORPHOP_CHAIN_MAX_STEPS]; // the steps added in the dialog
+} MorphOpElementSources;
+
+// the slot of the memory of the element shown in the dialog (the steps use theirs, see element_source_attach())
+#define ELEMENT_SLOT_CURRENT MORPHOP_CHAIN_MAX_STEPS
+
+gboolean element_source_attach(const ElementSource*, gint, StructuringElement*);
+
+#endif
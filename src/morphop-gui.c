@@ -2,6 +2,7 @@
 #include <gtk/gtk.h>
 #include <glib.h>
 #include <math.h>
+#include <string.h>
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
 #include "morphop.h"
@@ -12,17 +13,44 @@
 static void operator_changed(GtkWidget*, gpointer); 
 static gboolean element_changed (GtkWidget*, GdkEvent*, gpointer);
 static void size_changed (GtkWidget*, gpointer); 
+static void iterations_changed (GtkWidget*, gpointer); 
+static void weights_changed (GtkWidget*, gpointer); 
+static void channels_changed (GtkWidget*, gpointer); 
+static void layers_changed (GtkWidget*, gpointer); 
+static void source_changed (GtkWidget*, gpointer); 
+static void source_update_sensitivity (void);
+static gboolean operator_uses_channels(MorphOperator);
+static ElementWeights weights_detect(const StructuringElement*, int*);
+static void chain_add (GtkWidget*, gpointer);
+static void chain_clear (GtkWidget*, gpointer);
+static void chain_update (void);
 static void update_preview(GimpPreview*, gpointer);
 static void open_about(void);
+static gboolean same_size_drawable(gint32, gint32, gpointer);
+static void area_operator_changed(GtkWidget*, gpointer);
+static void area_changed(GtkWidget*, gpointer);
+static void update_area_preview(GimpPreview*, gpointer);
+static void markers_toggled(GtkWidget*, gpointer);
 const char* operator_get_info(MorphOperator);
 const char* size_get_string(ElementSize);
+const char* weights_get_string(ElementWeights);
+const char* channels_get_string(ChannelMode);
+const char* layers_get_string(MorphOpLayers);
+const char* source_get_string(ElementSourceKind);
 
 GtkWidget *morphop_window_main;
-GtkWidget *panel_preview, *combo_operator, *combo_size, *grid_strelem_def;
+GtkWidget *panel_preview, *combo_operator, *combo_size, *spin_iterations, *grid_strelem_def;
+GtkWidget *combo_weights, *spin_height, *combo_channels, *combo_layers;
+GtkWidget *combo_source, *combo_source_channel;
 GtkWidget *label_info;
+GtkWidget *label_chain, *button_chain_add, *button_chain_clear;
+GtkWidget *panel_area_preview;
 
 GtkWidget* strelem_drawarea_matrix[STRELEM_DEFAULT_SIZE][STRELEM_DEFAULT_SIZE];
 
+// the heights given by a script, that are not a profile of the dialog: "Custom" restores them
+signed char custom_weights[STRELEM_DEFAULT_SIZE][STRELEM_DEFAULT_SIZE];
+
 gboolean morphop_show_gui(gint32 image_id, GimpDrawable* drawable) 
 {
 	gboolean run;
@@ -31,9 +59,14 @@ gboolean morphop_show_gui(gint32 image_id, GimpDrawable* drawable)
 	GtkWidget *main_container, *center_container, *panel_settings;
 	
 	// widgets for settings panel
-	GtkWidget *panel_opsel, *label_opsel, *panel_size, *label_size;
+	GtkWidget *panel_opsel, *label_opsel, *panel_size, *label_size, *label_iterations;
+	GtkWidget *panel_weights, *label_weights, *label_height;
+	GtkWidget *panel_channels, *label_channels;
+	GtkWidget *panel_layers, *label_layers;
+	GtkWidget *panel_source, *label_source;
 	GtkWidget *label_strelem_def;
 	GtkWidget *panel_info, *icon_info;
+	GtkWidget *panel_chain;
 	
 	gimp_ui_init (MORPHOP_BINARY, FALSE);
 	
@@ -50,7 +83,7 @@ gboolean morphop_show_gui(gint32 image_id, GimpDrawable* drawable)
 	);
 	
 	gimp_window_set_transient (GTK_WINDOW(morphop_window_main));
-	gtk_widget_set_size_request (morphop_window_main, 530, 470);
+	gtk_widget_set_size_request (morphop_window_main, 530, 570);
 	gtk_window_set_resizable (GTK_WINDOW(morphop_window_main), FALSE);
 	gtk_window_set_position(GTK_WINDOW(morphop_window_main), GTK_WIN_POS_CENTER);
 	gtk_container_set_border_width(GTK_CONTAINER(morphop_window_main), 5);
@@ -126,6 +159,29 @@ gboolean morphop_show_gui(gint32 image_id, GimpDrawable* drawable)
 	gtk_container_add(GTK_CONTAINER(align_strelem), grid_strelem_def);
 	gtk_box_pack_start (GTK_BOX (panel_settings), align_strelem, TRUE, TRUE, 0);
 	
+	// a custom element of any size instead of the matrix: the pixels of a channel, or the mask of the active brush
+	GtkWidget* align_source = gtk_alignment_new (0.5, 0, 0, 0);
+	panel_source = gtk_hbox_new(FALSE, 5);
+	label_source = gtk_label_new("From:");
+	combo_source = gtk_combo_box_new_text();
+	for(i = 0; i < ELEMENT_SOURCE_END; i++) {
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_source), source_get_string(i));
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_source), melements.current.kind);
+	gtk_widget_set_tooltip_text (combo_source, "A channel or a brush: its pixels at least half white are the element, of any size up to 511x511, centered in its middle pixel. Hit-or-miss looks for them white and for the others black");
+	g_signal_connect(G_OBJECT(combo_source), "changed", G_CALLBACK(source_changed), NULL);
+	
+	combo_source_channel = gimp_channel_combo_box_new(NULL, NULL);
+	if (melements.current.kind == ELEMENT_CHANNEL) gimp_int_combo_box_set_active(GIMP_INT_COMBO_BOX(combo_source_channel), melements.current.channel_id);
+	g_signal_connect(G_OBJECT(combo_source_channel), "changed", G_CALLBACK(source_changed), NULL);
+	
+	gtk_box_pack_start (GTK_BOX (panel_source), label_source, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_source), combo_source, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_source), combo_source_channel, FALSE, FALSE, 0);
+	
+	gtk_container_add(GTK_CONTAINER(align_source), panel_source);
+	gtk_box_pack_start (GTK_BOX (panel_settings), align_source, FALSE, FALSE, 0);
+	
 	GtkWidget* align_size = gtk_alignment_new (0.5, 0, 0, 0);
 	panel_size = gtk_hbox_new(FALSE, 5);
 	label_size = gtk_label_new("Element size:");
@@ -136,17 +192,116 @@ gboolean morphop_show_gui(gint32 image_id, GimpDrawable* drawable)
 	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_size), msettings.element.size);
 	g_signal_connect(G_OBJECT(combo_size), "changed", G_CALLBACK(size_changed), NULL);
 	
+	// erosion, dilation, opening and closing can apply the element more times, as if it was bigger
+	label_iterations = gtk_label_new("x");
+	spin_iterations = gtk_spin_button_new_with_range(1, MORPHOP_MAX_ITERATIONS, 1);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_iterations), msettings.iterations);
+	gtk_widget_set_tooltip_text (spin_iterations, "Iterations: the element is applied this many times, as if it was that many times bigger");
+	gtk_widget_set_sensitive(spin_iterations, morphop_operator_can_iterate(msettings.operator));
+	g_signal_connect(G_OBJECT(spin_iterations), "value-changed", G_CALLBACK(iterations_changed), NULL);
+	
 	gtk_box_pack_start (GTK_BOX (panel_size), label_size, FALSE, FALSE, 0);
 	gtk_box_pack_start (GTK_BOX (panel_size), combo_size, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_size), label_iterations, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_size), spin_iterations, FALSE, FALSE, 0);
 	
 	gtk_container_add(GTK_CONTAINER(align_size), panel_size);
 	gtk_box_pack_start (GTK_BOX (panel_settings), align_size, FALSE, FALSE, 0);
 	
+	// the heights of the white cells (non-flat element): the erosion subtracts them, the dilation adds them
+	GtkWidget* align_weights = gtk_alignment_new (0.5, 0, 0, 0);
+	ElementWeights weights;
+	int height;
+	
+	weights = weights_detect(&msettings.element, &height);
+	panel_weights = gtk_hbox_new(FALSE, 5);
+	label_weights = gtk_label_new("Heights:");
+	combo_weights = gtk_combo_box_new_text();
+	for(i = 0; i < WEIGHTS_END; i++) {
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_weights), weights_get_string(i));
+	}
+	if (weights == WEIGHTS_END) {
+		memcpy(custom_weights, msettings.element.weights, sizeof(custom_weights));
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_weights), "Custom");
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_weights), weights);
+	gtk_widget_set_tooltip_text (combo_weights, "Ball and cone: the center of the element is higher than its border, so the erosion and the dilation smooth the image like a rolling ball");
+	g_signal_connect(G_OBJECT(combo_weights), "changed", G_CALLBACK(weights_changed), NULL);
+	
+	label_height = gtk_label_new("of");
+	spin_height = gtk_spin_button_new_with_range(0, 127, 1);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_height), height);
+	gtk_widget_set_tooltip_text (spin_height, "The height of the center over the border, in levels of an 8-bit image");
+	gtk_widget_set_sensitive(spin_height, weights == WEIGHTS_BALL || weights == WEIGHTS_CONE);
+	g_signal_connect(G_OBJECT(spin_height), "value-changed", G_CALLBACK(weights_changed), NULL);
+	
+	gtk_box_pack_start (GTK_BOX (panel_weights), label_weights, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_weights), combo_weights, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_weights), label_height, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_weights), spin_height, FALSE, FALSE, 0);
+	
+	gtk_container_add(GTK_CONTAINER(align_weights), panel_weights);
+	gtk_box_pack_start (GTK_BOX (panel_settings), align_weights, FALSE, FALSE, 0);
+	
+	// how the neighbors of a color pixel are compared (hit-or-miss and the others based on it always use the luminosity)
+	GtkWidget* align_channels = gtk_alignment_new (0.5, 0, 0, 0);
+	panel_channels = gtk_hbox_new(FALSE, 5);
+	label_channels = gtk_label_new("Channels:");
+	combo_channels = gtk_combo_box_new_text();
+	for(i = 0; i < CHANNELS_END; i++) {
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_channels), channels_get_string(i));
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_channels), msettings.channel_mode);
+	gtk_widget_set_tooltip_text (combo_channels, "Luminosity: each pixel takes the darkest (or brightest) of its neighbors as a whole. The others erode and dilate each channel on its own: the colors can change, and it's faster");
+	gtk_widget_set_sensitive(combo_channels, operator_uses_channels(msettings.operator));
+	g_signal_connect(G_OBJECT(combo_channels), "changed", G_CALLBACK(channels_changed), NULL);
+	
+	gtk_box_pack_start (GTK_BOX (panel_channels), label_channels, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_channels), combo_channels, FALSE, FALSE, 0);
+	
+	gtk_container_add(GTK_CONTAINER(align_channels), panel_channels);
+	gtk_box_pack_start (GTK_BOX (panel_settings), align_channels, FALSE, FALSE, 0);
+	
+	// the layers that get the operator (the preview shows the active one)
+	GtkWidget* align_layers = gtk_alignment_new (0.5, 0, 0, 0);
+	panel_layers = gtk_hbox_new(FALSE, 5);
+	label_layers = gtk_label_new("Layers:");
+	combo_layers = gtk_combo_box_new_text();
+	for(i = 0; i < LAYERS_END; i++) {
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_layers), layers_get_string(i));
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_layers), mlayers);
+	gtk_widget_set_tooltip_text (combo_layers, "All the layers (or the linked ones) get the same operator within the selection. A layer is read while another one is computed, and they are undone in a single step");
+	g_signal_connect(G_OBJECT(combo_layers), "changed", G_CALLBACK(layers_changed), NULL);
+	
+	gtk_box_pack_start (GTK_BOX (panel_layers), label_layers, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_layers), combo_layers, FALSE, FALSE, 0);
+	
+	gtk_container_add(GTK_CONTAINER(align_layers), panel_layers);
+	gtk_box_pack_start (GTK_BOX (panel_settings), align_layers, FALSE, FALSE, 0);
+	
 	gtk_box_pack_start (GTK_BOX (center_container), panel_preview, TRUE, TRUE, 0);
 	gtk_box_pack_start (GTK_BOX (center_container), panel_settings, TRUE, TRUE, 0);
 	
 	gtk_box_pack_start (GTK_BOX (main_container), center_container, TRUE, TRUE, 0);
 	
+	// chain panel: the steps added here run before the operator shown above, and the whole chain is applied at once
+	panel_chain = gtk_hbox_new(FALSE, 5);
+	button_chain_add = gtk_button_new_with_label("Add step");
+	gtk_widget_set_tooltip_text (button_chain_add, "Keep this operator as a step, and choose the next one: it will run on its result");
+	g_signal_connect(G_OBJECT(button_chain_add), "clicked", G_CALLBACK(chain_add), NULL);
+	button_chain_clear = gtk_button_new_with_label("Clear steps");
+	g_signal_connect(G_OBJECT(button_chain_clear), "clicked", G_CALLBACK(chain_clear), NULL);
+	label_chain = gtk_label_new(NULL);
+	gtk_label_set_line_wrap (GTK_LABEL(label_chain), TRUE);
+	gtk_widget_set_size_request (label_chain, 300, -1);
+	
+	gtk_box_pack_start (GTK_BOX (panel_chain), button_chain_add, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_chain), button_chain_clear, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_chain), label_chain, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (main_container), panel_chain, FALSE, FALSE, 0);
+	chain_update();
+	
 	// info panel
 	panel_info = gtk_hbox_new(FALSE, 10);
 	icon_info = gtk_image_new_from_stock(GIMP_STOCK_INFO, GTK_ICON_SIZE_BUTTON);
@@ -159,6 +314,7 @@ gboolean morphop_show_gui(gint32 image_id, GimpDrawable* drawable)
 	gtk_box_pack_start (GTK_BOX (panel_info), label_info, FALSE, FALSE, 0);
 	
 	gtk_box_pack_start (GTK_BOX (main_container), panel_info, TRUE, TRUE, 0);
+	source_update_sensitivity();
 	
 	gtk_container_add (GTK_CONTAINER (GTK_DIALOG(morphop_window_main)->vbox), main_container);
 	gtk_widget_show_all(morphop_window_main);
@@ -169,15 +325,8 @@ gboolean morphop_show_gui(gint32 image_id, GimpDrawable* drawable)
 		gint run = gimp_dialog_run (GIMP_DIALOG(morphop_window_main));
 		if (run == GTK_RESPONSE_APPLY) {
 			
+			// the operation itself is started by run(), once the dialog is closed
 			gtk_widget_destroy (morphop_window_main);
-			
-			gimp_progress_init (operator_get_string(msettings.operator));
-			start_operation(
-				drawable,
-				NULL, 
-				msettings
-			);
-			
 			return TRUE;
 		}
 		else if (run == GTK_RESPONSE_HELP) {
@@ -214,6 +363,8 @@ static void operator_changed(GtkWidget* widget, gpointer data)
 	}
 	
 	gtk_label_set_text (GTK_LABEL(label_info), operator_get_info(msettings.operator));
+	gtk_widget_set_sensitive(spin_iterations, morphop_operator_can_iterate(msettings.operator));
+	gtk_widget_set_sensitive(combo_channels, operator_uses_channels(msettings.operator));
 	
 	if (gimp_preview_get_update(GIMP_PREVIEW(panel_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_preview));
 }
@@ -279,21 +430,449 @@ static void size_changed (GtkWidget* widget, gpointer data)
 	if (gimp_preview_get_update(GIMP_PREVIEW(panel_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_preview));
 }
 
+static void iterations_changed (GtkWidget* widget, gpointer data) 
+{
+	msettings.iterations = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(widget));
+	if (gimp_preview_get_update(GIMP_PREVIEW(panel_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_preview));
+}
+
+static void weights_changed (GtkWidget* widget, gpointer data) 
+{
+	ElementWeights weights = gtk_combo_box_get_active(GTK_COMBO_BOX(combo_weights));
+	
+	if (weights == WEIGHTS_END) {
+		memcpy(msettings.element.weights, custom_weights, sizeof(custom_weights));
+	}
+	else {
+		morphop_element_set_weights(&msettings.element, weights, gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin_height)));
+	}
+	
+	gtk_widget_set_sensitive(spin_height, weights == WEIGHTS_BALL || weights == WEIGHTS_CONE);
+	if (gimp_preview_get_update(GIMP_PREVIEW(panel_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_preview));
+}
+
+static void channels_changed (GtkWidget* widget, gpointer data) 
+{
+	msettings.channel_mode = gtk_combo_box_get_active(GTK_COMBO_BOX(widget));
+	if (gimp_preview_get_update(GIMP_PREVIEW(panel_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_preview));
+}
+
+static void layers_changed (GtkWidget* widget, gpointer data) 
+{
+	mlayers = gtk_combo_box_get_active(GTK_COMBO_BOX(widget));
+}
+
+/* source_changed()
+ * 
+ * Reads the custom element chosen in the dialog (the channel, or the brush active now). If it can't be used,
+ * the matrix is chosen again.
+ */
+static void source_changed (GtkWidget* widget, gpointer data) 
+{
+	ElementSource* source = &melements.current;
+	gchar* brush;
+	
+	source->kind = gtk_combo_box_get_active(GTK_COMBO_BOX(combo_source));
+	if (source->kind == ELEMENT_CHANNEL && !gimp_int_combo_box_get_active(GIMP_INT_COMBO_BOX(combo_source_channel), &source->channel_id)) {
+		source->kind = ELEMENT_MATRIX;
+	}
+	else if (source->kind == ELEMENT_BRUSH && widget == combo_source) {
+		brush = gimp_context_get_brush();
+		g_strlcpy(source->brush, (brush != NULL ? brush : ""), ELEMENT_BRUSH_NAME_SIZE);
+		g_free(brush);
+	}
+	
+	if (!element_source_attach(source, ELEMENT_SLOT_CURRENT, &msettings.element)) {
+		g_message("The %s can't be the structuring element: it must be at most %dx%d pixels",
+			(source->kind == ELEMENT_CHANNEL ? "channel" : "brush"), MORPHOP_SHAPE_MAX_SIZE, MORPHOP_SHAPE_MAX_SIZE);
+		source->kind = ELEMENT_MATRIX;
+	}
+	
+	// back to the matrix, if the custom element can't be used
+	if (gtk_combo_box_get_active(GTK_COMBO_BOX(combo_source)) != source->kind) {
+		gtk_combo_box_set_active(GTK_COMBO_BOX(combo_source), source->kind);
+	}
+	
+	source_update_sensitivity();
+	if (gimp_preview_get_update(GIMP_PREVIEW(panel_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_preview));
+}
+
+/* source_update_sensitivity()
+ * 
+ * The matrix, its size and its heights don't apply to a custom element (that is flat)
+ */
+static void source_update_sensitivity (void)
+{
+	gboolean matrix = (melements.current.kind == ELEMENT_MATRIX);
+	
+	gtk_widget_set_sensitive(grid_strelem_def, matrix);
+	gtk_widget_set_sensitive(combo_size, matrix);
+	gtk_widget_set_sensitive(combo_weights, matrix);
+	gtk_widget_set_sensitive(spin_height, matrix && (gtk_combo_box_get_active(GTK_COMBO_BOX(combo_weights)) == WEIGHTS_BALL || gtk_combo_box_get_active(GTK_COMBO_BOX(combo_weights)) == WEIGHTS_CONE));
+	gtk_widget_set_sensitive(combo_source_channel, melements.current.kind == ELEMENT_CHANNEL);
+}
+
+/* operator_uses_channels()
+ * 
+ * Returns TRUE if the channel mode changes the result of the operator
+ */
+static gboolean operator_uses_channels(MorphOperator op)
+{
+	return !(op == OPERATOR_HITORMISS || op == OPERATOR_THICKENING || op == OPERATOR_THINNING || op == OPERATOR_SKELETON);
+}
+
+/* weights_detect()
+ * 
+ * Finds the profile and the height that give the heights of the element, or WEIGHTS_END (and a height of 0)
+ * if they don't come from a profile
+ */
+static ElementWeights weights_detect(const StructuringElement* element, int* height)
+{
+	StructuringElement profile;
+	int w, h;
+	
+	*height = 0;
+	if (morphop_element_is_flat(element)) return WEIGHTS_FLAT;
+	
+	for (w = WEIGHTS_BALL; w < WEIGHTS_END; w++) {
+		for (h = 1; h <= 127; h++) {
+			morphop_element_set_weights(&profile, w, h);
+			if (memcmp(profile.weights, element->weights, sizeof(profile.weights)) == 0) {
+				*height = h;
+				return w;
+			}
+		}
+	}
+	
+	return WEIGHTS_END;
+}
+
+/* chain_add()
+ *
+ * Adds the operator shown in the dialog to the steps of the chain. The dialog keeps it, as the next step.
+ * The step reads its custom element again, in its own memory: the one of the dialog is replaced when it changes.
+ */
+static void chain_add (GtkWidget* widget, gpointer data) 
+{
+	int step = mchain.n_steps;
+	
+	if (step >= MORPHOP_CHAIN_MAX_STEPS - 1) return;
+	
+	melements.steps[step] = melements.current;
+	mchain.steps[step] = msettings;
+	if (!element_source_attach(&melements.steps[step], step, &mchain.steps[step].element)) melements.steps[step].kind = ELEMENT_MATRIX;
+	mchain.n_steps++;
+	chain_update();
+	
+	if (gimp_preview_get_update(GIMP_PREVIEW(panel_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_preview));
+}
+
+static void chain_clear (GtkWidget* widget, gpointer data) 
+{
+	mchain.n_steps = 0;
+	chain_update();
+	
+	if (gimp_preview_get_update(GIMP_PREVIEW(panel_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_preview));
+}
+
+/* chain_update()
+ *
+ * Lists the steps of the chain, and enables its buttons
+ */
+static void chain_update (void) 
+{
+	GString* text = g_string_new(NULL);
+	int i;
+	
+	if (mchain.n_steps == 0) {
+		g_string_append(text, "Single operator");
+	}
+	else {
+		g_string_append(text, "After:");
+		for (i = 0; i < mchain.n_steps; i++) {
+			const MorphOpShape* shape = mchain.steps[i].element.shape;
+			int side = 3 + 2 * mchain.steps[i].element.size;
+			g_string_append_printf(text, "%s %s %dx%d", (i > 0 ? "," : ""), operator_get_string(mchain.steps[i].operator),
+				(shape != NULL ? shape->width : side), (shape != NULL ? shape->height : side));
+			if (morphop_settings_get_iterations(&mchain.steps[i]) > 1) g_string_append_printf(text, " x%d", mchain.steps[i].iterations);
+		}
+	}
+	
+	gtk_label_set_text (GTK_LABEL(label_chain), text->str);
+	g_string_free(text, TRUE);
+	
+	gtk_widget_set_sensitive(button_chain_add, mchain.n_steps < MORPHOP_CHAIN_MAX_STEPS - 1);
+	gtk_widget_set_sensitive(button_chain_clear, mchain.n_steps > 0);
+}
+
+/* morphop_show_reconstruct_gui()
+ *
+ * The dialog of the reconstruction: the marker and the mask (drawables of the same size of 'drawable') and
+ * the operator. Returns FALSE if the user closed it, else TRUE and the choices in 'reconstruction'.
+ */
+gboolean morphop_show_reconstruct_gui(GimpDrawable* drawable, MorphOpReconstruction* reconstruction)
+{
+	GtkWidget *dialog, *table, *combo_marker, *combo_mask, *combo_reconstruction, *label;
+	gboolean run;
+	int i;
+	
+	gimp_ui_init (MORPHOP_BINARY, FALSE);
+	
+	dialog = gimp_dialog_new(
+		"Morphological reconstruction",
+		MORPHOP_BINARY,
+		NULL,
+		0,
+		NULL,
+		NULL,
+		GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+		GTK_STOCK_OK, GTK_RESPONSE_OK, NULL
+	);
+	
+	gimp_window_set_transient (GTK_WINDOW(dialog));
+	gtk_window_set_resizable (GTK_WINDOW(dialog), FALSE);
+	gtk_container_set_border_width(GTK_CONTAINER(dialog), 5);
+	
+	table = gtk_table_new(3, 2, FALSE);
+	
+	// only the drawables of the same size can be the marker or the mask: the reconstruction is pixel by pixel
+	label = gtk_label_new("Marker:");
+	combo_marker = gimp_drawable_combo_box_new(same_size_drawable, drawable);
+	gimp_int_combo_box_set_active(GIMP_INT_COMBO_BOX(combo_marker), reconstruction->marker_id);
+	gtk_widget_set_tooltip_text (combo_marker, "Where the reconstruction starts from");
+	gtk_table_attach (GTK_TABLE (table), label, 0, 1, 0, 1, GTK_FILL, GTK_FILL, 5, 5);
+	gtk_table_attach (GTK_TABLE (table), combo_marker, 1, 2, 0, 1, GTK_FILL, GTK_FILL, 5, 5);
+	
+	label = gtk_label_new("Mask:");
+	combo_mask = gimp_drawable_combo_box_new(same_size_drawable, drawable);
+	gimp_int_combo_box_set_active(GIMP_INT_COMBO_BOX(combo_mask), reconstruction->mask_id);
+	gtk_widget_set_tooltip_text (combo_mask, "The limit of the reconstruction");
+	gtk_table_attach (GTK_TABLE (table), label, 0, 1, 1, 2, GTK_FILL, GTK_FILL, 5, 5);
+	gtk_table_attach (GTK_TABLE (table), combo_mask, 1, 2, 1, 2, GTK_FILL, GTK_FILL, 5, 5);
+	
+	label = gtk_label_new("Operation:");
+	combo_reconstruction = gtk_combo_box_new_text();
+	for (i = OPERATOR_EROSION; i <= OPERATOR_DILATION; i++) {
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_reconstruction), reconstruction_get_string(i));
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_reconstruction), reconstruction->operator);
+	gtk_table_attach (GTK_TABLE (table), label, 0, 1, 2, 3, GTK_FILL, GTK_FILL, 5, 5);
+	gtk_table_attach (GTK_TABLE (table), combo_reconstruction, 1, 2, 2, 3, GTK_FILL, GTK_FILL, 5, 5);
+	
+	gtk_container_add (GTK_CONTAINER (GTK_DIALOG(dialog)->vbox), table);
+	gtk_widget_show_all(dialog);
+	
+	run = (gimp_dialog_run (GIMP_DIALOG(dialog)) == GTK_RESPONSE_OK);
+	if (run) {
+		gimp_int_combo_box_get_active(GIMP_INT_COMBO_BOX(combo_marker), &reconstruction->marker_id);
+		gimp_int_combo_box_get_active(GIMP_INT_COMBO_BOX(combo_mask), &reconstruction->mask_id);
+		reconstruction->operator = gtk_combo_box_get_active(GTK_COMBO_BOX(combo_reconstruction));
+	}
+	
+	gtk_widget_destroy (dialog);
+	return run;
+}
+
+/* morphop_show_area_gui()
+ *
+ * The dialog of the area opening and closing: the operator and the area threshold, with a preview. Returns FALSE
+ * if the user closed it, else TRUE and the choices in 'settings'.
+ */
+gboolean morphop_show_area_gui(GimpDrawable* drawable, MorphOpAreaSettings* settings)
+{
+	GtkWidget *dialog, *main_container, *panel_settings, *combo_area, *spin_area, *label;
+	gboolean run;
+	int i;
+	
+	gimp_ui_init (MORPHOP_BINARY, FALSE);
+	
+	dialog = gimp_dialog_new(
+		"Area opening and closing",
+		MORPHOP_BINARY,
+		NULL,
+		0,
+		NULL,
+		NULL,
+		GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+		GTK_STOCK_OK, GTK_RESPONSE_OK, NULL
+	);
+	
+	gimp_window_set_transient (GTK_WINDOW(dialog));
+	gtk_container_set_border_width(GTK_CONTAINER(dialog), 5);
+	
+	main_container = gtk_vbox_new(FALSE, 10);
+	
+	panel_area_preview = gimp_drawable_preview_new (drawable, NULL);
+	gtk_widget_set_size_request (panel_area_preview, 300, 300);
+	gtk_box_pack_start (GTK_BOX (main_container), panel_area_preview, TRUE, TRUE, 0);
+	
+	panel_settings = gtk_hbox_new(FALSE, 5);
+	combo_area = gtk_combo_box_new_text();
+	for (i = OPERATOR_OPENING; i <= OPERATOR_CLOSING; i++) {
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_area), area_get_string(i));
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_area), settings->operator - OPERATOR_OPENING);
+	g_signal_connect(G_OBJECT(combo_area), "changed", G_CALLBACK(area_operator_changed), settings);
+	
+	// the trees don't depend on the area: changing it only filters them again (see start_area_operation())
+	label = gtk_label_new("Smaller than:");
+	spin_area = gtk_spin_button_new_with_range(1, MAX((gdouble)drawable->width * drawable->height, 1), 1);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_area), settings->min_area);
+	gtk_widget_set_tooltip_text (spin_area, "The bright (opening) or dark (closing) spots with fewer pixels than this are removed, whatever their shape");
+	g_signal_connect(G_OBJECT(spin_area), "value-changed", G_CALLBACK(area_changed), settings);
+	
+	gtk_box_pack_start (GTK_BOX (panel_settings), combo_area, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_settings), label, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_settings), spin_area, FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (panel_settings), gtk_label_new("pixels"), FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (main_container), panel_settings, FALSE, FALSE, 0);
+	
+	gtk_container_add (GTK_CONTAINER (GTK_DIALOG(dialog)->vbox), main_container);
+	gtk_widget_show_all(dialog);
+	
+	g_signal_connect (panel_area_preview, "invalidated", G_CALLBACK (update_area_preview), settings);
+	
+	run = (gimp_dialog_run (GIMP_DIALOG(dialog)) == GTK_RESPONSE_OK);
+	
+	gtk_widget_destroy (dialog);
+	return run;
+}
+
+static void area_operator_changed(GtkWidget* widget, gpointer data)
+{
+	MorphOpAreaSettings* settings = data;
+	
+	settings->operator = OPERATOR_OPENING + gtk_combo_box_get_active(GTK_COMBO_BOX(widget));
+	if (gimp_preview_get_update(GIMP_PREVIEW(panel_area_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_area_preview));
+}
+
+static void area_changed(GtkWidget* widget, gpointer data)
+{
+	MorphOpAreaSettings* settings = data;
+	
+	settings->min_area = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(widget));
+	if (gimp_preview_get_update(GIMP_PREVIEW(panel_area_preview))) gimp_preview_invalidate(GIMP_PREVIEW(panel_area_preview));
+}
+
+static void update_area_preview(GimpPreview* preview, gpointer data)
+{
+	MorphOpAreaSettings* settings = data;
+	
+	start_area_operation(
+		gimp_drawable_preview_get_drawable (GIMP_DRAWABLE_PREVIEW (preview)),
+		preview,
+		*settings
+	);
+}
+
+/* morphop_show_watershed_gui()
+ *
+ * The dialog of the watershed: the size of the element of the gradient (its shape is the one of the main dialog)
+ * and, if any, the drawable with the markers. Returns FALSE if the user closed it, else TRUE and the choices
+ * in 'settings'.
+ */
+gboolean morphop_show_watershed_gui(GimpDrawable* drawable, MorphOpWatershedSettings* settings)
+{
+	GtkWidget *dialog, *table, *combo_watershed_size, *check_markers, *combo_markers, *label;
+	gboolean run;
+	int i;
+	
+	gimp_ui_init (MORPHOP_BINARY, FALSE);
+	
+	dialog = gimp_dialog_new(
+		"Watershed",
+		MORPHOP_BINARY,
+		NULL,
+		0,
+		NULL,
+		NULL,
+		GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+		GTK_STOCK_OK, GTK_RESPONSE_OK, NULL
+	);
+	
+	gimp_window_set_transient (GTK_WINDOW(dialog));
+	gtk_window_set_resizable (GTK_WINDOW(dialog), FALSE);
+	gtk_container_set_border_width(GTK_CONTAINER(dialog), 5);
+	
+	table = gtk_table_new(2, 2, FALSE);
+	
+	label = gtk_label_new("Gradient size:");
+	combo_watershed_size = gtk_combo_box_new_text();
+	for(i = 0; i < SIZE_END; i++) {
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_watershed_size), size_get_string(i));
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_watershed_size), settings->element.size);
+	gtk_widget_set_tooltip_text (combo_watershed_size, "The size of the element of the gradient, that is flooded. Its shape is the one of the main dialog");
+	gtk_table_attach (GTK_TABLE (table), label, 0, 1, 0, 1, GTK_FILL, GTK_FILL, 5, 5);
+	gtk_table_attach (GTK_TABLE (table), combo_watershed_size, 1, 2, 0, 1, GTK_FILL, GTK_FILL, 5, 5);
+	
+	// without markers, each regional minimum of the gradient is the seed of a basin
+	check_markers = gtk_check_button_new_with_label("Markers:");
+	combo_markers = gimp_drawable_combo_box_new(same_size_drawable, drawable);
+	gimp_int_combo_box_set_active(GIMP_INT_COMBO_BOX(combo_markers), (settings->markers_id != -1 ? settings->markers_id : drawable->drawable_id));
+	gtk_widget_set_tooltip_text (combo_markers, "Each group of pixels that are not black is the seed of a basin");
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(check_markers), settings->markers_id != -1);
+	gtk_widget_set_sensitive(combo_markers, settings->markers_id != -1);
+	g_signal_connect(G_OBJECT(check_markers), "toggled", G_CALLBACK(markers_toggled), combo_markers);
+	gtk_table_attach (GTK_TABLE (table), check_markers, 0, 1, 1, 2, GTK_FILL, GTK_FILL, 5, 5);
+	gtk_table_attach (GTK_TABLE (table), combo_markers, 1, 2, 1, 2, GTK_FILL, GTK_FILL, 5, 5);
+	
+	gtk_container_add (GTK_CONTAINER (GTK_DIALOG(dialog)->vbox), table);
+	gtk_widget_show_all(dialog);
+	
+	run = (gimp_dialog_run (GIMP_DIALOG(dialog)) == GTK_RESPONSE_OK);
+	if (run) {
+		settings->element.size = gtk_combo_box_get_active(GTK_COMBO_BOX(combo_watershed_size));
+		settings->markers_id = -1;
+		if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_markers))) {
+			gimp_int_combo_box_get_active(GIMP_INT_COMBO_BOX(combo_markers), &settings->markers_id);
+		}
+	}
+	
+	gtk_widget_destroy (dialog);
+	return run;
+}
+
+static void markers_toggled(GtkWidget* widget, gpointer data)
+{
+	gtk_widget_set_sensitive(data, gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget)));
+}
+
+static gboolean same_size_drawable(gint32 image_id, gint32 drawable_id, gpointer data)
+{
+	GimpDrawable* drawable = data;
+	
+	return (gimp_drawable_width(drawable_id) == drawable->width && gimp_drawable_height(drawable_id) == drawable->height);
+}
+
+/* morphop_get_chain()
+ *
+ * The chain to run: the steps added in the dialog, then the operator shown in it
+ */
+void morphop_get_chain(MorphOpChain* chain)
+{
+	*chain = mchain;
+	chain->n_steps = MIN(chain->n_steps, MORPHOP_CHAIN_MAX_STEPS - 1);
+	chain->steps[chain->n_steps++] = msettings;
+}
+
 static void update_preview(GimpPreview* preview, gpointer data) 
 {
+	MorphOpChain chain;
+	
 	gtk_widget_set_sensitive(grid_strelem_def, FALSE);
 	gtk_widget_set_sensitive(combo_operator, FALSE);
 	gtk_widget_set_sensitive(combo_size, FALSE);
 	
-	start_operation(
+	morphop_get_chain(&chain);
+	start_chain_operation(
 		gimp_drawable_preview_get_drawable (GIMP_DRAWABLE_PREVIEW (preview)),
 		preview, 
-		msettings
+		&chain
 	);
 	
-	gtk_widget_set_sensitive(grid_strelem_def, TRUE);
 	gtk_widget_set_sensitive(combo_operator, TRUE);
-	gtk_widget_set_sensitive(combo_size, TRUE);
+	source_update_sensitivity();
 }
 
 static void open_about() 
@@ -349,6 +928,24 @@ const char* operator_get_string(MorphOperator o)
 	}
 }
 
+const char* reconstruction_get_string(MorphOperator o)
+{
+	switch (o) {
+		case OPERATOR_EROSION: return "Reconstruction by erosion"; break;
+		case OPERATOR_DILATION: return "Reconstruction by dilation"; break;
+		default: return "<unknown>"; break;
+	}
+}
+
+const char* area_get_string(MorphOperator o)
+{
+	switch (o) {
+		case OPERATOR_OPENING: return "Area opening"; break;
+		case OPERATOR_CLOSING: return "Area closing"; break;
+		default: return "<unknown>"; break;
+	}
+}
+
 const char* operator_get_info(MorphOperator o)
 {	
 	switch (o) {
@@ -368,6 +965,46 @@ const char* operator_get_info(MorphOperator o)
 	}
 }
 
+const char* weights_get_string(ElementWeights w)
+{
+	switch (w) {
+		case WEIGHTS_FLAT: return "Flat"; break;
+		case WEIGHTS_BALL: return "Ball"; break;
+		case WEIGHTS_CONE: return "Cone"; break;
+		default: return "<unknown>"; break;
+	}
+}
+
+const char* channels_get_string(ChannelMode m)
+{
+	switch (m) {
+		case CHANNELS_LUMINOSITY: return "Luminosity"; break;
+		case CHANNELS_COLOR: return "Each color"; break;
+		case CHANNELS_ALL: return "Each color and alpha"; break;
+		default: return "<unknown>"; break;
+	}
+}
+
+const char* layers_get_string(MorphOpLayers l)
+{
+	switch (l) {
+		case LAYERS_ACTIVE: return "This layer"; break;
+		case LAYERS_ALL: return "All layers"; break;
+		case LAYERS_LINKED: return "Linked layers"; break;
+		default: return "<unknown>"; break;
+	}
+}
+
+const char* source_get_string(ElementSourceKind k)
+{
+	switch (k) {
+		case ELEMENT_MATRIX: return "The matrix"; break;
+		case ELEMENT_CHANNEL: return "A channel"; break;
+		case ELEMENT_BRUSH: return "The active brush"; break;
+		default: return "<unknown>"; break;
+	}
+}
+
 const char* size_get_string(ElementSize s)
 {
 	switch (s) {
@@ -5,6 +5,12 @@
 #include <libgimp/gimp.h>
 
 gboolean morphop_show_gui(gint32, GimpDrawable*);
+gboolean morphop_show_reconstruct_gui(GimpDrawable*, MorphOpReconstruction*);
+gboolean morphop_show_area_gui(GimpDrawable*, MorphOpAreaSettings*);
+gboolean morphop_show_watershed_gui(GimpDrawable*, MorphOpWatershedSettings*);
 const char* operator_get_string(MorphOperator);
+const char* reconstruction_get_string(MorphOperator);
+const char* area_get_string(MorphOperator);
+void morphop_get_chain(MorphOpChain*);
 
 #endif
@@ -0,0 +1,331 @@
+
+#include <libgimp/gimp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "morphop-profile.h"
+
+// the highest nesting of stages and passes (operation > stage > pass)
+#define PROFILE_MAX_DEPTH 8
+
+/*
+ * A recorded operation, stage or pass
+ */
+typedef struct {
+	const gchar* operation; // label of the operation it belongs to (interned string)
+	const gchar* name; // name of the stage or pass, it's the label itself for the whole operation
+	int depth; // 0 for the whole operation
+	gint64 start, duration; // in microseconds, since the profile was enabled
+	gulong pixels, rows_read, rows_written;
+	gsize bytes_allocated;
+	gulong tile_hits, tile_misses; // of the tile cache, for the whole operation only (see profile_tiles())
+} ProfileEvent;
+
+/*
+ * The records of the same stage or pass of an operator, added up
+ */
+typedef struct {
+	const gchar* operation;
+	const gchar* name;
+	int depth;
+	int calls;
+	gint64 duration;
+	gulong pixels, rows_read, rows_written;
+	gsize bytes_allocated;
+	gulong tile_hits, tile_misses;
+} ProfileTotal;
+
+typedef struct {
+	gboolean enabled;
+	const gchar* path; // the Chrome trace file, or NULL to print the breakdown
+	gint64 origin; // time when the profile was enabled
+	GArray* events; // of ProfileEvent
+
+	const gchar* operation; // label of the running operation
+	const gchar* open_names[PROFILE_MAX_DEPTH]; // the stages and passes started but not ended yet
+	gint64 open_starts[PROFILE_MAX_DEPTH];
+	int depth;
+	gulong tile_hits, tile_misses; // of the running operation
+} MorphOpProfile;
+
+static MorphOpProfile profile = { FALSE, NULL, 0, NULL, NULL, { NULL }, { 0 }, 0, 0, 0 };
+
+static void profile_begin(const gchar*);
+static void profile_end(const gchar*, gulong, gulong, gulong, gsize);
+static void profile_write(void);
+static void profile_write_trace(FILE*);
+static void json_write_string(FILE*, const gchar*);
+static void profile_write_breakdown(FILE*);
+
+/* profile_init()
+ *
+ * Enables the profile if the environment variable MORPHOP_PROFILE is set (and it's not "0"): the records
+ * will be written when the plugin exits
+ */
+void profile_init(void)
+{
+	const gchar* value = g_getenv("MORPHOP_PROFILE");
+
+	if (profile.enabled || value == NULL || value[0] == '\0' || strcmp(value, "0") == 0) return;
+
+	profile.enabled = TRUE;
+	profile.path = (g_str_has_suffix(value, ".json") ? g_strdup(value) : NULL);
+	profile.origin = g_get_monotonic_time();
+	profile.events = g_array_new(FALSE, FALSE, sizeof(ProfileEvent));
+
+	atexit(profile_write);
+}
+
+gboolean profile_is_enabled(void)
+{
+	return profile.enabled;
+}
+
+/* profile_operation_begin()
+ *
+ * Starts recording an operation (named after its operator, or its operators for a chain): the following stages
+ * and passes belong to it. Previews are recorded separately from the operations on the whole drawable.
+ */
+void profile_operation_begin(const char* name, gboolean is_preview)
+{
+	if (!profile.enabled) return;
+
+	gchar* label = g_strdup_printf("%s%s", name, (is_preview ? " (preview)" : ""));
+	profile.operation = g_intern_string(label);
+	g_free(label);
+
+	profile.depth = 0;
+	profile.tile_hits = profile.tile_misses = 0;
+	profile_begin(profile.operation);
+}
+
+void profile_operation_end(void)
+{
+	if (!profile.enabled || profile.operation == NULL) return;
+
+	profile_end(profile.operation, 0, 0, 0, 0);
+	profile.operation = NULL;
+}
+
+/* profile_tiles()
+ *
+ * Adds the hits and misses of the tile cache (see tiles_access()) to the running operation
+ */
+void profile_tiles(gulong hits, gulong misses)
+{
+	if (!profile.enabled || profile.operation == NULL) return;
+
+	profile.tile_hits += hits;
+	profile.tile_misses += misses;
+}
+
+/* profile_stage_begin()
+ *
+ * Starts recording a stage of the running operation, e.g. the transfer of the pixels from GIMP to memory
+ */
+void profile_stage_begin(const char* name)
+{
+	if (profile.enabled && profile.operation != NULL) profile_begin(name);
+}
+
+/* profile_stage_end()
+ *
+ * Records a stage of the running operation, with what it did: pixels, rows read and written, bytes allocated
+ */
+void profile_stage_end(const char* name, gulong pixels, gulong rows_read, gulong rows_written, gsize bytes_allocated)
+{
+	if (profile.enabled && profile.operation != NULL) profile_end(name, pixels, rows_read, rows_written, bytes_allocated);
+}
+
+/* profile_pass()
+ *
+ * The profile function of the libmorphop context (see MorphOpProfileFunc): the passes of the engine
+ * are recorded as stages. Erosions and dilations are named with the engine that the planner chose for them,
+ * e.g. "erosion (channels: 3 runs by cells, blocks)", so the passes of each engine are added up apart.
+ */
+void profile_pass(const MorphOpPassInfo* info, void* data)
+{
+	const gchar* name = info->name;
+
+	if (info->engine != NULL) {
+		gchar* label = g_strdup_printf("%s (%s)", info->name, info->engine);
+		name = g_intern_string(label);
+		g_free(label);
+	}
+
+	if (!info->end) profile_stage_begin(name);
+	else profile_stage_end(name, info->pixels, info->rows_read, info->rows_written, info->bytes_allocated);
+}
+
+static void profile_begin(const gchar* name)
+{
+	if (profile.depth >= PROFILE_MAX_DEPTH) return;
+
+	profile.open_names[profile.depth] = name;
+	profile.open_starts[profile.depth] = g_get_monotonic_time();
+	profile.depth++;
+}
+
+/* profile_end()
+ *
+ * Records the last started stage with the given name. The stages started after it, and never ended
+ * (the operation stopped in the middle of a pass), are dropped.
+ */
+static void profile_end(const gchar* name, gulong pixels, gulong rows_read, gulong rows_written, gsize bytes_allocated)
+{
+	gint64 now = g_get_monotonic_time();
+	int depth = profile.depth - 1;
+
+	while (depth >= 0 && strcmp(profile.open_names[depth], name) != 0) depth--;
+	if (depth < 0) return;
+
+	ProfileEvent event = {
+		profile.operation, profile.open_names[depth], depth,
+		profile.open_starts[depth] - profile.origin, now - profile.open_starts[depth],
+		pixels, rows_read, rows_written, bytes_allocated,
+		(depth == 0 ? profile.tile_hits : 0), (depth == 0 ? profile.tile_misses : 0)
+	};
+	g_array_append_val(profile.events, event);
+
+	profile.depth = depth;
+}
+
+/* profile_write()
+ *
+ * Called at exit: writes the Chrome trace file, or prints the breakdown by operator
+ */
+static void profile_write(void)
+{
+	if (profile.path != NULL) {
+		FILE* file = fopen(profile.path, "w");
+
+		if (file == NULL) {
+			g_printerr("morphop: can't write the profile to %s\n", profile.path);
+			return;
+		}
+
+		profile_write_trace(file);
+		fclose(file);
+	}
+	else {
+		profile_write_breakdown(stderr);
+	}
+}
+
+/* profile_write_trace()
+ *
+ * Writes the records as "complete" events of the Chrome trace format. The category of each event is its operation.
+ */
+static void profile_write_trace(FILE* file)
+{
+	guint i;
+
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+	for (i = 0; i < profile.events->len; i++) {
+		ProfileEvent* event = &g_array_index(profile.events, ProfileEvent, i);
+
+		fprintf(file, "%s\n\t{\"name\": ", (i > 0 ? "," : ""));
+		json_write_string(file, event->name);
+		fprintf(file, ", \"cat\": ");
+		json_write_string(file, event->operation);
+		fprintf(file, ", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+			"\"ts\": %" G_GINT64_FORMAT ", \"dur\": %" G_GINT64_FORMAT ", \"args\": {\"pixels\": %lu, "
+			"\"rows_read\": %lu, \"rows_written\": %lu, \"bytes_allocated\": %lu, \"tile_hits\": %lu, \"tile_misses\": %lu}}",
+			event->start, event->duration,
+			event->pixels, event->rows_read, event->rows_written, (gulong)event->bytes_allocated,
+			event->tile_hits, event->tile_misses);
+	}
+
+	fprintf(file, "\n]}\n");
+}
+
+/* json_write_string()
+ *
+ * Writes a string as a JSON string: the names come from the labels of the operators and of the engines, and
+ * the quotes, the backslashes and the control characters must be escaped. The other bytes (UTF-8) are kept.
+ */
+static void json_write_string(FILE* file, const gchar* text)
+{
+	const guchar* c;
+
+	fputc('"', file);
+
+	for (c = (const guchar*)text; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+		else if (*c < 0x20) fprintf(file, "\\u%04x", *c);
+		else fputc(*c, file);
+	}
+
+	fputc('"', file);
+}
+
+/* profile_write_breakdown()
+ *
+ * Prints, for each operation, the total of each of its stages and passes, in the order they were first run.
+ * The time of the operation not spent in any stage is shown as "(other)".
+ */
+static void profile_write_breakdown(FILE* file)
+{
+	GArray* totals = g_array_new(FALSE, TRUE, sizeof(ProfileTotal));
+	guint i, j;
+
+	for (i = 0; i < profile.events->len; i++) {
+		ProfileEvent* event = &g_array_index(profile.events, ProfileEvent, i);
+		ProfileTotal* total = NULL;
+
+		for (j = 0; j < totals->len && total == NULL; j++) {
+			ProfileTotal* this_total = &g_array_index(totals, ProfileTotal, j);
+			if (this_total->operation == event->operation && this_total->depth == event->depth && strcmp(this_total->name, event->name) == 0) {
+				total = this_total;
+			}
+		}
+
+		if (total == NULL) {
+			ProfileTotal new_total = { event->operation, event->name, event->depth, 0, 0, 0, 0, 0, 0, 0, 0 };
+			g_array_append_val(totals, new_total);
+			total = &g_array_index(totals, ProfileTotal, totals->len - 1);
+		}
+
+		total->calls++;
+		total->duration += event->duration;
+		total->pixels += event->pixels;
+		total->rows_read += event->rows_read;
+		total->rows_written += event->rows_written;
+		total->bytes_allocated += event->bytes_allocated;
+		total->tile_hits += event->tile_hits;
+		total->tile_misses += event->tile_misses;
+	}
+
+	fprintf(file, "morphop profile\n");
+
+	for (i = 0; i < totals->len; i++) {
+		ProfileTotal* operation = &g_array_index(totals, ProfileTotal, i);
+		gint64 staged = 0;
+
+		if (operation->depth != 0) continue;
+
+		fprintf(file, "\n%s: %d run(s), %.3f ms", operation->name, operation->calls, operation->duration / 1000.0);
+		if (operation->tile_hits + operation->tile_misses > 0) {
+			fprintf(file, ", tile cache %lu hits, %lu misses (%.1f%%)", operation->tile_hits, operation->tile_misses,
+				100.0 * operation->tile_hits / (operation->tile_hits + operation->tile_misses));
+		}
+		fprintf(file, "\n");
+		fprintf(file, "  %-24s %8s %12s %12s %12s %12s %14s\n", "stage", "calls", "ms", "Mpixels", "rows read", "rows written", "KB allocated");
+
+		for (j = 0; j < totals->len; j++) {
+			ProfileTotal* total = &g_array_index(totals, ProfileTotal, j);
+			if (total->operation != operation->operation || total->depth == 0) continue;
+
+			if (total->depth == 1) staged += total->duration;
+
+			fprintf(file, "  %*s%-*s %8d %12.3f %12.3f %12lu %12lu %14.1f\n",
+				2 * (total->depth - 1), "", 24 - 2 * (total->depth - 1), total->name, total->calls,
+				total->duration / 1000.0, total->pixels / 1e6, total->rows_read, total->rows_written, total->bytes_allocated / 1024.0);
+		}
+
+		fprintf(file, "  %-24s %8s %12.3f\n", "(other)", "", (operation->duration - staged) / 1000.0);
+	}
+
+	g_array_free(totals, TRUE);
+}
@@ -0,0 +1,25 @@
+#ifndef __MORPHOP_PROFILE_H__
+#define __MORPHOP_PROFILE_H__
+
+#include <libgimp/gimp.h>
+#include "morphop-algorithms.h"
+
+/*
+ * Instrumentation of the operations, enabled by the environment variable MORPHOP_PROFILE:
+ * every pass of libmorphop and every transfer between GIMP and memory is recorded with its wall time,
+ * pixels, rows read and written and bytes allocated, and each operation with the hits and misses of the tile
+ * cache. When the plugin exits, the records are printed as a per-operator breakdown on stderr or, if
+ * MORPHOP_PROFILE is the name of a ".json" file, written to it in the Chrome trace format (open it with
+ * chrome://tracing or https://ui.perfetto.dev).
+ */
+
+void profile_init(void);
+gboolean profile_is_enabled(void);
+void profile_operation_begin(const char*, gboolean);
+void profile_operation_end(void);
+void profile_stage_begin(const char*);
+void profile_stage_end(const char*, gulong, gulong, gulong, gsize);
+void profile_tiles(gulong, gulong);
+void profile_pass(const MorphOpPassInfo*, void*);
+
+#endif
@@ -0,0 +1,299 @@
+
+#include <libgimp/gimp.h>
+#include <string.h>
+#include "morphop-region.h"
+#include "morphop-profile.h"
+#include "morphop-tiles.h"
+
+// the cost of starting a thread, relative to the cost of processing one pixel (see gegl_parallel_distribute_area())
+#define GEGL_THREAD_COST 64
+
+static PixelFormat drawable_get_pixel_format(gint32, SampleType);
+
+#if USE_GEGL_API
+static const Babl* gegl_get_working_format(gint32, gboolean, PixelFormat*);
+static void parallel_band(const GeglRectangle*, gpointer);
+
+typedef struct {
+	MorphOpBandFunc func;
+	gpointer data;
+} RegionBandTask;
+#endif
+
+/* region_init()
+ *
+ * Sets the rectangle of the region and the format of its pixels, without reading them
+ *
+ * - GimpDrawable* drawable: the input drawable
+ * - MorphOpRegion* region: the region to be initialized
+ * - int sel_x, int sel_y, int sel_w, int sel_h: selection boundaries
+ * - gboolean is_preview: if TRUE, the pixels are always 8-bit (the preview can't show more).
+ *   Else (GEGL only) they keep the precision of the drawable
+ */
+void region_init(GimpDrawable* drawable, MorphOpRegion* region, int sel_x, int sel_y, int sel_w, int sel_h, gboolean is_preview)
+{
+	PixelFormat format;
+
+	region->x = sel_x;
+	region->y = sel_y;
+	region->w = sel_w;
+	region->h = sel_h;
+
+#if USE_GEGL_API
+	region->babl_format = gegl_get_working_format(drawable->drawable_id, is_preview, &format);
+#else
+	format = drawable_get_pixel_format(drawable->drawable_id, SAMPLE_U8);
+#endif
+
+	region->src.width = region->dst.width = sel_w;
+	region->src.height = region->dst.height = sel_h;
+	region->src.format = region->dst.format = format;
+	region->src.stride = region->dst.stride = (gsize)sel_w * pixel_format_get_bpp(format);
+	region->src.data = region->dst.data = NULL;
+}
+
+/* region_prepare()
+ *
+ * Copies the selected pixels of the drawable to memory, and allocates the memory for the result (see region_init()
+ * for the parameters). 'arena' is the arena for the pixels.
+ *
+ * Returns FALSE if there is no memory for the region.
+ */
+gboolean region_prepare(
+	GimpDrawable* drawable,
+	MorphOpRegion* region,
+	int sel_x, int sel_y, int sel_w, int sel_h,
+	gboolean is_preview,
+	MorphOpArena* arena
+){
+	region_init(drawable, region, sel_x, sel_y, sel_w, sel_h, is_preview);
+
+	region->src.data = arena_alloc(arena, region->src.stride * sel_h);
+	region->dst.data = arena_alloc(arena, region->dst.stride * sel_h);
+
+	if (region->src.data == NULL || region->dst.data == NULL) return FALSE;
+
+	region_read_rows(drawable, region, 0, sel_h, &region->src);
+
+	return TRUE;
+}
+
+/* region_read_rows()
+ *
+ * Copies the rows [y0, y1) of the region (counted from its top) from the drawable to 'image', whose rows
+ * are contiguous
+ */
+void region_read_rows(GimpDrawable* drawable, const MorphOpRegion* region, int y0, int y1, MorphOpImage* image)
+{
+#if USE_GEGL_API
+	GeglRectangle rect = { region->x, region->y + y0, region->w, y1 - y0 };
+	GeglBuffer* buffer = gimp_drawable_get_buffer(drawable->drawable_id);
+	gegl_buffer_get(buffer, &rect, 1.0, region->babl_format, image->data, image->stride, GEGL_ABYSS_NONE);
+	g_object_unref(buffer);
+#else
+	GimpPixelRgn rgn;
+	gimp_pixel_rgn_init (&rgn, drawable, region->x, region->y + y0, region->w, y1 - y0, FALSE, FALSE);
+	gimp_pixel_rgn_get_rect (&rgn, image->data, region->x, region->y + y0, region->w, y1 - y0);
+#endif
+
+	tiles_access(drawable->drawable_id, FALSE, region->x, region->y + y0, region->w, y1 - y0);
+}
+
+/* region_store_rows()
+ *
+ * Writes the rows [y0, y1) of the result (from 'image', whose rows are contiguous) to the shadow of the drawable.
+ * They become its content with region_merge().
+ */
+void region_store_rows(GimpDrawable* drawable, const MorphOpRegion* region, int y0, int y1, const MorphOpImage* image)
+{
+#if USE_GEGL_API
+	GeglRectangle rect = { region->x, region->y + y0, region->w, y1 - y0 };
+	GeglBuffer* shadow = gimp_drawable_get_shadow_buffer(drawable->drawable_id);
+	gegl_buffer_set(shadow, &rect, 0, region->babl_format, image->data, image->stride);
+	gegl_buffer_flush(shadow);
+	g_object_unref(shadow);
+#else
+	GimpPixelRgn rgn;
+	gimp_pixel_rgn_init (&rgn, drawable, region->x, region->y + y0, region->w, y1 - y0, TRUE, TRUE);
+	gimp_pixel_rgn_set_rect (&rgn, image->data, region->x, region->y + y0, region->w, y1 - y0);
+	gimp_drawable_flush (drawable);
+#endif
+
+	tiles_access(drawable->drawable_id, TRUE, region->x, region->y + y0, region->w, y1 - y0);
+}
+
+/* region_read_drawable()
+ *
+ * Copies the rectangle of the region from another drawable (of the same size) to 'image', that must be as big
+ * as the region. The pixels are converted to the format of the region (GEGL only: without it, the drawable
+ * must have the same bytes per pixel). Returns FALSE if the drawable can't be read.
+ */
+gboolean region_read_drawable(gint32 drawable_id, const MorphOpRegion* region, MorphOpImage* image)
+{
+#if USE_GEGL_API
+	GeglRectangle rect = { region->x, region->y, region->w, region->h };
+	GeglBuffer* buffer = gimp_drawable_get_buffer(drawable_id);
+	gegl_buffer_get(buffer, &rect, 1.0, region->babl_format, image->data, image->stride, GEGL_ABYSS_NONE);
+	g_object_unref(buffer);
+#else
+	if (gimp_drawable_bpp(drawable_id) != pixel_format_get_bpp(image->format)) return FALSE;
+
+	GimpDrawable* drawable = gimp_drawable_get(drawable_id);
+	GimpPixelRgn rgn;
+	gimp_pixel_rgn_init (&rgn, drawable, region->x, region->y, region->w, region->h, FALSE, FALSE);
+	gimp_pixel_rgn_get_rect (&rgn, image->data, region->x, region->y, region->w, region->h);
+	gimp_drawable_detach (drawable);
+#endif
+
+	tiles_access(drawable_id, FALSE, region->x, region->y, region->w, region->h);
+	return TRUE;
+}
+
+/* region_read_selection()
+ *
+ * If the selection of the image (of id 'image_id') is not a rectangle, finds the pixels of the region that are
+ * selected, even partially: their spans go in 'region->selection', taken from the arena, so the operator computes
+ * only them (GIMP keeps the other pixels as they are). Returns FALSE if all the pixels of the region are selected,
+ * or if there is no memory: the whole region is computed.
+ * The mask is read in the destination of the region, that the operator writes later.
+ */
+gboolean region_read_selection(gint32 image_id, GimpDrawable* drawable, MorphOpRegion* region, MorphOpArena* arena)
+{
+	unsigned char* mask = region->dst.data;
+	gint32 selection_id = gimp_image_get_selection(image_id);
+	int offset_x, offset_y, y;
+
+	if (gimp_selection_is_empty(image_id)) return FALSE;
+
+	// the selection is as big as the image, the region can go out of it (in the preview)
+	gimp_drawable_offsets(drawable->drawable_id, &offset_x, &offset_y);
+	offset_x += region->x;
+	offset_y += region->y;
+	if (
+		offset_x < 0 || offset_y < 0 ||
+		offset_x + region->w > gimp_image_width(image_id) || offset_y + region->h > gimp_image_height(image_id)
+	) return FALSE;
+
+#if USE_GEGL_API
+	GeglRectangle rect = { offset_x, offset_y, region->w, region->h };
+	GeglBuffer* buffer = gimp_drawable_get_buffer(selection_id);
+	gegl_buffer_get(buffer, &rect, 1.0, babl_format("Y u8"), mask, region->w, GEGL_ABYSS_NONE);
+	g_object_unref(buffer);
+#else
+	GimpDrawable* selection = gimp_drawable_get(selection_id);
+	GimpPixelRgn rgn;
+	gimp_pixel_rgn_init (&rgn, selection, offset_x, offset_y, region->w, region->h, FALSE, FALSE);
+	gimp_pixel_rgn_get_rect (&rgn, mask, offset_x, offset_y, region->w, region->h);
+	gimp_drawable_detach (selection);
+#endif
+
+	tiles_access(selection_id, FALSE, offset_x, offset_y, region->w, region->h);
+
+	for (y = 0; y < region->h; y++) {
+		if (memchr(mask + (gsize)y * region->w, 0, region->w) != NULL) break;
+	}
+	if (y == region->h) return FALSE;
+
+	return (morphop_selection_build(&region->selection, mask, region->w, region->w, region->h, arena) == MORPHOP_OK);
+}
+
+/* region_commit()
+ *
+ * Writes the result of the operator to the shadow of the drawable, and makes it the new content of the drawable
+ */
+void region_commit(GimpDrawable* drawable, MorphOpRegion* region)
+{
+	profile_stage_begin("store");
+	region_store_rows(drawable, region, 0, region->h, &region->dst);
+	profile_stage_end("store", (gulong)region->w * region->h, 0, region->h, 0);
+
+	region_merge(drawable, region);
+}
+
+/* region_merge()
+ *
+ * Makes the shadow of the drawable, where the result has been stored, its new content (within the selection)
+ */
+void region_merge(GimpDrawable* drawable, const MorphOpRegion* region)
+{
+	gulong pixels = (gulong)region->w * region->h;
+
+	profile_stage_begin("merge-shadow");
+	gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
+	gimp_drawable_update (drawable->drawable_id, region->x, region->y, region->w, region->h);
+	profile_stage_end("merge-shadow", pixels, region->h, region->h, 0);
+}
+
+#if USE_GEGL_API
+
+/* region_parallel_for()
+ *
+ * The parallel function of the libmorphop context (see MorphOpParallelFunc): the rows [y0, y1) are split
+ * in bands, that are processed concurrently by the GEGL threads. 'region_data' is the MorphOpRegion.
+ */
+void region_parallel_for(int y0, int y1, MorphOpBandFunc func, void* data, void* region_data)
+{
+	MorphOpRegion* region = region_data;
+	RegionBandTask task = { func, data };
+	GeglRectangle area = { 0, y0, region->w, y1 - y0 };
+
+	// bands must span the whole width of the region: the kernels work on entire rows
+	gegl_parallel_distribute_area(&area, GEGL_THREAD_COST, GEGL_SPLIT_STRATEGY_HORIZONTAL, parallel_band, &task);
+}
+
+static void parallel_band(const GeglRectangle* area, gpointer data)
+{
+	RegionBandTask* task = data;
+	task->func(area->y, area->y + area->height, task->data);
+}
+
+/* gegl_get_working_format()
+ *
+ * Returns the babl format used to read and write the drawable, and sets 'format' accordingly. It has the same
+ * components and space of the drawable, with 8-bit, 16-bit or float samples (whichever is closer to the
+ * precision of the drawable). The preview always works in 8-bit.
+ * Values are perceptual (gamma-corrected), as in the 8-bit version of the operators.
+ */
+static const Babl* gegl_get_working_format(gint32 drawable_id, gboolean is_preview, PixelFormat* format)
+{
+	const Babl* native = gimp_drawable_get_format(drawable_id);
+	const Babl* native_type = babl_format_get_type(native, 0);
+	const char* model, *type;
+
+	if (is_preview || native_type == babl_type("u8")) {
+		*format = drawable_get_pixel_format(drawable_id, SAMPLE_U8);
+		type = "u8";
+	}
+	else if (native_type == babl_type("u16")) {
+		*format = drawable_get_pixel_format(drawable_id, SAMPLE_U16);
+		type = "u16";
+	}
+	else {
+		// 32-bit integers, half and double precision are processed as float
+		*format = drawable_get_pixel_format(drawable_id, SAMPLE_FLOAT);
+		type = "float";
+	}
+
+	if (format->is_rgb) model = (format->has_alpha ? "R'G'B'A" : "R'G'B'");
+	else model = (format->has_alpha ? "Y'A" : "Y'");
+
+	gchar* name = g_strdup_printf("%s %s", model, type);
+	const Babl* babl_format = babl_format_with_space(name, native);
+	g_free(name);
+
+	return babl_format;
+}
+
+#endif
+
+static PixelFormat drawable_get_pixel_format(gint32 drawable_id, SampleType type)
+{
+	PixelFormat format;
+
+	format.type = type;
+	format.is_rgb = gimp_drawable_is_rgb(drawable_id);
+	format.has_alpha = gimp_drawable_has_alpha(drawable_id);
+	format.channels = (format.is_rgb ? 3 : 1) + (format.has_alpha ? 1 : 0);
+
+	return format;
+}
@@ -0,0 +1,38 @@
+#ifndef __MORPHOP_REGION_H__
+#define __MORPHOP_REGION_H__
+
+#include <libgimp/gimp.h>
+#include "morphop-algorithms.h"
+
+#if USE_GEGL_API
+	#include <gegl.h>
+#endif
+
+/*
+ * The selected rectangle of a drawable, copied to memory so that libmorphop can work on it
+ */
+typedef struct {
+	int x, y, w, h; // selection boundaries, in drawable coordinates
+	MorphOpImage src; // the selected pixels
+	MorphOpImage dst; // the result of the operator, written back by region_commit()
+	MorphOpSelection selection; // the selected pixels, see region_read_selection()
+
+#if USE_GEGL_API
+	const Babl* babl_format; // the format of the pixels of 'src' and 'dst'
+#endif
+} MorphOpRegion;
+
+void region_init(GimpDrawable*, MorphOpRegion*, int, int, int, int, gboolean);
+gboolean region_prepare(GimpDrawable*, MorphOpRegion*, int, int, int, int, gboolean, MorphOpArena*);
+void region_read_rows(GimpDrawable*, const MorphOpRegion*, int, int, MorphOpImage*);
+void region_store_rows(GimpDrawable*, const MorphOpRegion*, int, int, const MorphOpImage*);
+gboolean region_read_drawable(gint32, const MorphOpRegion*, MorphOpImage*);
+gboolean region_read_selection(gint32, GimpDrawable*, MorphOpRegion*, MorphOpArena*);
+void region_commit(GimpDrawable*, MorphOpRegion*);
+void region_merge(GimpDrawable*, const MorphOpRegion*);
+
+#if USE_GEGL_API
+void region_parallel_for(int, int, MorphOpBandFunc, void*, void*);
+#endif
+
+#endif
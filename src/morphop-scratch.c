@@ -0,0 +1,53 @@
+
+#include <glib.h>
+#include "morphop-scratch.h"
+
+#ifdef G_OS_UNIX
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+static gsize scratch_get_size(const MorphOpImage*);
+
+/* scratch_image_alloc()
+ *
+ * Allocates the pixels of the image (see MorphOpTempAllocFunc) in a new file, that is deleted right away: it goes
+ * with the mapping. Where files can't be mapped, they are on the heap. Returns 0 if there is no memory, or no space.
+ */
+int scratch_image_alloc(MorphOpImage* image, void* data)
+{
+	image->stride = (gsize)image->width * pixel_format_get_bpp(image->format);
+
+#ifdef G_OS_UNIX
+	gsize size = scratch_get_size(image);
+	gchar* path;
+	gint fd = g_file_open_tmp("morphop-XXXXXX", &path, NULL);
+
+	if (fd < 0) return 0;
+	unlink(path);
+	g_free(path);
+
+	void* map = (ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED);
+	close(fd);
+
+	image->data = (map != MAP_FAILED ? map : NULL);
+#else
+	image->data = g_try_malloc(scratch_get_size(image));
+#endif
+
+	return (image->data != NULL);
+}
+
+void scratch_image_free(MorphOpImage* image, void* data)
+{
+#ifdef G_OS_UNIX
+	munmap(image->data, scratch_get_size(image));
+#else
+	g_free(image->data);
+#endif
+}
+
+static gsize scratch_get_size(const MorphOpImage* image)
+{
+	return MAX(image->stride * image->height, 1);
+}
@@ -0,0 +1,16 @@
+#ifndef __MORPHOP_SCRATCH_H__
+#define __MORPHOP_SCRATCH_H__
+
+#include <glib.h>
+#include "morphop-engine.h"
+
+/*
+ * The temporary images of the operations that don't fit the memory budget (see MorphOpContext.temp_alloc):
+ * each one is a file in the temporary directory, mapped in memory, so the system writes its pixels to the disk
+ * when it needs the memory, instead of the swap
+ */
+
+int scratch_image_alloc(MorphOpImage*, void*);
+void scratch_image_free(MorphOpImage*, void*);
+
+#endif
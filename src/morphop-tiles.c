@@ -0,0 +1,125 @@
+
+#include <libgimp/gimp.h>
+#include "morphop-tiles.h"
+#include "morphop-profile.h"
+
+/*
+ * A tile in the model of the cache: 'link' is its place in the order of use
+ */
+typedef struct {
+	guint64 key; // see tiles_get_key()
+	GList link;
+} CachedTile;
+
+/*
+ * The model of the libgimp tile cache: it drops the least recently used tile when it's full, as libgimp does
+ */
+typedef struct {
+	gulong capacity; // in tiles, as given to gimp_tile_cache_ntiles()
+	GHashTable* tiles; // of CachedTile, by key
+	GQueue order; // of CachedTile, the least recently used first
+} TileCacheModel;
+
+static TileCacheModel cache = { 0, NULL, G_QUEUE_INIT };
+
+static guint64 tiles_get_key(gint32, gboolean, int, int);
+static gboolean tiles_use(guint64);
+static void tiles_evict(void);
+
+/* tiles_cache_init()
+ *
+ * - int sel_x, int sel_w: the columns of the region that the operation transfers
+ * - int n_drawables: the drawables it reads and writes (the shadow of a drawable is one more)
+ * - int window: the rows of a drawable that a transfer reads again after the previous one, e.g. the halo around
+ *   the strips of an operation out of core, or the whole region for a preview, that is read at each update.
+ *   0 if each row is read once.
+ *
+ * Sets the size of the tile cache: for each drawable, the tile columns of the region (the first and the last are
+ * rarely whole) times the tile rows across the window, plus the one that two consecutive transfers share.
+ */
+void tiles_cache_init(int sel_x, int sel_w, int n_drawables, int window)
+{
+	int tile_w = gimp_tile_width(), tile_h = gimp_tile_height();
+	int columns = (sel_x + MAX(sel_w, 1) - 1) / tile_w - sel_x / tile_w + 1;
+	int rows = (MAX(window, 0) + tile_h - 1) / tile_h + 1;
+
+	cache.capacity = (gulong)MAX(n_drawables, 1) * columns * rows;
+	gimp_tile_cache_ntiles (cache.capacity);
+
+	tiles_evict();
+}
+
+/* tiles_access()
+ *
+ * Counts the tiles of the rectangle of a drawable (or of its shadow), just transferred, as hits or misses of the
+ * cache, for the profile. Nothing is done if the profile is not enabled.
+ * The pixel regions go through the libgimp cache; with GEGL, the buffers have their own, and the counts tell how
+ * many tiles the transfers read again.
+ */
+void tiles_access(gint32 drawable_id, gboolean shadow, int x, int y, int w, int h)
+{
+	int tile_w = gimp_tile_width(), tile_h = gimp_tile_height();
+	gulong hits = 0, misses = 0;
+	int tx, ty;
+
+	if (!profile_is_enabled() || w <= 0 || h <= 0) return;
+
+	if (cache.tiles == NULL) cache.tiles = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+
+	// a pixel region is walked a row of tiles at a time
+	for (ty = y / tile_h; ty <= (y + h - 1) / tile_h; ty++) {
+		for (tx = x / tile_w; tx <= (x + w - 1) / tile_w; tx++) {
+			if (tiles_use(tiles_get_key(drawable_id, shadow, tx, ty))) hits++;
+			else misses++;
+		}
+	}
+
+	profile_tiles(hits, misses);
+}
+
+/* tiles_get_key()
+ *
+ * Identifies a tile of a drawable, or of its shadow, in the model of the cache
+ */
+static guint64 tiles_get_key(gint32 drawable_id, gboolean shadow, int tx, int ty)
+{
+	return ((guint64)(guint32)drawable_id << 33) | ((guint64)(shadow ? 1 : 0) << 32) | ((guint64)(tx & 0xFFFF) << 16) | (ty & 0xFFFF);
+}
+
+/* tiles_use()
+ *
+ * Makes the tile the most recently used of the model, adding it if it's not there. Returns TRUE if it was (a hit).
+ */
+static gboolean tiles_use(guint64 key)
+{
+	CachedTile* tile = g_hash_table_lookup(cache.tiles, &key);
+
+	if (tile != NULL) {
+		g_queue_unlink(&cache.order, &tile->link);
+		g_queue_push_tail_link(&cache.order, &tile->link);
+		return TRUE;
+	}
+
+	tile = g_new0(CachedTile, 1);
+	tile->key = key;
+	tile->link.data = tile;
+	g_queue_push_tail_link(&cache.order, &tile->link);
+	g_hash_table_insert(cache.tiles, &tile->key, tile);
+
+	tiles_evict();
+	return FALSE;
+}
+
+/* tiles_evict()
+ *
+ * Drops the least recently used tiles of the model that don't fit the cache
+ */
+static void tiles_evict(void)
+{
+	while (cache.order.length > cache.capacity) {
+		GList* link = g_queue_pop_head_link(&cache.order);
+		CachedTile* tile = link->data;
+
+		g_hash_table_remove(cache.tiles, &tile->key);
+	}
+}
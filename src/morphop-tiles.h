@@ -0,0 +1,15 @@
+#ifndef __MORPHOP_TILES_H__
+#define __MORPHOP_TILES_H__
+
+#include <libgimp/gimp.h>
+
+/*
+ * The tile cache of libgimp, sized for each operation from the drawables it reads and writes and from the rows
+ * that its transfers read again (see tiles_cache_init()). With the profile enabled, the tiles of every transfer
+ * are counted as hits or misses of a model of the cache, and reported with the operation.
+ */
+
+void tiles_cache_init(int, int, int, int);
+void tiles_access(gint32, gboolean, int, int, int, int);
+
+#endif
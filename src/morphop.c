@@ -27,6 +27,7 @@
 #include <string.h>
 #include "morphop.h"
 #include "morphop-gui.h"
+#include "morphop-profile.h"
 
 static void query (void);
 
@@ -38,6 +39,14 @@ static void run (
 	GimpParam **return_vals
 );
 
+static GimpPDBStatusType get_pdb_status(MorphOpStatus);
+static MorphOpStatus start_dialog_operation(gint32, GimpDrawable*, const MorphOpChain*);
+static void attach_elements(void);
+static gboolean settings_from_params(const GimpParam*, gint, MorphOpSettings*);
+static gboolean chain_from_params(const GimpParam*, gint, MorphOpChain*);
+static void element_from_param(const gint8*, StructuringElement*);
+static void weights_from_param(const gint8*, StructuringElement*);
+
 const GimpPlugInInfo PLUG_IN_INFO = {
 	NULL,  /* init_proc  */
 	NULL,  /* quit_proc  */
@@ -59,7 +68,25 @@ static void query (void)
 			"The structuring element. Must be declared as an array representing a matrix, with size 7x7. "
 			"The first 7 cells represent the first row, and so on. To define the element, set each element[i] to 1, 0 or -1 in case of HIT-OR-MISS, THICKENING or THINNING" },
 		{ GIMP_PDB_INT32, "center", "Center of the structuring element, or rather the i-th index of the 'element' array (0 <= i <= 48)" },
-		{ GIMP_PDB_INT32, "size", "Final scaled size of the structuring element { 3x3 (0), 5x5 (1), 7x7 (2), 9x9 (3), 11x11 (4)}" }
+		{ GIMP_PDB_INT32, "size", "Final scaled size of the structuring element { 3x3 (0), 5x5 (1), 7x7 (2), 9x9 (3), 11x11 (4)}" },
+		{ GIMP_PDB_INT32, "iterations", ""
+			"EROSION, DILATION, OPENING and CLOSING: how many times the element is applied, as if it was that many times bigger "
+			"(1 <= iterations <= 32). It can be omitted by the calls made before it existed, it's 1 then" },
+		{ GIMP_PDB_INT32, "num-weights", "The number of cells of 'weights' (49)" },
+		{ GIMP_PDB_INT8ARRAY, "weights", ""
+			"The heights of the cells of the element, in the same order of 'element', in levels of an 8-bit image (-127 <= weights[i] <= 127): "
+			"the erosion subtracts them and the dilation adds them (non-flat element, e.g. a rolling ball). "
+			"HIT-OR-MISS, THICKENING, THINNING and SKELETONIZATION ignore them. They can be omitted, the element is flat then" },
+		{ GIMP_PDB_INT32, "channel-mode", ""
+			"How the neighbors of a color pixel are compared { LUMINOSITY (0): the whole darkest or brightest neighbor, "
+			"COLOR (1): each color channel on its own, the alpha doesn't change, ALL (2): each channel on its own, the alpha too }. "
+			"HIT-OR-MISS, THICKENING, THINNING and SKELETONIZATION always use LUMINOSITY. It can be omitted (with the weights too), it's LUMINOSITY then" },
+		{ GIMP_PDB_CHANNEL, "element-channel", ""
+			"A custom element of any size (up to 511x511), instead of 'element', 'size' and 'weights': the pixels of the channel that are "
+			"at least half white are its cells, its center is the middle pixel. For HIT-OR-MISS, THICKENING and THINNING they must be white, "
+			"the others black. -1 for none. It can be omitted (with 'element-brush'), there is none then" },
+		{ GIMP_PDB_STRING, "element-brush", ""
+			"The name of a brush whose mask is the custom element, the same way (if there is no 'element-channel'). \"\" for none" }
 	};
 	
 	gimp_install_procedure (
@@ -80,6 +107,177 @@ static void query (void)
 	);
 
 	gimp_plugin_menu_register (MORPHOP_PROC, "<Image>/Filters/Generic"); 
+	
+	// the same operator on many drawables at once, for scripts (no menu entry)
+	static GimpParamDef batch_args[] = {
+		{ GIMP_PDB_INT32, "run-mode", "The run mode { RUN-NONINTERACTIVE (1) }" },
+		{ GIMP_PDB_IMAGE, "image", "Input image (unused, the drawables can belong to different images)" },
+		{ GIMP_PDB_INT32, "num-drawables", "The number of drawables" },
+		{ GIMP_PDB_INT32ARRAY, "drawables", "The drawables to process" },
+		{ GIMP_PDB_INT32, "operator", "The morphological operator, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "element-size", "Initial size of the structuring element (fake parameter, it's always 7)" },
+		{ GIMP_PDB_INT8ARRAY, "element", "The structuring element, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "center", "Center of the structuring element, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "size", "Final scaled size of the structuring element, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "iterations", "Iterations of the operator, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "num-weights", "The number of cells of 'weights' (49)" },
+		{ GIMP_PDB_INT8ARRAY, "weights", "The heights of the cells of the element, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "channel-mode", "How the neighbors of a color pixel are compared, see " MORPHOP_PROC },
+		{ GIMP_PDB_CHANNEL, "element-channel", "A channel with a custom element, or -1, see " MORPHOP_PROC },
+		{ GIMP_PDB_STRING, "element-brush", "A brush with a custom element, or \"\", see " MORPHOP_PROC }
+	};
+	
+	gimp_install_procedure (
+		MORPHOP_BATCH_PROC,
+		"Morphological operators on many drawables",
+		"Runs a morphological operator, with the same settings, on all the given drawables in a single call. "
+		"It's faster than calling " MORPHOP_PROC " for each of them: the plugin starts once, and the drawables are read "
+		"and written while the operator works on the others. Each drawable gets its own undo step.",
+		"Alessandro Francesconi <alessandrofrancesconi@live.it>",
+		"Copyright (C) Alessandro Francesconi\n"
+		"http://www.alessandrofrancesconi.it/projects/morphop",
+		"2013",
+		NULL,
+		NULL,
+		GIMP_PLUGIN,
+		G_N_ELEMENTS (batch_args),
+		0,
+		batch_args, 
+		NULL
+	);
+	
+	// many operators, one after the other, on the same drawable (no menu entry: in the dialog, use "Add step")
+	static GimpParamDef chain_args[] = {
+		{ GIMP_PDB_INT32, "run-mode", "The run mode { RUN-NONINTERACTIVE (1) }" },
+		{ GIMP_PDB_IMAGE, "image", "Input image" },
+		{ GIMP_PDB_DRAWABLE, "drawable", "Input drawable" },
+		{ GIMP_PDB_INT32, "num-steps", "The number of steps (1 <= num-steps <= 8)" },
+		{ GIMP_PDB_INT32ARRAY, "operators", "The morphological operator of each step, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "num-cells", "The number of cells of the elements (49 * num-steps)" },
+		{ GIMP_PDB_INT8ARRAY, "elements", "The structuring element of each step, 49 cells each, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "num-sizes", "The number of sizes (num-steps)" },
+		{ GIMP_PDB_INT32ARRAY, "sizes", "Final scaled size of the structuring element of each step, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "num-iterations", "The number of iterations (num-steps)" },
+		{ GIMP_PDB_INT32ARRAY, "iterations", "Iterations of the operator of each step, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "num-weights", "The number of heights of the elements (49 * num-steps)" },
+		{ GIMP_PDB_INT8ARRAY, "weights", "The heights of the cells of the element of each step, 49 cells each, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "num-channel-modes", "The number of channel modes (num-steps)" },
+		{ GIMP_PDB_INT32ARRAY, "channel-modes", "How the neighbors of a color pixel are compared in each step, see " MORPHOP_PROC }
+	};
+	
+	gimp_install_procedure (
+		MORPHOP_CHAIN_PROC,
+		"Chain of morphological operators",
+		"Runs morphological operators one after the other, each one on the result of the previous "
+		"(e.g. closing 3x3, then opening 5x5, then white top-hat 11x11). It's faster than calling " MORPHOP_PROC " "
+		"for each of them: the drawable is read and written once, the steps run together in memory, and the "
+		"whole chain is a single undo step.",
+		"Alessandro Francesconi <alessandrofrancesconi@live.it>",
+		"Copyright (C) Alessandro Francesconi\n"
+		"http://www.alessandrofrancesconi.it/projects/morphop",
+		"2013",
+		NULL,
+		"RGB*, GRAY*",
+		GIMP_PLUGIN,
+		G_N_ELEMENTS (chain_args),
+		0,
+		chain_args, 
+		NULL
+	);
+	
+	static GimpParamDef reconstruct_args[] = {
+		{ GIMP_PDB_INT32, "run-mode", "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
+		{ GIMP_PDB_IMAGE, "image", "Input image" },
+		{ GIMP_PDB_DRAWABLE, "drawable", "The drawable that gets the result" },
+		{ GIMP_PDB_INT32, "operator", "The reconstruction { BY EROSION (0), BY DILATION (1) }" },
+		{ GIMP_PDB_DRAWABLE, "marker", "Where the reconstruction starts from (same size of 'drawable', it can be 'drawable' itself)" },
+		{ GIMP_PDB_DRAWABLE, "mask", "The limit of the reconstruction (same size of 'drawable', it can be 'drawable' itself)" }
+	};
+	
+	gimp_install_procedure (
+		MORPHOP_RECONSTRUCT_PROC,
+		"Morphological reconstruction",
+		"Dilates the marker again and again, each time taking the darkest of it and of the mask, until it doesn't "
+		"change anymore (by erosion: erodes it, taking the brightest). The bright regions of the mask that touch the marker "
+		"are recovered with their exact shape, the others disappear. The neighbors of a pixel are the 8 around it, and "
+		"each color channel is reconstructed on its own; the alpha is the one of the mask.",
+		"Alessandro Francesconi <alessandrofrancesconi@live.it>",
+		"Copyright (C) Alessandro Francesconi\n"
+		"http://www.alessandrofrancesconi.it/projects/morphop",
+		"2013",
+		g_strconcat("Morphological reconstruction", "...", NULL),
+		"RGB*, GRAY*",
+		GIMP_PLUGIN,
+		G_N_ELEMENTS (reconstruct_args),
+		0,
+		reconstruct_args, 
+		NULL
+	);
+
+	gimp_plugin_menu_register (MORPHOP_RECONSTRUCT_PROC, "<Image>/Filters/Generic");
+	
+	static GimpParamDef area_args[] = {
+		{ GIMP_PDB_INT32, "run-mode", "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
+		{ GIMP_PDB_IMAGE, "image", "Input image" },
+		{ GIMP_PDB_DRAWABLE, "drawable", "Input drawable" },
+		{ GIMP_PDB_INT32, "operator", "The operator { AREA-OPENING (2), AREA-CLOSING (3) } (the numbers of OPENING and CLOSING in " MORPHOP_PROC ")" },
+		{ GIMP_PDB_INT32, "min-area", "The bright (opening) or dark (closing) components with fewer pixels than this are removed (min-area >= 1)" }
+	};
+	
+	gimp_install_procedure (
+		MORPHOP_AREA_PROC,
+		"Area opening and closing",
+		"Removes the bright (area opening) or dark (area closing) spots smaller than a number of pixels, whatever "
+		"their shape: they take the level of what surrounds them, the others don't change. The neighbors of a pixel "
+		"are the 8 around it, and each color channel is filtered on its own.",
+		"Alessandro Francesconi <alessandrofrancesconi@live.it>",
+		"Copyright (C) Alessandro Francesconi\n"
+		"http://www.alessandrofrancesconi.it/projects/morphop",
+		"2013",
+		g_strconcat("Area opening and closing", "...", NULL),
+		"RGB*, GRAY*",
+		GIMP_PLUGIN,
+		G_N_ELEMENTS (area_args),
+		0,
+		area_args, 
+		NULL
+	);
+
+	gimp_plugin_menu_register (MORPHOP_AREA_PROC, "<Image>/Filters/Generic");
+	
+	static GimpParamDef watershed_args[] = {
+		{ GIMP_PDB_INT32, "run-mode", "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
+		{ GIMP_PDB_IMAGE, "image", "Input image" },
+		{ GIMP_PDB_DRAWABLE, "drawable", "Input drawable" },
+		{ GIMP_PDB_INT32, "element-size", "Initial size of the structuring element (fake parameter, it's always 7)" },
+		{ GIMP_PDB_INT8ARRAY, "element", "The structuring element of the gradient, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "center", "Center of the structuring element, see " MORPHOP_PROC },
+		{ GIMP_PDB_INT32, "size", "Final scaled size of the structuring element, see " MORPHOP_PROC },
+		{ GIMP_PDB_DRAWABLE, "markers", ""
+			"The markers (same size of 'drawable', it can be 'drawable' itself): each group of pixels that are not black "
+			"is the seed of a basin. -1 to start from the regional minima of the gradient" }
+	};
+	
+	gimp_install_procedure (
+		MORPHOP_WATERSHED_PROC,
+		"Watershed",
+		"Watershed segmentation: the morphological gradient of the drawable is flooded from the markers (or from its "
+		"regional minima), and the pixels where two basins meet become white lines on a black background. The gradient "
+		"is quantized to 256 levels (luminosity, for RGB) and the neighbors of a pixel are the 8 around it.",
+		"Alessandro Francesconi <alessandrofrancesconi@live.it>",
+		"Copyright (C) Alessandro Francesconi\n"
+		"http://www.alessandrofrancesconi.it/projects/morphop",
+		"2013",
+		g_strconcat("Watershed", "...", NULL),
+		"RGB*, GRAY*",
+		GIMP_PLUGIN,
+		G_N_ELEMENTS (watershed_args),
+		0,
+		watershed_args, 
+		NULL
+	);
+
+	gimp_plugin_menu_register (MORPHOP_WATERSHED_PROC, "<Image>/Filters/Generic");
 }
 
 static void run (
@@ -93,6 +291,7 @@ static void run (
 	
 	gint32 image_id;
 	GimpDrawable *drawable;
+	MorphOpChain chain;
 	
 	GimpPDBStatusType status = GIMP_PDB_SUCCESS;
 	GimpRunMode run_mode;
@@ -104,10 +303,17 @@ static void run (
 	values[0].data.d_status = status;
 	
 	image_id = param[1].data.d_image;
-	drawable = gimp_drawable_get (param[2].data.d_drawable);
-	
 	run_mode = param[0].data.d_int32;
 	
+#if USE_GEGL_API
+	// work on the drawables through GEGL, in their own precision (16-bit and float images are not converted to 8-bit)
+	gegl_init (NULL, NULL);
+	gimp_plugin_enable_precision ();
+#endif
+
+	// MORPHOP_PROFILE=1 prints where the time goes when the plugin exits
+	profile_init ();
+	
 	// default settings
 	MorphOpSettings default_set = {
 		.operator = OPERATOR_EROSION,
@@ -122,57 +328,275 @@ static void run (
 				{0, 0, 0, 1, 0, 0, 0},
 			},
 			.size = SIZE_7x7
-		}
+		},
+		.iterations = 1
 	};
 	msettings = default_set;
+	mchain.n_steps = 0;
+	mlayers = LAYERS_ACTIVE;
+	memset(&melements, 0, sizeof(MorphOpElementSources));
 	
 	if (strcmp (name, MORPHOP_PROC) == 0) {
+		drawable = gimp_drawable_get (param[2].data.d_drawable);
+		
 		switch (run_mode) {
 			case GIMP_RUN_WITH_LAST_VALS:
 			
 				gimp_get_data (MORPHOP_PROC, &msettings);
-				start_operation(drawable, NULL, msettings);
+				gimp_get_data (MORPHOP_CHAIN_PROC, &mchain);
+				gimp_get_data (MORPHOP_LAYERS_DATA, &mlayers);
+				gimp_get_data (MORPHOP_ELEMENT_DATA, &melements);
+				attach_elements();
+				morphop_get_chain(&chain);
+				status = get_pdb_status(start_dialog_operation(image_id, drawable, &chain));
 				break;
 				
 			case GIMP_RUN_INTERACTIVE:
 				
 				gimp_get_data (MORPHOP_PROC, &msettings);
+				gimp_get_data (MORPHOP_CHAIN_PROC, &mchain);
+				gimp_get_data (MORPHOP_LAYERS_DATA, &mlayers);
+				gimp_get_data (MORPHOP_ELEMENT_DATA, &melements);
+				attach_elements();
 				if (! morphop_show_gui(image_id, drawable))
 					return;
 				gimp_set_data (MORPHOP_PROC, &msettings, sizeof(MorphOpSettings));
+				gimp_set_data (MORPHOP_CHAIN_PROC, &mchain, sizeof(MorphOpChain));
+				gimp_set_data (MORPHOP_LAYERS_DATA, &mlayers, sizeof(MorphOpLayers));
+				gimp_set_data (MORPHOP_ELEMENT_DATA, &melements, sizeof(MorphOpElementSources));
+				
+				// the steps added in the dialog, if any, then the one shown in it
+				morphop_get_chain(&chain);
+				status = get_pdb_status(start_dialog_operation(image_id, drawable, &chain));
 				break;
 
 			case GIMP_RUN_NONINTERACTIVE:
 			
-				if (nparams != 8) {
-					values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+				// "iterations", then "weights", then "channel-mode", then the custom element were added later
+				if (!settings_from_params(&param[3], nparams - 3, &msettings)) {
+					status = GIMP_PDB_CALLING_ERROR;
 					break;
 				}
 				
-				msettings.operator = param[3].data.d_int32;
+				status = get_pdb_status(start_operation(drawable, NULL, msettings));
+				break;
+				
+			default:
+			
+				status = GIMP_PDB_CALLING_ERROR;
+				break;
+		}
+		
+		if (status == GIMP_PDB_SUCCESS) {			
+			if (run_mode != GIMP_RUN_NONINTERACTIVE) 
+				gimp_displays_flush ();
+		}
+		else if (status == GIMP_PDB_EXECUTION_ERROR) {
+			*nreturn_vals = 2;
+			values[1].type = GIMP_PDB_STRING;
+			values[1].data.d_string = "Execution error.";
+		}
+	}
+
+	else if (strcmp (name, MORPHOP_BATCH_PROC) == 0) {
+		// the drawables come with their number: GIMP passes the array as long as 'num-drawables' says,
+		// so it must be there, of the declared types, and not empty unless there are no drawables
+		if (nparams < 9 ||
+			param[2].type != GIMP_PDB_INT32 || param[3].type != GIMP_PDB_INT32ARRAY ||
+			param[2].data.d_int32 < 0 || (param[2].data.d_int32 > 0 && param[3].data.d_int32array == NULL) ||
+			!settings_from_params(&param[4], nparams - 4, &msettings)) {
+			status = GIMP_PDB_CALLING_ERROR;
+		}
+		else {
+			status = get_pdb_status(start_batch_operation(param[3].data.d_int32array, param[2].data.d_int32, msettings));
+			
+			if (status == GIMP_PDB_EXECUTION_ERROR) {
+				*nreturn_vals = 2;
+				values[1].type = GIMP_PDB_STRING;
+				values[1].data.d_string = "Execution error.";
+			}
+		}
+	}
+
+	else if (strcmp (name, MORPHOP_CHAIN_PROC) == 0) {
+		if (!chain_from_params(&param[3], nparams - 3, &chain)) {
+			status = GIMP_PDB_CALLING_ERROR;
+		}
+		else {
+			drawable = gimp_drawable_get (param[2].data.d_drawable);
+			status = get_pdb_status(start_chain_operation(drawable, NULL, &chain));
+			
+			if (status == GIMP_PDB_EXECUTION_ERROR) {
+				*nreturn_vals = 2;
+				values[1].type = GIMP_PDB_STRING;
+				values[1].data.d_string = "Execution error.";
+			}
+		}
+	}
+
+	else if (strcmp (name, MORPHOP_RECONSTRUCT_PROC) == 0) {
+		MorphOpReconstruction reconstruction;
+		
+		drawable = gimp_drawable_get (param[2].data.d_drawable);
+		
+		// by default, the drawable is both the marker and the mask (the result is the drawable itself)
+		reconstruction.operator = OPERATOR_DILATION;
+		reconstruction.marker_id = reconstruction.mask_id = drawable->drawable_id;
+		
+		switch (run_mode) {
+			case GIMP_RUN_WITH_LAST_VALS:
+			
+				gimp_get_data (MORPHOP_RECONSTRUCT_PROC, &reconstruction);
+				break;
+				
+			case GIMP_RUN_INTERACTIVE:
+				
+				gimp_get_data (MORPHOP_RECONSTRUCT_PROC, &reconstruction);
+				if (! morphop_show_reconstruct_gui(drawable, &reconstruction))
+					return;
+				gimp_set_data (MORPHOP_RECONSTRUCT_PROC, &reconstruction, sizeof(MorphOpReconstruction));
+				break;
+				
+			default:
+			
+				if (nparams != 6) status = GIMP_PDB_CALLING_ERROR;
+				else {
+					reconstruction.operator = param[3].data.d_int32;
+					reconstruction.marker_id = param[4].data.d_drawable;
+					reconstruction.mask_id = param[5].data.d_drawable;
+				}
+				break;
+		}
+		
+		if (status == GIMP_PDB_SUCCESS && reconstruction.operator != OPERATOR_EROSION && reconstruction.operator != OPERATOR_DILATION) {
+			status = GIMP_PDB_CALLING_ERROR;
+		}
+		
+		if (status == GIMP_PDB_SUCCESS) {
+			MorphOpStatus result = start_reconstruct_operation(drawable, reconstruction);
+			
+			// the marker or the mask are not drawables of the same size
+			status = get_pdb_status(result);
+			
+			if (status == GIMP_PDB_SUCCESS && run_mode != GIMP_RUN_NONINTERACTIVE)
+				gimp_displays_flush ();
+		}
+		
+		if (status == GIMP_PDB_EXECUTION_ERROR) {
+			*nreturn_vals = 2;
+			values[1].type = GIMP_PDB_STRING;
+			values[1].data.d_string = "Execution error.";
+		}
+	}
+
+	else if (strcmp (name, MORPHOP_AREA_PROC) == 0) {
+		MorphOpAreaSettings area_settings = { OPERATOR_OPENING, 10 };
+		
+		drawable = gimp_drawable_get (param[2].data.d_drawable);
+		
+		switch (run_mode) {
+			case GIMP_RUN_WITH_LAST_VALS:
+			
+				gimp_get_data (MORPHOP_AREA_PROC, &area_settings);
+				break;
+				
+			case GIMP_RUN_INTERACTIVE:
+				
+				gimp_get_data (MORPHOP_AREA_PROC, &area_settings);
+				if (! morphop_show_area_gui(drawable, &area_settings))
+					return;
+				gimp_set_data (MORPHOP_AREA_PROC, &area_settings, sizeof(MorphOpAreaSettings));
+				break;
 				
-				int i;
-				for (i = 0; i < STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE; i++) {
-					msettings.element.matrix[i % STRELEM_DEFAULT_SIZE][(int)ceil((i + 1.0) / STRELEM_DEFAULT_SIZE) - 1] = param[5].data.d_int8array[i];
+			default:
+			
+				if (nparams != 5) status = GIMP_PDB_CALLING_ERROR;
+				else {
+					area_settings.operator = param[3].data.d_int32;
+					area_settings.min_area = param[4].data.d_int32;
 				}
+				break;
+		}
+		
+		if (
+			status == GIMP_PDB_SUCCESS &&
+			((area_settings.operator != OPERATOR_OPENING && area_settings.operator != OPERATOR_CLOSING) || area_settings.min_area < 1)
+		) {
+			status = GIMP_PDB_CALLING_ERROR;
+		}
+		
+		if (status == GIMP_PDB_SUCCESS) {
+			status = get_pdb_status(start_area_operation(drawable, NULL, area_settings));
+			
+			if (status == GIMP_PDB_SUCCESS && run_mode != GIMP_RUN_NONINTERACTIVE)
+				gimp_displays_flush ();
+		}
+		
+		if (status == GIMP_PDB_EXECUTION_ERROR) {
+			*nreturn_vals = 2;
+			values[1].type = GIMP_PDB_STRING;
+			values[1].data.d_string = "Execution error.";
+		}
+	}
+
+	else if (strcmp (name, MORPHOP_WATERSHED_PROC) == 0) {
+		MorphOpWatershedSettings watershed;
+		
+		drawable = gimp_drawable_get (param[2].data.d_drawable);
+		
+		// by default, the element of the main dialog and no markers
+		gimp_get_data (MORPHOP_PROC, &msettings);
+		watershed.element = msettings.element;
+		watershed.markers_id = -1;
+		
+		switch (run_mode) {
+			case GIMP_RUN_WITH_LAST_VALS:
+			
+				gimp_get_data (MORPHOP_WATERSHED_PROC, &watershed);
+				break;
 				
-				msettings.element.size = param[7].data.d_int32;
+			case GIMP_RUN_INTERACTIVE:
+				
+				// only the size of the element is chosen in the dialog, its shape and heights are always the ones of the main dialog
+				gimp_get_data (MORPHOP_WATERSHED_PROC, &watershed);
+				memcpy(watershed.element.matrix, msettings.element.matrix, sizeof(watershed.element.matrix));
+				memcpy(watershed.element.weights, msettings.element.weights, sizeof(watershed.element.weights));
+				if (watershed.markers_id != -1 && !gimp_drawable_is_valid(watershed.markers_id)) watershed.markers_id = -1;
 				
-				start_operation(gimp_drawable_get(param[2].data.d_drawable), NULL, msettings);
+				if (! morphop_show_watershed_gui(drawable, &watershed))
+					return;
+				gimp_set_data (MORPHOP_WATERSHED_PROC, &watershed, sizeof(MorphOpWatershedSettings));
 				break;
 				
 			default:
 			
-				values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+				if (nparams != 8) status = GIMP_PDB_CALLING_ERROR;
+				else {
+					element_from_param(param[4].data.d_int8array, &watershed.element);
+					watershed.element.size = param[6].data.d_int32;
+					watershed.markers_id = param[7].data.d_drawable;
+				}
 				break;
 		}
 		
-		if (status == GIMP_PDB_SUCCESS) {			
-			if (run_mode != GIMP_RUN_NONINTERACTIVE) 
+		// the gradient uses the matrix, the custom element of the main dialog (if any) is not kept with its data
+		watershed.element.shape = NULL;
+		
+		if (status == GIMP_PDB_SUCCESS && (watershed.element.size < 0 || watershed.element.size >= SIZE_END)) {
+			status = GIMP_PDB_CALLING_ERROR;
+		}
+		
+		if (status == GIMP_PDB_SUCCESS) {
+			MorphOpStatus result = start_watershed_operation(drawable, watershed);
+			
+			// the markers are not a drawable of the same size
+			status = get_pdb_status(result);
+			
+			if (status == GIMP_PDB_SUCCESS && run_mode != GIMP_RUN_NONINTERACTIVE)
 				gimp_displays_flush ();
 		}
-		else {
-			status  = GIMP_PDB_EXECUTION_ERROR;
+		
+		if (status == GIMP_PDB_EXECUTION_ERROR) {
 			*nreturn_vals = 2;
 			values[1].type = GIMP_PDB_STRING;
 			values[1].data.d_string = "Execution error.";
@@ -181,3 +605,150 @@ static void run (
 
 	values[0].data.d_status = status;
 }
+
+/* start_dialog_operation()
+ * 
+ * Runs the chain of the dialog on the layers it says: the drawable alone, or the layers of the image
+ * (see start_layers_operation())
+ */
+static MorphOpStatus start_dialog_operation(gint32 image_id, GimpDrawable* drawable, const MorphOpChain* chain)
+{
+	if (mlayers == LAYERS_ACTIVE) return start_chain_operation(drawable, NULL, chain);
+
+	gimp_drawable_detach(drawable);
+	return start_layers_operation(image_id, mlayers, chain);
+}
+
+/* attach_elements()
+ * 
+ * Reads the custom elements of the dialog and of its steps again, after the data of the last run: the settings
+ * kept there point to the ones of that run. The ones that can't be read anymore (e.g. the channel has been
+ * deleted) go back to their matrix.
+ */
+static void attach_elements(void)
+{
+	int i;
+	
+	if (!element_source_attach(&melements.current, ELEMENT_SLOT_CURRENT, &msettings.element)) melements.current.kind = ELEMENT_MATRIX;
+	
+	for (i = 0; i < MIN(mchain.n_steps, MORPHOP_CHAIN_MAX_STEPS); i++) {
+		if (!element_source_attach(&melements.steps[i], i, &mchain.steps[i].element)) melements.steps[i].kind = ELEMENT_MATRIX;
+	}
+}
+
+/* settings_from_params()
+ * 
+ * Reads the settings of a non-interactive call: 'param' points to the "operator" parameter,
+ * followed by "element-size", "element", "center", "size" and, if given, "iterations", then
+ * "num-weights" and "weights", then "channel-mode", then "element-channel" and "element-brush" ('n_params'
+ * of them in all). Returns FALSE if they are not 5, 6, 8, 9 or 11, if the weights are not 49, or if the
+ * custom element can't be read.
+ */
+static gboolean settings_from_params(const GimpParam* param, gint n_params, MorphOpSettings* settings)
+{
+	ElementSource source = { ELEMENT_MATRIX };
+	
+	if (
+		(n_params != 5 && n_params != 6 && n_params != 8 && n_params != 9 && n_params != 11) ||
+		(n_params >= 8 && param[6].data.d_int32 != STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE)
+	) return FALSE;
+	
+	if (n_params == 11 && param[9].data.d_channel != -1) {
+		source.kind = ELEMENT_CHANNEL;
+		source.channel_id = param[9].data.d_channel;
+	}
+	else if (n_params == 11 && param[10].data.d_string != NULL && param[10].data.d_string[0] != '\0') {
+		source.kind = ELEMENT_BRUSH;
+		g_strlcpy(source.brush, param[10].data.d_string, ELEMENT_BRUSH_NAME_SIZE);
+	}
+	
+	settings->operator = param[0].data.d_int32;
+	element_from_param(param[2].data.d_int8array, &settings->element);
+	settings->element.size = param[4].data.d_int32;
+	settings->iterations = (n_params >= 6 ? param[5].data.d_int32 : 1);
+	if (n_params >= 8) weights_from_param(param[7].data.d_int8array, &settings->element);
+	settings->channel_mode = (n_params >= 9 ? param[8].data.d_int32 : CHANNELS_LUMINOSITY);
+	
+	return element_source_attach(&source, ELEMENT_SLOT_CURRENT, &settings->element);
+}
+
+/* chain_from_params()
+ * 
+ * Reads the steps of a call to MORPHOP_CHAIN_PROC: 'param' points to the "num-steps" parameter, followed by
+ * the arrays of the operators, of the elements, of the sizes and, if given, of the iterations, of the weights and
+ * of the channel modes ('n_params' parameters in all). Returns FALSE if they are not 6, 8, 10 or 12, or if the arrays
+ * don't match the steps.
+ */
+static gboolean chain_from_params(const GimpParam* param, gint n_params, MorphOpChain* chain)
+{
+	const gboolean has_iterations = (n_params >= 8);
+	int n_steps = param[0].data.d_int32;
+	int i;
+	
+	if (
+		(n_params != 6 && n_params != 8 && n_params != 10 && n_params != 12) ||
+		n_steps < 1 || n_steps > MORPHOP_CHAIN_MAX_STEPS ||
+		param[2].data.d_int32 != n_steps * STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE ||
+		param[4].data.d_int32 != n_steps ||
+		(has_iterations && param[6].data.d_int32 != n_steps) ||
+		(n_params >= 10 && param[8].data.d_int32 != n_steps * STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE) ||
+		(n_params == 12 && param[10].data.d_int32 != n_steps)
+	) return FALSE;
+	
+	chain->n_steps = n_steps;
+	for (i = 0; i < n_steps; i++) {
+		chain->steps[i].operator = param[1].data.d_int32array[i];
+		element_from_param(param[3].data.d_int8array + i * STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE, &chain->steps[i].element);
+		chain->steps[i].element.size = param[5].data.d_int32array[i];
+		chain->steps[i].iterations = (has_iterations ? param[7].data.d_int32array[i] : 1);
+		if (n_params >= 10) {
+			weights_from_param(param[9].data.d_int8array + i * STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE, &chain->steps[i].element);
+		}
+		chain->steps[i].channel_mode = (n_params == 12 ? param[11].data.d_int32array[i] : CHANNELS_LUMINOSITY);
+	}
+	
+	return TRUE;
+}
+
+/* element_from_param()
+ * 
+ * Reads the 49 cells of a structuring element given to a procedure. The element is flat, see weights_from_param(),
+ * and it has no custom element
+ */
+static void element_from_param(const gint8* cells, StructuringElement* element)
+{
+	int i;
+	
+	for (i = 0; i < STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE; i++) {
+		element->matrix[i % STRELEM_DEFAULT_SIZE][(int)ceil((i + 1.0) / STRELEM_DEFAULT_SIZE) - 1] = cells[i];
+	}
+	morphop_element_set_weights(element, WEIGHTS_FLAT, 0);
+	element->shape = NULL;
+}
+
+/* weights_from_param()
+ * 
+ * Reads the 49 heights of a structuring element given to a procedure, in the order of its cells
+ */
+static void weights_from_param(const gint8* weights, StructuringElement* element)
+{
+	int i;
+	
+	for (i = 0; i < STRELEM_DEFAULT_SIZE * STRELEM_DEFAULT_SIZE; i++) {
+		element->weights[i % STRELEM_DEFAULT_SIZE][i / STRELEM_DEFAULT_SIZE] = weights[i];
+	}
+}
+
+/* get_pdb_status()
+ * 
+ * Converts the result of an operation to the status returned to GIMP, settings
+ * the library refuses (iterations, channel mode, operator...) are a calling error
+ */
+static GimpPDBStatusType get_pdb_status(MorphOpStatus status)
+{
+	switch (status) {
+		case MORPHOP_OK: return GIMP_PDB_SUCCESS;
+		case MORPHOP_INVALID: return GIMP_PDB_CALLING_ERROR;
+		default: return GIMP_PDB_EXECUTION_ERROR;
+	}
+}
@@ -3,6 +3,7 @@
 
 #include <gtk/gtk.h>
 #include "morphop-algorithms.h"
+#include "morphop-element.h"
 
 #define MORPHOP_FULLNAME "Morphological operators"
 #define MORPHOP_COPYRIGHT "(C) 2013 - Alessandro Francesconi"
@@ -10,11 +11,21 @@
 #define MORPHOP_BINARY "morphop"
 
 #define MORPHOP_PROC "plug-in-morphop"
+#define MORPHOP_BATCH_PROC "plug-in-morphop-batch"
+#define MORPHOP_CHAIN_PROC "plug-in-morphop-chain"
+#define MORPHOP_RECONSTRUCT_PROC "plug-in-morphop-reconstruct"
+#define MORPHOP_AREA_PROC "plug-in-morphop-area"
+#define MORPHOP_WATERSHED_PROC "plug-in-morphop-watershed"
+#define MORPHOP_LAYERS_DATA "plug-in-morphop-layers" // the key of 'mlayers' in the data of the last run
+#define MORPHOP_ELEMENT_DATA "plug-in-morphop-element" // the key of 'melements' in the data of the last run
 #define MORPHOP_PROC_DESCRIPTION "A set of morphological operators for GIMP"
 
 #define PLUG_IN_VERSION_MAJ 1
 #define PLUG_IN_VERSION_MIN 0
 
 MorphOpSettings msettings;
+MorphOpChain mchain; // the steps added in the dialog, run before the one shown in it
+MorphOpLayers mlayers; // the layers the dialog applies the operator to
+MorphOpElementSources melements; // where the elements of 'msettings' and of 'mchain' come from
 
 #endif